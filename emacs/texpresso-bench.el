@@ -0,0 +1,95 @@
+;;; texpresso-bench.el --- Benchmark parsing of TeXpresso output -*- lexical-binding: t; -*-
+;;
+;; Copyright (C) 2023 Frédéric Bour
+;;
+;; Author: Frédéric Bour <frederic.bour@lakaban.net>
+;; Maintainer: Frédéric Bour <frederic.bour@lakaban.net>
+;; Package-Requires: ((emacs "26.1"))
+;;
+;; This file is not part of GNU Emacs.
+;;
+;;; Commentary:
+;;
+;; Replays a stream of TeXpresso output through `texpresso--stdout-filter', cut
+;; in chunks of the size Emacs reads from a pipe, and reports the throughput:
+;;
+;;   emacs -Q --batch -L emacs -l texpresso-bench -f texpresso-bench-stdout [FILE]
+;;
+;; FILE is a recording of the standard output of texpresso.  Without FILE, a
+;; synthetic stream of a few megabytes is used, with many small messages and a
+;; few large `append' ones.
+;; Messages are only parsed: `texpresso--stdout-dispatch' is replaced by a
+;; function counting them.
+;;
+;;; Code:
+
+(require 'cl-lib)
+(require 'texpresso)
+
+(defvar texpresso-bench-chunk-size 4096
+  "Number of bytes passed to the filter at once.")
+
+(defun texpresso-bench--synthetic-stream ()
+  "Return a stream resembling TeXpresso output and the number of messages."
+  (let ((line (concat (make-string 120 ?x) "\\n"))
+        (parts nil)
+        (count 0)
+        (pos 0))
+    (dotimes (i 20000)
+      (push (format "(append log %d \"%s\")\n" pos line) parts)
+      (setq pos (+ pos 121)
+            count (1+ count))
+      (when (= (% i 1000) 999)
+        ;; A large message, spread over hundreds of chunks
+        (let ((text (apply #'concat (make-list 2000 line))))
+          (push (format "(append out %d \"%s\")\n" 0 text) parts)
+          (push (format "(truncate out %d)\n" (* 2000 121)) parts)
+          (push "(flush)\n\n" parts)
+          (setq count (+ count 3)))))
+    (cons (apply #'concat (nreverse parts)) count)))
+
+(defun texpresso-bench--read-file (file)
+  "Return the contents of FILE, the number of messages is not known."
+  (with-temp-buffer
+    (insert-file-contents file)
+    (cons (buffer-string) nil)))
+
+(defun texpresso-bench-stdout ()
+  "Measure `texpresso--stdout-filter' on a recorded or synthetic stream.
+The file to replay is taken from the remaining command-line arguments."
+  (let* ((file (pop command-line-args-left))
+         (input (if file
+                    (texpresso-bench--read-file file)
+                  (texpresso-bench--synthetic-stream)))
+         (stream (car input))
+         (size (length stream))
+         (process (make-pipe-process
+                   :name "texpresso-bench"
+                   :buffer (generate-new-buffer " *texpresso-bench*")
+                   :noquery t))
+         (count 0)
+         start elapsed)
+    (unwind-protect
+        (cl-letf (((symbol-function 'texpresso--stdout-dispatch)
+                   (lambda (_process _expr) (setq count (1+ count)))))
+          (garbage-collect)
+          (setq start (float-time))
+          (let ((pos 0))
+            (while (< pos size)
+              (texpresso--stdout-filter
+               process
+               (substring stream pos
+                          (min size (+ pos texpresso-bench-chunk-size))))
+              (setq pos (+ pos texpresso-bench-chunk-size))))
+          (setq elapsed (- (float-time) start)))
+      (let ((buffer (process-buffer process)))
+        (delete-process process)
+        (kill-buffer buffer)))
+    (message "%d messages, %.1f MB in %.3fs (%.1f MB/s)"
+             count (/ size 1048576.0) elapsed
+             (/ size 1048576.0 (max elapsed 1e-6)))
+    (unless (or (null (cdr input)) (= count (cdr input)))
+      (error "Expected %d messages, parsed %d" (cdr input) count))))
+
+(provide 'texpresso-bench)
+;;; texpresso-bench.el ends here
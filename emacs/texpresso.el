@@ -54,7 +54,9 @@ marker objects are compared for physical equality.
 not used anywhere.\)")
 
 (defun texpresso--send (&rest value)
-  "Send VALUE as a serialized s-expression to `texpresso--process'."
+  "Send VALUE as a serialized s-expression to `texpresso--process'.
+Pending changes are sent first, see `texpresso--flush-changes'."
+  (texpresso--flush-changes)
   (setq value (prin1-to-string value))
   ; (with-current-buffer (get-buffer-create "*texpresso-log*")
   ;   (let ((inhibit-read-only t))
@@ -79,6 +81,21 @@ it is too late to access the number of bytes.  To work around this limitation,
 the changed region is saved by the `texpresso--before-change' function (a
 `before-change-functions' hook).")
 
+(defvar-local texpresso--pending-changes nil
+  "Changes of the current buffer not yet sent to TeXpresso.
+A sorted list of disjoint regions (BEG END BYTES): the text between BEG and END
+replaces BYTES bytes of the text last sent to TeXpresso.  Regions that overlap
+or touch are merged, so that bulk edits are sent as a few changes.")
+
+(defvar texpresso--pending-buffers nil
+  "Buffers with pending changes, see `texpresso--flush-changes'.")
+
+(defvar texpresso--flush-timer nil
+  "Timer sending the changes made outside of a command.")
+
+(defconst texpresso--max-pending 64
+  "Number of pending regions in a buffer after which changes are sent.")
+
 (define-minor-mode texpresso-mode
   "A global minor mode that synchronizes buffer with TeXpresso.
 Also launches a new TeXpresso process if none is running."
@@ -153,8 +170,8 @@ It records the number of bytes between START and END (the bytes removed)."
 
 (defun texpresso--after-change (start end removed)
   "An `after-change-functions' hook to synchronize the buffer with TeXpresso.
-It instructs `texpresso--process' to replace REMOVED characters by the contents
-between START and END.
+It records that REMOVED characters were replaced by the contents between START
+and END, to be sent to `texpresso--process' by `texpresso--flush-changes'.
 Character counts are converted to byte offsets using `texpresso--before-change'."
   (when (texpresso--enabled-p)
                                         ; (message "after change %S %S %S" start end removed)
@@ -170,14 +187,13 @@ Character counts are converted to byte offsets using `texpresso--before-change'.
                  (eq process  texpresso--process)
                  (eq marker   (process-get texpresso--process 'marker))))
       (if (and same-process (<= bstart start (+ start removed) bend))
-          (let ((ofs (- start bstart)))
-            (texpresso--send 'change filename (1- (position-bytes start))
-                             (string-bytes (substring btext ofs (+ ofs removed)))
-                             (buffer-substring-no-properties start end)))
+          (texpresso--queue-change start end removed bstart btext)
         (when same-process
           (message "TeXpresso: change hooks called with invalid arguments")
           (message "(before-change %S %S %S)" bstart bend btext)
           (message "(after-change %S %S %S)" start end removed))
+        ;; The whole buffer is sent again, pending changes are obsolete
+        (setq texpresso--pending-changes nil)
         (when (process-live-p process)
           (process-send-string
            process (prin1-to-string (list 'close filename))))
@@ -186,15 +202,102 @@ Character counts are converted to byte offsets using `texpresso--before-change'.
                     (process-get texpresso--process 'marker)))
         (texpresso--send 'open (buffer-file-name)
                          (buffer-substring-no-properties
-                          (point-min) (point-max))))
-      (when texpresso-follow-edition
-        (texpresso--send 'synctex-forward
-                         (buffer-file-name)
-                         (line-number-at-pos nil t))))))
+                          (point-min) (point-max)))
+        (when texpresso-follow-edition
+          (texpresso--send 'synctex-forward
+                           (buffer-file-name)
+                           (line-number-at-pos nil t)))))))
+
+(defun texpresso--synchronized-p ()
+  "Check if TeXpresso has a copy of the current buffer.
+The copy is up-to-date once pending changes are sent."
+  (and (eq (nth 0 texpresso--state) (buffer-file-name))
+       (eq (nth 1 texpresso--state) texpresso--process)
+       (eq (nth 2 texpresso--state) (process-get texpresso--process 'marker))))
+
+(defun texpresso--queue-change (start end removed bstart btext)
+  "Record that START..END replaced REMOVED characters of the current buffer.
+BTEXT is the text that started at BSTART before the change.  The change is
+merged with the pending regions it overlaps or touches; text outside of the
+pending regions is the same as in TeXpresso, its size is measured in BTEXT."
+  (let ((stop (+ start removed))
+        (delta (- end start removed))
+        (beg start)
+        (lim (+ start removed))
+        (bytes 0)
+        (pos start)
+        before after)
+    (dolist (region texpresso--pending-changes)
+      (let ((rbeg (nth 0 region))
+            (rend (nth 1 region)))
+        (cond
+         ((< rend start) (push region before))
+         ((> rbeg stop)
+          (push (list (+ rbeg delta) (+ rend delta) (nth 2 region)) after))
+         (t
+          (when (< pos rbeg)
+            (setq bytes (+ bytes (string-bytes (substring btext (- pos bstart)
+                                                          (- rbeg bstart))))))
+          (setq pos (max pos rend)
+                beg (min beg rbeg)
+                lim (max lim rend)
+                bytes (+ bytes (nth 2 region)))))))
+    (when (< pos stop)
+      (setq bytes (+ bytes (string-bytes (substring btext (- pos bstart)
+                                                    (- stop bstart))))))
+    (setq texpresso--pending-changes
+          (nconc (nreverse before)
+                 (list (list beg (+ lim delta) bytes))
+                 (nreverse after))))
+  (unless (memq (current-buffer) texpresso--pending-buffers)
+    (push (current-buffer) texpresso--pending-buffers))
+  (cond
+   ((> (length texpresso--pending-changes) texpresso--max-pending)
+    (texpresso--flush-changes))
+   ((not texpresso--flush-timer)
+    (setq texpresso--flush-timer
+          (run-with-timer 0.05 nil #'texpresso--flush-changes)))))
+
+(defun texpresso--flush-changes ()
+  "Send the pending changes of all buffers to TeXpresso in a single write.
+TeXpresso handles the changes it reads at once with a single rollback."
+  (when texpresso--flush-timer
+    (cancel-timer texpresso--flush-timer)
+    (setq texpresso--flush-timer nil))
+  (let ((buffers texpresso--pending-buffers)
+        (messages nil))
+    (setq texpresso--pending-buffers nil)
+    (dolist (buffer buffers)
+      (when (buffer-live-p buffer)
+        (with-current-buffer buffer
+          (let ((changes texpresso--pending-changes)
+                (filename (nth 0 texpresso--state)))
+            (setq texpresso--pending-changes nil)
+            (when (and changes (texpresso--synchronized-p))
+              ;; Regions are sorted: when one is sent, the text before it is
+              ;; already up-to-date, so current byte offsets are valid
+              (dolist (change changes)
+                (push (prin1-to-string
+                       (list 'change filename
+                             (1- (position-bytes (nth 0 change)))
+                             (nth 2 change)
+                             (buffer-substring-no-properties
+                              (nth 0 change) (nth 1 change))))
+                      messages))
+              (when texpresso-follow-edition
+                (push (prin1-to-string
+                       (list 'synctex-forward filename
+                             (line-number-at-pos nil t)))
+                      messages)))))))
+    (when (and messages (process-live-p texpresso--process))
+      (process-send-string texpresso--process
+                           (apply #'concat (nreverse messages))))))
 
 (defun texpresso--post-command ()
   "Function executed on post-command hook.
-Sends cursor position to TeXpresso if `texpresso-follow-cursor'."
+Sends pending changes, and cursor position to TeXpresso if
+`texpresso-follow-cursor'."
+  (texpresso--flush-changes)
   (when texpresso-follow-cursor
     (texpresso-move-to-cursor)))
 
@@ -302,28 +405,62 @@ standard output. This function interprets one of these."
               (switch-to-buffer buf))
           (message "TeXpresso: unknown file %s" (nth 1 expr)))))
 
+     ((eq tag 'exported-pdf)
+      (message "TeXpresso: exported %s (%d pages, %d updated)"
+               (nth 1 expr) (nth 2 expr) (nth 3 expr)))
+
+     ((eq tag 'compilation-paused)
+      (message "TeXpresso: compilation paused at %s:%d after %ds of CPU, \
+it will resume on the next change"
+               (nth 1 expr) (nth 2 expr) (nth 3 expr)))
+
+     ((eq tag 'compilation-resumed)
+      (message "TeXpresso: compilation resumed"))
+
      (t (message "Unknown message in texpresso output: %S" expr)))))
 
 (defun texpresso--stdout-filter (process text)
   "Interpret output of TeXpresso PROCESS.
 TeXpresso communicates with Emacs by writing a sequence of textual s-expressions
-on its standard output. This function receives a chunk of this TEXT, parses and
-forwards the complete ones to `texpresso--stdout-dispatch', and buffers the
-remainder."
-  (let ((prefix (process-get process 'buffer)))
-    (when prefix (setq text (concat prefix text))))
-  (let ((pos 0))
-    (condition-case nil
-        (while t
-          (let ((result (read-from-string text pos)))
-            (setq pos (cdr result))
-            (condition-case-unless-debug err
-                (texpresso--stdout-dispatch process (car result))
-              (error (message
-                      "Error in texpresso--stdout-dispatch: %S\nWhile processing: %S"
-                      err (car result))))))
-      ((end-of-file)
-       (process-put process 'buffer (substring text pos))))))
+on its standard output, one per line.  This function appends a chunk of this
+TEXT to the process buffer and forwards the complete ones to
+`texpresso--stdout-dispatch'.
+Each message is read once: only the new TEXT is searched for the end of a line,
+and consumed messages are removed from the buffer, which never holds more than
+one incomplete message."
+  (let ((buffer (process-buffer process))
+        (exprs nil))
+    (when (buffer-live-p buffer)
+      (with-current-buffer buffer
+        (let ((start (point-max)) end)
+          (goto-char start)
+          (insert text)
+          (when (search-backward "\n" start t)
+            (setq end (1+ (point)))
+            (goto-char (point-min))
+            (while (progn (skip-chars-forward " \t\n" end)
+                          (< (point) end))
+              (condition-case err
+                  (push (read buffer) exprs)
+                (error
+                 (message "TeXpresso: invalid output %S: %S" err
+                          (buffer-substring-no-properties
+                           (line-beginning-position) (line-end-position)))
+                 (forward-line 1))))
+            (delete-region (point-min) end)))))
+    (dolist (expr (nreverse exprs))
+      (condition-case-unless-debug err
+          (texpresso--stdout-dispatch process expr)
+        (error (message
+                "Error in texpresso--stdout-dispatch: %S\nWhile processing: %S"
+                err expr))))))
+
+(defun texpresso--stdout-sentinel (process _event)
+  "Release the output buffer of TeXpresso PROCESS once it has exited."
+  (unless (process-live-p process)
+    (let ((buffer (process-buffer process)))
+      (when (buffer-live-p buffer)
+        (kill-buffer buffer)))))
 
 (defun texpresso-reset ()
   "Invalidate the synchronization state of all buffers."
@@ -356,6 +493,7 @@ remainder."
             (delete-region (point-min) (point-max))))))
     (setq texpresso--process
           (make-process :name "texpresso"
+                        :buffer (generate-new-buffer " *texpresso-output*")
                         :stderr texpresso-stderr
                         :connection-type 'pipe
                         :command command))
@@ -363,6 +501,8 @@ remainder."
                         #'texpresso--stderr-filter)
     (set-process-filter texpresso--process
                         #'texpresso--stdout-filter)
+    (set-process-sentinel texpresso--process
+                          #'texpresso--stdout-sentinel)
     (process-put texpresso--process 'marker (cons nil nil))
     (texpresso--send 'theme
                      (color-name-to-rgb (face-attribute 'default :background))
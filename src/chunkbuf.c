@@ -0,0 +1,170 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2023 Frédéric Bour <frederic.bour@lakaban.net>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#include <string.h>
+#include <stdlib.h>
+#include "chunkbuf.h"
+
+#define CHUNK_MASK (CHUNKBUF_CHUNK_SIZE - 1)
+
+chunkbuf_t *chunkbuf_new(fz_context *ctx)
+{
+  chunkbuf_t *cb = fz_malloc_struct(ctx, chunkbuf_t);
+  cb->refs = 1;
+  return cb;
+}
+
+chunkbuf_t *chunkbuf_keep(fz_context *ctx, chunkbuf_t *cb)
+{
+  if (cb)
+    cb->refs += 1;
+  return cb;
+}
+
+void chunkbuf_drop(fz_context *ctx, chunkbuf_t *cb)
+{
+  if (!cb)
+    return;
+  cb->refs -= 1;
+  if (cb->refs > 0)
+    return;
+  for (int i = 0; i < cb->chunk_count; ++i)
+    fz_free(ctx, cb->chunks[i]);
+  fz_free(ctx, cb->chunks);
+  fz_free(ctx, cb);
+}
+
+static void reserve(fz_context *ctx, chunkbuf_t *cb, int len)
+{
+  int count = (len + CHUNK_MASK) >> CHUNKBUF_BITS;
+  if (count <= cb->chunk_count)
+    return;
+
+  if (count > cb->chunk_cap)
+  {
+    int cap = cb->chunk_cap ? cb->chunk_cap : 16;
+    while (cap < count)
+      cap *= 2;
+    // Only the index is reallocated, chunks themselves stay in place
+    cb->chunks = fz_realloc_array(ctx, cb->chunks, cap, uint8_t *);
+    cb->chunk_cap = cap;
+  }
+
+  while (cb->chunk_count < count)
+  {
+    cb->chunks[cb->chunk_count] = fz_malloc(ctx, CHUNKBUF_CHUNK_SIZE);
+    cb->chunk_count += 1;
+  }
+}
+
+void chunkbuf_write(fz_context *ctx, chunkbuf_t *cb, int pos, const void *data, int len)
+{
+  if (pos < 0 || len < 0)
+    abort();
+
+  const uint8_t *src = data;
+  reserve(ctx, cb, pos + len);
+  if (pos < cb->len && len > 0)
+    cb->rewrites += 1;
+
+  while (len > 0)
+  {
+    int off = pos & CHUNK_MASK;
+    int n = CHUNKBUF_CHUNK_SIZE - off;
+    if (n > len)
+      n = len;
+    memcpy(cb->chunks[pos >> CHUNKBUF_BITS] + off, src, n);
+    pos += n;
+    src += n;
+    len -= n;
+  }
+
+  if (pos > cb->len)
+    cb->len = pos;
+}
+
+void chunkbuf_truncate(chunkbuf_t *cb, int len)
+{
+  if (len < 0 || len > cb->chunk_count * CHUNKBUF_CHUNK_SIZE)
+    abort();
+  if (len < cb->len)
+    cb->rewrites += 1;
+  cb->len = len;
+}
+
+size_t chunkbuf_size(const chunkbuf_t *cb)
+{
+  return (size_t)cb->chunk_count * CHUNKBUF_CHUNK_SIZE +
+         (size_t)cb->chunk_cap * sizeof(uint8_t *);
+}
+
+void chunkbuf_read(const chunkbuf_t *cb, int pos, void *data, int len)
+{
+  if (pos < 0 || len < 0 || pos + len > cb->len)
+    abort();
+
+  uint8_t *dst = data;
+
+  while (len > 0)
+  {
+    int off = pos & CHUNK_MASK;
+    int n = CHUNKBUF_CHUNK_SIZE - off;
+    if (n > len)
+      n = len;
+    memcpy(dst, cb->chunks[pos >> CHUNKBUF_BITS] + off, n);
+    pos += n;
+    dst += n;
+    len -= n;
+  }
+}
+
+const uint8_t *chunkbuf_at(const chunkbuf_t *cb, int pos, int *avail)
+{
+  if (pos < 0 || pos >= cb->len)
+  {
+    *avail = 0;
+    return NULL;
+  }
+
+  int off = pos & CHUNK_MASK;
+  int n = CHUNKBUF_CHUNK_SIZE - off;
+  if (n > cb->len - pos)
+    n = cb->len - pos;
+  *avail = n;
+  return cb->chunks[pos >> CHUNKBUF_BITS] + off;
+}
+
+const uint8_t *chunkbuf_span(fz_context *ctx, const chunkbuf_t *cb, int pos, int len, fz_buffer *scratch)
+{
+  int avail;
+  const uint8_t *ptr = chunkbuf_at(cb, pos, &avail);
+  if (len <= avail)
+    return ptr;
+
+  if (scratch->cap < len)
+    fz_resize_buffer(ctx, scratch, len);
+  chunkbuf_read(cb, pos, scratch->data, len);
+  scratch->len = len;
+  return scratch->data;
+}
@@ -0,0 +1,77 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2023 Frédéric Bour <frederic.bour@lakaban.net>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#ifndef CHUNKBUF_H_
+#define CHUNKBUF_H_
+
+#include <stdint.h>
+#include <mupdf/fitz/buffer.h>
+
+// Growable storage made of fixed-size chunks.
+// Chunks never move: growing the buffer does not copy the existing
+// contents and truncating only updates the length (chunks are kept for
+// reuse). Reading at an offset is O(1).
+//
+// Chunked buffers are reference counted, like fz_buffer, so that the
+// rollback log can keep them alive.
+
+#define CHUNKBUF_BITS 16
+#define CHUNKBUF_CHUNK_SIZE (1 << CHUNKBUF_BITS)
+
+typedef struct {
+  int refs;
+  int len;
+  int chunk_count, chunk_cap;
+  uint8_t **chunks;
+  // Incremented when existing bytes are overwritten or truncated: while it
+  // does not change, the buffer is only appended to.
+  unsigned rewrites;
+} chunkbuf_t;
+
+chunkbuf_t *chunkbuf_new(fz_context *ctx);
+chunkbuf_t *chunkbuf_keep(fz_context *ctx, chunkbuf_t *cb);
+void chunkbuf_drop(fz_context *ctx, chunkbuf_t *cb);
+
+// Write len bytes at offset pos, growing the buffer if needed
+void chunkbuf_write(fz_context *ctx, chunkbuf_t *cb, int pos, const void *data, int len);
+void chunkbuf_truncate(chunkbuf_t *cb, int len);
+
+// Copy len bytes starting at pos
+void chunkbuf_read(const chunkbuf_t *cb, int pos, void *data, int len);
+
+// Bytes allocated, including chunks kept for reuse after a truncation
+size_t chunkbuf_size(const chunkbuf_t *cb);
+
+// Pointer to the data at pos, *avail is set to the number of contiguous
+// bytes that can be read from it (until the end of the chunk or of the
+// buffer).
+const uint8_t *chunkbuf_at(const chunkbuf_t *cb, int pos, int *avail);
+
+// Pointer to len contiguous bytes starting at pos.
+// Points directly into the buffer if the range fits in a chunk, otherwise
+// the bytes are copied to scratch. The result is valid until the next
+// use of scratch.
+const uint8_t *chunkbuf_span(fz_context *ctx, const chunkbuf_t *cb, int pos, int len, fz_buffer *scratch);
+
+#endif // CHUNKBUF_H_
@@ -27,6 +27,8 @@
 #include <mupdf/fitz/document.h>
 #include "logo.h"
 #include "driver.h"
+#include "worker.h"
+#include "poolalloc.h"
 
 #ifdef __APPLE__
 #include <sys/syslimits.h>
@@ -40,12 +42,12 @@ Uint32 custom_event = 0;
 
 void schedule_event(enum custom_events ev)
 {
-  static char scheduled[EVENT_COUNT] = {0,};
+  // Events are scheduled from worker threads too
+  static SDL_atomic_t scheduled[EVENT_COUNT];
 
-  char *sched = scheduled + ev;
-  if (!*sched)
+  SDL_atomic_t *sched = scheduled + ev;
+  if (SDL_AtomicCAS(sched, 0, 1))
   {
-    *sched = 1;
     SDL_Event event;
     SDL_zero(event);
     event.type = custom_event;
@@ -102,6 +104,41 @@ static bool should_reload_binary(void)
   return 0;
 }
 
+static void open_window(struct persistent_state *ps)
+{
+  if (SDL_InitSubSystem(SDL_INIT_VIDEO) < 0)
+  {
+    fprintf(stderr, "SDL could not initialize! SDL_Error: %s\n", SDL_GetError());
+    abort();
+  }
+
+  //Create window
+  char window_title[128] = "TeXpresso ";
+  strcat(window_title, ps->doc_name);
+
+  SDL_Window *window;
+  window = SDL_CreateWindow(window_title,
+    SDL_WINDOWPOS_UNDEFINED, SDL_WINDOWPOS_UNDEFINED,
+    700, 900,
+    SDL_WINDOW_SHOWN | SDL_WINDOW_ALLOW_HIGHDPI | SDL_WINDOW_RESIZABLE
+  );
+
+  if (window == NULL)
+  {
+    fprintf(stderr, "Window could not be created! SDL_Error: %s\n", SDL_GetError() );
+    abort();
+  }
+
+  SDL_Surface *logo = texpresso_logo();
+  fprintf(stderr, "texpresso logo: %dx%d\n", logo->w, logo->h);
+  SDL_SetWindowIcon(window, logo);
+  SDL_FreeSurface(logo);
+
+  ps->window = window;
+  ps->renderer =
+    SDL_CreateRenderer(window, -1, SDL_RENDERER_PRESENTVSYNC | SDL_RENDERER_TARGETTEXTURE);
+}
+
 int main(int argc, const char **argv)
 {
   char work_dir[PATH_MAX];
@@ -126,6 +163,14 @@ int main(int argc, const char **argv)
   const char *doc_arg = NULL;
   enum editor_protocol protocol = EDITOR_SEXP;
   bool line_output = 0;
+  bool framebuffer = 0;
+  bool pool_alloc = 0;
+  bool glyph_atlas = 0;
+  size_t memory_limit = 0;
+  int render_helpers = 0;
+  bool verbose = 0;
+  int watchdog = 15;
+  const char *serve_path = NULL;
 
   int inclusion_path_size = 1;
   for (int i = 1; i < argc; i++)
@@ -161,6 +206,62 @@ int main(int argc, const char **argv)
       {
         line_output = 1;
       }
+      else if (strcmp(arg, "-framebuffer") == 0)
+      {
+        framebuffer = 1;
+      }
+      else if (strcmp(arg, "-pool-alloc") == 0)
+      {
+        pool_alloc = 1;
+      }
+      else if (strcmp(arg, "-glyph-atlas") == 0)
+      {
+        glyph_atlas = 1;
+      }
+      else if (strcmp(arg, "-memory-limit") == 0)
+      {
+        i += 1;
+        if (i == argc || atoi(argv[i]) <= 0)
+        {
+          fprintf(stderr, "[error] Expecting a size in megabytes after -memory-limit\n");
+          exit(1);
+        }
+        memory_limit = (size_t)atoi(argv[i]) << 20;
+      }
+      else if (strcmp(arg, "-render-helpers") == 0)
+      {
+        i += 1;
+        if (i == argc || atoi(argv[i]) <= 0)
+        {
+          fprintf(stderr, "[error] Expecting a number of processes after -render-helpers\n");
+          exit(1);
+        }
+        render_helpers = atoi(argv[i]);
+      }
+      else if (strcmp(arg, "-watchdog") == 0)
+      {
+        i += 1;
+        if (i == argc || argv[i][0] < '0' || argv[i][0] > '9')
+        {
+          fprintf(stderr, "[error] Expecting a number of seconds after -watchdog\n");
+          exit(1);
+        }
+        watchdog = atoi(argv[i]);
+      }
+      else if (strcmp(arg, "-v") == 0)
+      {
+        verbose = 1;
+      }
+      else if (strcmp(arg, "-serve") == 0)
+      {
+        i += 1;
+        if (i == argc)
+        {
+          fprintf(stderr, "[error] Expecting a socket path after -serve\n");
+          exit(1);
+        }
+        serve_path = argv[i];
+      }
       else
       {
         fprintf(stderr, "[error] Unknown option %s\n", arg);
@@ -183,10 +284,18 @@ int main(int argc, const char **argv)
 
   if (doc_arg == NULL)
   {
-    fprintf(stderr, "Usage: texpresso [-I path]* [-json] root_file.tex\n");
+    fprintf(stderr, "Usage: texpresso [-I path]* [-json] [-framebuffer] [-serve socket] [-pool-alloc] [-glyph-atlas] [-memory-limit MB] [-render-helpers N] [-watchdog seconds] [-v] root_file.tex\n");
     exit(1);
   }
 
+  // The socket path is relative to the working directory, not to the document
+  char serve_abs_path[PATH_MAX];
+  if (serve_path && serve_path[0] != '/')
+  {
+    snprintf(serve_abs_path, PATH_MAX, "%s/%s", work_dir, serve_path);
+    serve_path = serve_abs_path;
+  }
+
   char *inclusion_path = malloc(inclusion_path_size);
   if (!inclusion_path) abort();
 
@@ -222,11 +331,13 @@ int main(int argc, const char **argv)
     abort();
   }
 
-  fz_context *ctx = fz_new_context(NULL, NULL, FZ_STORE_DEFAULT);
+  fz_context *ctx =
+    fz_new_context(pool_alloc ? txp_pool_allocator() : NULL,
+                   txp_worker_locks(), FZ_STORE_DEFAULT);
   fz_register_document_handlers(ctx);
 
-  //Initialize SDL
-  if (SDL_Init(SDL_INIT_VIDEO) < 0)
+  //Initialize SDL, the video subsystem is initialized with the window
+  if (SDL_Init(SDL_INIT_EVENTS) < 0)
   {
     fprintf(stderr, "SDL could not initialize! SDL_Error: %s\n", SDL_GetError());
     abort();
@@ -235,37 +346,20 @@ int main(int argc, const char **argv)
   custom_event = SDL_RegisterEvents(1);
   signal(SIGUSR1, signal_usr1);
 
-  //Create window
-  char window_title[128] = "TeXpresso ";
-  strcat(window_title, doc_name);
-
-  SDL_Window *window;
-  window = SDL_CreateWindow(window_title,
-    SDL_WINDOWPOS_UNDEFINED, SDL_WINDOWPOS_UNDEFINED,
-    700, 900,
-    SDL_WINDOW_SHOWN | SDL_WINDOW_ALLOW_HIGHDPI | SDL_WINDOW_RESIZABLE
-  );
-
-  if (window == NULL)
-  {
-    fprintf(stderr, "Window could not be created! SDL_Error: %s\n", SDL_GetError() );
-    abort();
-  }
-
-  SDL_Surface *logo = texpresso_logo();
-  fprintf(stderr, "texpresso logo: %dx%d\n", logo->w, logo->h);
-  SDL_SetWindowIcon(window, logo);
-  SDL_FreeSurface(logo);
-
-  SDL_Renderer *renderer;
-  renderer = SDL_CreateRenderer(window, -1, SDL_RENDERER_PRESENTVSYNC | SDL_RENDERER_TARGETTEXTURE);
-
   struct persistent_state pstate = {
       .initial = {0,},
       .protocol = protocol,
       .line_output = line_output,
-      .window = window,
-      .renderer = renderer,
+      .framebuffer = framebuffer,
+      .serve_path = serve_path,
+      .memory_limit = memory_limit,
+      .glyph_atlas = glyph_atlas,
+      .render_helpers = render_helpers,
+      .watchdog = watchdog,
+      .verbose = verbose,
+      .start_ticks = SDL_GetTicks(),
+      .window = NULL,
+      .renderer = NULL,
       .ctx = ctx,
       .exe_path = exe_path,
       .doc_path = doc_path,
@@ -274,12 +368,16 @@ int main(int argc, const char **argv)
       .custom_event = custom_event,
       .schedule_event = &schedule_event,
       .should_reload_binary = &should_reload_binary,
+      .pool_size = pool_alloc ? &txp_pool_allocator_size : NULL,
+      .open_window = &open_window,
   };
 
   while (texpresso_main(&pstate));
 
-  SDL_DestroyRenderer(renderer);
-  SDL_DestroyWindow(window);
+  if (pstate.renderer)
+    SDL_DestroyRenderer(pstate.renderer);
+  if (pstate.window)
+    SDL_DestroyWindow(pstate.window);
   SDL_Quit();
   fz_drop_context(ctx);
 
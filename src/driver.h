@@ -35,6 +35,7 @@ enum custom_events {
   RENDER_EVENT,
   RELOAD_EVENT,
   STDIN_EVENT,
+  HELPER_EVENT,
 
   EVENT_COUNT,
 };
@@ -59,10 +60,32 @@ struct persistent_state {
   struct initial_state initial;
   enum editor_protocol protocol;
   int line_output;
+  // Export rendered frames to shared memory
+  int framebuffer;
+  // Unix socket where viewers can connect, or NULL
+  const char *serve_path;
+  // Memory budget in bytes, 0 for the default
+  size_t memory_limit;
+  // Composite text from a glyph atlas
+  int glyph_atlas;
+  // Number of texpresso-render processes rendering pages, 0 to render in
+  // the UI process
+  int render_helpers;
+  // Seconds of CPU LaTeX can use without progressing before being paused,
+  // 0 to never pause
+  int watchdog;
+  // Print the duration of the startup steps
+  int verbose;
+  // SDL_GetTicks() when the process started
+  Uint32 start_ticks;
   Uint32 custom_event;
 
   void (*schedule_event)(enum custom_events ev);
   bool (*should_reload_binary)(void);
+  // Bytes held by the pool allocator, NULL if it is not used
+  size_t (*pool_size)(void);
+  // Create window and renderer, they are opened once TeX is running
+  void (*open_window)(struct persistent_state *ps);
 
   SDL_Window *window;
   SDL_Renderer *renderer;
@@ -24,13 +24,15 @@
 
 #include "mydvi.h"
 
-dvi_context *dvi_context_new(fz_context *ctx, dvi_reshooks hooks)
+dvi_context *dvi_context_new(fz_context *ctx, dvi_resmanager *rm, const char *document_dir)
 {
   dvi_context *dc = fz_malloc_struct(ctx, dvi_context);
 
   dc->dev = NULL;
-  dc->resmanager = dvi_resmanager_new(ctx, hooks);
+  dc->resmanager = dvi_resmanager_keep(ctx, rm);
+  dc->document_dir = document_dir ? fz_strdup(ctx, document_dir) : NULL;
   dvi_scratch_init(&dc->scratch);
+  dc->cull = fz_infinite_rect;
 
   dvi_state *st = &dc->root;
   st->fonts = dvi_fonttable_new(ctx);
@@ -59,7 +61,9 @@ dvi_context_set_device(fz_context *ctx, dvi_context *dc, fz_device *dev)
 void dvi_context_free(fz_context *ctx, dvi_context *dc)
 {
   dvi_context_set_device(ctx, dc, NULL);
-  dvi_resmanager_free(ctx, dc->resmanager);
+  dvi_resmanager_drop(ctx, dc->resmanager);
+  if (dc->document_dir)
+    fz_free(ctx, dc->document_dir);
   dvi_scratch_release(ctx, &dc->scratch);
   fz_free(ctx, dc);
 }
@@ -79,6 +83,7 @@ void dvi_context_begin_frame(fz_context *ctx, dvi_context *dc, fz_device *dev)
   dc->colorstack.depth = 0;
   for (int i = 0; i < dc->pdfcolorstacks.capacity; i++)
     dc->pdfcolorstacks.stacks[i].depth = 0;
+  dc->culled = 0;
 }
 
 void dvi_context_end_frame(fz_context *ctx, dvi_context *dc)
@@ -124,3 +129,21 @@ bool dvi_state_enter_vf(dvi_context *dc, dvi_state *vfst, const dvi_state *st, d
   return 1;
 }
 
+void dvi_context_set_cull(dvi_context *dc, fz_rect cull)
+{
+  dc->cull = cull;
+}
+
+// Return true if an object with these (conservative) bounds can be skipped
+bool dvi_context_cull(dvi_context *dc, fz_rect bounds)
+{
+  if (fz_is_infinite_rect(dc->cull) || fz_is_infinite_rect(bounds))
+    return 0;
+  if (bounds.x1 < dc->cull.x0 || bounds.x0 > dc->cull.x1 ||
+      bounds.y1 < dc->cull.y0 || bounds.y0 > dc->cull.y1)
+  {
+    dc->culled = 1;
+    return 1;
+  }
+  return 0;
+}
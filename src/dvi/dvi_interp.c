@@ -557,13 +557,26 @@ int dvi_interp_bop(const uint8_t *buf, int len, float *width, float *height, boo
     pos += n;
     CHECK_LEN(pos + size);
     const char * ptr = (const char *)buf + pos;
-    dvi_prescan_special(ptr, ptr + len, width, height, landscape);
+    dvi_prescan_special(ptr, ptr + size, width, height, landscape);
     pos += size;
   }
 
   return pos;
 }
 
+void dvi_interp_prefetch(fz_context *ctx, dvi_context *dc, const uint8_t *buf, int len)
+{
+  if (len > 0 && XXX1 <= buf[0] && buf[0] <= XXX4)
+  {
+    int n = (buf[0] - XXX1) + 1;
+    if (1 + n > len) return;
+    int size = decode_uB(buf+1, n);
+    if (1 + n + size > len) return;
+    const char *ptr = (const char *)buf + 1 + n;
+    dvi_prefetch_special(ctx, dc, ptr, ptr + size);
+  }
+}
+
 void dvi_interp_init(fz_context *ctx, dvi_context *dc, const uint8_t *buf, int len)
 {
   if (len > 0 && XXX1 <= buf[0] && buf[0] <= XXX4)
@@ -573,6 +586,6 @@ void dvi_interp_init(fz_context *ctx, dvi_context *dc, const uint8_t *buf, int l
     int size = decode_uB(buf+1, n);
     if (1 + n + size > len) return;
     const char *ptr = (const char *)buf + 1 + n;
-    dvi_init_special(ctx, dc, dvi_context_state(dc), ptr, ptr + len);
+    dvi_init_special(ctx, dc, dvi_context_state(dc), ptr, ptr + size);
   }
 }
@@ -34,6 +34,10 @@ static void output_fill_rect(fz_context *ctx, dvi_context *dc, dvi_state *st, in
   if (ctx && dc->dev)
   {
     float s = dc->scale;
+    fz_rect r = fz_make_rect(fz_mini(x0, x1) * s, - fz_maxi(y0, y1) * s,
+                             fz_maxi(x0, x1) * s, - fz_mini(y0, y1) * s);
+    if (dvi_context_cull(dc, fz_transform_rect(r, st->gs.ctm)))
+      return;
     fz_path *path = fz_new_path(ctx);
     fz_rectto(ctx, path, x0 * s, - y0 * s, x1 * s, - y1 * s);
     fz_fill_path(ctx, dc->dev, path, 0, st->gs.ctm, fz_device_rgb(ctx),
@@ -79,6 +83,30 @@ static dvi_fontdef *dvi_current_font(fz_context *ctx, dvi_state *st)
   return dvi_fonttable_get(ctx, st->fonts, st->f);
 }
 
+// Conservative bounds of a glyph drawn with transform trm.
+// TFM metrics, padded by one em for overhangs and accents, are preferred;
+// otherwise fall back to the font bounding box.
+static fz_rect glyph_bounds(fz_context *ctx, dvi_context *dc, dvi_state *st,
+                            dvi_font *font, uint32_t c, fixed_t scale_factor,
+                            fz_matrix trm)
+{
+  if (font->tfm)
+  {
+    int32_t em = scale_factor.value;
+    int32_t w = fixed_mul(tex_tfm_char_width(font->tfm, c), scale_factor).value;
+    int32_t h = fixed_mul(tex_tfm_char_height(font->tfm, c), scale_factor).value;
+    int32_t d = fixed_mul(tex_tfm_char_depth(font->tfm, c), scale_factor).value;
+    float s = dc->scale;
+    fz_rect r = fz_make_rect(-em * s, -(d + em) * s, (w + em) * s, (h + em) * s);
+    return fz_transform_rect(r, dvi_get_ctm(dc, st));
+  }
+
+  fz_rect bbox = fz_font_bbox(ctx, font->fz);
+  if (fz_is_empty_rect(bbox))
+    return fz_infinite_rect;
+  return fz_transform_rect(bbox, trm);
+}
+
 void dvi_exec_char(fz_context *ctx, dvi_context *dc, dvi_state *st, uint32_t c, bool set)
 {
   int debug = 0;
@@ -105,27 +133,8 @@ void dvi_exec_char(fz_context *ctx, dvi_context *dc, dvi_state *st, uint32_t c,
       int u = -1;
       if (c >= 0 && c <= 255)
       {
-        if (font->glyph_map)
-          u = font->glyph_map[c];
-        else
-        {
-          int *buf = fz_malloc_array(ctx, 256, int);
-          if (!buf) abort();
-          for (int i = 0; i < 256; ++i) buf[i] = -1;
-          font->glyph_map = buf;
-        }
-
-        if (u == -1)
-        {
-          const char *name = NULL;
-          if (font->enc)
-            name = tex_enc_get(font->enc, c);
-          if (name)
-            u = fz_encode_character_by_glyph_name(ctx, font->fz, (const char *)name);
-          else
-            u = fz_encode_character(ctx, font->fz, c);
-          font->glyph_map[c] = u;
-        }
+        // Filled by the resource manager when the font is loaded
+        u = font->glyph_map[c];
       }
       else
       {
@@ -136,9 +145,12 @@ void dvi_exec_char(fz_context *ctx, dvi_context *dc, dvi_state *st, uint32_t c,
       if (dc->dev)
       {
         float s = dc->scale * scale_factor.value;
-        fz_show_glyph(ctx, get_text(ctx, dc), font->fz,
-                      fz_pre_scale(dvi_get_ctm(dc, st), s, s), u, c, 0, 0,
-                      FZ_BIDI_LTR, FZ_LANG_UNSET);
+        fz_matrix trm = fz_pre_scale(dvi_get_ctm(dc, st), s, s);
+        if (fz_is_infinite_rect(dc->cull) ||
+            !dvi_context_cull(dc, glyph_bounds(ctx, dc, st, font, c,
+                                               scale_factor, trm)))
+          fz_show_glyph(ctx, get_text(ctx, dc), font->fz, trm, u, c, 0, 0,
+                        FZ_BIDI_LTR, FZ_LANG_UNSET);
       }
     }
     else if (font->vf)
@@ -345,12 +357,22 @@ void dvi_exec_xdvglyphs(fz_context *ctx, dvi_context *dc, dvi_state *st, fixed_t
     if (dc->dev)
     {
       fz_text *text = get_text(ctx, dc);
+      fz_rect bbox = fz_infinite_rect;
+      if (!fz_is_infinite_rect(dc->cull))
+      {
+        bbox = fz_font_bbox(ctx, font);
+        if (fz_is_empty_rect(bbox))
+          bbox = fz_infinite_rect;
+      }
       for (int i = 0; i < num_glyphs; ++i)
       {
         int32_t h = sh + dx[i].value;
         int32_t v = dy ? sv + dy[i].value : sv;
         fz_matrix ctm =
             fz_pre_scale(fz_pre_translate(st->gs.ctm, h * ds, -v * ds), fs, fs);
+        if (!fz_is_infinite_rect(bbox) &&
+            dvi_context_cull(dc, fz_transform_rect(bbox, ctm)))
+          continue;
         fz_show_glyph(ctx, text, font, ctm, glyphs[i], 0, 0, 0, FZ_BIDI_LTR,
                       FZ_LANG_UNSET);
       }
@@ -0,0 +1,861 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2023 Frédéric Bour <frederic.bour@lakaban.net>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+// Resource daemon: a per-user process that owns a bundle-serve helper and
+// caches the files it returns (fontmaps, TFM, VF, encodings, fonts).
+//
+// Clients talk to it over a unix socket:
+// - request: one byte for the resource kind ('0' + dvi_reskind), the name,
+//   and a newline
+// - answer: one byte for success and the size as a big-endian u64.
+//   On success, a memfd holding the contents is attached to the answer.
+//
+// The memfd is sealed, the daemon keeps it around and sends the same file to
+// every client: contents are fetched once per user session rather than once
+// per window. Clients map it shared and use the pages in place, so a font
+// lives in memory once whatever the number of texpresso processes.
+//
+// The first client that finds no daemon starts texpresso-resd, looked up
+// next to texpresso-tonic, and waits briefly for its socket.
+
+#ifdef __linux__
+#define _GNU_SOURCE
+#endif
+
+#include "mydvi.h"
+#include "fz_util.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+#define RESD_IDLE_TIMEOUT (10 * 60)
+#define RESD_MAX_CLIENTS 64
+// Failed lookups are retried after this many seconds: files installed while
+// the daemon is running are eventually found
+#define RESD_MISS_TIMEOUT 30
+// How long a client waits for a daemon it started, in milliseconds
+#define RESD_START_TIMEOUT 500
+
+bool dvi_resdaemon_socket_path(char *path, size_t len)
+{
+  const char *dir = getenv("XDG_RUNTIME_DIR");
+  int n;
+  if (dir && *dir)
+    n = snprintf(path, len, "%s/texpresso-resd.sock", dir);
+  else
+    n = snprintf(path, len, "/tmp/texpresso-resd-%d.sock", (int)getuid());
+  return (n > 0 && (size_t)n < len);
+}
+
+// The fallback socket lives in a world-writable directory: only trust a
+// daemon run by the same user
+static bool resd_trusted_peer(int fd)
+{
+#ifdef __linux__
+  struct ucred cred;
+  socklen_t len = sizeof(cred);
+  if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) == -1)
+    return 0;
+  return cred.uid == getuid();
+#else
+  uid_t uid;
+  gid_t gid;
+  if (getpeereid(fd, &uid, &gid) == -1)
+    return 0;
+  return uid == getuid();
+#endif
+}
+
+static int resd_connect(void)
+{
+  struct sockaddr_un addr = {0,};
+  addr.sun_family = AF_UNIX;
+  if (!dvi_resdaemon_socket_path(addr.sun_path, sizeof(addr.sun_path)))
+    return -1;
+
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd == -1)
+    return -1;
+  fcntl(fd, F_SETFD, FD_CLOEXEC);
+
+  if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1)
+  {
+    close(fd);
+    return -1;
+  }
+
+  if (!resd_trusted_peer(fd))
+  {
+    fprintf(stderr, "[dvi] %s is not owned by this user, ignoring it\n",
+            addr.sun_path);
+    close(fd);
+    return -1;
+  }
+
+  return fd;
+}
+
+static bool write_all(int fd, const void *data, size_t len)
+{
+  const char *ptr = data;
+  while (len > 0)
+  {
+    ssize_t n = write(fd, ptr, len);
+    if (n == -1 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      return 0;
+    ptr += n;
+    len -= n;
+  }
+  return 1;
+}
+
+// Like write_all, but a closed socket reports an error rather than SIGPIPE
+static bool send_all(int fd, const void *data, size_t len)
+{
+  const char *ptr = data;
+  while (len > 0)
+  {
+    ssize_t n = send(fd, ptr, len, MSG_NOSIGNAL);
+    if (n == -1 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      return 0;
+    ptr += n;
+    len -= n;
+  }
+  return 1;
+}
+
+static bool read_all(int fd, void *data, size_t len)
+{
+  char *ptr = data;
+  while (len > 0)
+  {
+    ssize_t n = read(fd, ptr, len);
+    if (n == -1 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      return 0;
+    ptr += n;
+    len -= n;
+  }
+  return 1;
+}
+
+static void encode_answer(uint8_t answer[9], bool success, uint64_t size)
+{
+  answer[0] = success;
+  for (int i = 0; i < 8; ++i)
+    answer[1 + i] = (size >> ((7 - i) * 8)) & 0xFF;
+}
+
+static uint64_t decode_size(const uint8_t answer[9])
+{
+  uint64_t size = 0;
+  for (int i = 0; i < 8; ++i)
+    size = (size << 8) | answer[1 + i];
+  return size;
+}
+
+/* Client */
+
+// A memfd received from the daemon, mapped shared. The buffer points to the
+// mapped pages; we keep one reference and unmap the pages once it is the
+// last one.
+struct resd_mapping {
+  fz_buffer *buf;
+  void *data;
+  size_t size;
+  struct resd_mapping *next;
+};
+
+struct resdaemon_env {
+  char *document_dir;
+  int fd;
+  // Private helper, used if the daemon goes away
+  dvi_reshooks fallback;
+  const char *tectonic_path;
+  struct resd_mapping *mappings;
+};
+
+static bool mapping_in_use(fz_context *ctx, struct resd_mapping *m)
+{
+  fz_lock(ctx, FZ_LOCK_ALLOC);
+  int refs = m->buf->refs;
+  fz_unlock(ctx, FZ_LOCK_ALLOC);
+  return refs > 1;
+}
+
+// Unmap the files that are no longer used.
+// With release set, forget the others: they stay mapped as long as the
+// process lives, fonts can outlive the resource manager in display lists.
+static void resd_sweep(fz_context *ctx, struct resdaemon_env *env, bool release)
+{
+  struct resd_mapping **link = &env->mappings;
+  while (*link)
+  {
+    struct resd_mapping *m = *link;
+    bool used = mapping_in_use(ctx, m);
+    if (used && !release)
+    {
+      link = &m->next;
+      continue;
+    }
+    *link = m->next;
+    fz_drop_buffer(ctx, m->buf);
+    if (!used)
+      munmap(m->data, m->size);
+    fz_free(ctx, m);
+  }
+}
+
+static fz_stream *
+open_local_file(fz_context *ctx, const char *document_dir, const char *name)
+{
+  char path[4096];
+  if (name[0] != '/' && document_dir && document_dir[0])
+  {
+    if (snprintf(path, sizeof(path), "%s/%s", document_dir, name) >=
+        (int)sizeof(path))
+      return NULL;
+    name = path;
+  }
+
+  fz_ptr(fz_stream, result);
+  fz_try(ctx)
+  {
+    result = fz_open_file(ctx, name);
+  }
+  fz_catch(ctx)
+  {
+    fz_warn(ctx, "dvi_resdaemon_open_file(%s): %s", name,
+            fz_caught_message(ctx));
+  }
+  return result;
+}
+
+// Receive the header of an answer and the file descriptor attached to it
+static bool resd_receive(int fd, uint8_t answer[9], int *memfd)
+{
+  char control[CMSG_SPACE(sizeof(int))];
+  struct iovec iov = {.iov_base = answer, .iov_len = 9};
+  struct msghdr msg = {
+    .msg_iov = &iov,
+    .msg_iovlen = 1,
+    .msg_control = control,
+    .msg_controllen = sizeof(control),
+  };
+
+  ssize_t n;
+  do n = recvmsg(fd, &msg, 0);
+  while (n == -1 && errno == EINTR);
+  if (n <= 0)
+    return 0;
+
+  *memfd = -1;
+  for (struct cmsghdr *c = CMSG_FIRSTHDR(&msg); c; c = CMSG_NXTHDR(&msg, c))
+    if (c->cmsg_level == SOL_SOCKET && c->cmsg_type == SCM_RIGHTS)
+    {
+      memcpy(memfd, CMSG_DATA(c), sizeof(int));
+      fcntl(*memfd, F_SETFD, FD_CLOEXEC);
+    }
+
+  if (n < 9 && !read_all(fd, answer + n, 9 - n))
+  {
+    if (*memfd != -1)
+      close(*memfd);
+    return 0;
+  }
+
+  return 1;
+}
+
+static fz_buffer *
+resd_request(fz_context *ctx, struct resdaemon_env *env, dvi_reskind kind, const char *name)
+{
+  char request[1024];
+  int len = snprintf(request, sizeof(request), "%c%s\n", '0' + kind, name);
+  if (len < 0 || len >= (int)sizeof(request))
+    return NULL;
+
+  uint8_t answer[9];
+  int memfd = -1;
+  if (!send_all(env->fd, request, len) ||
+      !resd_receive(env->fd, answer, &memfd))
+  {
+    fprintf(stderr, "[dvi] resource daemon disconnected\n");
+    close(env->fd);
+    env->fd = -1;
+    return NULL;
+  }
+
+  uint64_t size = decode_size(answer);
+  if (!answer[0] || memfd == -1)
+  {
+    if (memfd != -1)
+      close(memfd);
+    return NULL;
+  }
+
+  if (size == 0)
+  {
+    close(memfd);
+    return fz_new_buffer(ctx, 1);
+  }
+
+  void *data = mmap(NULL, size, PROT_READ, MAP_SHARED, memfd, 0);
+  close(memfd);
+
+  if (data == MAP_FAILED)
+  {
+    perror("dvi_resdaemon: mmap");
+    return NULL;
+  }
+
+  resd_sweep(ctx, env, 0);
+
+  struct resd_mapping *m = NULL;
+  fz_var(m);
+  fz_try(ctx)
+  {
+    m = fz_malloc_struct(ctx, struct resd_mapping);
+    m->buf = fz_new_buffer_from_shared_data(ctx, data, size);
+  }
+  fz_catch(ctx)
+  {
+    fz_free(ctx, m);
+    munmap(data, size);
+    return NULL;
+  }
+  m->data = data;
+  m->size = size;
+  m->next = env->mappings;
+  env->mappings = m;
+  return fz_keep_buffer(ctx, m->buf);
+}
+
+static fz_stream *
+resdaemon_hooks_open_file(fz_context *ctx, void *_env, dvi_reskind kind, const char *name)
+{
+  struct resdaemon_env *env = _env;
+
+  // Graphics and fonts referred to by path are local to the document
+  if (kind == RES_PDF || (kind == RES_FONT && name[0] == '/'))
+    return open_local_file(ctx, env->document_dir, name);
+
+  if (env->fd != -1)
+  {
+    fprintf(stderr, "[dvi] loading %s (daemon)\n", name);
+    fz_buffer *buffer = resd_request(ctx, env, kind, name);
+    if (buffer)
+    {
+      fz_stream *result = fz_open_buffer(ctx, buffer);
+      fz_drop_buffer(ctx, buffer);
+      return result;
+    }
+    if (env->fd != -1)
+      return NULL;
+  }
+
+  if (!env->fallback.open_file)
+    env->fallback =
+      dvi_bundle_serve_hooks(ctx, env->tectonic_path, env->document_dir);
+  return env->fallback.open_file(ctx, env->fallback.env, kind, name);
+}
+
+static fz_buffer *
+resdaemon_hooks_load_file(fz_context *ctx, void *_env, dvi_reskind kind, const char *name)
+{
+  struct resdaemon_env *env = _env;
+  fz_stream *stm = NULL;
+
+  if (env->fd != -1 &&
+      !(kind == RES_PDF || (kind == RES_FONT && name[0] == '/')))
+  {
+    fprintf(stderr, "[dvi] loading %s (daemon)\n", name);
+    fz_buffer *result = resd_request(ctx, env, kind, name);
+    if (result || env->fd != -1)
+      return result;
+  }
+
+  stm = resdaemon_hooks_open_file(ctx, env, kind, name);
+  if (!stm)
+    return NULL;
+
+  fz_buffer *result = NULL;
+  fz_try(ctx)
+  {
+    result = fz_read_all(ctx, stm, 16384);
+  }
+  fz_always(ctx)
+  {
+    fz_drop_stream(ctx, stm);
+  }
+  fz_catch(ctx)
+  {
+    fz_rethrow(ctx);
+  }
+  return result;
+}
+
+static void
+resdaemon_free_env(fz_context *ctx, void *_env)
+{
+  struct resdaemon_env *env = _env;
+  if (env->fd != -1)
+    close(env->fd);
+  resd_sweep(ctx, env, 1);
+  dvi_free_hooks(ctx, &env->fallback);
+  fz_free(ctx, (void*)env->tectonic_path);
+  fz_free(ctx, env->document_dir);
+  fz_free(ctx, env);
+}
+
+#ifdef __linux__
+
+// Start texpresso-resd in the background, detached from this process.
+// Returns false if it could not be executed.
+static bool resd_spawn(const char *tectonic_path)
+{
+  char path[4096];
+  const char *sep = strrchr(tectonic_path, '/');
+  if (sep)
+  {
+    if (snprintf(path, sizeof(path), "%.*s/texpresso-resd",
+                 (int)(sep - tectonic_path), tectonic_path) >= (int)sizeof(path))
+      return 0;
+  }
+  else
+    strcpy(path, "texpresso-resd");
+
+  char *argv[] = {path, (char *)tectonic_path, NULL};
+
+  // Closed on exec: a byte is written on it only if exec failed
+  int status[2];
+  if (pipe2(status, O_CLOEXEC) == -1)
+    return 0;
+
+  // Fork twice so that the daemon is not our child
+  pid_t pid = fork();
+  if (pid == -1)
+  {
+    close(status[0]);
+    close(status[1]);
+    return 0;
+  }
+  if (pid == 0)
+  {
+    close(status[0]);
+    if (fork() == 0)
+    {
+      setsid();
+      int null = open("/dev/null", O_RDWR);
+      if (null != -1)
+      {
+        dup2(null, STDIN_FILENO);
+        dup2(null, STDOUT_FILENO);
+      }
+      execvp(path, argv);
+      char c = 0;
+      while (write(status[1], &c, 1) == -1 && errno == EINTR);
+    }
+    _exit(0);
+  }
+  close(status[1]);
+  while (waitpid(pid, NULL, 0) == -1 && errno == EINTR);
+
+  char c;
+  ssize_t n;
+  do n = read(status[0], &c, 1);
+  while (n == -1 && errno == EINTR);
+  close(status[0]);
+  return n == 0;
+}
+
+static int resd_start(const char *tectonic_path)
+{
+  if (!resd_spawn(tectonic_path))
+    return -1;
+  fprintf(stderr, "[dvi] starting resource daemon\n");
+  for (int waited = 0; waited < RESD_START_TIMEOUT; waited += 10)
+  {
+    struct timespec delay = {.tv_sec = 0, .tv_nsec = 10 * 1000 * 1000};
+    nanosleep(&delay, NULL);
+    int fd = resd_connect();
+    if (fd != -1)
+      return fd;
+  }
+  return -1;
+}
+
+#else
+
+// The daemon needs memfd
+static int resd_start(const char *tectonic_path)
+{
+  return -1;
+}
+
+#endif
+
+dvi_reshooks dvi_resdaemon_hooks(fz_context *ctx, const char *tectonic_path, const char *document_dir)
+{
+  int fd = resd_connect();
+  if (fd == -1)
+    fd = resd_start(tectonic_path);
+  if (fd == -1)
+    return dvi_bundle_serve_hooks(ctx, tectonic_path, document_dir);
+
+  fprintf(stderr, "[dvi] using resource daemon\n");
+  struct resdaemon_env *env = fz_malloc_struct(ctx, struct resdaemon_env);
+  env->fd = fd;
+  env->document_dir = fz_strdup(ctx, document_dir ? document_dir : "");
+  env->tectonic_path = fz_strdup(ctx, tectonic_path);
+  return (dvi_reshooks){
+    .env = env,
+    .free_env = resdaemon_free_env,
+    .open_file = resdaemon_hooks_open_file,
+    .load_file = resdaemon_hooks_load_file,
+  };
+}
+
+/* Server */
+
+#ifdef __linux__
+
+typedef struct cell_resource cell_resource;
+
+struct cell_resource {
+  dvi_reskind kind;
+  char *name;
+  int fd;
+  uint64_t size;
+  // When the lookup failed, to retry it later
+  time_t checked;
+  cell_resource *next;
+};
+
+struct resd_client {
+  int fd;
+  int len;
+  char buffer[1024];
+};
+
+static int resd_make_memfd(fz_buffer *buf)
+{
+  int fd = memfd_create("texpresso-resd", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+  if (fd == -1)
+  {
+    perror("dvi_resdaemon: memfd_create");
+    return -1;
+  }
+
+  if (!write_all(fd, buf->data, buf->len) ||
+      fcntl(fd, F_ADD_SEALS,
+            F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL) == -1)
+  {
+    perror("dvi_resdaemon: memfd");
+    close(fd);
+    return -1;
+  }
+
+  return fd;
+}
+
+static cell_resource *
+resd_lookup(fz_context *ctx, dvi_reshooks *hooks, cell_resource **first,
+            dvi_reskind kind, const char *name)
+{
+  cell_resource *cell;
+  for (cell = *first; cell; cell = cell->next)
+    if (cell->kind == kind && strcmp(cell->name, name) == 0)
+      break;
+
+  if (cell && (cell->fd != -1 || time(NULL) - cell->checked < RESD_MISS_TIMEOUT))
+    return cell;
+
+  if (!cell)
+  {
+    cell = fz_malloc_struct(ctx, cell_resource);
+    cell->kind = kind;
+    cell->name = fz_strdup(ctx, name);
+    cell->fd = -1;
+    cell->next = *first;
+    *first = cell;
+  }
+  cell->checked = time(NULL);
+
+  fz_ptr(fz_stream, stm);
+  fz_ptr(fz_buffer, buf);
+  fz_try(ctx)
+  {
+    stm = hooks->open_file(ctx, hooks->env, kind, name);
+    if (stm)
+    {
+      buf = fz_read_all(ctx, stm, 16384);
+      cell->fd = resd_make_memfd(buf);
+      cell->size = buf->len;
+    }
+  }
+  fz_always(ctx)
+  {
+    if (stm)
+      fz_drop_stream(ctx, stm);
+    if (buf)
+      fz_drop_buffer(ctx, buf);
+  }
+  fz_catch(ctx)
+  {
+    fz_warn(ctx, "dvi_resdaemon(%s): %s", name, fz_caught_message(ctx));
+  }
+
+  return cell;
+}
+
+static bool resd_answer(int fd, cell_resource *cell)
+{
+  uint8_t answer[9];
+  bool success = cell->fd != -1;
+  encode_answer(answer, success, success ? cell->size : 0);
+
+  char control[CMSG_SPACE(sizeof(int))];
+  memset(control, 0, sizeof(control));
+  struct iovec iov = {.iov_base = answer, .iov_len = 9};
+  struct msghdr msg = {
+    .msg_iov = &iov,
+    .msg_iovlen = 1,
+  };
+
+  if (success)
+  {
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    struct cmsghdr *c = CMSG_FIRSTHDR(&msg);
+    c->cmsg_level = SOL_SOCKET;
+    c->cmsg_type = SCM_RIGHTS;
+    c->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(c), &cell->fd, sizeof(int));
+  }
+
+  ssize_t n;
+  do n = sendmsg(fd, &msg, MSG_NOSIGNAL);
+  while (n == -1 && errno == EINTR);
+  if (n <= 0)
+    return 0;
+  return (n == 9 || send_all(fd, answer + n, 9 - n));
+}
+
+// Process complete requests, return false if the client should be dropped
+static bool resd_client_input(fz_context *ctx, dvi_reshooks *hooks,
+                              cell_resource **first, struct resd_client *cl)
+{
+  ssize_t n;
+  do n = read(cl->fd, cl->buffer + cl->len, sizeof(cl->buffer) - cl->len);
+  while (n == -1 && errno == EINTR);
+  if (n <= 0)
+    return 0;
+  cl->len += n;
+
+  char *line = cl->buffer, *lim = cl->buffer + cl->len, *nl;
+  while ((nl = memchr(line, '\n', lim - line)))
+  {
+    *nl = '\0';
+    int kind = line[0] - '0';
+    if (kind < RES_ENC || kind > RES_FONT || !line[1])
+    {
+      fprintf(stderr, "[resd] invalid request\n");
+      return 0;
+    }
+    cell_resource *cell = resd_lookup(ctx, hooks, first, kind, line + 1);
+    if (!resd_answer(cl->fd, cell))
+      return 0;
+    line = nl + 1;
+  }
+
+  cl->len = lim - line;
+  if (cl->len == sizeof(cl->buffer))
+  {
+    fprintf(stderr, "[resd] request too long\n");
+    return 0;
+  }
+  memmove(cl->buffer, line, cl->len);
+  return 1;
+}
+
+static int resd_listen(const char *path)
+{
+  struct sockaddr_un addr = {0,};
+  addr.sun_family = AF_UNIX;
+  if (strlen(path) >= sizeof(addr.sun_path))
+    return -1;
+  strcpy(addr.sun_path, path);
+
+  // Replace the socket only if nobody is answering on it
+  int probe = resd_connect();
+  if (probe != -1)
+  {
+    close(probe);
+    fprintf(stderr, "[resd] a daemon is already running on %s\n", path);
+    return -1;
+  }
+  unlink(path);
+
+  int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd == -1)
+  {
+    perror("[resd] socket");
+    return -1;
+  }
+
+  mode_t mask = umask(0077);
+  int r = bind(fd, (struct sockaddr *)&addr, sizeof(addr));
+  umask(mask);
+
+  if (r == -1 || listen(fd, 16) == -1)
+  {
+    perror("[resd] bind");
+    close(fd);
+    return -1;
+  }
+
+  return fd;
+}
+
+int dvi_resdaemon_serve(fz_context *ctx, const char *tectonic_path)
+{
+  char path[sizeof(((struct sockaddr_un *)0)->sun_path)];
+  if (!dvi_resdaemon_socket_path(path, sizeof(path)))
+    return 1;
+
+  int lfd = resd_listen(path);
+  if (lfd == -1)
+    return 1;
+
+  fprintf(stderr, "[resd] listening on %s\n", path);
+
+  dvi_reshooks hooks = dvi_bundle_serve_hooks(ctx, tectonic_path, NULL);
+  cell_resource *first = NULL;
+  struct resd_client clients[RESD_MAX_CLIENTS];
+  struct pollfd fds[RESD_MAX_CLIENTS + 1];
+  int count = 0;
+  time_t last_activity = time(NULL);
+
+  while (1)
+  {
+    fds[0].fd = lfd;
+    fds[0].events = POLLIN;
+    for (int i = 0; i < count; ++i)
+    {
+      fds[i + 1].fd = clients[i].fd;
+      fds[i + 1].events = POLLIN;
+    }
+
+    int n = poll(fds, count + 1, 60 * 1000);
+    if (n == -1)
+    {
+      if (errno == EINTR)
+        continue;
+      perror("[resd] poll");
+      break;
+    }
+
+    if (count > 0)
+      last_activity = time(NULL);
+    else if (time(NULL) - last_activity > RESD_IDLE_TIMEOUT)
+    {
+      fprintf(stderr, "[resd] idle, exiting\n");
+      break;
+    }
+
+    for (int i = count - 1; i >= 0; --i)
+    {
+      if (!fds[i + 1].revents)
+        continue;
+      if (!resd_client_input(ctx, &hooks, &first, &clients[i]))
+      {
+        close(clients[i].fd);
+        clients[i] = clients[count - 1];
+        count -= 1;
+      }
+    }
+
+    if (fds[0].revents & POLLIN)
+    {
+      int fd = accept4(lfd, NULL, NULL, SOCK_CLOEXEC);
+      if (fd == -1)
+        perror("[resd] accept");
+      else if (count == RESD_MAX_CLIENTS)
+        close(fd);
+      else
+      {
+        clients[count].fd = fd;
+        clients[count].len = 0;
+        count += 1;
+      }
+    }
+  }
+
+  for (int i = 0; i < count; ++i)
+    close(clients[i].fd);
+  close(lfd);
+  unlink(path);
+
+  for (cell_resource *cell = first; cell; )
+  {
+    cell_resource *next = cell->next;
+    if (cell->fd != -1)
+      close(cell->fd);
+    fz_free(ctx, cell->name);
+    fz_free(ctx, cell);
+    cell = next;
+  }
+  dvi_free_hooks(ctx, &hooks);
+
+  return 0;
+}
+
+#else
+
+int dvi_resdaemon_serve(fz_context *ctx, const char *tectonic_path)
+{
+  fprintf(stderr, "[resd] the resource daemon requires memfd (Linux only)\n");
+  return 1;
+}
+
+#endif
@@ -27,6 +27,7 @@
 #include "mydvi.h"
 #include "fz_util.h"
 #include <sys/wait.h>
+#include <pthread.h>
 #include <unistd.h>
 
 typedef struct cell_dvi_font cell_dvi_font;
@@ -56,6 +57,7 @@ struct cell_fz_font {
 struct cell_pdf_doc {
   const char *name;
   pdf_document *doc;
+  size_t size;
   cell_pdf_doc *next;
 };
 
@@ -66,6 +68,9 @@ struct cell_image {
 };
 
 struct dvi_resmanager {
+  // Recursive: loading a VF font loads the fonts it refers to
+  pthread_mutex_t lock;
+  int refs;
   dvi_reshooks hooks;
   cell_dvi_font *first_dvi_font;
   cell_tex_enc  *first_tex_enc;
@@ -73,6 +78,14 @@ struct dvi_resmanager {
   cell_fz_font  *first_fz_font;
   cell_image    *first_image;
   tex_fontmap *map;
+  // The fontmap is parsed by a thread started with the manager, it is waited
+  // for before the first use of the map or of the hooks
+  pthread_mutex_t map_lock;
+  pthread_t map_loader;
+  bool map_loading;
+  fz_context *map_ctx;
+  dvi_prefetch_fn *prefetch;
+  void *prefetch_env;
 };
 
 static void
@@ -509,7 +522,7 @@ void dvi_free_hooks(fz_context *ctx, const dvi_reshooks *hooks)
 }
 
 
-static fz_stream *dvi_resmanager_open_file(fz_context *ctx, dvi_resmanager *rm, dvi_reskind kind, const char *path)
+static fz_stream *hooks_open_file(fz_context *ctx, dvi_resmanager *rm, dvi_reskind kind, const char *path)
 {
   if (!rm->hooks.open_file)
     return NULL;
@@ -517,6 +530,51 @@ static fz_stream *dvi_resmanager_open_file(fz_context *ctx, dvi_resmanager *rm,
   return rm->hooks.open_file(ctx, rm->hooks.env, kind, path);
 }
 
+// The hooks are not thread-safe: wait for the fontmap loader to be done
+// with them
+static void fontmap_wait(dvi_resmanager *rm)
+{
+  pthread_mutex_lock(&rm->map_lock);
+  if (rm->map_loading)
+  {
+    pthread_join(rm->map_loader, NULL);
+    rm->map_loading = 0;
+  }
+  pthread_mutex_unlock(&rm->map_lock);
+}
+
+static fz_stream *dvi_resmanager_open_file(fz_context *ctx, dvi_resmanager *rm, dvi_reskind kind, const char *path)
+{
+  fontmap_wait(rm);
+  return hooks_open_file(ctx, rm, kind, path);
+}
+
+static fz_buffer *dvi_resmanager_load_file(fz_context *ctx, dvi_resmanager *rm, dvi_reskind kind, const char *path)
+{
+  fontmap_wait(rm);
+  if (rm->hooks.load_file)
+    return rm->hooks.load_file(ctx, rm->hooks.env, kind, path);
+
+  fz_stream *stm = hooks_open_file(ctx, rm, kind, path);
+  if (!stm)
+    return NULL;
+
+  fz_buffer *buf = NULL;
+  fz_try(ctx)
+  {
+    buf = fz_read_all(ctx, stm, 16384);
+  }
+  fz_always(ctx)
+  {
+    fz_drop_stream(ctx, stm);
+  }
+  fz_catch(ctx)
+  {
+    fz_rethrow(ctx);
+  }
+  return buf;
+}
+
 static void load_fontmap(fz_context *ctx, dvi_resmanager *rm)
 {
   if (rm->map)
@@ -525,13 +583,13 @@ static void load_fontmap(fz_context *ctx, dvi_resmanager *rm)
     rm->map = NULL;
   }
 
-  fz_stream *stm[3];
+  fz_stream *stm[3] = {NULL, NULL, NULL};
   fz_var(stm);
   fz_try(ctx)
   {
-    stm[0] = dvi_resmanager_open_file(ctx, rm, RES_MAP, "pdftex.map");
-    stm[1] = dvi_resmanager_open_file(ctx, rm, RES_MAP, "kanjix.map");
-    stm[2] = dvi_resmanager_open_file(ctx, rm, RES_MAP, "ckx.map");
+    stm[0] = hooks_open_file(ctx, rm, RES_MAP, "pdftex.map");
+    stm[1] = hooks_open_file(ctx, rm, RES_MAP, "kanjix.map");
+    stm[2] = hooks_open_file(ctx, rm, RES_MAP, "ckx.map");
 
     // printf(stm ? "FONT: loading fontmap\n" : "FONT: no fontmap\n");
     rm->map = tex_fontmap_load(ctx, stm, 3);
@@ -545,6 +603,25 @@ static void load_fontmap(fz_context *ctx, dvi_resmanager *rm)
   fz_try_rethrow(ctx);
 }
 
+static void *fontmap_loader_main(void *data)
+{
+  dvi_resmanager *rm = data;
+  fz_context *ctx = rm->map_ctx;
+
+  fz_try(ctx)
+  {
+    load_fontmap(ctx, rm);
+  }
+  fz_catch(ctx)
+  {
+    fprintf(stderr, "[dvi] cannot load fontmap: %s\n", fz_caught_message(ctx));
+  }
+
+  rm->map_ctx = NULL;
+  fz_drop_context(ctx);
+  return NULL;
+}
+
 dvi_resmanager *dvi_resmanager_new(fz_context *ctx, dvi_reshooks hooks)
 {
   dvi_resmanager *rm = fz_malloc_struct(ctx, dvi_resmanager);
@@ -553,15 +630,68 @@ dvi_resmanager *dvi_resmanager_new(fz_context *ctx, dvi_reshooks hooks)
   rm->first_pdf_doc = NULL;
   rm->first_fz_font = NULL;
   rm->first_image = NULL;
+  rm->refs = 1;
   rm->hooks = hooks;
 
-  load_fontmap(ctx, rm);
+  pthread_mutexattr_t attr;
+  pthread_mutexattr_init(&attr);
+  pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+  pthread_mutex_init(&rm->lock, &attr);
+  pthread_mutexattr_destroy(&attr);
+  pthread_mutex_init(&rm->map_lock, NULL);
+
+  // Parsing the fontmap takes a while, it overlaps with the rest of the
+  // startup. Contexts created without locks cannot be cloned: load it now.
+  rm->map_ctx = fz_clone_context(ctx);
+  if (rm->map_ctx &&
+      pthread_create(&rm->map_loader, NULL, fontmap_loader_main, rm) == 0)
+    rm->map_loading = 1;
+  else
+  {
+    if (rm->map_ctx)
+      fz_drop_context(rm->map_ctx);
+    rm->map_ctx = NULL;
+    load_fontmap(ctx, rm);
+  }
+
+  return rm;
+}
+
+void dvi_resmanager_lock(dvi_resmanager *rm)
+{
+  pthread_mutex_lock(&rm->lock);
+}
+
+void dvi_resmanager_unlock(dvi_resmanager *rm)
+{
+  pthread_mutex_unlock(&rm->lock);
+}
 
+dvi_resmanager *dvi_resmanager_keep(fz_context *ctx, dvi_resmanager *rm)
+{
+  if (rm)
+  {
+    dvi_resmanager_lock(rm);
+    rm->refs += 1;
+    dvi_resmanager_unlock(rm);
+  }
   return rm;
 }
 
-void dvi_resmanager_free(fz_context *ctx, dvi_resmanager *rm)
+void dvi_resmanager_drop(fz_context *ctx, dvi_resmanager *rm)
 {
+  if (!rm)
+    return;
+
+  dvi_resmanager_lock(rm);
+  rm->refs -= 1;
+  int refs = rm->refs;
+  dvi_resmanager_unlock(rm);
+  if (refs > 0)
+    return;
+
+  fontmap_wait(rm);
+  pthread_mutex_destroy(&rm->map_lock);
   dvi_free_hooks(ctx, &rm->hooks);
 
   if (rm->map)
@@ -578,6 +708,7 @@ void dvi_resmanager_free(fz_context *ctx, dvi_resmanager *rm)
       tex_tfm_free(ctx, cell->font.tfm);
     if (cell->font.fz)
       fz_drop_font(ctx, cell->font.fz);
+    fz_free(ctx, cell->font.glyph_map);
     fz_free(ctx, cell);
     cell = next;
   }
@@ -618,6 +749,7 @@ void dvi_resmanager_free(fz_context *ctx, dvi_resmanager *rm)
     cell = next;
   }
 
+  pthread_mutex_destroy(&rm->lock);
   fz_free(ctx, rm);
 }
 
@@ -665,7 +797,6 @@ static fz_font *dvi_resmanager_get_fz_font(fz_context *ctx, dvi_resmanager *rm,
 
   fz_ptr(cell_fz_font, cell);
   fz_ptr(char, cell_name);
-  fz_ptr(fz_stream, stm);
   fz_ptr(fz_buffer, buf);
 
   fz_try(ctx)
@@ -678,13 +809,9 @@ static fz_font *dvi_resmanager_get_fz_font(fz_context *ctx, dvi_resmanager *rm,
 
     fprintf(stderr, "dvi_resmanager_get_fz_font: loading font %s\n", cell_name);
 
-    stm = dvi_resmanager_open_file(ctx, rm, RES_FONT, cell_name);
-
-    if (stm)
-    {
-      buf = fz_read_all(ctx, stm, 16384);
+    buf = dvi_resmanager_load_file(ctx, rm, RES_FONT, cell_name);
+    if (buf)
       cell->font = fz_new_font_from_buffer(ctx, NULL, buf, index, 0);
-    }
 
     if (cell->font)
     {
@@ -703,8 +830,6 @@ static fz_font *dvi_resmanager_get_fz_font(fz_context *ctx, dvi_resmanager *rm,
   }
   fz_always(ctx)
   {
-    if (stm)
-      fz_drop_stream(ctx, stm);
     if (buf)
       fz_drop_buffer(ctx, buf);
   }
@@ -721,7 +846,7 @@ static fz_font *dvi_resmanager_get_fz_font(fz_context *ctx, dvi_resmanager *rm,
   return cell->font;
 }
 
-dvi_font *dvi_resmanager_get_tex_font(fz_context *ctx, dvi_resmanager *rm, const char *name, int len)
+static dvi_font *get_tex_font(fz_context *ctx, dvi_resmanager *rm, const char *name, int len)
 {
   for (cell_dvi_font *cell = rm->first_dvi_font; cell; cell = cell->next)
   {
@@ -736,13 +861,25 @@ dvi_font *dvi_resmanager_get_tex_font(fz_context *ctx, dvi_resmanager *rm, const
   cell->next = rm->first_dvi_font;
   rm->first_dvi_font = cell;
 
-  tex_fontmap_entry *e = tex_fontmap_lookup(rm->map, cell->font.name);
+  fontmap_wait(rm);
+  tex_fontmap_entry *e =
+    rm->map ? tex_fontmap_lookup(rm->map, cell->font.name) : NULL;
 
   if (e && e->font_file_name)
   {
     cell->font.fz = fz_keep_font(ctx, dvi_resmanager_get_fz_font(ctx, rm, e->font_file_name, strlen(e->font_file_name), 0));
     if (e->enc_file_name)
       cell->font.enc = dvi_resmanager_get_tex_enc(ctx, rm, e->enc_file_name);
+    // Filled while the resource manager is locked: afterwards, threads
+    // rendering with the same font only read it
+    cell->font.glyph_map = fz_malloc_array(ctx, 256, int);
+    for (int c = 0; c < 256; ++c)
+    {
+      const char *glyph = cell->font.enc ? tex_enc_get(cell->font.enc, c) : NULL;
+      cell->font.glyph_map[c] =
+        glyph ? fz_encode_character_by_glyph_name(ctx, cell->font.fz, glyph)
+              : fz_encode_character(ctx, cell->font.fz, c);
+    }
   }
 
   fz_ptr(fz_stream, stm);
@@ -807,12 +944,7 @@ dvi_font *dvi_resmanager_get_tex_font(fz_context *ctx, dvi_resmanager *rm, const
   return &cell->font;
 }
 
-fz_font *dvi_resmanager_get_xdv_font(fz_context *ctx, dvi_resmanager *rm, const char *name, int len, int index)
-{
-  return dvi_resmanager_get_fz_font(ctx, rm, name, len, index);
-}
-
-void dvi_resmanager_invalidate(fz_context *ctx, dvi_resmanager *rm, dvi_reskind kind, const char *name)
+static void invalidate(fz_context *ctx, dvi_resmanager *rm, dvi_reskind kind, const char *name)
 {
   switch (kind)
   {
@@ -854,6 +986,7 @@ void dvi_resmanager_invalidate(fz_context *ctx, dvi_resmanager *rm, dvi_reskind
           tex_tfm_free(ctx, (*cell)->font.tfm);
         if ((*cell)->font.fz)
           fz_drop_font(ctx, (*cell)->font.fz);
+        fz_free(ctx, (*cell)->font.glyph_map);
         cell_dvi_font *next = (*cell)->next;
         fz_free(ctx, *cell);
         *cell = next;
@@ -878,7 +1011,7 @@ void dvi_resmanager_invalidate(fz_context *ctx, dvi_resmanager *rm, dvi_reskind
   }
 }
 
-pdf_document *dvi_resmanager_get_pdf(fz_context *ctx, dvi_resmanager *rm, const char *filename)
+static pdf_document *get_pdf(fz_context *ctx, dvi_resmanager *rm, const char *filename)
 {
   for (cell_pdf_doc *cell = rm->first_pdf_doc; cell; cell = cell->next)
     if (strcmp(filename, cell->name) == 0)
@@ -896,7 +1029,13 @@ pdf_document *dvi_resmanager_get_pdf(fz_context *ctx, dvi_resmanager *rm, const
     cell->next = rm->first_pdf_doc;
     stm = dvi_resmanager_open_file(ctx, rm, RES_PDF, pname);
     if (stm)
+    {
+      // File size, to estimate the memory used by the document
+      fz_seek(ctx, stm, 0, SEEK_END);
+      cell->size = fz_tell(ctx, stm);
+      fz_seek(ctx, stm, 0, SEEK_SET);
       cell->doc = pdf_open_document_with_stream(ctx, stm);
+    }
   }
   fz_always(ctx)
   {
@@ -917,7 +1056,7 @@ pdf_document *dvi_resmanager_get_pdf(fz_context *ctx, dvi_resmanager *rm, const
   return cell->doc;
 }
 
-fz_image *dvi_resmanager_get_img(fz_context *ctx, dvi_resmanager *rm, const char *filename)
+static fz_image *get_img(fz_context *ctx, dvi_resmanager *rm, const char *filename)
 {
   for (cell_image *cell = rm->first_image; cell; cell = cell->next)
     if (strcmp(filename, cell->name) == 0)
@@ -947,3 +1086,168 @@ fz_image *dvi_resmanager_get_img(fz_context *ctx, dvi_resmanager *rm, const char
 
   return cell->img;
 }
+
+// Public entry points: take the lock around the unlocked implementations
+
+dvi_font *dvi_resmanager_get_tex_font(fz_context *ctx, dvi_resmanager *rm, const char *name, int len)
+{
+  dvi_font *result = NULL;
+  dvi_resmanager_lock(rm);
+  fz_try(ctx)
+  {
+    result = get_tex_font(ctx, rm, name, len);
+  }
+  fz_always(ctx)
+  {
+    dvi_resmanager_unlock(rm);
+  }
+  fz_catch(ctx)
+  {
+    fz_rethrow(ctx);
+  }
+  return result;
+}
+
+fz_font *dvi_resmanager_get_xdv_font(fz_context *ctx, dvi_resmanager *rm, const char *name, int len, int index)
+{
+  fz_font *result = NULL;
+  dvi_resmanager_lock(rm);
+  fz_try(ctx)
+  {
+    result = dvi_resmanager_get_fz_font(ctx, rm, name, len, index);
+  }
+  fz_always(ctx)
+  {
+    dvi_resmanager_unlock(rm);
+  }
+  fz_catch(ctx)
+  {
+    fz_rethrow(ctx);
+  }
+  return result;
+}
+
+void dvi_resmanager_invalidate(fz_context *ctx, dvi_resmanager *rm, dvi_reskind kind, const char *name)
+{
+  dvi_resmanager_lock(rm);
+  fz_try(ctx)
+  {
+    invalidate(ctx, rm, kind, name);
+  }
+  fz_always(ctx)
+  {
+    dvi_resmanager_unlock(rm);
+  }
+  fz_catch(ctx)
+  {
+    fz_rethrow(ctx);
+  }
+}
+
+pdf_document *dvi_resmanager_get_pdf(fz_context *ctx, dvi_resmanager *rm, const char *filename)
+{
+  pdf_document *result = NULL;
+  dvi_resmanager_lock(rm);
+  fz_try(ctx)
+  {
+    result = get_pdf(ctx, rm, filename);
+  }
+  fz_always(ctx)
+  {
+    dvi_resmanager_unlock(rm);
+  }
+  fz_catch(ctx)
+  {
+    fz_rethrow(ctx);
+  }
+  return result;
+}
+
+fz_image *dvi_resmanager_get_img(fz_context *ctx, dvi_resmanager *rm, const char *filename)
+{
+  fz_image *result = NULL;
+  dvi_resmanager_lock(rm);
+  fz_try(ctx)
+  {
+    result = get_img(ctx, rm, filename);
+  }
+  fz_always(ctx)
+  {
+    dvi_resmanager_unlock(rm);
+  }
+  fz_catch(ctx)
+  {
+    fz_rethrow(ctx);
+  }
+  return result;
+}
+
+size_t dvi_resmanager_cache_size(fz_context *ctx, dvi_resmanager *rm)
+{
+  size_t size = 0;
+  dvi_resmanager_lock(rm);
+  for (cell_pdf_doc *cell = rm->first_pdf_doc; cell; cell = cell->next)
+    size += cell->size;
+  for (cell_image *cell = rm->first_image; cell; cell = cell->next)
+    if (cell->img)
+      size += fz_image_size(ctx, cell->img);
+  dvi_resmanager_unlock(rm);
+  return size;
+}
+
+size_t dvi_resmanager_shed(fz_context *ctx, dvi_resmanager *rm)
+{
+  size_t size = 0;
+  dvi_resmanager_lock(rm);
+  for (cell_pdf_doc *cell = rm->first_pdf_doc; cell; )
+  {
+    cell_pdf_doc *next = cell->next;
+    size += cell->size;
+    fz_free(ctx, (void*)cell->name);
+    if (cell->doc)
+      pdf_drop_document(ctx, cell->doc);
+    fz_free(ctx, cell);
+    cell = next;
+  }
+  rm->first_pdf_doc = NULL;
+  for (cell_image *cell = rm->first_image; cell; )
+  {
+    cell_image *next = cell->next;
+    if (cell->img)
+    {
+      size += fz_image_size(ctx, cell->img);
+      fz_drop_image(ctx, cell->img);
+    }
+    fz_free(ctx, (void*)cell->name);
+    fz_free(ctx, cell);
+    cell = next;
+  }
+  rm->first_image = NULL;
+  dvi_resmanager_unlock(rm);
+  return size;
+}
+
+void dvi_resmanager_set_prefetch(dvi_resmanager *rm, dvi_prefetch_fn *prefetch, void *env)
+{
+  rm->prefetch = prefetch;
+  rm->prefetch_env = env;
+}
+
+void dvi_resmanager_prefetch_img(fz_context *ctx, dvi_resmanager *rm, const char *filename, float width, float height)
+{
+  if (!rm->prefetch)
+    return;
+
+  fz_image *img = NULL;
+  fz_try(ctx)
+  {
+    img = dvi_resmanager_get_img(ctx, rm, filename);
+  }
+  fz_catch(ctx)
+  {
+    fprintf(stderr, "[dvi] cannot prefetch image %s\n", filename);
+    return;
+  }
+
+  rm->prefetch(ctx, rm->prefetch_env, img, width, height);
+}
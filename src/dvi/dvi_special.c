@@ -437,14 +437,27 @@ static struct xform_spec xform_spec()
 static bool
 embed_pdf(fz_context *ctx, dvi_context *dc, dvi_state *st, struct xform_spec *xf, const char *filename)
 {
+  bool result = 1;
+  pdf_page *page = NULL;
+  fz_display_list *list = NULL;
+  fz_device *dev = NULL;
+  bool locked = 1;
+  fz_var(page);
+  fz_var(list);
+  fz_var(dev);
+  fz_var(locked);
+
+  // Documents are shared between rendering threads but are not thread-safe:
+  // the page is recorded under the lock, and drawn once it is released.
+  dvi_resmanager_lock(dc->resmanager);
   fz_try(ctx)
   {
     pdf_document *doc = dvi_resmanager_get_pdf(ctx, dc->resmanager, filename);
     if (!doc)
-      return 0;
+      fz_throw(ctx, FZ_ERROR_GENERIC, "cannot open %s", filename);
 
     // from mupdf/source/pdf/pdf-page.c: pdf_page_obj_transform
-    pdf_page *page = pdf_load_page(ctx, doc, xf->page ? xf->page - 1 : 0);
+    page = pdf_load_page(ctx, doc, xf->page ? xf->page - 1 : 0);
     pdf_obj *pageobj = page ? page->obj : NULL;
 
     fz_rect mediabox = pdf_to_rect(ctx, pdf_dict_get_inheritable(ctx, pageobj, PDF_NAME(MediaBox)));
@@ -463,13 +476,40 @@ embed_pdf(fz_context *ctx, dvi_context *dc, dvi_state *st, struct xform_spec *xf
     fz_matrix ctm = fz_flip_vertically(dvi_get_ctm(dc, st));
     ctm = fz_concat(xf->ctm, ctm);
     ctm = fz_pre_translate(ctm, 0, mediabox.y0 - mediabox.y1);
-    pdf_run_page(ctx, page, dc->dev, ctm, NULL);
+    // Square area: also covers rotated pages
+    float side = fz_max(mediabox.x1 - mediabox.x0, mediabox.y1 - mediabox.y0);
+    fz_rect area = fz_make_rect(0, 0, side, side);
+    fz_rect bounds = fz_transform_rect(area, ctm);
+    if (!dvi_context_cull(dc, bounds))
+    {
+      list = fz_new_display_list(ctx, bounds);
+      dev = fz_new_list_device(ctx, list);
+      pdf_run_page(ctx, page, dev, ctm, NULL);
+      fz_close_device(ctx, dev);
+    }
+    fz_drop_device(ctx, dev);
+    dev = NULL;
+    fz_drop_page(ctx, (fz_page*)page);
+    page = NULL;
+    dvi_resmanager_unlock(dc->resmanager);
+    locked = 0;
+
+    if (list)
+      fz_run_display_list(ctx, list, dc->dev, fz_identity, fz_infinite_rect, NULL);
+  }
+  fz_always(ctx)
+  {
+    fz_drop_device(ctx, dev);
+    fz_drop_page(ctx, (fz_page*)page);
+    if (locked)
+      dvi_resmanager_unlock(dc->resmanager);
+    fz_drop_display_list(ctx, list);
   }
   fz_catch(ctx)
   {
-    return 0;
+    result = 0;
   }
-  return 1;
+  return result;
 }
 
 static bool
@@ -493,7 +533,8 @@ embed_image(fz_context *ctx, dvi_context *dc, dvi_state *st, struct xform_spec *
     if (w != w) w = h * ar;
     if (h != h) h = w / ar;
     ctm = fz_pre_scale(fz_pre_translate(ctm, 0, h), w, -h);
-    fz_fill_image(ctx, dc->dev, img, ctm, 1.0, color_params);
+    if (!dvi_context_cull(dc, fz_transform_rect(fz_unit_rect, ctm)))
+      fz_fill_image(ctx, dc->dev, img, ctm, 1.0, color_params);
   }
   fz_always(ctx)
   {
@@ -507,20 +548,40 @@ embed_image(fz_context *ctx, dvi_context *dc, dvi_state *st, struct xform_spec *
   return 1;
 }
 
-static bool
-embed_graphics(fz_context *ctx, dvi_context *dc, dvi_state *st, struct xform_spec *xf, const char *filename)
+// The resource manager can be shared by documents living in different
+// directories: resolve relative paths before using them as cache keys.
+static const char *
+resolve_graphics_path(dvi_context *dc, const char *filename, char *path, int size)
 {
-  if (!dc->dev)
-    return 1;
+  if (filename[0] != '/' && dc->document_dir && dc->document_dir[0] &&
+      snprintf(path, size, "%s/%s", dc->document_dir, filename) < size)
+    return path;
+  return filename;
+}
 
+static bool
+is_pdf_path(const char *filename)
+{
   const char *ext = filename;
 
   for (const char *ptr = ext; *ptr; ptr++)
     if (*ptr == '.') ext = ptr + 1;
 
-  if ((ext[0] == 'p' || ext[0] == 'P') &&
-      (ext[1] == 'd' || ext[1] == 'D') &&
-      (ext[2] == 'f' || ext[2] == 'F'))
+  return (ext[0] == 'p' || ext[0] == 'P') &&
+         (ext[1] == 'd' || ext[1] == 'D') &&
+         (ext[2] == 'f' || ext[2] == 'F');
+}
+
+static bool
+embed_graphics(fz_context *ctx, dvi_context *dc, dvi_state *st, struct xform_spec *xf, const char *filename)
+{
+  if (!dc->dev)
+    return 1;
+
+  char path[4096];
+  filename = resolve_graphics_path(dc, filename, path, sizeof(path));
+
+  if (is_pdf_path(filename))
     return embed_pdf(ctx, dc, st, xf, filename);
   else
     return embed_image(ctx, dc, st, xf, filename);
@@ -1329,3 +1390,29 @@ void dvi_prescan_special(cursor_t cur, cursor_t lim, float *width, float *height
 
   */
 }
+
+void dvi_prefetch_special(fz_context *ctx, dvi_context *dc, cursor_t cur, cursor_t lim)
+{
+  cursor_t mar, pxform = NULL, pstart;
+
+  /*!re2c
+
+  "pdf:" ws* "image" ws+ @pxform ([a-z] | ws | float)* @pstart "("
+  {
+    struct xform_spec xf = xform_spec();
+    parse_xform_or_dim(&xf, pxform, pstart);
+    char filename[2048], path[4096];
+    parse_pdf_string(filename, filename + 2048, cur, lim);
+    const char *resolved = resolve_graphics_path(dc, filename, path, sizeof(path));
+    // PDF graphics are interpreted while rendering, only raster images
+    // benefit from being decoded ahead of time.
+    if (!is_pdf_path(resolved))
+      dvi_resmanager_prefetch_img(ctx, dc->resmanager, resolved, xf.width, xf.height);
+    return;
+  }
+
+  ''
+  { return; }
+
+  */
+}
@@ -198,6 +198,9 @@ typedef enum {
 typedef struct {
   void *env;
   fz_stream *(*open_file)(fz_context *ctx, void *env, dvi_reskind kind, const char *name);
+  // Optional: the whole file as a buffer, for hooks that can share the
+  // contents rather than copying them
+  fz_buffer *(*load_file)(fz_context *ctx, void *env, dvi_reskind kind, const char *name);
   void (*free_env)(fz_context *ctx, void *env);
 } dvi_reshooks;
 
@@ -206,14 +209,46 @@ dvi_reshooks dvi_bundle_serve_hooks(fz_context *ctx, const char *tectonic_path,
 
 void dvi_free_hooks(fz_context *ctx, const dvi_reshooks *hooks);
 
+// Resource daemon, sharing bundle files between texpresso processes.
+// dvi_resdaemon_hooks connects to the daemon of the current user, starting
+// it if none is running, and falls back to dvi_bundle_serve_hooks otherwise.
+dvi_reshooks dvi_resdaemon_hooks(fz_context *ctx, const char *tectonic_path, const char *document_directory);
+int dvi_resdaemon_serve(fz_context *ctx, const char *tectonic_path);
+bool dvi_resdaemon_socket_path(char *path, size_t len);
+
+// A resource manager is reference counted so that it can be shared by the
+// DVI contexts of different documents: fontmaps, fonts, metrics and
+// encodings only depend on the bundle, they are loaded once per process.
 dvi_resmanager *dvi_resmanager_new(fz_context *ctx, dvi_reshooks hooks);
-void dvi_resmanager_free(fz_context *ctx, dvi_resmanager *rm);
+dvi_resmanager *dvi_resmanager_keep(fz_context *ctx, dvi_resmanager *rm);
+void dvi_resmanager_drop(fz_context *ctx, dvi_resmanager *rm);
 dvi_font *dvi_resmanager_get_tex_font(fz_context *ctx, dvi_resmanager *rm, const char *name, int namelen);
 fz_font *dvi_resmanager_get_xdv_font(fz_context *ctx, dvi_resmanager *rm, const char *name, int namelen, int index);
 pdf_document *dvi_resmanager_get_pdf(fz_context *ctx, dvi_resmanager *rm, const char *filename);
 fz_image *dvi_resmanager_get_img(fz_context *ctx, dvi_resmanager *rm, const char *filename);
 void dvi_resmanager_invalidate(fz_context *ctx, dvi_resmanager *rm, dvi_reskind kind, const char *name);
 
+// The resource manager can be used from several threads, each with its own
+// DVI context (and a fz_context created with locking functions).
+// Embedded PDF documents are not thread-safe: hold the lock while using one.
+void dvi_resmanager_lock(dvi_resmanager *rm);
+void dvi_resmanager_unlock(dvi_resmanager *rm);
+
+// Embedded PDF documents and images are cached until the resource manager
+// is dropped. Under memory pressure, they can be released: they will be
+// loaded again when needed. Sizes are estimates.
+size_t dvi_resmanager_cache_size(fz_context *ctx, dvi_resmanager *rm);
+size_t dvi_resmanager_shed(fz_context *ctx, dvi_resmanager *rm);
+
+// Images are decoded lazily by mupdf, during rasterization.
+// A prefetch hook lets the embedder decode them ahead of time, e.g. on
+// another thread, as soon as they are referenced by a shipped page.
+// width and height are the dimensions requested by the document, in
+// points, or NAN when unspecified.
+typedef void dvi_prefetch_fn(fz_context *ctx, void *env, fz_image *img, float width, float height);
+void dvi_resmanager_set_prefetch(dvi_resmanager *rm, dvi_prefetch_fn *prefetch, void *env);
+void dvi_resmanager_prefetch_img(fz_context *ctx, dvi_resmanager *rm, const char *filename, float width, float height);
+
 /****************************************/
 /* Definition of DVI runtime structures */
 /****************************************/
@@ -327,6 +362,8 @@ typedef struct
   fz_path *path;
   dvi_scratch scratch;
   dvi_resmanager *resmanager;
+  // Directory used to resolve relative graphics paths, can be NULL
+  char *document_dir;
   dvi_state root;
   dvi_registers registers_stack[256];
   dvi_graphicstate gs_stack[256];
@@ -336,17 +373,25 @@ typedef struct
   // Pdf color stacks (introduced by pdftex)
   dvi_colorstacks pdfcolorstacks;
   float scale;
+
+  // Area of interest, in device space. Glyphs, rules and graphics that
+  // fall entirely outside are not emitted (infinite by default).
+  fz_rect cull;
+  // Set when something has been skipped since the beginning of the frame
+  bool culled;
 } dvi_context;
 
 #define DC_ALLOC(ctx, dc, type, count) ((type*)dvi_scratch_alloc(ctx, &(dc)->scratch, sizeof(type) * (count)))
 
-dvi_context *dvi_context_new(fz_context *ctx, dvi_reshooks hooks);
+dvi_context *dvi_context_new(fz_context *ctx, dvi_resmanager *rm, const char *document_dir);
 void dvi_context_free(fz_context *ctx, dvi_context *dc);
 dvi_state *dvi_context_state(dvi_context *dc);
 bool dvi_state_enter_vf(dvi_context *dc, dvi_state *vfst, const dvi_state *st, dvi_fonttable *fonts, int font, fixed_t scale);
 void dvi_context_flush_text(fz_context *ctx, dvi_context *dc, dvi_state *st);
 void dvi_context_begin_frame(fz_context *ctx, dvi_context *dc, fz_device *dev);
 void dvi_context_end_frame(fz_context *ctx, dvi_context *dc);
+void dvi_context_set_cull(dvi_context *dc, fz_rect cull);
+bool dvi_context_cull(dvi_context *dc, fz_rect bounds);
 
 #define inlined static inline __attribute__((unused))
 
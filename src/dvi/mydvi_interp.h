@@ -39,6 +39,7 @@ bool dvi_interp_sub(fz_context *ctx, dvi_context *dc, dvi_state *st, const uint8
 bool dvi_interp(fz_context *ctx, dvi_context *dc, const uint8_t *buf);
 void dvi_interp_init(fz_context *ctx, dvi_context *dc, const uint8_t *bop, int len);
 int dvi_interp_bop(const uint8_t *bop, int len, float *width, float *height, bool *landscape);
+void dvi_interp_prefetch(fz_context *ctx, dvi_context *dc, const uint8_t *buf, int len);
 
 // DVI primitives
 
@@ -67,5 +68,6 @@ void dvi_exec_xdvglyphs(fz_context *ctx, dvi_context *dc, dvi_state *st, fixed_t
 bool dvi_exec_special(fz_context *ctx, dvi_context *dc, dvi_state *st, const char *ptr, const char *lim);
 bool dvi_init_special(fz_context *ctx, dvi_context *dc, dvi_state *st, const char *ptr, const char *lim);
 void dvi_prescan_special(const char *ptr, const char *lim, float *width, float *height, bool *landscape);
+void dvi_prefetch_special(fz_context *ctx, dvi_context *dc, const char *ptr, const char *lim);
 
 #endif /*!DVI_INTERP_H*/
@@ -227,6 +227,48 @@ bool editor_parse(fz_context *ctx,
             },
     };
   }
+  else if (strcmp(verb, "open-root") == 0)
+  {
+    if (len != 2) goto arity;
+    val path = val_array_get(ctx, stack, command, 1);
+    if (!val_is_string(path))
+      goto arguments;
+    *out = (struct editor_command){
+        .tag = EDIT_OPEN_ROOT,
+        .open_root =
+            {
+                .path = val_string(ctx, stack, path),
+            },
+    };
+  }
+  else if (strcmp(verb, "close-root") == 0)
+  {
+    if (len != 2) goto arity;
+    val path = val_array_get(ctx, stack, command, 1);
+    if (!val_is_string(path))
+      goto arguments;
+    *out = (struct editor_command){
+        .tag = EDIT_CLOSE_ROOT,
+        .close_root =
+            {
+                .path = val_string(ctx, stack, path),
+            },
+    };
+  }
+  else if (strcmp(verb, "export-pdf") == 0)
+  {
+    if (len != 2) goto arity;
+    val path = val_array_get(ctx, stack, command, 1);
+    if (!val_is_string(path))
+      goto arguments;
+    *out = (struct editor_command){
+        .tag = EDIT_EXPORT_PDF,
+        .export_pdf =
+            {
+                .path = val_string(ctx, stack, path),
+            },
+    };
+  }
   else
   {
     fprintf(stderr, "[command] unknown verb: %s\n", verb);
@@ -456,6 +498,63 @@ void editor_synctex(const char *dirname,
   }
 }
 
+void editor_exported_pdf(const char *path, int pages, int updated)
+{
+  switch (protocol)
+  {
+    case EDITOR_SEXP: fprintf(stdout, "(exported-pdf \""); break;
+    case EDITOR_JSON: fprintf(stdout, "[\"exported-pdf\", \""); break;
+  }
+  output_data_string(stdout, path, strlen(path));
+  switch (protocol)
+  {
+    case EDITOR_SEXP: fprintf(stdout, "\" %d %d)\n", pages, updated); break;
+    case EDITOR_JSON: fprintf(stdout, "\", %d, %d]\n", pages, updated); break;
+  }
+}
+
+void editor_compilation_paused(const char *path, int line, int cpu)
+{
+  switch (protocol)
+  {
+    case EDITOR_SEXP: fprintf(stdout, "(compilation-paused \""); break;
+    case EDITOR_JSON: fprintf(stdout, "[\"compilation-paused\", \""); break;
+  }
+  output_data_string(stdout, path, strlen(path));
+  switch (protocol)
+  {
+    case EDITOR_SEXP: fprintf(stdout, "\" %d %d)\n", line, cpu); break;
+    case EDITOR_JSON: fprintf(stdout, "\", %d, %d]\n", line, cpu); break;
+  }
+}
+
+void editor_compilation_resumed(void)
+{
+  switch (protocol)
+  {
+    case EDITOR_SEXP: fprintf(stdout, "(compilation-resumed)\n"); break;
+    case EDITOR_JSON: fprintf(stdout, "[\"compilation-resumed\"]\n"); break;
+  }
+}
+
+void editor_framebuffer(const char *name, unsigned long long sequence,
+                        int width, int height, fz_irect damage)
+{
+  switch (protocol)
+  {
+    case EDITOR_SEXP:
+      fprintf(stdout, "(framebuffer \"%s\" %llu %d %d %d %d %d %d)\n",
+              name, sequence, width, height,
+              damage.x0, damage.y0, damage.x1, damage.y1);
+      break;
+    case EDITOR_JSON:
+      fprintf(stdout, "[\"framebuffer\", \"%s\", %llu, %d, %d, %d, %d, %d, %d]\n",
+              name, sequence, width, height,
+              damage.x0, damage.y0, damage.x1, damage.y1);
+      break;
+  }
+}
+
 void editor_reset_sync(void)
 {
   switch (protocol)
@@ -24,6 +24,9 @@ enum EDITOR_COMMAND
   EDIT_SYNCTEX_FORWARD,
   EDIT_MAP_WINDOW,
   EDIT_UNMAP_WINDOW,
+  EDIT_OPEN_ROOT,
+  EDIT_CLOSE_ROOT,
+  EDIT_EXPORT_PDF,
 };
 
 struct editor_command {
@@ -82,6 +85,18 @@ struct editor_command {
     struct {
     } unmap_window;
 
+    struct {
+      const char *path;
+    } open_root;
+
+    struct {
+      const char *path;
+    } close_root;
+
+    struct {
+      const char *path;
+    } export_pdf;
+
   };
 };
 
@@ -103,5 +118,13 @@ void editor_truncate(enum EDITOR_INFO_BUFFER name, fz_buffer *buf);
 void editor_flush(void);
 void editor_synctex(const char *dirname, const char *basename, int basename_len, int line, int column);
 void editor_reset_sync(void);
+void editor_exported_pdf(const char *path, int pages, int updated);
+// The TeX process made no progress within its budget and was paused at
+// line of path, after using cpu seconds. It is resumed or killed on the
+// next change.
+void editor_compilation_paused(const char *path, int line, int cpu);
+void editor_compilation_resumed(void);
+void editor_framebuffer(const char *name, unsigned long long sequence,
+                        int width, int height, fz_irect damage);
 
 #endif  // EDITOR_H_
@@ -39,14 +39,20 @@ typedef struct txp_engine_s txp_engine;
 
 txp_engine *txp_create_tex_engine(fz_context *ctx,
                                   const char *tectonic_path,
+                                  dvi_resmanager *rm,
                                   const char *inclusion_path,
                                   const char *tex_dir,
-                                  const char *tex_name);
+                                  const char *tex_name,
+                                  int watchdog);
+
+// Put TeX processes in their own cgroups when possible.
+// Call before starting other processes.
+void txp_tex_scheduler_init(void);
 
 txp_engine *txp_create_pdf_engine(fz_context *ctx, const char *pdf_path);
 
 txp_engine *txp_create_dvi_engine(fz_context *ctx,
-                                  const char *tectonic_path,
+                                  dvi_resmanager *rm,
                                   const char *dvi_dir,
                                   const char *dvi_path);
 
@@ -69,17 +75,28 @@ struct txp_engine_class
   bool (*end_changes)(txp_engine *self, fz_context *ctx);
   int (*page_count)(txp_engine *self);
   fz_display_list *(*render_page)(txp_engine *self, fz_context *ctx, int page);
+  // Render what intersects area; complete is set to false if some contents
+  // were left out.
+  fz_display_list *(*render_page_area)(txp_engine *self, fz_context *ctx,
+                                       int page, fz_rect area, bool *complete);
   txp_engine_status (*get_status)(txp_engine *self);
   float (*scale_factor)(txp_engine *self);
   synctex_t *(*synctex)(txp_engine *self, fz_buffer **buf);
   fileentry_t *(*find_file)(txp_engine *self, fz_context *ctx, const char *path);
   void (*notify_file_changes)(txp_engine *self, fz_context *ctx, fileentry_t *entry, int offset);
+  // The XDV output being interpreted, NULL for other kinds of documents
+  chunkbuf_t *(*xdv_output)(txp_engine *self);
+  // Number of leading pages that did not change since the previous call
+  int (*unchanged_pages)(txp_engine *self);
 };
 
 #define TXP_ENGINE_DEF_CLASS                                                \
   static void engine_destroy(txp_engine *_self, fz_context *ctx);           \
   static fz_display_list *engine_render_page(txp_engine *_self,             \
                                              fz_context *ctx, int page);    \
+  static fz_display_list *engine_render_page_area(                          \
+      txp_engine *_self, fz_context *ctx, int page, fz_rect area,           \
+      bool *complete);                                                      \
   static bool engine_step(txp_engine *_self, fz_context *ctx,               \
                           bool restart_if_needed);                          \
   static void engine_begin_changes(txp_engine *_self, fz_context *ctx);     \
@@ -93,12 +110,15 @@ struct txp_engine_class
                                        const char *path);                   \
   static void engine_notify_file_changes(txp_engine *self, fz_context *ctx, \
                                          fileentry_t *entry, int offset);   \
+  static chunkbuf_t *engine_xdv_output(txp_engine *_self);                  \
+  static int engine_unchanged_pages(txp_engine *_self);                     \
                                                                             \
   static struct txp_engine_class _class = {                                 \
       .destroy = engine_destroy,                                            \
       .step = engine_step,                                                  \
       .page_count = engine_page_count,                                      \
       .render_page = engine_render_page,                                    \
+      .render_page_area = engine_render_page_area,                          \
       .get_status = engine_get_status,                                      \
       .scale_factor = engine_scale_factor,                                  \
       .synctex = engine_synctex,                                            \
@@ -107,6 +127,8 @@ struct txp_engine_class
       .detect_changes = engine_detect_changes,                              \
       .end_changes = engine_end_changes,                                    \
       .notify_file_changes = engine_notify_file_changes,                    \
+      .xdv_output = engine_xdv_output,                                      \
+      .unchanged_pages = engine_unchanged_pages,                            \
   }
 
 #endif // GENERIC_ENGINE_H_
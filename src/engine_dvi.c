@@ -30,7 +30,7 @@
 struct dvi_engine
 {
   struct txp_engine_class *_class;
-  fz_buffer *buffer;
+  chunkbuf_t *buffer;
   incdvi_t *dvi;
 };
 
@@ -43,23 +43,35 @@ TXP_ENGINE_DEF_CLASS;
 static void engine_destroy(txp_engine *_self, fz_context *ctx)
 {
   SELF;
-  fz_drop_buffer(ctx, self->buffer);
+  chunkbuf_drop(ctx, self->buffer);
   incdvi_free(ctx, self->dvi);
 }
 
 static fz_display_list *engine_render_page(txp_engine *_self,
                                            fz_context *ctx,
                                            int index)
+{
+  return engine_render_page_area(_self, ctx, index, fz_infinite_rect, NULL);
+}
+
+static fz_display_list *engine_render_page_area(txp_engine *_self,
+                                                fz_context *ctx,
+                                                int index,
+                                                fz_rect area,
+                                                bool *complete)
 {
   SELF;
   float width, height;
-  incdvi_page_dim(self->dvi, self->buffer, index, &width, &height, NULL);
+  incdvi_page_dim(ctx, self->dvi, self->buffer, index, &width, &height, NULL);
   fz_rect box = fz_make_rect(0, 0, width, height);
   fz_display_list *dl = fz_new_display_list(ctx, box);
   fz_device *dev = fz_new_list_device(ctx, dl);
-  incdvi_render_page(ctx, self->dvi, self->buffer, index, dev);
+  bool result =
+    incdvi_render_page_area(ctx, self->dvi, self->buffer, index, dev, area);
   fz_close_device(ctx, dev);
   fz_drop_device(ctx, dev);
+  if (complete)
+    *complete = result;
   return dl;
 }
 
@@ -118,13 +130,30 @@ static void engine_notify_file_changes(txp_engine *_self,
 {
 }
 
-txp_engine *txp_create_dvi_engine(fz_context *ctx, const char *tectonic_path, const char *dvi_dir, const char *dvi_path)
+static chunkbuf_t *engine_xdv_output(txp_engine *_self)
+{
+  SELF;
+  return self->buffer;
+}
+
+static int engine_unchanged_pages(txp_engine *_self)
+{
+  SELF;
+  int count = incdvi_unchanged_pages(self->dvi);
+  incdvi_mark_pages(self->dvi);
+  return count;
+}
+
+txp_engine *txp_create_dvi_engine(fz_context *ctx, dvi_resmanager *rm, const char *dvi_dir, const char *dvi_path)
 {
-  fz_buffer *buffer = fz_read_file(ctx, dvi_path);
+  fz_buffer *data = fz_read_file(ctx, dvi_path);
+  chunkbuf_t *buffer = chunkbuf_new(ctx);
+  chunkbuf_write(ctx, buffer, 0, data->data, data->len);
+  fz_drop_buffer(ctx, data);
   struct dvi_engine *self = fz_malloc_struct(ctx, struct dvi_engine);
   self->_class = &_class;
   self->buffer = buffer;
-  self->dvi = incdvi_new(ctx, tectonic_path, dvi_dir);
+  self->dvi = incdvi_new(ctx, rm, dvi_dir);
   incdvi_update(ctx, self->dvi, buffer);
   return (txp_engine*)self;
 }
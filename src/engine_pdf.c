@@ -58,6 +58,18 @@ static fz_display_list *engine_render_page(txp_engine *_self,
   return dl;
 }
 
+static fz_display_list *engine_render_page_area(txp_engine *_self,
+                                                fz_context *ctx,
+                                                int index,
+                                                fz_rect area,
+                                                bool *complete)
+{
+  // PDF pages are always rendered entirely
+  if (complete)
+    *complete = 1;
+  return engine_render_page(_self, ctx, index);
+}
+
 static bool engine_step(txp_engine *_self,
                         fz_context *ctx,
                         bool restart_if_needed)
@@ -111,6 +123,17 @@ static void engine_notify_file_changes(txp_engine *_self,
 {
 }
 
+static chunkbuf_t *engine_xdv_output(txp_engine *_self)
+{
+  return NULL;
+}
+
+static int engine_unchanged_pages(txp_engine *_self)
+{
+  // Changes of the file are not tracked page by page
+  return 0;
+}
+
 txp_engine *txp_create_pdf_engine(fz_context *ctx, const char *pdf_path)
 {
   fz_document *doc = fz_open_document(ctx, pdf_path);
@@ -31,12 +31,19 @@
 #include <sys/wait.h>
 #include <sys/stat.h>
 #include <sys/socket.h>
+#include <sys/resource.h>
 #include <signal.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#endif
 #include "engine.h"
 #include "incdvi.h"
 #include "state.h"
 #include "synctex.h"
 #include "editor.h"
+#include "membudget.h"
 
 typedef struct
 {
@@ -55,6 +62,9 @@ typedef struct
   int pid;
   int trace_len;
   mark_t snap;
+  // When the snapshot was taken, and whether its memory was marked cold
+  double since;
+  bool cold;
 } process_t;
 
 struct tex_engine
@@ -66,6 +76,8 @@ struct tex_engine
   char *tectonic_path;
   char *inclusion_path;
   filesystem_t *fs;
+  // Last time cold input files were looked for
+  time_t cold_files_check;
   state_t st;
   log_t *log;
 
@@ -81,6 +93,18 @@ struct tex_engine
 
   process_t processes[32];
   int process_pos;
+  double next_cooling;
+
+  // Pause processes that make no progress, see watchdog_check
+  struct {
+    double progress, next_check;
+    // CPU time (ms) of the process when the stall was noticed, -1 if unknown
+    long cpu_base;
+    // Seconds of CPU before pausing, 0 to never pause
+    int limit;
+    bool paused;
+    int pidfd;
+  } watchdog;
   incdvi_t *dvi;
   synctex_t *stex;
 
@@ -106,6 +130,14 @@ static char *last_index(char *path, char needle)
   return result;
 }
 
+static bool is_output_document(char *path)
+{
+  char *ext = last_index(path, '.');
+  return (strcmp(ext, "xdv") == 0 ||
+          strcmp(ext, "dvi") == 0 ||
+          strcmp(ext, "pdf") == 0);
+}
+
 // tex_engine implementation
 
 TXP_ENGINE_DEF_CLASS;
@@ -113,6 +145,344 @@ TXP_ENGINE_DEF_CLASS;
 
 static int answer_query(fz_context *ctx, struct tex_engine *self, channel_t *c, query_t *q);
 
+// Signalling processes
+
+static double monotonic_seconds(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Signals go through a pidfd when available, so that they cannot reach a
+// recycled pid.
+static int open_pidfd(pid_t pid)
+{
+#if defined(__linux__) && defined(SYS_pidfd_open)
+  return syscall(SYS_pidfd_open, pid, 0);
+#else
+  return -1;
+#endif
+}
+
+static void signal_process(pid_t pid, int pidfd, int sig)
+{
+#if defined(__linux__) && defined(SYS_pidfd_send_signal)
+  if (pidfd >= 0 && syscall(SYS_pidfd_send_signal, pidfd, sig, NULL, 0) == 0)
+    return;
+#endif
+  kill(pid, sig);
+}
+
+// State of a process (as in /proc/<pid>/stat) and its CPU time in ms.
+// Returns 0 if unknown: not on Linux, or the process is gone.
+static char process_stat(pid_t pid, long *cpu_ms)
+{
+#ifdef __linux__
+  char path[64], buf[512];
+  snprintf(path, sizeof(path), "/proc/%d/stat", (int)pid);
+  int fd = open(path, O_RDONLY);
+  if (fd < 0)
+    return 0;
+  ssize_t n = read(fd, buf, sizeof(buf) - 1);
+  close(fd);
+  if (n <= 0)
+    return 0;
+  buf[n] = 0;
+
+  // The command name can contain spaces, fields start after the last ')'
+  char *p = strrchr(buf, ')');
+  char state;
+  unsigned long utime, stime;
+  if (!p || sscanf(p + 1, " %c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu",
+                   &state, &utime, &stime) != 3)
+    return 0;
+  if (cpu_ms)
+    *cpu_ms = (utime + stime) * 1000 / sysconf(_SC_CLK_TCK);
+  return state;
+#else
+  return 0;
+#endif
+}
+
+// Stop a process and wait for the signal to be delivered: once it returns,
+// no new query can arrive from that process.
+static void stop_process(pid_t pid, int pidfd)
+{
+  signal_process(pid, pidfd, SIGSTOP);
+#ifdef __linux__
+  for (int i = 0; i < 100; ++i)
+  {
+    char state = process_stat(pid, NULL);
+    if (state == 0 || state == 'T' || state == 't')
+      return;
+    usleep(1000);
+  }
+#else
+  // Give some time for the signal to be delivered
+  usleep(5000);
+#endif
+}
+
+static void watchdog_progress(struct tex_engine *self)
+{
+  self->watchdog.progress = monotonic_seconds();
+  self->watchdog.next_check = self->watchdog.progress + 1;
+  self->watchdog.cpu_base = -1;
+}
+
+// Forget about a paused process, after it has been resumed or killed
+static void watchdog_clear(struct tex_engine *self)
+{
+  if (!self->watchdog.paused)
+    return;
+  if (self->watchdog.pidfd >= 0)
+    close(self->watchdog.pidfd);
+  self->watchdog.pidfd = -1;
+  self->watchdog.paused = 0;
+  editor_compilation_resumed();
+  watchdog_progress(self);
+}
+
+// Scheduling processes
+//
+// Only the process producing output runs at normal priority. Snapshots are
+// blocked on their child and a paused process is stopped: they get the
+// lowest CPU share, so that the little work they still do (a snapshot
+// reports back when its child ends) does not compete with the compilation.
+// Their memory is marked cold to be reclaimed first under pressure.
+//
+// With cgroup v2, when the cgroup of texpresso is writable (e.g. started
+// with `systemd-run --user --scope`), snapshots are moved to a child cgroup
+// with the lowest cpu.weight: this needs no privilege.
+// Otherwise, nice levels are used, which need privileges a normal user
+// usually lacks (see can_demote_process). Marking the memory of another
+// process cold requires CAP_SYS_NICE.
+
+#define CGROUP_MAIN "texpresso-main"
+#define CGROUP_SNAPSHOTS "texpresso-snapshots"
+
+// Directory of the cgroup holding texpresso and its children, empty if
+// cgroups cannot be used
+static char cgroup_base[4096];
+
+static bool write_file(const char *dir, const char *file, const char *value)
+{
+  char path[4200];
+  snprintf(path, sizeof(path), "%s/%s", dir, file);
+  int fd = open(path, O_WRONLY | O_CLOEXEC);
+  if (fd == -1)
+    return 0;
+  size_t len = strlen(value);
+  bool ok = write(fd, value, len) == (ssize_t)len;
+  close(fd);
+  return ok;
+}
+
+static bool move_to_cgroup(pid_t pid, const char *group)
+{
+  char dir[4200], value[32];
+  snprintf(dir, sizeof(dir), "%s/%s", cgroup_base, group);
+  snprintf(value, sizeof(value), "%d", (int)pid);
+  return write_file(dir, "cgroup.procs", value);
+}
+
+// Processes other than texpresso in the cgroup: controllers cannot be
+// enabled for children while it has member processes.
+static bool cgroup_only_self(const char *dir)
+{
+  char path[4200];
+  snprintf(path, sizeof(path), "%s/cgroup.procs", dir);
+  FILE *f = fopen(path, "r");
+  if (!f)
+    return 0;
+  int pid;
+  bool only_self = 1;
+  while (only_self && fscanf(f, "%d", &pid) == 1)
+    only_self = (pid == getpid());
+  fclose(f);
+  return only_self;
+}
+
+void txp_tex_scheduler_init(void)
+{
+#ifdef __linux__
+  cgroup_base[0] = '\0';
+
+  FILE *f = fopen("/proc/self/cgroup", "r");
+  if (!f)
+    return;
+  char line[4096] = "";
+  bool found = 0;
+  while (!found && fgets(line, sizeof(line), f))
+    found = strncmp(line, "0::", 3) == 0;
+  fclose(f);
+  if (!found)
+    return;
+  line[strcspn(line, "\n")] = '\0';
+
+  char base[4096];
+  snprintf(base, sizeof(base), "/sys/fs/cgroup%s", line + 3);
+  // Already set up by a previous instance (after reloading texpresso.so)
+  size_t len = strlen(base), suffix = strlen("/" CGROUP_MAIN);
+  bool ready = len > suffix && strcmp(base + len - suffix, "/" CGROUP_MAIN) == 0;
+  if (ready)
+    base[len - suffix] = '\0';
+  else if (!cgroup_only_self(base))
+    return;
+
+  char dir[4200];
+  snprintf(dir, sizeof(dir), "%s/" CGROUP_MAIN, base);
+  mkdir(dir, 0755);
+  snprintf(dir, sizeof(dir), "%s/" CGROUP_SNAPSHOTS, base);
+  mkdir(dir, 0755);
+  strcpy(cgroup_base, base);
+
+  if (!ready && !move_to_cgroup(getpid(), CGROUP_MAIN))
+  {
+    cgroup_base[0] = '\0';
+    return;
+  }
+  if (!write_file(base, "cgroup.subtree_control", "+cpu") ||
+      !write_file(dir, "cpu.weight", "1"))
+  {
+    fprintf(stderr, "[sched] cannot enable the cpu controller in %s, "
+                    "using nice levels\n", base);
+    cgroup_base[0] = '\0';
+    return;
+  }
+  fprintf(stderr, "[sched] snapshots are scheduled by %s\n", dir);
+#endif
+}
+
+// A snapshot becomes the running process again after a rollback. Without
+// CAP_SYS_NICE, raising its priority back is allowed only if RLIMIT_NICE
+// permits; otherwise processes keep the default priority.
+static bool can_demote_process(int *base)
+{
+  static int result = -1, base_nice = 0;
+  if (result == -1)
+  {
+    errno = 0;
+    base_nice = getpriority(PRIO_PROCESS, 0);
+    result = (errno == 0 && geteuid() == 0);
+#ifdef RLIMIT_NICE
+    struct rlimit rl;
+    if (errno == 0 && !result && getrlimit(RLIMIT_NICE, &rl) == 0)
+      result = rl.rlim_cur == RLIM_INFINITY ||
+               rl.rlim_cur >= (rlim_t)(20 - base_nice);
+#endif
+    if (!result)
+      fprintf(stderr, "[sched] RLIMIT_NICE does not allow restoring "
+                      "priorities, snapshots are not demoted\n");
+  }
+  *base = base_nice;
+  return result;
+}
+
+static void set_process_background(pid_t pid, bool background)
+{
+  if (pid <= 0)
+    return;
+  if (cgroup_base[0])
+  {
+    if (move_to_cgroup(pid, background ? CGROUP_SNAPSHOTS : CGROUP_MAIN) ||
+        errno == ESRCH)
+      return;
+    perror("[sched] moving process to cgroup");
+  }
+
+  int base;
+  if (!can_demote_process(&base))
+    return;
+  if (setpriority(PRIO_PROCESS, pid, background ? 19 : base) == -1 &&
+      errno != ESRCH)
+    perror("[sched] setpriority");
+}
+
+// Ask the kernel to reclaim the private memory of an idle process first.
+// Without CAP_SYS_NICE, process_madvise fails with EPERM and this does
+// nothing.
+static void advise_cold(pid_t pid)
+{
+#if defined(__linux__) && defined(SYS_process_madvise) && defined(MADV_COLD)
+  static bool unsupported = 0;
+  if (unsupported)
+    return;
+
+  char path[64];
+  snprintf(path, sizeof(path), "/proc/%d/maps", (int)pid);
+  FILE *maps = fopen(path, "r");
+  if (!maps)
+    return;
+  int pidfd = open_pidfd(pid);
+  if (pidfd < 0)
+  {
+    fclose(maps);
+    return;
+  }
+
+  struct iovec iov[64];
+  int count = 0;
+  char line[4096];
+  bool more = 1;
+  while (more && !unsupported)
+  {
+    more = fgets(line, sizeof(line), maps) != NULL;
+    unsigned long start, end;
+    char perms[5];
+    // Private writable mappings: heap, stack and TeX memory
+    if (more && sscanf(line, "%lx-%lx %4s", &start, &end, perms) == 3 &&
+        perms[1] == 'w' && perms[3] == 'p')
+    {
+      iov[count].iov_base = (void*)start;
+      iov[count].iov_len = end - start;
+      count += 1;
+    }
+    if (count == 64 || (!more && count > 0))
+    {
+      if (syscall(SYS_process_madvise, pidfd, iov, count, MADV_COLD, 0) == -1 &&
+          (errno == EPERM || errno == ENOSYS))
+      {
+        if (errno == EPERM)
+          fprintf(stderr, "[sched] process_madvise needs CAP_SYS_NICE, "
+                          "the memory of snapshots is not marked cold\n");
+        else
+          perror("[sched] process_madvise");
+        unsupported = 1;
+      }
+      count = 0;
+    }
+  }
+
+  close(pidfd);
+  fclose(maps);
+#else
+  (void)pid;
+#endif
+}
+
+// Right after the fork, a snapshot shares its memory with its child and the
+// hint would have no effect: wait until the child has diverged.
+#define SNAPSHOT_COLD_AGE 10
+
+static void cool_snapshots(struct tex_engine *self)
+{
+  double now = monotonic_seconds();
+  if (now < self->next_cooling)
+    return;
+  self->next_cooling = now + 1;
+  for (int i = 0; i < self->process_pos; ++i)
+  {
+    process_t *process = &self->processes[i];
+    if (!process->cold && now - process->since >= SNAPSHOT_COLD_AGE)
+    {
+      advise_cold(process->pid);
+      process->cold = 1;
+    }
+  }
+}
+
 // Launching processes
 
 static pid_t exec_xelatex_generic(char **args, channel_t **c)
@@ -200,6 +570,7 @@ static void prepare_process(struct tex_engine *self)
       mabort();
 
     self->status = DOC_RUNNING;
+    watchdog_progress(self);
   }
   else
   {
@@ -214,6 +585,14 @@ static void close_process(struct tex_engine *self)
 {
   if (self->status != DOC_TERMINATED)
   {
+    // A paused process would never terminate
+    if (self->watchdog.paused)
+    {
+      signal_process(self->pid, self->watchdog.pidfd, SIGTERM);
+      signal_process(self->pid, self->watchdog.pidfd, SIGCONT);
+      watchdog_clear(self);
+    }
+
     if (self->c == NULL) mabort();
     channel_free(self->c);
     self->c = NULL;
@@ -237,32 +616,25 @@ static void kill_process_if_stuck(struct tex_engine *self)
   // looping macro. In this case we should kill the process asap.
   if (!channel_has_pending_query(self->c, 0))
   {
-    // FIXME: there is a race condition here, if a query arrives between
-    // checking and before killing.
-
-    // Solution: a future version of the protocol should use custom unix
-    // sockets for each child, it's too risky to multiplex stuff on this
-    // clunky platform.
-
-    // Workaround: we first stop the process, and waits a bit for another
-    // query to arrive.
-    // Waiting gives time for the signal to be delivered and ensures that no
-    // query arrived in between.
-    kill(self->pid, SIGSTOP);
-    if (channel_has_pending_query(self->c, 5))
+    // A query could arrive between checking and killing: stop the process
+    // first, once it is stopped, no new query can arrive.
+    bool own_pidfd = !self->watchdog.paused;
+    int pidfd = own_pidfd ? open_pidfd(self->pid) : self->watchdog.pidfd;
+    stop_process(self->pid, pidfd);
+    if (channel_has_pending_query(self->c, 0))
     {
       // If a query arrived, resume process and keep working.
-      kill(self->pid, SIGCONT);
+      signal_process(self->pid, pidfd, SIGCONT);
     }
     else
     {
       // No query arrived, kill!
       fprintf(stderr, "kill(%d, SIGTERM)\n", self->pid);
-      kill(self->pid, SIGTERM);
+      signal_process(self->pid, pidfd, SIGTERM);
 
       // Under Linux, the process needs to be resumed for the signal to be
       // delivered
-      kill(self->pid, SIGCONT);
+      signal_process(self->pid, pidfd, SIGCONT);
 
       // If we killed a child process, its parent will resume operations and
       // write a "BACK" message.
@@ -270,6 +642,10 @@ static void kill_process_if_stuck(struct tex_engine *self)
       if (self->pid == self->rootpid)
         close_process(self);
     }
+
+    if (own_pidfd && pidfd >= 0)
+      close(pidfd);
+    watchdog_clear(self);
   }
 }
 
@@ -327,6 +703,7 @@ static void pop_process(fz_context *ctx, struct tex_engine *self)
   self->pid = process->pid;
   self->trace_len = process->trace_len;
   self->status = DOC_RUNNING;
+  set_process_background(self->pid, 0);
   log_rollback(ctx, self->log, process->snap);
 }
 
@@ -337,6 +714,7 @@ static void resume_process(struct tex_engine *self)
   channel_write_answer(self->c, &a);
   channel_flush(self->c);
   self->status = DOC_RUNNING;
+  watchdog_progress(self);
 }
 
 static void resume_after_termination(fz_context *ctx, struct tex_engine *self)
@@ -358,9 +736,64 @@ static void resume_after_termination(fz_context *ctx, struct tex_engine *self)
 
 // Engine class implementation
 
+// Memory owned by the snapshots and by the running process, for the budget.
+// Snapshots cannot be evicted: they are only accounted.
+static size_t snapshots_memory(void *data)
+{
+  struct tex_engine *self = data;
+  size_t size = 0;
+  for (int i = 0; i < self->process_pos; ++i)
+    size += txp_budget_process_memory(self->processes[i].pid);
+  if (self->pid > 0)
+    size += txp_budget_process_memory(self->pid);
+  return size;
+}
+
+// Input files are kept compressed when they are not being read.
+// Packing them is cheap to undo, so they go first when over budget.
+static size_t input_files_memory(void *data)
+{
+  struct tex_engine *self = data;
+  return filesystem_data_size(self->fs);
+}
+
+static size_t pack_input_files(fz_context *ctx, void *data, size_t wanted)
+{
+  struct tex_engine *self = data;
+  return filesystem_pack_cold(ctx, self->fs, 5);
+}
+
+// The output of TeX and the rollback journal are only accounted: they are
+// needed to display the document and to resume from any snapshot.
+static size_t tex_output_memory(void *data)
+{
+  struct tex_engine *self = data;
+  return filesystem_output_size(self->fs) + synctex_memory(self->stex);
+}
+
+static size_t journal_memory(void *data)
+{
+  struct tex_engine *self = data;
+  return log_memory(self->log);
+}
+
+// Files not read for a minute are compressed, checked every 10s when idle
+#define COLD_FILE_AGE 60
+#define COLD_FILE_PERIOD 10
+
+static void pack_cold_files(fz_context *ctx, struct tex_engine *self)
+{
+  time_t now = time(NULL);
+  if (now - self->cold_files_check < COLD_FILE_PERIOD)
+    return;
+  self->cold_files_check = now;
+  filesystem_pack_cold(ctx, self->fs, COLD_FILE_AGE);
+}
+
 static void engine_destroy(txp_engine *_self, fz_context *ctx)
 {
   SELF;
+  txp_budget_unregister(self);
   close_process(self);
   incdvi_free(ctx, self->dvi);
   synctex_free(ctx, self->stex);
@@ -450,13 +883,25 @@ static void record_trace(struct tex_engine *self, fileentry_t *entry, int seen,
   self->trace_len += 1;
 }
 
-static fz_buffer *entry_data(fileentry_t *e)
+static fz_buffer *entry_data(fz_context *ctx, fileentry_t *e)
 {
   if (e->saved.data)
     return e->saved.data;
   if (e->edit_data)
     return e->edit_data;
-  return e->fs_data;
+  return fileentry_fs_data(ctx, e);
+}
+
+static int entry_length(fileentry_t *e)
+{
+  if (e->saved.chunks)
+    return e->saved.chunks->len;
+  if (e->saved.data)
+    return e->saved.data->len;
+  if (e->edit_data)
+    return e->edit_data->len;
+  // Answer without decompressing cold files
+  return fileentry_fs_length(e);
 }
 
 static fz_buffer *output_data(fileentry_t *e)
@@ -505,7 +950,7 @@ static int answer_standard_query(fz_context *ctx, struct tex_engine *self, chann
       if (q->open.mode[0] == 'r')
       {
         e = filesystem_lookup(self->fs, q->open.path);
-        if (!e || !entry_data(e))
+        if (!e || (!entry_data(ctx, e) && !e->saved.chunks))
         {
           fs_path = lookup_path(self, q->open.path, fs_path_buffer, NULL);
 
@@ -538,14 +983,25 @@ static int answer_standard_query(fz_context *ctx, struct tex_engine *self, chann
             mabort("path: %s\nmode:%s\n", q->open.path, q->open.mode);
           if (fs_path == q->open.path)
             fs_path = e->path;
-          e->fs_data = fz_read_file(ctx, fs_path);
+          fileentry_set_fs_data(ctx, e, fz_read_file(ctx, fs_path));
           e->saved.level = FILE_READ;
           stat(fs_path, &e->fs_stat);
         }
       }
       else
       {
-        e->saved.data = fz_new_buffer(ctx, 1024);
+        // The output document can get large, it is stored in chunks so
+        // that growing it never copies the pages already produced
+        if (is_output_document(q->open.path))
+        {
+          e->saved.data = NULL;
+          e->saved.chunks = chunkbuf_new(ctx);
+        }
+        else
+        {
+          e->saved.data = fz_new_buffer(ctx, 1024);
+          e->saved.chunks = NULL;
+        }
         e->saved.level = level;
       }
 
@@ -573,9 +1029,7 @@ static int answer_standard_query(fz_context *ctx, struct tex_engine *self, chann
           if (0)
             fprintf(stderr, "extension is %s\n", ext);
           if (!ext);
-          else if ((strcmp(ext, "xdv") == 0 ||
-                    strcmp(ext, "dvi") == 0 ||
-                    strcmp(ext, "pdf") == 0))
+          else if (is_output_document(q->open.path))
           {
             if (self->st.document.entry != NULL)
             {
@@ -626,21 +1080,21 @@ static int answer_standard_query(fz_context *ctx, struct tex_engine *self, chann
       fileentry_t *e = self->st.table[q->read.fid].entry;
       if (e == NULL) mabort();
       if (e->saved.level < FILE_READ) mabort();
-      fz_buffer *data = entry_data(e);
+      int len = entry_length(e);
       if (e->rollback.invalidated > -1)
       {
         if (q->read.pos > e->rollback.invalidated)
           mabort();
         e->rollback.invalidated = -1;
       }
-      if (q->read.pos > data->len)
+      if (q->read.pos > len)
       {
-        fprintf(stderr, "read:%d\ndata->len:%d\n", q->read.pos, (int)data->len);
+        fprintf(stderr, "read:%d\ndata->len:%d\n", q->read.pos, len);
         mabort();
       }
       size_t n = q->read.size;
-      if (n > data->len - q->read.pos)
-        n = data->len - q->read.pos;
+      if (n > len - q->read.pos)
+        n = len - q->read.pos;
 
       int fork = 0;
       if (self->fence_pos >= 0 &&
@@ -656,8 +1110,12 @@ static int answer_standard_query(fz_context *ctx, struct tex_engine *self, chann
         a.tag = A_FORK;
       else
       {
-        memmove(channel_write_buffer(c, n),
-                data->data + q->read.pos, n);
+        if (e->saved.chunks)
+          chunkbuf_read(e->saved.chunks, q->read.pos,
+                        channel_write_buffer(c, n), n);
+        else
+          memmove(channel_write_buffer(c, n),
+                  entry_data(ctx, e)->data + q->read.pos, n);
         a.tag = A_READ;
         a.read.size = n;
       }
@@ -703,7 +1161,9 @@ static int answer_standard_query(fz_context *ctx, struct tex_engine *self, chann
       if (e == NULL || e->saved.level != FILE_WRITE) mabort();
       log_fileentry(ctx, self->log, e);
 
-      if (q->writ.pos + q->writ.size > e->saved.data->len)
+      if (e->saved.chunks)
+        chunkbuf_write(ctx, e->saved.chunks, q->writ.pos, q->writ.buf, q->writ.size);
+      else if (q->writ.pos + q->writ.size > e->saved.data->len)
       {
         e->saved.data->len = q->writ.pos;
         fz_append_data(ctx, e->saved.data, q->writ.buf, q->writ.size);
@@ -714,7 +1174,7 @@ static int answer_standard_query(fz_context *ctx, struct tex_engine *self, chann
       if (self->st.document.entry == e)
       {
         int opage = incdvi_page_count(self->dvi);
-        incdvi_update(ctx, self->dvi, e->saved.data);
+        incdvi_update(ctx, self->dvi, e->saved.chunks);
         int npage = incdvi_page_count(self->dvi);
         if (opage != npage)
           fprintf(stderr, "[info] output %d pages long\n", npage);
@@ -779,7 +1239,7 @@ static int answer_standard_query(fz_context *ctx, struct tex_engine *self, chann
       fileentry_t *e = self->st.table[q->clos.fid].entry;
       if (e == NULL || e->saved.level < FILE_READ) mabort();
       a.tag = A_SIZE;
-      a.size.size = entry_data(e)->len;
+      a.size.size = entry_length(e);
       if (LOG)
         fprintf(stderr, "SIZE = %d (seen = %d)\n", a.size.size, e->saved.seen);
       channel_write_answer(c, &a);
@@ -871,9 +1331,9 @@ static int answer_standard_query(fz_context *ctx, struct tex_engine *self, chann
         sa->uid = 1000;
         sa->gid = 0;
         sa->rdev = 0;
-        sa->size = e->saved.data->len;
+        sa->size = entry_length(e);
         sa->blksize = 4096;
-        sa->blocks = (e->saved.data->len + 4095) / 4096;
+        sa->blocks = (sa->size + 4095) / 4096;
         sa->atime.sec  = 0;
         sa->atime.nsec = 0;
         sa->ctime.sec  = 0;
@@ -949,6 +1409,10 @@ static int answer_query(fz_context *ctx, struct tex_engine *self, channel_t *c,
       process->pid = self->pid;
       process->snap = log_snapshot(ctx, self->log);
       process->trace_len = self->trace_len;
+      process->since = monotonic_seconds();
+      process->cold = 0;
+      // The child inherits the priority of its parent, which is now idle
+      set_process_background(process->pid, 1);
       self->pid = q->chld.pid;
       self->process_pos += 1;
       self->fence_pos -= 1;
@@ -975,10 +1439,10 @@ static int answer_query(fz_context *ctx, struct tex_engine *self, channel_t *c,
 
 static int output_length(fileentry_t *entry)
 {
-  if (!entry || !entry->saved.data)
+  if (!entry || (!entry->saved.data && !entry->saved.chunks))
     return 0;
   else
-    return entry->saved.data->len;
+    return entry_length(entry);
 }
 
 static void rollback(fz_context *ctx, struct tex_engine *self, int trace)
@@ -1032,14 +1496,12 @@ static void rollback(fz_context *ctx, struct tex_engine *self, int trace)
   else
     mabort();
   fprintf(stderr, "after rollback: %d bytes of output\n",
-    self->st.document.entry
-    ? (int)self->st.document.entry->saved.data->len
-    : 0
+    output_length(self->st.document.entry)
   );
   if (self->st.document.entry)
   {
     fprintf(stderr, "[info] before rollback: %d pages\n", incdvi_page_count(self->dvi));
-    incdvi_update(ctx, self->dvi, self->st.document.entry->saved.data);
+    incdvi_update(ctx, self->dvi, self->st.document.entry->saved.chunks);
     fprintf(stderr, "[info] after  rollback: %d pages\n", incdvi_page_count(self->dvi));
   }
   else
@@ -1126,36 +1588,153 @@ static int engine_page_count(txp_engine *_self)
 }
 
 static fz_display_list *engine_render_page(txp_engine *_self, fz_context *ctx, int page)
+{
+  return engine_render_page_area(_self, ctx, page, fz_infinite_rect, NULL);
+}
+
+static fz_display_list *engine_render_page_area(txp_engine *_self, fz_context *ctx, int page,
+                                                fz_rect area, bool *complete)
 {
   SELF;
 
   float pw, ph;
   bool landscape;
-  fz_buffer *data = self->st.document.entry->saved.data;
-  incdvi_page_dim(self->dvi, data, page, &pw, &ph, &landscape);
+  chunkbuf_t *data = self->st.document.entry->saved.chunks;
+  incdvi_page_dim(ctx, self->dvi, data, page, &pw, &ph, &landscape);
 
   fz_rect box = fz_make_rect(0, 0, pw, ph);
   fz_display_list *dl = fz_new_display_list(ctx, box);
   fz_device *dev = fz_new_list_device(ctx, dl);
-  incdvi_render_page(ctx, self->dvi, data, page, dev);
+  bool result = incdvi_render_page_area(ctx, self->dvi, data, page, dev, area);
   fz_close_device(ctx, dev);
   fz_drop_device(ctx, dev);
+  if (complete)
+    *complete = result;
   return dl;
 }
 
+// Watchdog: a process that sends no query (no read, no output) while
+// using watchdog.limit seconds of CPU is likely stuck in a loop. It is
+// paused until the next change. Without /proc, the process is given
+// WATCHDOG_WALL times the limit in wall-clock time.
+#define WATCHDOG_WALL 4
+
+// Line of the last position TeX has seen in a file
+static int seen_line(fz_context *ctx, fileentry_t *e)
+{
+  if (e->saved.chunks)
+    return 0;
+  fz_buffer *data = NULL;
+  fz_try(ctx)
+  {
+    data = entry_data(ctx, e);
+  }
+  fz_catch(ctx)
+  {
+    data = NULL;
+  }
+  if (!data)
+    return 0;
+
+  int line = 1, end = fz_mini(e->saved.seen, data->len);
+  for (int i = 0; i < end; ++i)
+    if (data->data[i] == '\n')
+      line += 1;
+  return line;
+}
+
+static void pause_process(fz_context *ctx, struct tex_engine *self, long cpu_ms)
+{
+  int pidfd = open_pidfd(self->pid);
+  stop_process(self->pid, pidfd);
+
+  if (channel_has_pending_query(self->c, 0))
+  {
+    // A query arrived before the process stopped: it is making progress
+    signal_process(self->pid, pidfd, SIGCONT);
+    if (pidfd >= 0)
+      close(pidfd);
+    watchdog_progress(self);
+    return;
+  }
+
+  self->watchdog.paused = 1;
+  self->watchdog.pidfd = pidfd;
+  advise_cold(self->pid);
+
+  const char *path = "";
+  int line = 0;
+  if (self->trace_len > 0)
+  {
+    fileentry_t *e = self->trace[self->trace_len - 1].entry;
+    path = e->path;
+    line = seen_line(ctx, e);
+  }
+
+  fprintf(stderr, "[watchdog] process %d made no progress for %.0fs "
+          "(%.1fs of CPU), pausing it at %s:%d\n",
+          self->pid, monotonic_seconds() - self->watchdog.progress,
+          cpu_ms / 1000.0, path, line);
+  editor_compilation_paused(path, line, cpu_ms / 1000);
+}
+
+// Called when the process has no pending query. CPU time is sampled at
+// most once per second. Returns true if the process is paused.
+static bool watchdog_check(fz_context *ctx, struct tex_engine *self)
+{
+  if (self->watchdog.paused)
+    return 1;
+  if (self->watchdog.limit == 0)
+    return 0;
+
+  double now = monotonic_seconds();
+  if (now < self->watchdog.next_check)
+    return 0;
+  self->watchdog.next_check = now + 1;
+
+  long cpu = -1, used = 0, limit = self->watchdog.limit * 1000L;
+  if (process_stat(self->pid, &cpu))
+  {
+    if (self->watchdog.cpu_base < 0)
+      self->watchdog.cpu_base = cpu;
+    used = cpu - self->watchdog.cpu_base;
+    if (used < limit)
+      return 0;
+  }
+  else if ((now - self->watchdog.progress) * 1000 < limit * WATCHDOG_WALL)
+    return 0;
+
+  pause_process(ctx, self, used);
+  return self->watchdog.paused;
+}
+
+// Give a paused process another chance
+static void watchdog_resume(struct tex_engine *self)
+{
+  if (!self->watchdog.paused)
+    return;
+  fprintf(stderr, "[watchdog] resuming process %d\n", self->pid);
+  signal_process(self->pid, self->watchdog.pidfd, SIGCONT);
+  watchdog_clear(self);
+}
+
 static bool engine_step(txp_engine *_self, fz_context *ctx, bool restart_if_needed)
 {
   SELF;
   if (restart_if_needed)
     prepare_process(self);
+  cool_snapshots(self);
   if (self->status == DOC_RUNNING)
   {
     query_t q;
+    if (self->watchdog.paused)
+      return 0;
     if (!channel_has_pending_query(self->c, 10))
-      return 1;
+      return !watchdog_check(ctx, self);
     int result = read_query(self, self->c, &q);
     if (result)
     {
+      watchdog_progress(self);
       result = answer_query(ctx, self, self->c, &q);
       if (result == -1)
       {
@@ -1168,6 +1747,7 @@ static bool engine_step(txp_engine *_self, fz_context *ctx, bool restart_if_need
     }
     return result;
   }
+  pack_cold_files(ctx, self);
   return 0;
 }
 
@@ -1210,11 +1790,12 @@ static int scan_entry(fz_context *ctx, struct tex_engine *self, fileentry_t *e)
 
   e->pic_cache.type = -1;
 
-  int olen = e->fs_data->len, nlen = buf->len;
+  fz_buffer *old = fileentry_fs_data(ctx, e);
+  int olen = old->len, nlen = buf->len;
   int len = olen < nlen ? olen : nlen;
 
   int i = 0;
-  while (i < len && e->fs_data->data[i] == buf->data[i])
+  while (i < len && old->data[i] == buf->data[i])
     i += 1;
 
   if (i != len)
@@ -1230,8 +1811,7 @@ static int scan_entry(fz_context *ctx, struct tex_engine *self, fileentry_t *e)
   else
     fprintf(stderr, "[scan] content was shrinked from %d to %d bytes\n", olen, nlen);
 
-  fz_drop_buffer(ctx, e->fs_data);
-  e->fs_data = buf;
+  fileentry_set_fs_data(ctx, e, buf);
 
   return i;
 }
@@ -1368,6 +1948,22 @@ static void engine_notify_file_changes(txp_engine *_self,
   rollback_add_change(ctx, self, entry, offset);
 }
 
+static chunkbuf_t *engine_xdv_output(txp_engine *_self)
+{
+  SELF;
+  if (!self->st.document.entry)
+    return NULL;
+  return self->st.document.entry->saved.chunks;
+}
+
+static int engine_unchanged_pages(txp_engine *_self)
+{
+  SELF;
+  int count = incdvi_unchanged_pages(self->dvi);
+  incdvi_mark_pages(self->dvi);
+  return count;
+}
+
 static void engine_begin_changes(txp_engine *_self, fz_context *ctx)
 {
   SELF;
@@ -1394,7 +1990,12 @@ static bool engine_end_changes(txp_engine *_self, fz_context *ctx)
   int trace, offset;
 
   if (!rollback_end(ctx, self, &trace, &offset))
+  {
+    // The change does not affect what the process has read: let a paused
+    // process try again, it is killed by the rollback otherwise
+    watchdog_resume(self);
     return false;
+  }
 
   if (trace >= 0)
     trace = compute_fences(ctx, self, trace, offset);
@@ -1419,7 +2020,7 @@ static synctex_t *engine_synctex(txp_engine *_self, fz_buffer **buf)
 {
   SELF;
   if (buf)
-    *buf = self->st.synctex.entry ? entry_data(self->st.synctex.entry) : NULL;
+    *buf = output_data(self->st.synctex.entry);
   return self->stex;
 }
 
@@ -1431,9 +2032,11 @@ static fileentry_t *engine_find_file(txp_engine *_self, fz_context *ctx, const c
 
 txp_engine *txp_create_tex_engine(fz_context *ctx,
                                   const char *tectonic_path,
+                                  dvi_resmanager *rm,
                                   const char *inclusion_path,
                                   const char *tex_dir,
-                                  const char *tex_name)
+                                  const char *tex_name,
+                                  int watchdog)
 {
   struct tex_engine *self = fz_malloc_struct(ctx, struct tex_engine);
   self->_class = &_class;
@@ -1450,15 +2053,41 @@ txp_engine *txp_create_tex_engine(fz_context *ctx,
   self->trace_len = 0;
   self->trace_cap = 0;
   self->fence_pos = -1;
+  self->watchdog.pidfd = -1;
+  self->watchdog.limit = watchdog;
   self->restart = log_snapshot(ctx, self->log);
   self->status = DOC_TERMINATED;
 
-  self->dvi = incdvi_new(ctx, tectonic_path, tex_dir);
+  self->dvi = incdvi_new(ctx, rm, tex_dir);
 
   self->stex = synctex_new(ctx);
   self->rollback.changed = NULL;
   self->rollback.trace = NOT_IN_TRANSACTION;
   self->rollback.offset = -1;
 
+  txp_budget_register(&(txp_budget_consumer){
+    .name = "Input files",
+    .cost = 0.5,
+    .size = input_files_memory,
+    .evict = pack_input_files,
+    .data = self,
+  });
+  txp_budget_register(&(txp_budget_consumer){
+    .name = "TeX snapshots",
+    .size = snapshots_memory,
+    .external = 1,
+    .data = self,
+  });
+  txp_budget_register(&(txp_budget_consumer){
+    .name = "TeX output",
+    .size = tex_output_memory,
+    .data = self,
+  });
+  txp_budget_register(&(txp_budget_consumer){
+    .name = "Rollback journal",
+    .size = journal_memory,
+    .data = self,
+  });
+
   return (txp_engine*)self;
 }
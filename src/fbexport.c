@@ -0,0 +1,225 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2023 Frédéric Bour <frederic.bour@lakaban.net>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "fbexport.h"
+
+// Pixels start on a cache line boundary after the header
+#define HEADER_SIZE ((sizeof(struct txp_fb_header) + 63) & ~(size_t)63)
+
+struct txp_fbexport_s
+{
+  char name[64];
+  int generation;
+  int fd;
+  struct txp_fb_header *header;
+  size_t size, capacity;
+  uint64_t sequence;
+  // Contents of the front buffer are meaningful
+  bool front_valid;
+  // Frame being prepared
+  int back, width, height, stride;
+};
+
+txp_fbexport *txp_fbexport_new(fz_context *ctx)
+{
+  txp_fbexport *fb = fz_malloc_struct(ctx, txp_fbexport);
+  fb->fd = -1;
+  return fb;
+}
+
+static void unmap_segment(txp_fbexport *fb)
+{
+  if (!fb->header)
+    return;
+  munmap(fb->header, fb->size);
+  close(fb->fd);
+  shm_unlink(fb->name);
+  fb->header = NULL;
+  fb->fd = -1;
+  fb->size = fb->capacity = 0;
+  fb->front_valid = 0;
+}
+
+void txp_fbexport_free(fz_context *ctx, txp_fbexport *fb)
+{
+  unmap_segment(fb);
+  fz_free(ctx, fb);
+}
+
+static bool map_segment(txp_fbexport *fb, size_t capacity)
+{
+  char name[64];
+  snprintf(name, sizeof(name), "/texpresso-%d-%d", (int)getpid(),
+           fb->generation + 1);
+
+  size_t size = HEADER_SIZE + 2 * capacity;
+  int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+  if (fd == -1)
+  {
+    perror("[fbexport] shm_open");
+    return 0;
+  }
+
+  void *ptr = MAP_FAILED;
+  if (ftruncate(fd, size) == -1)
+    perror("[fbexport] ftruncate");
+  else if ((ptr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0))
+           == MAP_FAILED)
+    perror("[fbexport] mmap");
+
+  if (ptr == MAP_FAILED)
+  {
+    close(fd);
+    shm_unlink(name);
+    return 0;
+  }
+
+  // Readers of the previous segment keep their mapping
+  unmap_segment(fb);
+
+  fb->generation += 1;
+  strcpy(fb->name, name);
+  fb->fd = fd;
+  fb->header = ptr;
+  fb->size = size;
+  fb->capacity = capacity;
+
+  struct txp_fb_header *h = fb->header;
+  memset(h, 0, HEADER_SIZE);
+  h->magic = TXP_FB_MAGIC;
+  h->version = TXP_FB_VERSION;
+  h->format = TXP_FB_BGRA;
+  h->size = size;
+  h->sequence = fb->sequence;
+  h->buffers[0].offset = HEADER_SIZE;
+  h->buffers[1].offset = HEADER_SIZE + capacity;
+
+  fprintf(stderr, "[fbexport] mapped %s (%zu bytes)\n", name, size);
+  return 1;
+}
+
+uint8_t *txp_fbexport_begin(fz_context *ctx, txp_fbexport *fb, int w, int h, int *stride)
+{
+  if (w <= 0 || h <= 0)
+    return NULL;
+
+  size_t needed = (size_t)w * 4 * h;
+  if (needed > fb->capacity)
+  {
+    // Leave some room to grow before allocating a new segment
+    if (!map_segment(fb, needed + needed / 4))
+      return NULL;
+  }
+
+  fb->back = fb->front_valid ? 1 - fb->header->front : 0;
+  fb->width = w;
+  fb->height = h;
+  fb->stride = w * 4;
+  *stride = fb->stride;
+
+  // Invalidate the buffer before touching the pixels
+  __atomic_store_n(&fb->header->buffers[fb->back].sequence, 0, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+  return (uint8_t *)fb->header + fb->header->buffers[fb->back].offset;
+}
+
+// Find the area that differs between two frames of the same size.
+static bool frame_damage(const uint8_t *a, const uint8_t *b, int w, int h,
+                         int stride, fz_irect *damage)
+{
+  int y0 = 0, y1 = h;
+  while (y0 < h && memcmp(a + y0 * stride, b + y0 * stride, w * 4) == 0)
+    y0++;
+  if (y0 == h)
+    return 0;
+  while (memcmp(a + (y1 - 1) * stride, b + (y1 - 1) * stride, w * 4) == 0)
+    y1--;
+
+  int x0 = w, x1 = 0;
+  for (int y = y0; y < y1; ++y)
+  {
+    const uint32_t *ra = (const uint32_t *)(a + y * stride);
+    const uint32_t *rb = (const uint32_t *)(b + y * stride);
+    int l = 0, r = w;
+    while (l < x0 && ra[l] == rb[l])
+      l++;
+    while (r > x1 && r > l && ra[r - 1] == rb[r - 1])
+      r--;
+    if (l < x0) x0 = l;
+    if (r > x1) x1 = r;
+  }
+
+  *damage = fz_make_irect(x0, y0, x1, y1);
+  return 1;
+}
+
+bool txp_fbexport_commit(txp_fbexport *fb, fz_irect *damage)
+{
+  struct txp_fb_header *h = fb->header;
+  if (!h)
+    return 0;
+
+  struct txp_fb_buffer *back = &h->buffers[fb->back];
+  struct txp_fb_buffer *front = &h->buffers[1 - fb->back];
+  uint8_t *base = (uint8_t *)h;
+
+  *damage = fz_make_irect(0, 0, fb->width, fb->height);
+  if (fb->front_valid && front->width == fb->width &&
+      front->height == fb->height &&
+      !frame_damage(base + back->offset, base + front->offset,
+                    fb->width, fb->height, fb->stride, damage))
+    return 0;
+
+  fb->sequence += 1;
+  back->width = fb->width;
+  back->height = fb->height;
+  back->stride = fb->stride;
+  back->damage_x0 = damage->x0;
+  back->damage_y0 = damage->y0;
+  back->damage_x1 = damage->x1;
+  back->damage_y1 = damage->y1;
+  __atomic_store_n(&back->sequence, fb->sequence, __ATOMIC_RELEASE);
+
+  __atomic_store_n(&h->front, fb->back, __ATOMIC_RELEASE);
+  __atomic_store_n(&h->sequence, fb->sequence, __ATOMIC_RELEASE);
+  fb->front_valid = 1;
+  return 1;
+}
+
+const char *txp_fbexport_name(txp_fbexport *fb)
+{
+  return fb->name;
+}
+
+uint64_t txp_fbexport_sequence(txp_fbexport *fb)
+{
+  return fb->sequence;
+}
@@ -0,0 +1,90 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2023 Frédéric Bour <frederic.bour@lakaban.net>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#ifndef FBEXPORT_H_
+#define FBEXPORT_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <mupdf/fitz/context.h>
+#include <mupdf/fitz/geometry.h>
+
+// Export rendered frames to other processes through POSIX shared memory.
+//
+// The segment starts with a txp_fb_header followed by the pixels of two
+// buffers. Frames are written to the back buffer, then `front` and
+// `sequence` are updated. The `sequence` of a buffer is 0 while it is being
+// written: a reader copies the buffer designated by `front` and retries if
+// the `sequence` of that buffer changed meanwhile.
+// When the window grows, a larger segment is created under a new name.
+
+#define TXP_FB_MAGIC 0x42465854 // "TXFB"
+#define TXP_FB_VERSION 1
+
+enum txp_fb_format
+{
+  TXP_FB_BGRA, // 8 bits per channel, premultiplied, alpha is always 255
+};
+
+struct txp_fb_buffer
+{
+  uint32_t width, height, stride;
+  // Offset of the pixels from the start of the segment
+  uint32_t offset;
+  // Area that changed since the previous frame
+  int32_t damage_x0, damage_y0, damage_x1, damage_y1;
+  // Frame stored in this buffer
+  uint64_t sequence;
+};
+
+struct txp_fb_header
+{
+  uint32_t magic, version, format;
+  // Buffer holding the most recent frame
+  uint32_t front;
+  // Incremented for each frame
+  uint64_t sequence;
+  // Size of the segment, in bytes
+  uint64_t size;
+  struct txp_fb_buffer buffers[2];
+};
+
+typedef struct txp_fbexport_s txp_fbexport;
+
+txp_fbexport *txp_fbexport_new(fz_context *ctx);
+void txp_fbexport_free(fz_context *ctx, txp_fbexport *fb);
+
+// Return the back buffer, large enough for a frame of w x h pixels,
+// or NULL if the segment could not be allocated.
+uint8_t *txp_fbexport_begin(fz_context *ctx, txp_fbexport *fb, int w, int h, int *stride);
+
+// Publish the back buffer. Returns false if the frame is identical to the
+// previous one, otherwise damage is set to the area that changed.
+bool txp_fbexport_commit(txp_fbexport *fb, fz_irect *damage);
+
+// Name of the current segment (for shm_open)
+const char *txp_fbexport_name(txp_fbexport *fb);
+uint64_t txp_fbexport_sequence(txp_fbexport *fb);
+
+#endif // FBEXPORT_H_
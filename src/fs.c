@@ -22,7 +22,9 @@
  * IN THE SOFTWARE.
  */
 
+#include <stdio.h>
 #include <string.h>
+#include <time.h>
 #include "state.h"
 #include "../dvi/fz_util.h"
 
@@ -96,10 +98,13 @@ void filesystem_free(fz_context *ctx, filesystem_t *fs)
       continue;
     if (e->fs_data)
       fz_drop_buffer(ctx, e->fs_data);
+    packbuf_drop(ctx, e->fs_packed);
     if (e->edit_data)
       fz_drop_buffer(ctx, e->edit_data);
     if (e->saved.data)
       fz_drop_buffer(ctx, e->saved.data);
+    if (e->saved.chunks)
+      chunkbuf_drop(ctx, e->saved.chunks);
     fz_free(ctx, (void *)e->path);
     fz_free(ctx, fs->table[i].entry);
   }
@@ -195,3 +200,108 @@ fileentry_t *filesystem_scan(filesystem_t *fs, int *index)
   }
   return NULL;
 }
+
+fz_buffer *fileentry_fs_data(fz_context *ctx, fileentry_t *e)
+{
+  e->fs_used = time(NULL);
+  if (!e->fs_data && e->fs_packed)
+  {
+    e->fs_data = packbuf_unpack(ctx, e->fs_packed);
+    packbuf_drop(ctx, e->fs_packed);
+    e->fs_packed = NULL;
+  }
+  return e->fs_data;
+}
+
+int fileentry_fs_length(fileentry_t *e)
+{
+  if (e->fs_data)
+    return e->fs_data->len;
+  if (e->fs_packed)
+    return packbuf_length(e->fs_packed);
+  return 0;
+}
+
+void fileentry_set_fs_data(fz_context *ctx, fileentry_t *e, fz_buffer *data)
+{
+  fz_drop_buffer(ctx, e->fs_data);
+  packbuf_drop(ctx, e->fs_packed);
+  e->fs_data = data;
+  e->fs_packed = NULL;
+  e->fs_used = time(NULL);
+  e->fs_incompressible = 0;
+}
+
+size_t filesystem_pack_cold(fz_context *ctx, filesystem_t *fs, int age)
+{
+  time_t now = time(NULL);
+  size_t saved = 0;
+  int count = 0;
+
+  for (int i = 0; i < fs->cap; ++i)
+  {
+    fileentry_t *e = fs->table[i].entry;
+    if (!e || !e->fs_data || e->fs_incompressible || now - e->fs_used < age)
+      continue;
+
+    packbuf_t *pb = NULL;
+    fz_try(ctx)
+    {
+      pb = packbuf_pack(ctx, e->fs_data);
+    }
+    fz_catch(ctx)
+    {
+      pb = NULL;
+    }
+    if (!pb)
+    {
+      // Already compressed (pictures, fonts, ...)
+      e->fs_incompressible = 1;
+      continue;
+    }
+
+    saved += e->fs_data->len - packbuf_size(pb);
+    count += 1;
+    fz_drop_buffer(ctx, e->fs_data);
+    e->fs_data = NULL;
+    e->fs_packed = pb;
+  }
+
+  if (count > 0)
+    fprintf(stderr, "[fs] packed %d cold files, saved %zu KiB\n",
+            count, saved / 1024);
+  return saved;
+}
+
+size_t filesystem_data_size(filesystem_t *fs)
+{
+  size_t size = 0;
+  for (int i = 0; i < fs->cap; ++i)
+  {
+    fileentry_t *e = fs->table[i].entry;
+    if (!e)
+      continue;
+    if (e->fs_data)
+      size += e->fs_data->cap;
+    if (e->fs_packed)
+      size += packbuf_size(e->fs_packed);
+  }
+  return size;
+}
+
+size_t filesystem_output_size(filesystem_t *fs)
+{
+  size_t size = 0;
+  for (int i = 0; i < fs->cap; ++i)
+  {
+    fileentry_t *e = fs->table[i].entry;
+    if (!e)
+      continue;
+    if (e->saved.data && e->saved.data != e->fs_data &&
+        e->saved.data != e->edit_data)
+      size += e->saved.data->cap;
+    if (e->saved.chunks)
+      size += chunkbuf_size(e->saved.chunks);
+  }
+  return size;
+}
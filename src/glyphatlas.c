@@ -0,0 +1,896 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2023 Frédéric Bour <frederic.bour@lakaban.net>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#include <math.h>
+#include <string.h>
+#include <mupdf/fitz.h>
+#include "glyphatlas.h"
+
+// Collected content
+
+typedef struct {
+  int font; // index in page->fonts
+  int gid;
+  // Diagonal of the glyph matrix and position of the origin
+  float a, d;
+  fz_point p;
+  uint8_t rgb[3];
+} glyph_t;
+
+typedef struct {
+  fz_rect rect;
+  uint8_t rgb[3];
+  // Number of glyphs drawn before the rule, to keep the painting order
+  int glyphs_before;
+} rule_t;
+
+struct txp_glyph_page_s {
+  fz_font **fonts;
+  int font_count, font_cap;
+  glyph_t *glyphs;
+  int glyph_count, glyph_cap;
+  rule_t *rules;
+  int rule_count, rule_cap;
+  fz_display_list *residue;
+  // Largest glyph size, in document units
+  float max_size;
+};
+
+static int page_font(fz_context *ctx, txp_glyph_page *page, fz_font *font)
+{
+  // Spans of a page share a handful of fonts, search from the last one
+  for (int i = page->font_count - 1; i >= 0; --i)
+    if (page->fonts[i] == font)
+      return i;
+
+  if (page->font_count == page->font_cap)
+  {
+    int cap = page->font_cap ? page->font_cap * 2 : 16;
+    page->fonts = fz_realloc_array(ctx, page->fonts, cap, fz_font *);
+    page->font_cap = cap;
+  }
+  page->fonts[page->font_count] = fz_keep_font(ctx, font);
+  return page->font_count++;
+}
+
+static void page_add_glyph(fz_context *ctx, txp_glyph_page *page, glyph_t g)
+{
+  if (page->glyph_count == page->glyph_cap)
+  {
+    int cap = page->glyph_cap ? page->glyph_cap * 2 : 1024;
+    page->glyphs = fz_realloc_array(ctx, page->glyphs, cap, glyph_t);
+    page->glyph_cap = cap;
+  }
+  page->glyphs[page->glyph_count++] = g;
+  page->max_size = fz_max(page->max_size, fz_max(fabsf(g.a), fabsf(g.d)));
+}
+
+static void page_add_rule(fz_context *ctx, txp_glyph_page *page, rule_t r)
+{
+  if (page->rule_count == page->rule_cap)
+  {
+    int cap = page->rule_cap ? page->rule_cap * 2 : 64;
+    page->rules = fz_realloc_array(ctx, page->rules, cap, rule_t);
+    page->rule_cap = cap;
+  }
+  r.glyphs_before = page->glyph_count;
+  page->rules[page->rule_count++] = r;
+}
+
+// Collecting device: glyphs and rules drawn outside of any clip are
+// recorded, everything else is forwarded to the residual display list.
+//
+// The residue is painted first, below glyphs and rules. When residual
+// content is drawn over a glyph or a rule collected before it, the page
+// cannot be split.
+
+typedef struct {
+  fz_device super;
+  txp_glyph_page *page;
+  fz_device *residue;
+  int residue_ops;
+  int clip_depth;
+  bool unsupported;
+  // Bounds of the collected glyphs and rules, and their union
+  fz_rect *items;
+  int item_count, item_cap;
+  fz_rect items_bounds;
+} collect_device;
+
+static bool rects_overlap(fz_rect a, fz_rect b)
+{
+  return a.x0 < b.x1 && b.x0 < a.x1 && a.y0 < b.y1 && b.y0 < a.y1;
+}
+
+static void collect_item(fz_context *ctx, collect_device *dev, fz_rect r)
+{
+  if (dev->item_count == dev->item_cap)
+  {
+    int cap = dev->item_cap ? dev->item_cap * 2 : 1024;
+    dev->items = fz_realloc_array(ctx, dev->items, cap, fz_rect);
+    dev->item_cap = cap;
+  }
+  dev->items[dev->item_count++] = r;
+  dev->items_bounds = fz_union_rect(dev->items_bounds, r);
+}
+
+// Account for residual content covering r
+static void collect_residue(collect_device *dev, fz_rect r)
+{
+  dev->residue_ops += 1;
+  if (dev->unsupported || !rects_overlap(r, dev->items_bounds))
+    return;
+  for (int i = 0; i < dev->item_count; ++i)
+  {
+    if (rects_overlap(r, dev->items[i]))
+    {
+      dev->unsupported = 1;
+      return;
+    }
+  }
+}
+
+static void convert_rgb(fz_context *ctx, fz_colorspace *cs, const float *color,
+                        fz_color_params cp, uint8_t rgb[3])
+{
+  float v[3];
+  fz_convert_color(ctx, cs, color, fz_device_rgb(ctx), v, NULL, cp);
+  for (int i = 0; i < 3; ++i)
+    rgb[i] = fz_clamp(v[i], 0, 1) * 255 + 0.5f;
+}
+
+static bool is_upright(fz_matrix m)
+{
+  return fabsf(m.b) < 1e-4f && fabsf(m.c) < 1e-4f;
+}
+
+static bool text_is_upright(const fz_text *text, fz_matrix ctm)
+{
+  for (fz_text_span *span = text->head; span; span = span->next)
+    if (!is_upright(fz_concat(span->trm, ctm)))
+      return 0;
+  return 1;
+}
+
+static void collect_fill_text(fz_context *ctx, fz_device *dev_, const fz_text *text,
+                              fz_matrix ctm, fz_colorspace *cs, const float *color,
+                              float alpha, fz_color_params cp)
+{
+  collect_device *dev = (collect_device *)dev_;
+
+  if (dev->clip_depth > 0 || alpha != 1 || !text_is_upright(text, ctm))
+  {
+    collect_residue(dev, fz_bound_text(ctx, text, NULL, ctm));
+    fz_fill_text(ctx, dev->residue, text, ctm, cs, color, alpha, cp);
+    return;
+  }
+
+  glyph_t g;
+  convert_rgb(ctx, cs, color, cp, g.rgb);
+
+  for (fz_text_span *span = text->head; span; span = span->next)
+  {
+    fz_matrix trm = fz_concat(span->trm, ctm);
+    g.font = page_font(ctx, dev->page, span->font);
+    g.a = trm.a;
+    g.d = trm.d;
+    for (int i = 0; i < span->len; ++i)
+    {
+      fz_text_item *item = &span->items[i];
+      if (item->gid < 0)
+        continue;
+      g.gid = item->gid;
+      g.p = fz_transform_point_xy(item->x, item->y, ctm);
+      page_add_glyph(ctx, dev->page, g);
+      fz_matrix tm = span->trm;
+      tm.e = item->x;
+      tm.f = item->y;
+      collect_item(ctx, dev, fz_bound_glyph(ctx, span->font, item->gid, fz_concat(tm, ctm)));
+    }
+  }
+}
+
+// Recognize axis-aligned rectangles, the rules produced by TeX
+
+typedef struct {
+  fz_point pts[6];
+  int count;
+  bool rect, invalid;
+} rect_walker;
+
+static void rw_moveto(fz_context *ctx, void *arg, float x, float y)
+{
+  rect_walker *rw = arg;
+  if (rw->count > 0 || rw->rect)
+    rw->invalid = 1;
+  else
+    rw->pts[rw->count++] = fz_make_point(x, y);
+}
+
+static void rw_lineto(fz_context *ctx, void *arg, float x, float y)
+{
+  rect_walker *rw = arg;
+  if (rw->count == 0 || rw->count == 6)
+    rw->invalid = 1;
+  else
+    rw->pts[rw->count++] = fz_make_point(x, y);
+}
+
+static void rw_curveto(fz_context *ctx, void *arg, float x1, float y1,
+                       float x2, float y2, float x3, float y3)
+{
+  ((rect_walker *)arg)->invalid = 1;
+}
+
+static void rw_closepath(fz_context *ctx, void *arg)
+{
+}
+
+static void rw_rectto(fz_context *ctx, void *arg, float x1, float y1, float x2, float y2)
+{
+  rect_walker *rw = arg;
+  if (rw->count > 0 || rw->rect)
+    rw->invalid = 1;
+  else
+  {
+    rw->rect = 1;
+    rw->pts[0] = fz_make_point(x1, y1);
+    rw->pts[1] = fz_make_point(x2, y2);
+  }
+}
+
+static bool path_is_rect(fz_context *ctx, const fz_path *path, fz_matrix ctm, fz_rect *r)
+{
+  static const fz_path_walker walker = {
+    .moveto = rw_moveto,
+    .lineto = rw_lineto,
+    .curveto = rw_curveto,
+    .closepath = rw_closepath,
+    .rectto = rw_rectto,
+  };
+
+  if (!is_upright(ctm))
+    return 0;
+
+  rect_walker rw = {.count = 0};
+  fz_walk_path(ctx, path, &walker, &rw);
+  if (rw.invalid)
+    return 0;
+
+  if (!rw.rect)
+  {
+    // Closed polygon of 4 points, each edge horizontal or vertical
+    if (rw.count == 5 && rw.pts[4].x == rw.pts[0].x && rw.pts[4].y == rw.pts[0].y)
+      rw.count = 4;
+    if (rw.count != 4)
+      return 0;
+    for (int i = 0; i < 4; ++i)
+    {
+      fz_point p = rw.pts[i], q = rw.pts[(i + 1) % 4];
+      if (p.x != q.x && p.y != q.y)
+        return 0;
+    }
+    rw.pts[1] = rw.pts[2];
+  }
+
+  fz_rect rect = fz_make_rect(fz_min(rw.pts[0].x, rw.pts[1].x),
+                              fz_min(rw.pts[0].y, rw.pts[1].y),
+                              fz_max(rw.pts[0].x, rw.pts[1].x),
+                              fz_max(rw.pts[0].y, rw.pts[1].y));
+  *r = fz_transform_rect(rect, ctm);
+  return 1;
+}
+
+static void collect_fill_path(fz_context *ctx, fz_device *dev_, const fz_path *path,
+                              int even_odd, fz_matrix ctm, fz_colorspace *cs,
+                              const float *color, float alpha, fz_color_params cp)
+{
+  collect_device *dev = (collect_device *)dev_;
+  rule_t rule;
+
+  if (dev->clip_depth == 0 && alpha == 1 && path_is_rect(ctx, path, ctm, &rule.rect))
+  {
+    convert_rgb(ctx, cs, color, cp, rule.rgb);
+    page_add_rule(ctx, dev->page, rule);
+    collect_item(ctx, dev, rule.rect);
+    return;
+  }
+
+  collect_residue(dev, fz_bound_path(ctx, path, NULL, ctm));
+  fz_fill_path(ctx, dev->residue, path, even_odd, ctm, cs, color, alpha, cp);
+}
+
+// Everything else goes to the residue
+
+static void collect_stroke_path(fz_context *ctx, fz_device *dev_, const fz_path *path,
+                                const fz_stroke_state *stroke, fz_matrix ctm,
+                                fz_colorspace *cs, const float *color, float alpha,
+                                fz_color_params cp)
+{
+  collect_device *dev = (collect_device *)dev_;
+  collect_residue(dev, fz_bound_path(ctx, path, stroke, ctm));
+  fz_stroke_path(ctx, dev->residue, path, stroke, ctm, cs, color, alpha, cp);
+}
+
+static void collect_clip_path(fz_context *ctx, fz_device *dev_, const fz_path *path,
+                              int even_odd, fz_matrix ctm, fz_rect scissor)
+{
+  collect_device *dev = (collect_device *)dev_;
+  dev->clip_depth += 1;
+  fz_clip_path(ctx, dev->residue, path, even_odd, ctm, scissor);
+}
+
+static void collect_clip_stroke_path(fz_context *ctx, fz_device *dev_, const fz_path *path,
+                                     const fz_stroke_state *stroke, fz_matrix ctm,
+                                     fz_rect scissor)
+{
+  collect_device *dev = (collect_device *)dev_;
+  dev->clip_depth += 1;
+  fz_clip_stroke_path(ctx, dev->residue, path, stroke, ctm, scissor);
+}
+
+static void collect_stroke_text(fz_context *ctx, fz_device *dev_, const fz_text *text,
+                                const fz_stroke_state *stroke, fz_matrix ctm,
+                                fz_colorspace *cs, const float *color, float alpha,
+                                fz_color_params cp)
+{
+  collect_device *dev = (collect_device *)dev_;
+  collect_residue(dev, fz_bound_text(ctx, text, stroke, ctm));
+  fz_stroke_text(ctx, dev->residue, text, stroke, ctm, cs, color, alpha, cp);
+}
+
+static void collect_clip_text(fz_context *ctx, fz_device *dev_, const fz_text *text,
+                              fz_matrix ctm, fz_rect scissor)
+{
+  collect_device *dev = (collect_device *)dev_;
+  dev->clip_depth += 1;
+  fz_clip_text(ctx, dev->residue, text, ctm, scissor);
+}
+
+static void collect_clip_stroke_text(fz_context *ctx, fz_device *dev_, const fz_text *text,
+                                     const fz_stroke_state *stroke, fz_matrix ctm,
+                                     fz_rect scissor)
+{
+  collect_device *dev = (collect_device *)dev_;
+  dev->clip_depth += 1;
+  fz_clip_stroke_text(ctx, dev->residue, text, stroke, ctm, scissor);
+}
+
+static void collect_fill_shade(fz_context *ctx, fz_device *dev_, fz_shade *shade,
+                               fz_matrix ctm, float alpha, fz_color_params cp)
+{
+  collect_device *dev = (collect_device *)dev_;
+  collect_residue(dev, fz_bound_shade(ctx, shade, ctm));
+  fz_fill_shade(ctx, dev->residue, shade, ctm, alpha, cp);
+}
+
+static void collect_fill_image(fz_context *ctx, fz_device *dev_, fz_image *image,
+                               fz_matrix ctm, float alpha, fz_color_params cp)
+{
+  collect_device *dev = (collect_device *)dev_;
+  collect_residue(dev, fz_transform_rect(fz_unit_rect, ctm));
+  fz_fill_image(ctx, dev->residue, image, ctm, alpha, cp);
+}
+
+static void collect_fill_image_mask(fz_context *ctx, fz_device *dev_, fz_image *image,
+                                    fz_matrix ctm, fz_colorspace *cs,
+                                    const float *color, float alpha, fz_color_params cp)
+{
+  collect_device *dev = (collect_device *)dev_;
+  collect_residue(dev, fz_transform_rect(fz_unit_rect, ctm));
+  fz_fill_image_mask(ctx, dev->residue, image, ctm, cs, color, alpha, cp);
+}
+
+static void collect_clip_image_mask(fz_context *ctx, fz_device *dev_, fz_image *image,
+                                    fz_matrix ctm, fz_rect scissor)
+{
+  collect_device *dev = (collect_device *)dev_;
+  dev->clip_depth += 1;
+  fz_clip_image_mask(ctx, dev->residue, image, ctm, scissor);
+}
+
+static void collect_pop_clip(fz_context *ctx, fz_device *dev_)
+{
+  collect_device *dev = (collect_device *)dev_;
+  dev->clip_depth -= 1;
+  fz_pop_clip(ctx, dev->residue);
+}
+
+// Groups and masks apply to all the content they contain: the page
+// cannot be split.
+
+static void collect_begin_mask(fz_context *ctx, fz_device *dev_, fz_rect area,
+                               int luminosity, fz_colorspace *cs, const float *bc,
+                               fz_color_params cp)
+{
+  ((collect_device *)dev_)->unsupported = 1;
+}
+
+static void collect_begin_group(fz_context *ctx, fz_device *dev_, fz_rect area,
+                                fz_colorspace *cs, int isolated, int knockout,
+                                int blendmode, float alpha)
+{
+  ((collect_device *)dev_)->unsupported = 1;
+}
+
+static void collect_close_device(fz_context *ctx, fz_device *dev_)
+{
+  fz_close_device(ctx, ((collect_device *)dev_)->residue);
+}
+
+static void collect_drop_device(fz_context *ctx, fz_device *dev_)
+{
+  collect_device *dev = (collect_device *)dev_;
+  fz_drop_device(ctx, dev->residue);
+  fz_free(ctx, dev->items);
+}
+
+static collect_device *new_collect_device(fz_context *ctx, txp_glyph_page *page,
+                                          fz_display_list *residue)
+{
+  collect_device *dev = fz_new_derived_device(ctx, collect_device);
+
+  dev->super.close_device = collect_close_device;
+  dev->super.drop_device = collect_drop_device;
+  dev->super.fill_path = collect_fill_path;
+  dev->super.stroke_path = collect_stroke_path;
+  dev->super.clip_path = collect_clip_path;
+  dev->super.clip_stroke_path = collect_clip_stroke_path;
+  dev->super.fill_text = collect_fill_text;
+  dev->super.stroke_text = collect_stroke_text;
+  dev->super.clip_text = collect_clip_text;
+  dev->super.clip_stroke_text = collect_clip_stroke_text;
+  dev->super.fill_shade = collect_fill_shade;
+  dev->super.fill_image = collect_fill_image;
+  dev->super.fill_image_mask = collect_fill_image_mask;
+  dev->super.clip_image_mask = collect_clip_image_mask;
+  dev->super.pop_clip = collect_pop_clip;
+  dev->super.begin_mask = collect_begin_mask;
+  dev->super.begin_group = collect_begin_group;
+
+  dev->page = page;
+  dev->items_bounds = fz_empty_rect;
+  fz_try(ctx)
+  {
+    dev->residue = fz_new_list_device(ctx, residue);
+  }
+  fz_catch(ctx)
+  {
+    fz_drop_device(ctx, &dev->super);
+    fz_rethrow(ctx);
+  }
+  return dev;
+}
+
+txp_glyph_page *txp_glyph_page_new(fz_context *ctx, fz_display_list *dl)
+{
+  txp_glyph_page *page = fz_malloc_struct(ctx, txp_glyph_page);
+  collect_device *dev = NULL;
+  bool unsupported = 0;
+  fz_var(dev);
+
+  fz_try(ctx)
+  {
+    page->residue = fz_new_display_list(ctx, fz_bound_display_list(ctx, dl));
+    dev = new_collect_device(ctx, page, page->residue);
+    fz_run_display_list(ctx, dl, &dev->super, fz_identity, fz_infinite_rect, NULL);
+    fz_close_device(ctx, &dev->super);
+    unsupported = dev->unsupported;
+    if (dev->residue_ops == 0)
+    {
+      fz_drop_display_list(ctx, page->residue);
+      page->residue = NULL;
+    }
+  }
+  fz_always(ctx)
+  {
+    if (dev)
+      fz_drop_device(ctx, &dev->super);
+  }
+  fz_catch(ctx)
+  {
+    txp_glyph_page_free(ctx, page);
+    fz_rethrow(ctx);
+  }
+
+  if (unsupported)
+  {
+    txp_glyph_page_free(ctx, page);
+    return NULL;
+  }
+
+  return page;
+}
+
+void txp_glyph_page_free(fz_context *ctx, txp_glyph_page *page)
+{
+  if (!page)
+    return;
+  for (int i = 0; i < page->font_count; ++i)
+    fz_drop_font(ctx, page->fonts[i]);
+  fz_free(ctx, page->fonts);
+  fz_free(ctx, page->glyphs);
+  fz_free(ctx, page->rules);
+  fz_drop_display_list(ctx, page->residue);
+  fz_free(ctx, page);
+}
+
+fz_display_list *txp_glyph_page_residue(txp_glyph_page *page)
+{
+  return page->residue;
+}
+
+// Glyphs are bucketed by size, in quarters of pixels, and by horizontal
+// subpixel phase, in quarters of pixels too. Vertically, glyphs are
+// snapped to the pixel grid so that baselines stay sharp.
+#define SUBPIXEL 4
+
+// Atlas texture: glyphs are packed in shelves, with a 1 pixel gutter to
+// avoid bleeding when the renderer filters.
+// A 4x4 white block at the origin is used to draw rules.
+#define ATLAS_SIZE 1024
+#define WHITE_SIZE 4
+
+// Largest glyph size in pixels and largest glyph bitmap (glyphs can
+// extend beyond their size, e.g. big delimiters)
+#define MAX_GLYPH_SIZE 64
+#define MAX_GLYPH_BITMAP 256
+
+bool txp_glyph_page_fits(txp_glyph_page *page, float scale)
+{
+  return page->max_size * scale <= MAX_GLYPH_SIZE;
+}
+
+// Glyph cache, open addressing.
+// The atlas is reset when either the cache or the texture is full.
+#define CACHE_SIZE 8192
+#define CACHE_LOAD (CACHE_SIZE * 3 / 4)
+
+typedef struct {
+  fz_font *font; // NULL for empty slots
+  int gid;
+  short qa, qd;
+  short phase;
+  // Position in the atlas, size (0 for blank glyphs), offset from origin
+  short x, y, w, h;
+  int dx, dy;
+} atlas_entry;
+
+struct txp_glyph_atlas_s {
+  SDL_Renderer *sdl;
+  SDL_Texture *tex;
+  atlas_entry *entries;
+  int entry_count;
+  int shelf_x, shelf_y, shelf_h;
+  fz_buffer *scratch;
+
+  // Pending quads
+  SDL_Vertex *vertices;
+  int vertex_count, vertex_cap;
+  int *indices;
+  int index_count, index_cap;
+};
+
+static void atlas_reset(fz_context *ctx, txp_glyph_atlas *atlas)
+{
+  for (int i = 0; i < CACHE_SIZE; ++i)
+    if (atlas->entries[i].font)
+      fz_drop_font(ctx, atlas->entries[i].font);
+  memset(atlas->entries, 0, sizeof(atlas_entry) * CACHE_SIZE);
+  atlas->entry_count = 0;
+
+  uint8_t white[WHITE_SIZE * WHITE_SIZE * 4];
+  memset(white, 255, sizeof(white));
+  SDL_Rect r = {.x = 0, .y = 0, .w = WHITE_SIZE, .h = WHITE_SIZE};
+  SDL_UpdateTexture(atlas->tex, &r, white, WHITE_SIZE * 4);
+
+  atlas->shelf_x = WHITE_SIZE + 1;
+  atlas->shelf_y = 0;
+  atlas->shelf_h = WHITE_SIZE + 1;
+}
+
+size_t txp_glyph_atlas_memory(txp_glyph_atlas *atlas)
+{
+  if (!atlas)
+    return 0;
+  return (size_t)ATLAS_SIZE * ATLAS_SIZE * 4 +
+         CACHE_SIZE * sizeof(atlas_entry) +
+         (atlas->scratch ? atlas->scratch->cap : 0) +
+         (size_t)atlas->vertex_cap * sizeof(SDL_Vertex) +
+         (size_t)atlas->index_cap * sizeof(int);
+}
+
+txp_glyph_atlas *txp_glyph_atlas_new(fz_context *ctx, SDL_Renderer *sdl)
+{
+  SDL_Texture *tex =
+    SDL_CreateTexture(sdl, SDL_PIXELFORMAT_RGBA32, SDL_TEXTUREACCESS_STATIC,
+                      ATLAS_SIZE, ATLAS_SIZE);
+  if (!tex)
+  {
+    fprintf(stderr, "[atlas] cannot create texture: %s\n", SDL_GetError());
+    return NULL;
+  }
+  SDL_SetTextureBlendMode(tex, SDL_BLENDMODE_BLEND);
+
+  txp_glyph_atlas *atlas = NULL;
+  fz_var(atlas);
+  fz_try(ctx)
+  {
+    atlas = fz_malloc_struct(ctx, txp_glyph_atlas);
+    atlas->sdl = sdl;
+    atlas->tex = tex;
+    atlas->entries = fz_malloc_struct_array(ctx, CACHE_SIZE, atlas_entry);
+    atlas->scratch = fz_new_buffer(ctx, MAX_GLYPH_BITMAP * MAX_GLYPH_BITMAP * 4);
+  }
+  fz_catch(ctx)
+  {
+    if (atlas)
+    {
+      fz_free(ctx, atlas->entries);
+      fz_free(ctx, atlas);
+    }
+    SDL_DestroyTexture(tex);
+    fz_rethrow(ctx);
+  }
+
+  atlas_reset(ctx, atlas);
+  return atlas;
+}
+
+void txp_glyph_atlas_free(fz_context *ctx, txp_glyph_atlas *atlas)
+{
+  if (!atlas)
+    return;
+  for (int i = 0; i < CACHE_SIZE; ++i)
+    if (atlas->entries[i].font)
+      fz_drop_font(ctx, atlas->entries[i].font);
+  fz_free(ctx, atlas->entries);
+  fz_drop_buffer(ctx, atlas->scratch);
+  fz_free(ctx, atlas->vertices);
+  fz_free(ctx, atlas->indices);
+  SDL_DestroyTexture(atlas->tex);
+  fz_free(ctx, atlas);
+}
+
+static unsigned entry_hash(fz_font *font, int gid, int qa, int qd, int phase)
+{
+  uintptr_t h = (uintptr_t)font >> 4;
+  h = h * 31 + gid;
+  h = h * 31 + (unsigned)qa;
+  h = h * 31 + (unsigned)qd;
+  h = h * 31 + phase;
+  return (h * 2654435761u) >> 7;
+}
+
+// Place a w x h bitmap in the atlas, false if the texture is full
+static bool atlas_place(txp_glyph_atlas *atlas, int w, int h, int *x, int *y)
+{
+  if (atlas->shelf_x + w > ATLAS_SIZE)
+  {
+    atlas->shelf_y += atlas->shelf_h;
+    atlas->shelf_x = 0;
+    atlas->shelf_h = 0;
+  }
+  if (atlas->shelf_y + h > ATLAS_SIZE)
+    return 0;
+  *x = atlas->shelf_x;
+  *y = atlas->shelf_y;
+  atlas->shelf_x += w + 1;
+  atlas->shelf_h = fz_maxi(atlas->shelf_h, h + 1);
+  return 1;
+}
+
+// Find or rasterize a glyph. NULL if the atlas is full.
+static atlas_entry *atlas_glyph(fz_context *ctx, txp_glyph_atlas *atlas,
+                                fz_font *font, int gid, int qa, int qd, int phase)
+{
+  unsigned i = entry_hash(font, gid, qa, qd, phase) & (CACHE_SIZE - 1);
+  atlas_entry *e;
+  while ((e = &atlas->entries[i])->font)
+  {
+    if (e->font == font && e->gid == gid && e->qa == qa && e->qd == qd &&
+        e->phase == phase)
+      return e;
+    i = (i + 1) & (CACHE_SIZE - 1);
+  }
+
+  if (atlas->entry_count >= CACHE_LOAD)
+    return NULL;
+
+  fz_matrix m = {qa / (float)SUBPIXEL, 0, 0, qd / (float)SUBPIXEL,
+                 phase / (float)SUBPIXEL, 0};
+  fz_pixmap *pix = fz_render_glyph_pixmap(ctx, font, gid, &m, NULL, fz_aa_level(ctx));
+
+  int x = 0, y = 0, w = 0, h = 0, dx = 0, dy = 0;
+  if (pix)
+  {
+    w = fz_pixmap_width(ctx, pix);
+    h = fz_pixmap_height(ctx, pix);
+    dx = fz_pixmap_x(ctx, pix);
+    dy = fz_pixmap_y(ctx, pix);
+    if (w > MAX_GLYPH_BITMAP || h > MAX_GLYPH_BITMAP)
+      w = h = 0;
+  }
+
+  if (w > 0 && h > 0)
+  {
+    if (!atlas_place(atlas, w, h, &x, &y))
+    {
+      fz_drop_pixmap(ctx, pix);
+      return NULL;
+    }
+
+    // Glyph pixmaps only have an alpha channel
+    const uint8_t *src = fz_pixmap_samples(ctx, pix);
+    int stride = fz_pixmap_stride(ctx, pix);
+    uint8_t *dst = atlas->scratch->data;
+    for (int row = 0; row < h; ++row, src += stride)
+      for (int col = 0; col < w; ++col, dst += 4)
+      {
+        dst[0] = dst[1] = dst[2] = 255;
+        dst[3] = src[col];
+      }
+
+    SDL_Rect r = {.x = x, .y = y, .w = w, .h = h};
+    SDL_UpdateTexture(atlas->tex, &r, atlas->scratch->data, w * 4);
+  }
+  else
+    w = h = 0;
+
+  fz_drop_pixmap(ctx, pix);
+
+  *e = (atlas_entry){
+    .font = fz_keep_font(ctx, font),
+    .gid = gid, .qa = qa, .qd = qd, .phase = phase,
+    .x = x, .y = y, .w = w, .h = h, .dx = dx, .dy = dy,
+  };
+  atlas->entry_count += 1;
+  return e;
+}
+
+static void push_quad(fz_context *ctx, txp_glyph_atlas *atlas, SDL_FRect dst,
+                      SDL_FRect src, SDL_Color color)
+{
+  if (atlas->vertex_count + 4 > atlas->vertex_cap)
+  {
+    int cap = atlas->vertex_cap ? atlas->vertex_cap * 2 : 4096;
+    atlas->vertices = fz_realloc_array(ctx, atlas->vertices, cap, SDL_Vertex);
+    atlas->vertex_cap = cap;
+  }
+  if (atlas->index_count + 6 > atlas->index_cap)
+  {
+    int cap = atlas->index_cap ? atlas->index_cap * 2 : 6144;
+    atlas->indices = fz_realloc_array(ctx, atlas->indices, cap, int);
+    atlas->index_cap = cap;
+  }
+
+  float u0 = src.x / ATLAS_SIZE, v0 = src.y / ATLAS_SIZE;
+  float u1 = (src.x + src.w) / ATLAS_SIZE, v1 = (src.y + src.h) / ATLAS_SIZE;
+
+  int base = atlas->vertex_count;
+  SDL_Vertex *v = atlas->vertices + base;
+  v[0] = (SDL_Vertex){{dst.x, dst.y}, color, {u0, v0}};
+  v[1] = (SDL_Vertex){{dst.x + dst.w, dst.y}, color, {u1, v0}};
+  v[2] = (SDL_Vertex){{dst.x + dst.w, dst.y + dst.h}, color, {u1, v1}};
+  v[3] = (SDL_Vertex){{dst.x, dst.y + dst.h}, color, {u0, v1}};
+  atlas->vertex_count += 4;
+
+  int *i = atlas->indices + atlas->index_count;
+  i[0] = base; i[1] = base + 1; i[2] = base + 2;
+  i[3] = base; i[4] = base + 2; i[5] = base + 3;
+  atlas->index_count += 6;
+}
+
+static void flush_quads(txp_glyph_atlas *atlas)
+{
+  if (atlas->index_count > 0)
+    SDL_RenderGeometry(atlas->sdl, atlas->tex, atlas->vertices,
+                       atlas->vertex_count, atlas->indices, atlas->index_count);
+  atlas->vertex_count = 0;
+  atlas->index_count = 0;
+}
+
+// Same mapping as invert_pixmap in renderer.c
+static SDL_Color remap_color(const uint8_t rgb[3], uint32_t fg, uint32_t bg)
+{
+  uint8_t out[3];
+  for (int i = 0; i < 3; ++i)
+  {
+    int shift = 16 - i * 8;
+    int dark = (fg >> shift) & 0xFF, light = (bg >> shift) & 0xFF;
+    out[i] = dark + (rgb[i] * (light - dark)) / 255;
+  }
+  return (SDL_Color){out[0], out[1], out[2], 255};
+}
+
+static void draw_rule(fz_context *ctx, txp_glyph_atlas *atlas, rule_t *r,
+                      fz_point translate, float scale, int ow, int oh,
+                      uint32_t fg, uint32_t bg)
+{
+  const SDL_FRect white = {WHITE_SIZE / 2.0f, WHITE_SIZE / 2.0f, 0, 0};
+  SDL_FRect dst = {
+    translate.x + r->rect.x0 * scale,
+    translate.y + r->rect.y0 * scale,
+    (r->rect.x1 - r->rect.x0) * scale,
+    (r->rect.y1 - r->rect.y0) * scale,
+  };
+  if (dst.x > ow || dst.y > oh || dst.x + dst.w < 0 || dst.y + dst.h < 0)
+    return;
+  // Like the rasterizer, thin rules are at least one pixel wide
+  dst.w = fz_max(dst.w, 1);
+  dst.h = fz_max(dst.h, 1);
+  push_quad(ctx, atlas, dst, white, remap_color(r->rgb, fg, bg));
+}
+
+void txp_glyph_atlas_draw(fz_context *ctx, txp_glyph_atlas *atlas,
+                          txp_glyph_page *page, fz_point translate, float scale,
+                          uint32_t fg, uint32_t bg)
+{
+  int ow, oh;
+  SDL_GetRendererOutputSize(atlas->sdl, &ow, &oh);
+  float margin = MAX_GLYPH_BITMAP;
+
+  // Rules are interleaved with glyphs, in painting order
+  int next_rule = 0;
+  for (int i = 0; i <= page->glyph_count; ++i)
+  {
+    while (next_rule < page->rule_count && page->rules[next_rule].glyphs_before <= i)
+      draw_rule(ctx, atlas, &page->rules[next_rule++], translate, scale,
+                ow, oh, fg, bg);
+    if (i == page->glyph_count)
+      break;
+
+    glyph_t *g = &page->glyphs[i];
+    float x = translate.x + g->p.x * scale;
+    float y = translate.y + g->p.y * scale;
+    if (x < -margin || y < -margin || x > ow + margin || y > oh + margin)
+      continue;
+
+    float ix = floorf(x);
+    int phase = (int)((x - ix) * SUBPIXEL) % SUBPIXEL;
+    float iy = floorf(y + 0.5f);
+    int qa = lrintf(g->a * scale * SUBPIXEL);
+    int qd = lrintf(g->d * scale * SUBPIXEL);
+    fz_font *font = page->fonts[g->font];
+
+    atlas_entry *e = atlas_glyph(ctx, atlas, font, g->gid, qa, qd, phase);
+    if (!e)
+    {
+      // Draw what is queued before reusing the texture
+      flush_quads(atlas);
+      atlas_reset(ctx, atlas);
+      e = atlas_glyph(ctx, atlas, font, g->gid, qa, qd, phase);
+      if (!e)
+        continue;
+    }
+    if (e->w == 0)
+      continue;
+
+    SDL_FRect dst = {ix + e->dx, iy + e->dy, e->w, e->h};
+    SDL_FRect src = {e->x, e->y, e->w, e->h};
+    push_quad(ctx, atlas, dst, src, remap_color(g->rgb, fg, bg));
+  }
+
+  flush_quads(atlas);
+}
@@ -0,0 +1,71 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2023 Frédéric Bour <frederic.bour@lakaban.net>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#ifndef GLYPHATLAS_H_
+#define GLYPHATLAS_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <SDL2/SDL.h>
+#include <mupdf/fitz/context.h>
+#include <mupdf/fitz/display-list.h>
+
+// Compositing render path for text.
+//
+// The display list of a page is walked once to collect positioned glyphs
+// and rules. Other content (images, paths, clipped text, ...) is kept in a
+// residual display list that still goes through the pixmap path.
+// Each distinct glyph (font, glyph id, subpixel phase, size bucket) is
+// rasterized once into an atlas texture, and pages are drawn with batched
+// SDL_RenderGeometry quads: panning only composites.
+
+typedef struct txp_glyph_page_s txp_glyph_page;
+typedef struct txp_glyph_atlas_s txp_glyph_atlas;
+
+// Collect the glyphs and rules of a display list.
+// NULL if the page cannot be split and should be rendered as a pixmap:
+// it uses transparency groups or soft masks, or residual content is
+// painted over a glyph or a rule (the residue is drawn below them).
+txp_glyph_page *txp_glyph_page_new(fz_context *ctx, fz_display_list *dl);
+void txp_glyph_page_free(fz_context *ctx, txp_glyph_page *page);
+
+// Content that is neither a glyph nor a rule, NULL if there is none
+fz_display_list *txp_glyph_page_residue(txp_glyph_page *page);
+
+// Whether the glyphs are small enough for the atlas at this scale
+bool txp_glyph_page_fits(txp_glyph_page *page, float scale);
+
+txp_glyph_atlas *txp_glyph_atlas_new(fz_context *ctx, SDL_Renderer *sdl);
+void txp_glyph_atlas_free(fz_context *ctx, txp_glyph_atlas *atlas);
+// Bytes used by the atlas texture and the glyph cache
+size_t txp_glyph_atlas_memory(txp_glyph_atlas *atlas);
+
+// Draw the glyphs and rules of a page. A point p of the document is drawn
+// at translate + p * scale. Colors are remapped like the pixmap path:
+// black becomes fg and white becomes bg (0xRRGGBB).
+void txp_glyph_atlas_draw(fz_context *ctx, txp_glyph_atlas *atlas,
+                          txp_glyph_page *page, fz_point translate, float scale,
+                          uint32_t fg, uint32_t bg);
+
+#endif // GLYPHATLAS_H_
@@ -29,13 +29,25 @@
 #include "mydvi_interp.h"
 #include "mydvi_opcodes.h"
 
+// Font definitions and specials, which have to be interpreted before
+// rendering any page that follows them
+typedef struct {
+  int offset, len;
+} def_t;
+
 struct incdvi_s
 {
   int offset;
-  int fontdef_offset;
   int page_len, page_cap;
   int *pages;
+  // Definitions found so far, in order, and how many were interpreted
+  int def_len, def_cap, def_done;
+  def_t *defs;
+  // Complete pages that were not rolled back since incdvi_mark_pages
+  int unchanged_pages;
   dvi_context *dc;
+  // Holds instructions that cross a chunk boundary
+  fz_buffer *scratch;
 };
 
 static int add_page(fz_context *ctx, incdvi_t *d)
@@ -61,10 +73,22 @@ static int add_page(fz_context *ctx, incdvi_t *d)
   return result;
 }
 
-incdvi_t *incdvi_new(fz_context *ctx, const char *tectonic_path, const char *document_directory)
+static void add_def(fz_context *ctx, incdvi_t *d, int offset, int len)
+{
+  if (d->def_len == d->def_cap)
+  {
+    int cap = d->def_cap ? d->def_cap * 2 : 64;
+    d->defs = fz_realloc_array(ctx, d->defs, cap, def_t);
+    d->def_cap = cap;
+  }
+  d->defs[d->def_len++] = (def_t){.offset = offset, .len = len};
+}
+
+incdvi_t *incdvi_new(fz_context *ctx, dvi_resmanager *rm, const char *document_directory)
 {
   incdvi_t *d = fz_malloc_struct(ctx, incdvi_t);
-  d->dc = dvi_context_new(ctx, dvi_bundle_serve_hooks(ctx, tectonic_path, document_directory));
+  d->dc = dvi_context_new(ctx, rm, document_directory);
+  d->scratch = fz_new_buffer(ctx, 1024);
   return d;
 }
 
@@ -72,18 +96,132 @@ void incdvi_free(fz_context *ctx, incdvi_t *d)
 {
   if (d->pages)
     fz_free(ctx, d->pages);
+  fz_free(ctx, d->defs);
   dvi_context_free(ctx, d->dc);
+  fz_drop_buffer(ctx, d->scratch);
   fz_free(ctx, d);
 }
 
 void incdvi_reset(incdvi_t *d)
 {
   d->offset = 0;
-  d->fontdef_offset = 0;
   d->page_len = 0;
+  d->def_len = 0;
+  d->def_done = 0;
+  d->unchanged_pages = 0;
+}
+
+// Size of the instruction at offset, looking at no more than lim - offset
+// bytes. Same result as dvi_instr_size on a contiguous buffer.
+static int instr_size(fz_context *ctx, incdvi_t *d, chunkbuf_t *buf,
+                      int offset, int lim, enum dvi_version version)
+{
+  int avail;
+  const uint8_t *ptr = chunkbuf_at(buf, offset, &avail);
+  if (avail > lim - offset)
+    avail = lim - offset;
+  int ilen = dvi_instr_size(ptr, avail, version);
+
+  // The header of the instruction crosses a chunk boundary
+  while (ilen < 0 && -ilen > avail && -ilen <= lim - offset)
+  {
+    avail = -ilen;
+    ptr = chunkbuf_span(ctx, buf, offset, avail, d->scratch);
+    ilen = dvi_instr_size(ptr, avail, version);
+  }
+
+  return ilen;
 }
 
-void incdvi_update(fz_context *ctx, incdvi_t *d, fz_buffer *buf)
+static const uint8_t *instr_data(fz_context *ctx, incdvi_t *d, chunkbuf_t *buf,
+                                 int offset, int ilen)
+{
+  return chunkbuf_span(ctx, buf, offset, ilen, d->scratch);
+}
+
+// Length of the instructions that can be skipped without decoding their
+// operands, 0 for the others: variable length, or needing bookkeeping
+// (pages, definitions and specials).
+#define ONES8 1, 1, 1, 1, 1, 1, 1, 1
+#define ONES64 ONES8, ONES8, ONES8, ONES8, ONES8, ONES8, ONES8, ONES8
+#define SIZES(OP) [OP##1] = 2, [OP##2] = 3, [OP##3] = 4, [OP##4] = 5
+
+static const uint8_t op_length[256] = {
+  [SET_CHAR_0] = ONES64, ONES64,
+  [FNT_NUM_0] = ONES64,
+  SIZES(SET), SIZES(PUT), SIZES(RIGHT), SIZES(DOWN), SIZES(FNT),
+  SIZES(W), SIZES(X), SIZES(Y), SIZES(Z),
+  [SET_RULE] = 9, [PUT_RULE] = 9,
+  [NOP] = 1, [PUSH] = 1, [POP] = 1,
+  [W0] = 1, [X0] = 1, [Y0] = 1, [Z0] = 1,
+  [BEGIN_REFLECT] = 1, [END_REFLECT] = 1,
+};
+
+#undef ONES8
+#undef ONES64
+#undef SIZES
+
+// Find pages, definitions and specials in [d->offset, len).
+// Runs of fixed-length instructions are skipped with the table, other
+// instructions are decoded (XDV glyph arrays are skipped at once).
+static void scan(fz_context *ctx, incdvi_t *d, chunkbuf_t *buf, int len)
+{
+  enum dvi_version version = dvi_context_state(d->dc)->version;
+  int offset = d->offset;
+
+  while (offset < len)
+  {
+    int avail;
+    const uint8_t *ptr = chunkbuf_at(buf, offset, &avail);
+    if (avail > len - offset)
+      avail = len - offset;
+
+    const uint8_t *cur = ptr, *end = ptr + avail;
+    int l = 0;
+    while (cur < end && (l = op_length[*cur]) && l <= end - cur)
+      cur += l;
+    offset += cur - ptr;
+    if (cur == end)
+      continue;
+
+    if (l > 0)
+    {
+      // A fixed-length instruction crosses a chunk boundary, or is not
+      // completely written yet: leave it for the next scan
+      if (l > len - offset)
+        break;
+      offset += l;
+      continue;
+    }
+
+    int ilen = instr_size(ctx, d, buf, offset, len, version);
+    if (ilen <= 0)
+      break;
+
+    uint8_t op = *cur;
+    if (op == BOP || op == EOP)
+    {
+      int page = add_page(ctx, d);
+      if (!(page & 1) != (op == BOP))
+        abort();
+      d->pages[page] = offset;
+    }
+    else if (op >= XXX1 && op <= XXX4)
+    {
+      add_def(ctx, d, offset, ilen);
+      if (offset + ilen <= len)
+        // Give a chance to decode images before the page is displayed
+        dvi_interp_prefetch(ctx, d->dc, instr_data(ctx, d, buf, offset, ilen), ilen);
+    }
+    else if (dvi_is_fontdef(op))
+      add_def(ctx, d, offset, ilen);
+    offset += ilen;
+  }
+
+  d->offset = offset;
+}
+
+void incdvi_update(fz_context *ctx, incdvi_t *d, chunkbuf_t *buf)
 {
   if (buf == NULL)
   {
@@ -104,40 +242,32 @@ void incdvi_update(fz_context *ctx, incdvi_t *d, fz_buffer *buf)
       d->page_len -= 1;
       d->offset = d->pages[d->page_len];
     }
+    if (d->unchanged_pages > d->page_len / 2)
+      d->unchanged_pages = d->page_len / 2;
   }
 
   if (d->offset == 0)
   {
     if (d->page_len != 0) abort();
-    int plen = dvi_preamble_size(buf->data, len);
+    // The preamble is shorter than a chunk
+    int avail;
+    const uint8_t *pre = chunkbuf_at(buf, 0, &avail);
+    int plen = dvi_preamble_size(pre, avail);
     if (plen > 0)
     {
-      if (dvi_preamble_parse(ctx, d->dc, dvi_context_state(d->dc), buf->data))
+      if (dvi_preamble_parse(ctx, d->dc, dvi_context_state(d->dc), pre))
         d->offset = plen;
     }
   }
 
   if (d->offset > 0)
-  {
-    enum dvi_version version = dvi_context_state(d->dc)->version;
-    while (d->offset < len)
-    {
-      int ilen = dvi_instr_size(buf->data + d->offset, len - d->offset, version);
-      if (ilen <= 0)
-        break;
-      if (buf->data[d->offset] == BOP || buf->data[d->offset] == EOP)
-      {
-        int page = add_page(ctx, d);
-        if (!(page & 1) != (buf->data[d->offset] == BOP))
-          abort();
-        d->pages[page] = d->offset;
-      }
-      d->offset += ilen;
-    }
-  }
+    scan(ctx, d, buf, len);
 
-  if (d->fontdef_offset > d->offset)
-    d->fontdef_offset = d->offset;
+  // Forget the definitions that will be scanned again
+  while (d->def_len > 0 && d->defs[d->def_len - 1].offset >= d->offset)
+    d->def_len -= 1;
+  if (d->def_done > d->def_len)
+    d->def_done = d->def_len;
 }
 
 int incdvi_page_count(incdvi_t *d)
@@ -145,37 +275,59 @@ int incdvi_page_count(incdvi_t *d)
   return (d->page_len / 2);
 }
 
-static void incdvi_parse_fontdef(fz_context *ctx, incdvi_t *restrict d, fz_buffer *buf, int offset)
+int incdvi_unchanged_pages(incdvi_t *d)
+{
+  return d->unchanged_pages;
+}
+
+void incdvi_mark_pages(incdvi_t *d)
+{
+  d->unchanged_pages = d->page_len / 2;
+}
+
+static void incdvi_parse_fontdef(fz_context *ctx, incdvi_t *restrict d, chunkbuf_t *buf, int offset)
 {
   if (offset > buf->len) abort();
-  enum dvi_version version = dvi_context_state(d->dc)->version;
-  while (d->fontdef_offset < offset)
+  while (d->def_done < d->def_len)
   {
-    int ilen = dvi_instr_size(
-        buf->data + d->fontdef_offset,
-        offset - d->fontdef_offset,
-        version
-        );
-    if (ilen <= 0)
+    def_t *def = &d->defs[d->def_done];
+    if (def->offset + def->len > offset)
       break;
-    if (buf->data[d->fontdef_offset] >= XXX1 && buf->data[d->fontdef_offset] <= XXX4)
-      dvi_interp_init(ctx, d->dc, buf->data + d->fontdef_offset, offset - d->fontdef_offset);
-    if (dvi_is_fontdef(buf->data[d->fontdef_offset]))
-    {
-      dvi_interp(ctx, d->dc, buf->data + d->fontdef_offset);
-    }
-    d->fontdef_offset += ilen;
+    const uint8_t *ptr = instr_data(ctx, d, buf, def->offset, def->len);
+    if (*ptr >= XXX1 && *ptr <= XXX4)
+      dvi_interp_init(ctx, d->dc, ptr, def->len);
+    else
+      dvi_interp(ctx, d->dc, ptr);
+    d->def_done += 1;
   }
 }
 
-void incdvi_page_dim(incdvi_t *d, fz_buffer *buf, int page, float *width, float *height, bool *landscape)
+void incdvi_page_dim(fz_context *ctx, incdvi_t *d, chunkbuf_t *buf, int page, float *width, float *height, bool *landscape)
 {
   bool _landscape;
   if (!landscape) landscape = &_landscape;
   *landscape = 0;
   if (page < 0 || page >= incdvi_page_count(d)) abort();
   int bop = d->pages[page * 2];
-  if (dvi_interp_bop(buf->data + bop, buf->len - bop, width, height, landscape) <= 0)
+  int eop = d->pages[page * 2 + 1];
+
+  // The dimensions are given by the specials following the BOP
+  enum dvi_version version = dvi_context_state(d->dc)->version;
+  int lim = bop;
+  while (lim < eop)
+  {
+    int avail;
+    uint8_t op = *chunkbuf_at(buf, lim, &avail);
+    if (lim > bop && !(op >= XXX1 && op <= XXX4) && op != PUSH && op != POP)
+      break;
+    int ilen = instr_size(ctx, d, buf, lim, eop, version);
+    if (ilen <= 0 || lim + ilen > eop)
+      break;
+    lim += ilen;
+  }
+
+  const uint8_t *ptr = instr_data(ctx, d, buf, bop, lim - bop);
+  if (dvi_interp_bop(ptr, lim - bop, width, height, landscape) <= 0)
     abort();
   if (*landscape)
   {
@@ -185,7 +337,12 @@ void incdvi_page_dim(incdvi_t *d, fz_buffer *buf, int page, float *width, float
   }
 }
 
-void incdvi_render_page(fz_context *ctx, incdvi_t *d, fz_buffer *buf, int page, fz_device *dev)
+void incdvi_render_page(fz_context *ctx, incdvi_t *d, chunkbuf_t *buf, int page, fz_device *dev)
+{
+  incdvi_render_page_area(ctx, d, buf, page, dev, fz_infinite_rect);
+}
+
+bool incdvi_render_page_area(fz_context *ctx, incdvi_t *d, chunkbuf_t *buf, int page, fz_device *dev, fz_rect area)
 {
   if (page < 0 || page >= incdvi_page_count(d)) abort();
   int offset = d->pages[page * 2];
@@ -194,15 +351,19 @@ void incdvi_render_page(fz_context *ctx, incdvi_t *d, fz_buffer *buf, int page,
 
   dvi_context *dc = d->dc;
   enum dvi_version version = dvi_context_state(dc)->version;
+  dvi_context_set_cull(dc, area);
   dvi_context_begin_frame(ctx, d->dc, dev);
   while (offset < eop)
   {
-    int ilen = dvi_instr_size(buf->data + offset, eop - offset, version);
+    int ilen = instr_size(ctx, d, buf, offset, eop, version);
     if (ilen <= 0) abort();
-    dvi_interp(ctx, dc, buf->data + offset);
+    dvi_interp(ctx, dc, instr_data(ctx, d, buf, offset, ilen));
     offset += ilen;
   }
+  bool complete = !dc->culled;
   dvi_context_end_frame(ctx, dc);
+  dvi_context_set_cull(dc, fz_infinite_rect);
+  return complete;
 }
 
 float incdvi_tex_scale_factor(incdvi_t *d)
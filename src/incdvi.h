@@ -28,17 +28,26 @@
 #include <mupdf/fitz/buffer.h>
 #include <mupdf/fitz/device.h>
 #include <stdbool.h>
+#include "mydvi.h"
+#include "chunkbuf.h"
 
 typedef struct incdvi_s incdvi_t;
 
-incdvi_t *incdvi_new(fz_context *ctx, const char *tectonic_path, const char *document_directory);
+incdvi_t *incdvi_new(fz_context *ctx, dvi_resmanager *rm, const char *document_directory);
 void incdvi_free(fz_context *ctx, incdvi_t *d);
 void incdvi_reset(incdvi_t *d);
-void incdvi_update(fz_context *ctx, incdvi_t *d, fz_buffer *buf);
+void incdvi_update(fz_context *ctx, incdvi_t *d, chunkbuf_t *buf);
 int incdvi_page_count(incdvi_t *d);
-void incdvi_page_dim(incdvi_t *d, fz_buffer *buf, int page, float *width, float *height, bool *landscape);
-void incdvi_render_page(fz_context *ctx, incdvi_t *d, fz_buffer *buf, int page, fz_device *dev);
-void incdvi_find_page_loc(fz_context *ctx, incdvi_t *d, fz_buffer *buf, int page);
+// Number of pages that were not rolled back since the last call to
+// incdvi_mark_pages: their contents did not change.
+int incdvi_unchanged_pages(incdvi_t *d);
+void incdvi_mark_pages(incdvi_t *d);
+void incdvi_page_dim(fz_context *ctx, incdvi_t *d, chunkbuf_t *buf, int page, float *width, float *height, bool *landscape);
+void incdvi_render_page(fz_context *ctx, incdvi_t *d, chunkbuf_t *buf, int page, fz_device *dev);
+// Only emit what intersects area (in page coordinates).
+// Returns false if some contents have been skipped.
+bool incdvi_render_page_area(fz_context *ctx, incdvi_t *d, chunkbuf_t *buf, int page, fz_device *dev, fz_rect area);
+void incdvi_find_page_loc(fz_context *ctx, incdvi_t *d, chunkbuf_t *buf, int page);
 float incdvi_tex_scale_factor(incdvi_t *d);
 
 #endif /*!INCDVI_H*/
@@ -29,6 +29,8 @@
 #include <stdio.h>
 #include <unistd.h>
 #include <errno.h>
+#include <limits.h>
+#include <stdlib.h>
 #include "incdvi.h"
 #include "renderer.h"
 #include "sprotocol.h"
@@ -39,6 +41,11 @@
 #include "vstack.h"
 #include "prot_parser.h"
 #include "editor.h"
+#include "fbexport.h"
+#include "viewserver.h"
+#include "pdfexport.h"
+#include "membudget.h"
+#include "renderpool.h"
 
 struct persistent_state *pstate;
 
@@ -47,11 +54,59 @@ static void schedule_event(enum custom_events ev)
   pstate->schedule_event(ev);
 }
 
+static void schedule_render(void)
+{
+  schedule_event(RENDER_EVENT);
+}
+
+static void schedule_helper(void)
+{
+  schedule_event(HELPER_EVENT);
+}
+
 static bool should_reload_binary(void)
 {
   return pstate->should_reload_binary();
 }
 
+// With -v, report how long the steps of the first startup took
+static Uint32 startup_last;
+static bool startup_done;
+
+static void startup_mark(struct persistent_state *ps, const char *step)
+{
+  if (!ps->verbose || ps->initial.initialized || startup_done)
+    return;
+  Uint32 now = SDL_GetTicks();
+  fprintf(stderr, "[startup] %-16s %5ums (+%ums)\n",
+          step, now - ps->start_ticks, now - startup_last);
+  startup_last = now;
+}
+
+// While the window is created, a thread answers the queries of TeX until
+// the page to display is typeset. The engine and the context are used by
+// this thread only, until it is stopped.
+struct startup_stepper
+{
+  txp_engine *eng;
+  fz_context *ctx;
+  int page;
+  SDL_atomic_t stop;
+};
+
+static int SDLCALL startup_stepper_main(void *data)
+{
+  struct startup_stepper *s = data;
+  while (!SDL_AtomicGet(&s->stop) &&
+         send(get_status, s->eng) == DOC_RUNNING &&
+         send(page_count, s->eng) <= s->page)
+  {
+    if (!send(step, s->eng, s->ctx, false))
+      break;
+  }
+  return 0;
+}
+
 #ifdef __APPLE__
 # define st_time(a) st_##a##timespec
 #else
@@ -91,8 +146,35 @@ static void find_tectonic(char tectonic_path[4096], const char *exec_path)
   }
 }
 
+static void find_render_helper(char helper_path[4096], const char *exec_path)
+{
+  strcpy(helper_path, exec_path);
+  char *basename = NULL;
+  for (int i = 0; i < 4096 && helper_path[i]; ++i)
+    if (helper_path[i] == '/')
+      basename = helper_path + i + 1;
+  if (basename)
+  {
+    strcpy(basename, "texpresso-render");
+    if (access(helper_path, X_OK) != 0)
+      strcpy(helper_path, "texpresso-render");
+  }
+}
+
 /* UI state */
 
+#define MAX_DOCUMENTS 16
+
+// A document hosted by this process, identified by its root file
+struct ui_document {
+  char *path, *name;
+  txp_engine *eng;
+  int page;
+  int need_synctex;
+  // PDF kept up to date by export-pdf, NULL until the first export
+  txp_pdfexport *pdfexport;
+};
+
 enum ui_mouse_status {
   UI_MOUSE_NONE,
   UI_MOUSE_SELECT,
@@ -102,6 +184,26 @@ enum ui_mouse_status {
 typedef struct {
   txp_engine *eng;
   txp_renderer *doc_renderer;
+  txp_worker *worker;
+  // Frames shared with the editor (-framebuffer), can be NULL
+  txp_fbexport *fbexport;
+  // View of the last exported frame, unchanged views are not exported again
+  struct {
+    unsigned version;
+    int w, h;
+    fz_point translate;
+    float scale;
+    bool themed_color, invert_color;
+    uint32_t background_color, foreground_color;
+  } exported;
+  // Viewers sharing the current page (-serve), can be NULL
+  txp_viewserver *viewserver;
+  // Helper processes rendering pages (-render-helpers), can be NULL
+  txp_render_pool *render_pool;
+  // Last page requested from the helpers and last one displayed.
+  // Pages are requested at the scale of the screen.
+  uint32_t helper_requested, helper_shown;
+  float helper_scale;
   SDL_Renderer *sdl_renderer;
   SDL_Window *window;
 
@@ -114,6 +216,24 @@ typedef struct {
   uint32_t last_click_ticks;
   enum ui_mouse_status mouse_status;
   bool advancing;
+
+  // Window is hidden or minimized: nothing is rendered and the engine is
+  // not advanced until it becomes visible again
+  bool hidden;
+
+  // Only the visible area of the page has been interpreted so far
+  bool partial_page;
+
+  // Documents hosted by this process.
+  // eng, page and need_synctex mirror the fields of the active document.
+  struct ui_document documents[MAX_DOCUMENTS];
+  int document_count, active_document;
+  bool document_switched;
+  const char *doc_path;
+
+  // Resources shared by the engines of all documents
+  const char *tectonic_path, *inclusion_path;
+  dvi_resmanager *resmanager;
 } ui_state;
 
 /* UI rendering */
@@ -123,12 +243,64 @@ static float zoom_factor(int count)
   return expf((float)count / 5000.0f);
 }
 
+static void export_frame(fz_context *ctx, ui_state *ui)
+{
+  int w, h, stride;
+  fz_point translate;
+  float scale;
+  txp_renderer_screen_size(ctx, ui->doc_renderer, &w, &h);
+  if (!txp_renderer_page_position(ctx, ui->doc_renderer, NULL, &translate, &scale))
+    return;
+
+  // Rasterizing the whole view is expensive: skip frames that would be
+  // identical to the previous one
+  txp_renderer_config *config = txp_renderer_get_config(ctx, ui->doc_renderer);
+  unsigned version = txp_renderer_contents_version(ui->doc_renderer);
+  if (ui->exported.version == version &&
+      ui->exported.w == w && ui->exported.h == h &&
+      ui->exported.translate.x == translate.x &&
+      ui->exported.translate.y == translate.y &&
+      ui->exported.scale == scale &&
+      ui->exported.themed_color == config->themed_color &&
+      ui->exported.invert_color == config->invert_color &&
+      ui->exported.background_color == config->background_color &&
+      ui->exported.foreground_color == config->foreground_color)
+    return;
+
+  uint8_t *pixels = txp_fbexport_begin(ctx, ui->fbexport, w, h, &stride);
+  if (!pixels ||
+      !txp_renderer_render_pixels(ctx, ui->doc_renderer, pixels, w, h, stride))
+    return;
+
+  ui->exported.version = version;
+  ui->exported.w = w;
+  ui->exported.h = h;
+  ui->exported.translate = translate;
+  ui->exported.scale = scale;
+  ui->exported.themed_color = config->themed_color;
+  ui->exported.invert_color = config->invert_color;
+  ui->exported.background_color = config->background_color;
+  ui->exported.foreground_color = config->foreground_color;
+
+  fz_irect damage;
+  if (txp_fbexport_commit(ui->fbexport, &damage))
+  {
+    editor_framebuffer(txp_fbexport_name(ui->fbexport),
+                       txp_fbexport_sequence(ui->fbexport), w, h, damage);
+    fflush(stdout);
+  }
+}
+
 static void render(fz_context *ctx, ui_state *ui)
 {
+  if (ui->hidden)
+    return;
   SDL_SetRenderDrawColor(ui->sdl_renderer, 0, 0, 0, 255);
   SDL_RenderClear(ui->sdl_renderer);
   txp_renderer_render(ctx, ui->doc_renderer);
   SDL_RenderPresent(ui->sdl_renderer);
+  if (ui->fbexport)
+    export_frame(ctx, ui);
 }
 
 struct repaint_on_resize_env
@@ -153,6 +325,11 @@ static int repaint_on_resize(void *data, SDL_Event *event)
 
 static bool need_advance(fz_context *ctx, ui_state *ui)
 {
+  // TeX processes are driven by the queries we answer: not stepping the
+  // engine is enough to leave them idle while the window is hidden.
+  if (ui->hidden)
+    return false;
+
   int need = send(page_count, ui->eng) <= ui->page;
 
   if (!need)
@@ -255,7 +432,7 @@ static void ui_mouse_down(struct persistent_state *ps, ui_state *ui, int x, int
         // pt.y -= 72;
         fprintf(stderr, "click: (%f,%f) mapped:(%f,%f)\n",
                 pt.x, pt.y, f * pt.x, f * pt.y);
-        synctex_scan(ps->ctx, stx, buf, ps->doc_path, ui->page, f * pt.x, f * pt.y);
+        synctex_scan(ps->ctx, stx, buf, ui->doc_path, ui->page, f * pt.x, f * pt.y);
       }
     }
 
@@ -513,7 +690,7 @@ static int find_diff(const fz_buffer *buf, const void *data, int size)
 }
 
 static void realize_change(struct persistent_state *ps,
-                             ui_state *ui,
+                             struct ui_document *doc,
                              const char *path,
                              int offset,
                              int remove,
@@ -522,14 +699,14 @@ static void realize_change(struct persistent_state *ps,
                              int line_based)
 {
   int go_up = 0;
-  path = relative_path(path, ps->doc_path, &go_up);
+  path = relative_path(path, doc->path, &go_up);
   if (go_up > 0)
   {
     fprintf(stderr, "[command] change %s: file has a different root, skipping\n", path);
     return;
   }
 
-  fileentry_t *e = send(find_file, ui->eng, ps->ctx, path);
+  fileentry_t *e = send(find_file, doc->eng, ps->ctx, path);
   if (!e)
   {
     fprintf(stderr, "[command] change %s: file not found, skipping\n", path);
@@ -600,7 +777,7 @@ static void realize_change(struct persistent_state *ps,
   memmove(b->data + offset, data, length);
 
   fprintf(stderr, "[command] change %s: changed offset %d\n", path, offset);
-  send(notify_file_changes, ui->eng, ps->ctx, e, offset);
+  send(notify_file_changes, doc->eng, ps->ctx, e, offset);
 }
 
 #define BUFFERED_OPS 64
@@ -628,14 +805,16 @@ static void flush_changes(struct persistent_state *ps,
     for (int i = 0; i < count; ++i)
     {
       struct delayed_op *op = &delayed_changes.op[i];
-      realize_change(ps, ui, op->path, op->offset, op->remove, op->data, 
-                     op->length, op->line_based);
+      realize_change(ps, &ui->documents[ui->active_document], op->path,
+                     op->offset, op->remove, op->data, op->length,
+                     op->line_based);
     }
   }
 }
 
 static void interpret_change(struct persistent_state *ps,
                              ui_state *ui,
+                             struct ui_document *doc,
                              const char *path,
                              int offset,
                              int remove,
@@ -647,7 +826,8 @@ static void interpret_change(struct persistent_state *ps,
   int page_count = send(page_count, ui->eng);
   int cursor = delayed_changes.cursor;
 
-  if ((page_count == ui->page - 2 || page_count == ui->page - 1) &&
+  if (doc == &ui->documents[ui->active_document] &&
+      (page_count == ui->page - 2 || page_count == ui->page - 1) &&
       send(get_status, ui->eng) == DOC_RUNNING &&
       delayed_changes.count < BUFFERED_OPS &&
       cursor + plen + 1 + length + line_based <= BUFFERED_CHARS)
@@ -672,25 +852,26 @@ static void interpret_change(struct persistent_state *ps,
   else
   {
     flush_changes(ps, ui);
-    realize_change(ps, ui, path, offset, remove, data, length, line_based);
+    realize_change(ps, doc, path, offset, remove, data, length, line_based);
   }
 }
 
 static void interpret_open(struct persistent_state *ps,
                            ui_state *ui,
+                           struct ui_document *doc,
                            const char *path,
                            const void *data,
                            int size)
 {
   int go_up = 0;
-  path = relative_path(path, ps->doc_path, &go_up);
+  path = relative_path(path, doc->path, &go_up);
   if (go_up > 0)
   {
     fprintf(stderr, "[command] open %s: file has a different root, skipping\n", path);
     return;
   }
 
-  fileentry_t *e = send(find_file, ui->eng, ps->ctx, path);
+  fileentry_t *e = send(find_file, doc->eng, ps->ctx, path);
   if (!e)
   {
     fprintf(stderr, "[command] open %s: file not found, skipping\n", path);
@@ -714,30 +895,32 @@ static void interpret_open(struct persistent_state *ps,
   {
     fprintf(stderr, "[command] open %s: new file\n", path);
     e->edit_data = fz_new_buffer_from_copied_data(ps->ctx, data, size);
-    if (e->fs_data)
-      changed = find_diff(e->fs_data, data, size);
+    fz_buffer *fs_data = fileentry_fs_data(ps->ctx, e);
+    if (fs_data)
+      changed = find_diff(fs_data, data, size);
   }
 
   if (changed >= 0)
   {
     fprintf(stderr, "[command] open %s: changed offset is %d\n", path, changed);
-    send(notify_file_changes, ui->eng, ps->ctx, e, changed);
+    send(notify_file_changes, doc->eng, ps->ctx, e, changed);
   }
 }
 
 static void interpret_close(struct persistent_state *ps,
                             ui_state *ui,
+                            struct ui_document *doc,
                             const char *path)
 {
   int go_up = 0;
-  path = relative_path(path, ps->doc_path, &go_up);
+  path = relative_path(path, doc->path, &go_up);
   if (go_up > 0)
   {
     fprintf(stderr, "[command] close %s: file has a different root, skipping\n", path);
     return;
   }
 
-  fileentry_t *e = send(find_file, ui->eng, ps->ctx, path);
+  fileentry_t *e = send(find_file, doc->eng, ps->ctx, path);
   if (!e)
   {
     fprintf(stderr, "[command] close %s: file not found, skipping\n", path);
@@ -754,8 +937,9 @@ static void interpret_close(struct persistent_state *ps,
 
   int changed = 0;
 
-  if (e->fs_data)
-    changed = find_diff(e->fs_data, e->edit_data->data, e->edit_data->len);
+  fz_buffer *fs_data = fileentry_fs_data(ps->ctx, e);
+  if (fs_data)
+    changed = find_diff(fs_data, e->edit_data->data, e->edit_data->len);
 
   fz_drop_buffer(ps->ctx, e->edit_data);
   e->edit_data = NULL;
@@ -763,7 +947,7 @@ static void interpret_close(struct persistent_state *ps,
   fprintf(stderr, "[command] close %s: closing, changed offset %d\n", path,
           changed);
 
-  send(notify_file_changes, ui->eng, ps->ctx, e, changed);
+  send(notify_file_changes, doc->eng, ps->ctx, e, changed);
 }
 
 static uint32_t convert_color(fz_context *ctx, vstack *stack, float frgb[3])
@@ -776,14 +960,507 @@ static uint32_t convert_color(fz_context *ctx, vstack *stack, float frgb[3])
   return (rgb[0] << 16) | (rgb[1] << 8) | (rgb[2]);
 }
 
+// Ask the helpers for the current page, the previous contents are kept until
+// it is ready. Returns false if the page should be rendered in process.
+static bool request_page(struct persistent_state *ps, ui_state *ui)
+{
+  chunkbuf_t *doc;
+  if (!ui->render_pool || !(doc = send(xdv_output, ui->eng)))
+    return 0;
+  float scale;
+  if (!txp_renderer_page_position(ps->ctx, ui->doc_renderer, NULL, NULL, &scale))
+    scale = ui->helper_scale;
+  uint32_t id = txp_render_pool_request(ps->ctx, ui->render_pool, ui->doc_path,
+                                        doc, ui->page, scale);
+  if (!id)
+    return 0;
+  ui->helper_requested = id;
+  ui->helper_scale = scale;
+  return 1;
+}
+
+// Display the pages finished by the helpers.
+// Results for another page, or older than the page displayed, are dropped.
+// Failures are not retried: the next change to the document will.
+static void collect_pages(struct persistent_state *ps, ui_state *ui)
+{
+  txp_render_result r;
+  while (txp_render_pool_collect(ps->ctx, ui->render_pool, &r))
+  {
+    if (!r.dl)
+      fprintf(stderr, "[render] page %d could not be rendered\n", r.page + 1);
+    else if (r.page == ui->page && r.id > ui->helper_shown)
+    {
+      ui->helper_shown = r.id;
+      txp_renderer_set_contents(ps->ctx, ui->doc_renderer, r.dl);
+      if (ui->viewserver)
+        txp_viewserver_publish(ps->ctx, ui->viewserver, ui->page, r.dl);
+      schedule_event(RENDER_EVENT);
+    }
+    fz_drop_display_list(ps->ctx, r.dl);
+  }
+}
+
+// Pages from the helpers are images: render them again after zooming
+static void rescale_page(struct persistent_state *ps, ui_state *ui)
+{
+  float scale;
+  if (ui->hidden || ui->helper_shown == 0 ||
+      !txp_renderer_page_position(ps->ctx, ui->doc_renderer, NULL, NULL, &scale))
+    return;
+  if (fabsf(scale / ui->helper_scale - 1) > 0.1)
+    request_page(ps, ui);
+}
+
 static void display_page(struct persistent_state *ps, ui_state *ui)
 {
+  // Catch up when the window is shown again
+  if (ui->hidden)
+    return;
+  if (request_page(ps, ui))
+  {
+    ui->partial_page = 0;
+    return;
+  }
+  // First frame: only interpret what is visible, the rest of the page is
+  // filled in by complete_page when the main loop is idle
+  fz_rect area = txp_renderer_visible_rect(ps->ctx, ui->doc_renderer);
+  bool complete = 1;
+  fz_display_list *dl =
+    send(render_page_area, ui->eng, ps->ctx, ui->page, area, &complete);
+  if (complete)
+  {
+    txp_renderer_set_contents(ps->ctx, ui->doc_renderer, dl);
+    if (ui->viewserver)
+      txp_viewserver_publish(ps->ctx, ui->viewserver, ui->page, dl);
+  }
+  else
+    txp_renderer_set_partial_contents(ps->ctx, ui->doc_renderer, dl);
+  fz_drop_display_list(ps->ctx, dl);
+  ui->partial_page = !complete;
+  schedule_event(RENDER_EVENT);
+}
+
+static void complete_page(struct persistent_state *ps, ui_state *ui)
+{
+  ui->partial_page = 0;
+  if (ui->hidden || ui->page >= send(page_count, ui->eng))
+    return;
   fz_display_list *dl = send(render_page, ui->eng, ps->ctx, ui->page);
   txp_renderer_set_contents(ps->ctx, ui->doc_renderer, dl);
+  if (ui->viewserver)
+    txp_viewserver_publish(ps->ctx, ui->viewserver, ui->page, dl);
   fz_drop_display_list(ps->ctx, dl);
   schedule_event(RENDER_EVENT);
 }
 
+/* Documents */
+
+/* Memory budget */
+
+// Consumers of the memory budget owned by the UI.
+// Text and crop bounds of the renderer are the cheapest to rebuild, then
+// decoded images and glyphs in mupdf store, then cached TeX resources
+// (re-read from disk or from the daemon), then exported PDFs (a full
+// export is needed to rebuild them).
+
+static size_t budget_renderer_size(void *data)
+{
+  ui_state *ui = data;
+  return txp_renderer_memory(ui->doc_renderer);
+}
+
+static size_t budget_renderer_evict(fz_context *ctx, void *data, size_t wanted)
+{
+  ui_state *ui = data;
+  txp_renderer_shrink(ctx, ui->doc_renderer);
+  return 0;
+}
+
+// Empty chunks go back to the system on their own: pools are accounted only
+static size_t budget_pool_size(void *data)
+{
+  return pstate->pool_size();
+}
+
+static size_t budget_store_evict(fz_context *ctx, void *data, size_t wanted)
+{
+  int phase = 0;
+  fz_store_scavenge_external(ctx, wanted, &phase);
+  return 0;
+}
+
+static size_t budget_resources_size(void *data)
+{
+  ui_state *ui = data;
+  return dvi_resmanager_cache_size(pstate->ctx, ui->resmanager);
+}
+
+static size_t budget_resources_evict(fz_context *ctx, void *data, size_t wanted)
+{
+  ui_state *ui = data;
+  return dvi_resmanager_shed(ctx, ui->resmanager);
+}
+
+static size_t budget_pdfexport_size(void *data)
+{
+  ui_state *ui = data;
+  size_t size = 0;
+  for (int i = 0; i < ui->document_count; ++i)
+    if (ui->documents[i].pdfexport)
+      size += txp_pdfexport_size(ui->documents[i].pdfexport);
+  return size;
+}
+
+static size_t budget_pdfexport_evict(fz_context *ctx, void *data, size_t wanted)
+{
+  ui_state *ui = data;
+  size_t size = 0;
+  for (int i = 0; i < ui->document_count; ++i)
+  {
+    struct ui_document *doc = &ui->documents[i];
+    if (doc->pdfexport)
+    {
+      size += txp_pdfexport_size(doc->pdfexport);
+      txp_pdfexport_free(ctx, doc->pdfexport);
+      doc->pdfexport = NULL;
+    }
+  }
+  return size;
+}
+
+/* Image prefetching */
+
+struct prefetch_job
+{
+  fz_image *img;
+  int w, h;
+};
+
+static void prefetch_job_run(fz_context *ctx, void *data)
+{
+  struct prefetch_job *job = data;
+  fz_pixmap *pix = NULL;
+
+  // Decoded pixmaps are kept in mupdf store, where the draw device will
+  // find them when rendering the page
+  fz_try(ctx)
+  {
+    pix = fz_get_pixmap_from_image(ctx, job->img, NULL, NULL,
+                                   job->w > 0 ? &job->w : NULL,
+                                   job->h > 0 ? &job->h : NULL);
+  }
+  fz_always(ctx)
+  {
+    fz_drop_pixmap(ctx, pix);
+  }
+  fz_catch(ctx)
+  {
+    fprintf(stderr, "[info] image prefetch failed: %s\n", fz_caught_message(ctx));
+  }
+}
+
+static void prefetch_job_release(fz_context *ctx, void *data)
+{
+  struct prefetch_job *job = data;
+  fz_drop_image(ctx, job->img);
+  fz_free(ctx, job);
+}
+
+static void prefetch_image(fz_context *ctx, void *env, fz_image *img,
+                           float width, float height)
+{
+  ui_state *ui = env;
+
+  if (!ui->worker || img->w <= 0 || img->h <= 0)
+    return;
+
+  // Size on screen, in points, of the image
+  int xres, yres;
+  fz_image_resolution(img, &xres, &yres);
+  if (width != width && height != height)
+  {
+    width = img->w * 72.0 / xres;
+    height = img->h * 72.0 / yres;
+  }
+  else if (width != width)
+    width = height * img->w / img->h;
+  else if (height != height)
+    height = width * img->h / img->w;
+
+  // Decode at the current display resolution, or at full resolution if
+  // nothing is displayed yet
+  float scale;
+  int w = 0, h = 0;
+  if (txp_renderer_page_position(ctx, ui->doc_renderer, NULL, NULL, &scale))
+  {
+    w = fz_clampi(width * scale, 1, img->w);
+    h = fz_clampi(height * scale, 1, img->h);
+  }
+
+  struct prefetch_job *job = fz_malloc_struct(ctx, struct prefetch_job);
+  job->img = fz_keep_image(ctx, img);
+  job->w = w;
+  job->h = h;
+  if (!txp_worker_submit(ui->worker, prefetch_job_run, prefetch_job_release, job))
+    prefetch_job_release(ctx, job);
+}
+
+static txp_engine *create_engine(struct persistent_state *ps,
+                                 ui_state *ui,
+                                 const char *dir,
+                                 const char *name)
+{
+  const char *doc_ext = NULL;
+
+  for (const char *ptr = name; *ptr; ptr++)
+    if (*ptr == '.')
+      doc_ext = ptr + 1;
+
+  char path[PATH_MAX];
+  snprintf(path, PATH_MAX, "%s/%s", dir, name);
+
+  if (doc_ext && strcmp(doc_ext, "pdf") == 0)
+    return txp_create_pdf_engine(ps->ctx, path);
+
+  // Fontmaps, fonts and the bundle server are shared by all documents
+  if (!ui->resmanager)
+  {
+    ui->resmanager = dvi_resmanager_new(
+        ps->ctx, dvi_resdaemon_hooks(ps->ctx, ui->tectonic_path, NULL));
+    dvi_resmanager_set_prefetch(ui->resmanager, prefetch_image, ui);
+    txp_budget_register(&(txp_budget_consumer){
+      .name = "TeX resources",
+      .cost = 2,
+      .size = budget_resources_size,
+      .evict = budget_resources_evict,
+      .data = ui,
+    });
+  }
+
+  if (doc_ext && (strcmp(doc_ext, "dvi") == 0 || strcmp(doc_ext, "xdv") == 0))
+    return txp_create_dvi_engine(ps->ctx, ui->resmanager, dir, path);
+
+  return txp_create_tex_engine(ps->ctx, ui->tectonic_path, ui->resmanager,
+                               ui->inclusion_path, dir, name, ps->watchdog);
+}
+
+static int open_document(struct persistent_state *ps,
+                         ui_state *ui,
+                         const char *dir,
+                         const char *name)
+{
+  for (int i = 0; i < ui->document_count; ++i)
+  {
+    struct ui_document *doc = &ui->documents[i];
+    if (strcmp(doc->path, dir) == 0 && strcmp(doc->name, name) == 0)
+      return i;
+  }
+
+  if (ui->document_count == MAX_DOCUMENTS)
+  {
+    fprintf(stderr, "[info] cannot open %s/%s: too many documents\n", dir, name);
+    return -1;
+  }
+
+  txp_engine *eng = create_engine(ps, ui, dir, name);
+
+  struct ui_document *doc = &ui->documents[ui->document_count];
+  doc->path = fz_strdup(ps->ctx, dir);
+  doc->name = fz_strdup(ps->ctx, name);
+  doc->eng = eng;
+  doc->page = 0;
+  doc->need_synctex = 1;
+  doc->pdfexport = NULL;
+  fprintf(stderr, "[info] opened document %s/%s\n", dir, name);
+  return ui->document_count++;
+}
+
+// Switch the active document.
+// Must be called between begin_changes and end_changes: the transaction of
+// the previous document is closed and one is opened on the new document.
+static void select_document(struct persistent_state *ps, ui_state *ui, int index)
+{
+  if (index == ui->active_document)
+    return;
+
+  struct ui_document *doc = &ui->documents[index];
+  if (chdir(doc->path) == -1)
+  {
+    perror("[info] select document: chdir");
+    return;
+  }
+
+  flush_changes(ps, ui);
+  // If the transaction invalidated the process, it is restarted when the
+  // document is selected again.
+  send(end_changes, ui->eng, ps->ctx);
+
+  struct ui_document *prev = &ui->documents[ui->active_document];
+  prev->page = ui->page;
+  prev->need_synctex = ui->need_synctex;
+
+  ui->active_document = index;
+  ui->eng = doc->eng;
+  ui->page = doc->page;
+  ui->need_synctex = doc->need_synctex;
+  ui->doc_path = doc->path;
+  ui->document_switched = 1;
+
+  send(begin_changes, ui->eng, ps->ctx);
+
+  char title[PATH_MAX];
+  snprintf(title, PATH_MAX, "TeXpresso %s", doc->name);
+  SDL_SetWindowTitle(ui->window, title);
+
+  txp_renderer_set_contents(ps->ctx, ui->doc_renderer, NULL);
+  ui->partial_page = 0;
+  // Pages of the previous document may still come from the helpers
+  ui->helper_shown = ui->helper_requested;
+  editor_truncate(BUF_OUT, NULL);
+  editor_truncate(BUF_LOG, NULL);
+  fprintf(stderr, "[info] active document: %s/%s\n", doc->path, doc->name);
+  schedule_event(RELOAD_EVENT);
+}
+
+static void close_document(struct persistent_state *ps, ui_state *ui, int index)
+{
+  if (index == ui->active_document)
+  {
+    if (ui->document_count == 1)
+    {
+      fprintf(stderr, "[info] cannot close the last document\n");
+      return;
+    }
+    select_document(ps, ui, index == 0 ? 1 : 0);
+    // The switch fails if the directory of the other document is gone
+    if (ui->active_document == index)
+    {
+      fprintf(stderr, "[info] cannot close the active document\n");
+      return;
+    }
+  }
+
+  struct ui_document *doc = &ui->documents[index];
+  fprintf(stderr, "[info] closing document %s/%s\n", doc->path, doc->name);
+  send(destroy, doc->eng, ps->ctx);
+  txp_pdfexport_free(ps->ctx, doc->pdfexport);
+  fz_free(ps->ctx, doc->path);
+  fz_free(ps->ctx, doc->name);
+
+  ui->document_count -= 1;
+  memmove(doc, doc + 1,
+          sizeof(struct ui_document) * (ui->document_count - index));
+  if (ui->active_document > index)
+    ui->active_document -= 1;
+}
+
+// Split the path of a root file into its directory and name.
+// Relative paths are resolved against the active document.
+static bool find_root(const char *path, char root[PATH_MAX], char **name)
+{
+  if (!realpath(path, root))
+  {
+    fprintf(stderr, "[command] %s: cannot resolve path\n", path);
+    return 0;
+  }
+  char *sep = strrchr(root, '/');
+  if (!sep || sep == root)
+  {
+    fprintf(stderr, "[command] %s: invalid root\n", path);
+    return 0;
+  }
+  *sep = '\0';
+  *name = sep + 1;
+  return 1;
+}
+
+// Find the document a file belongs to, preferring the active one.
+static struct ui_document *find_document(ui_state *ui, const char *path)
+{
+  int go_up = 0;
+  relative_path(path, ui->doc_path, &go_up);
+  if (go_up == 0)
+    return &ui->documents[ui->active_document];
+
+  for (int i = 0; i < ui->document_count; ++i)
+  {
+    relative_path(path, ui->documents[i].path, &go_up);
+    if (go_up == 0)
+      return &ui->documents[i];
+  }
+
+  return &ui->documents[ui->active_document];
+}
+
+// Changes to an inactive document are applied in their own transaction.
+// The process is not resumed until the document is selected.
+static struct ui_document *begin_document_changes(struct persistent_state *ps,
+                                                  ui_state *ui,
+                                                  const char *path)
+{
+  struct ui_document *doc = find_document(ui, path);
+  if (doc != &ui->documents[ui->active_document])
+    send(begin_changes, doc->eng, ps->ctx);
+  return doc;
+}
+
+static void end_document_changes(struct persistent_state *ps,
+                                 ui_state *ui,
+                                 struct ui_document *doc)
+{
+  if (doc != &ui->documents[ui->active_document])
+    send(end_changes, doc->eng, ps->ctx);
+}
+
+// Write the pages of the active document to a PDF.
+// Every page is interpreted again, but only the pages whose contents changed
+// since the previous export are written to the PDF.
+static void export_pdf(struct persistent_state *ps, ui_state *ui, const char *path)
+{
+  fz_context *ctx = ps->ctx;
+  struct ui_document *doc = &ui->documents[ui->active_document];
+  uint32_t ticks = SDL_GetTicks();
+  int count = send(page_count, ui->eng), updated = 0;
+  // Pages the engine did not roll back since the previous export are
+  // already up to date
+  int unchanged = send(unchanged_pages, ui->eng);
+  fz_display_list *dl = NULL;
+  fz_var(dl);
+  fz_var(updated);
+
+  fz_try(ctx)
+  {
+    if (!doc->pdfexport)
+      doc->pdfexport = txp_pdfexport_new(ctx);
+    int first = fz_mini(unchanged, txp_pdfexport_page_count(doc->pdfexport));
+    for (int i = first; i < count; ++i)
+    {
+      dl = send(render_page, ui->eng, ctx, i);
+      if (txp_pdfexport_update_page(ctx, doc->pdfexport, i, dl))
+        updated += 1;
+      fz_drop_display_list(ctx, dl);
+      dl = NULL;
+    }
+    txp_pdfexport_truncate(ctx, doc->pdfexport, count);
+    txp_pdfexport_save(ctx, doc->pdfexport, path);
+    fprintf(stderr, "[command] export-pdf %s: %d pages, %d updated, %ums\n",
+            path, count, updated, SDL_GetTicks() - ticks);
+    editor_exported_pdf(path, count, updated);
+  }
+  fz_always(ctx)
+  {
+    fz_drop_display_list(ctx, dl);
+  }
+  fz_catch(ctx)
+  {
+    fprintf(stderr, "[command] export-pdf %s: %s\n", path, fz_caught_message(ctx));
+    // Pages were marked as exported: start over next time
+    txp_pdfexport_free(ctx, doc->pdfexport);
+    doc->pdfexport = NULL;
+  }
+}
+
 static void interpret_command(struct persistent_state *ps,
                               ui_state *ui,
                               vstack *stack,
@@ -796,24 +1473,31 @@ static void interpret_command(struct persistent_state *ps,
   switch (cmd.tag)
   {
     case EDIT_OPEN:
-      interpret_open(ps, ui, cmd.open.path, cmd.open.data, cmd.open.length);
-      break;
+    {
+      struct ui_document *doc = begin_document_changes(ps, ui, cmd.open.path);
+      interpret_open(ps, ui, doc, cmd.open.path, cmd.open.data, cmd.open.length);
+      end_document_changes(ps, ui, doc);
+    }
+    break;
 
     case EDIT_CLOSE:
-      interpret_close(ps, ui, cmd.close.path);
-      break;
+    {
+      struct ui_document *doc = begin_document_changes(ps, ui, cmd.close.path);
+      interpret_close(ps, ui, doc, cmd.close.path);
+      end_document_changes(ps, ui, doc);
+    }
+    break;
 
     case EDIT_CHANGE:
-      interpret_change(ps, ui, cmd.change.path, cmd.change.offset,
-                       cmd.change.remove_length, cmd.change.data,
-                       cmd.change.insert_length, 0);
-      break;
-
     case EDIT_CHANGE_LINES:
-      interpret_change(ps, ui, cmd.change.path, cmd.change.offset,
+    {
+      struct ui_document *doc = begin_document_changes(ps, ui, cmd.change.path);
+      interpret_change(ps, ui, doc, cmd.change.path, cmd.change.offset,
                        cmd.change.remove_length, cmd.change.data,
-                       cmd.change.insert_length, 1);
-      break;
+                       cmd.change.insert_length, cmd.tag == EDIT_CHANGE_LINES);
+      end_document_changes(ps, ui, doc);
+    }
+    break;
 
     case EDIT_THEME:
     {
@@ -883,10 +1567,12 @@ static void interpret_command(struct persistent_state *ps,
 
     case EDIT_SYNCTEX_FORWARD:
     {
+      struct ui_document *doc = find_document(ui, cmd.synctex_forward.path);
+      select_document(ps, ui, doc - ui->documents);
       fz_buffer *buf;
       synctex_t *stx = send(synctex, ui->eng, &buf);
       int go_up = 0;
-      const char *path = relative_path(cmd.synctex_forward.path, ps->doc_path, &go_up);
+      const char *path = relative_path(cmd.synctex_forward.path, ui->doc_path, &go_up);
       if (go_up > 0)
       {
         fprintf(stderr,
@@ -900,6 +1586,41 @@ static void interpret_command(struct persistent_state *ps,
       }
     }
     break;
+
+    case EDIT_OPEN_ROOT:
+    {
+      char root[PATH_MAX], *name;
+      if (find_root(cmd.open_root.path, root, &name))
+      {
+        int index = open_document(ps, ui, root, name);
+        if (index >= 0)
+          select_document(ps, ui, index);
+      }
+    }
+    break;
+
+    case EDIT_CLOSE_ROOT:
+    {
+      char root[PATH_MAX], *name;
+      if (find_root(cmd.close_root.path, root, &name))
+      {
+        int index = -1;
+        for (int i = 0; i < ui->document_count; ++i)
+          if (strcmp(ui->documents[i].path, root) == 0 &&
+              strcmp(ui->documents[i].name, name) == 0)
+            index = i;
+        if (index >= 0)
+          close_document(ps, ui, index);
+        else
+          fprintf(stderr, "[command] close-root %s: unknown document\n",
+                  cmd.close_root.path);
+      }
+    }
+    break;
+
+    case EDIT_EXPORT_PDF:
+      export_pdf(ps, ui, cmd.export_pdf.path);
+      break;
   }
 }
 
@@ -913,28 +1634,106 @@ bool texpresso_main(struct persistent_state *ps)
 
   ui_state raw_ui, *ui = &raw_ui;
 
-  ui->window = ps->window;
-
-  const char *doc_ext = NULL;
-
-  for (const char *ptr = ps->doc_name; *ptr; ptr++)
-    if (*ptr == '.')
-      doc_ext = ptr + 1;
+  startup_last = ps->start_ticks;
 
   char tectonic_path[4096];
   find_tectonic(tectonic_path, ps->exe_path);
   fprintf(stderr, "[info] tectonic path: %s\n", tectonic_path);
+  startup_mark(ps, "tectonic path");
+
+  ui->tectonic_path = tectonic_path;
+  ui->inclusion_path = ps->inclusion_path;
+  ui->resmanager = NULL;
+  ui->document_count = 0;
+  ui->active_document = 0;
+  ui->document_switched = 0;
+
+  txp_tex_scheduler_init();
+  ui->worker = txp_worker_new(ps->ctx, txp_worker_default_threads());
+  ui->fbexport = ps->framebuffer ? txp_fbexport_new(ps->ctx) : NULL;
+  ui->exported.w = -1;
+  ui->viewserver =
+    ps->serve_path ? txp_viewserver_new(ps->ctx, ps->serve_path) : NULL;
+  ui->render_pool = NULL;
+  ui->helper_requested = ui->helper_shown = 0;
+  ui->helper_scale = 2;
+  if (ps->render_helpers > 0)
+  {
+    char helper_path[4096];
+    find_render_helper(helper_path, ps->exe_path);
+    ui->render_pool = txp_render_pool_new(ps->ctx, helper_path,
+                                          ps->render_helpers, schedule_helper);
+  }
+  txp_budget_set_limit(ps->memory_limit ? ps->memory_limit
+                                        : txp_budget_default_limit());
+  fprintf(stderr, "[info] memory budget: %zuMB\n", txp_budget_limit() >> 20);
+  txp_budget_register(&(txp_budget_consumer){
+    .name = "mupdf store",
+    .cost = 1,
+    .evict = budget_store_evict,
+    .data = ui,
+  });
+  if (ps->pool_size)
+    txp_budget_register(&(txp_budget_consumer){
+      .name = "Allocator pools",
+      .size = budget_pool_size,
+      .data = ui,
+    });
+  txp_budget_register(&(txp_budget_consumer){
+    .name = "PDF export",
+    .cost = 4,
+    .size = budget_pdfexport_size,
+    .evict = budget_pdfexport_evict,
+    .data = ui,
+  });
+
+  if (chdir(ps->doc_path) == -1)
+    perror("chdir to document path");
+  open_document(ps, ui, ps->doc_path, ps->doc_name);
+  ui->eng = ui->documents[0].eng;
+  ui->doc_path = ui->documents[0].path;
+  startup_mark(ps, "document opened");
+
+  // Start TeX before opening the window, and keep it running while SDL
+  // initializes video and creates the renderer
+  send(step, ui->eng, ps->ctx, true);
+  startup_mark(ps, "TeX started");
 
-  if (doc_ext && strcmp(doc_ext, "pdf") == 0)
-    ui->eng = txp_create_pdf_engine(ps->ctx, ps->doc_name);
-  else if (doc_ext && (strcmp(doc_ext, "dvi") == 0 || strcmp(doc_ext, "xdv") == 0))
-    ui->eng = txp_create_dvi_engine(ps->ctx, tectonic_path, ps->doc_path, ps->doc_name);
-  else
-    ui->eng = txp_create_tex_engine(ps->ctx, tectonic_path,
-                                    ps->inclusion_path, ps->doc_path, ps->doc_name);
-
+  if (!ps->window)
+  {
+    struct startup_stepper stepper = {
+      .eng = ui->eng,
+      .ctx = ps->ctx,
+      .page = ps->initial.initialized ? ps->initial.page : 0,
+    };
+    SDL_AtomicSet(&stepper.stop, 0);
+    SDL_Thread *thread =
+      SDL_CreateThread(startup_stepper_main, "startup_stepper", &stepper);
+    ps->open_window(ps);
+    startup_mark(ps, "window");
+    if (thread)
+    {
+      SDL_AtomicSet(&stepper.stop, 1);
+      SDL_WaitThread(thread, NULL);
+    }
+    if (ps->verbose)
+      fprintf(stderr, "[startup] %d pages typeset while opening the window\n",
+              send(page_count, ui->eng));
+  }
+  ui->window = ps->window;
   ui->sdl_renderer = ps->renderer;
   ui->doc_renderer = txp_renderer_new(ps->ctx, ui->sdl_renderer);
+  txp_renderer_set_worker(ps->ctx, ui->doc_renderer, ui->worker, schedule_render);
+  if (ps->glyph_atlas)
+    txp_renderer_use_glyph_atlas(ps->ctx, ui->doc_renderer);
+  txp_budget_register(&(txp_budget_consumer){
+    .name = "Renderer",
+    .cost = 0.25,
+    .size = budget_renderer_size,
+    .evict = budget_renderer_evict,
+    .data = ui,
+  });
+  startup_mark(ps, "renderer");
 
   if (ps->initial.initialized)
   {
@@ -956,6 +1755,10 @@ bool texpresso_main(struct persistent_state *ps)
   ui->last_mouse_x = -1000;
   ui->last_mouse_y = -1000;
   ui->last_click_ticks = SDL_GetTicks() - 200000000;
+  // When frames are exported, the editor keeps consuming them
+  ui->hidden = !ui->fbexport &&
+               !!(SDL_GetWindowFlags(ui->window) &
+                  (SDL_WINDOW_HIDDEN | SDL_WINDOW_MINIMIZED));
 
   bool quit = 0, reload = 0;
   send(step, ui->eng, ps->ctx, true);
@@ -1026,8 +1829,9 @@ bool texpresso_main(struct persistent_state *ps)
     }
     if (n == 0) stdin_eof = 1;
 
-    if (send(end_changes, ui->eng, ps->ctx))
+    if (send(end_changes, ui->eng, ps->ctx) || ui->document_switched)
     {
+      ui->document_switched = 0;
       send(step, ui->eng, ps->ctx, true);
       schedule_event(RELOAD_EVENT);
     }
@@ -1044,6 +1848,12 @@ bool texpresso_main(struct persistent_state *ps)
 
       if (!has_event)
       {
+        if (ui->partial_page)
+        {
+          complete_page(ps, ui);
+          continue;
+        }
+        txp_budget_enforce(ps->ctx);
         if (advance)
           continue;
         if (!stdin_eof)
@@ -1186,8 +1996,16 @@ bool texpresso_main(struct persistent_state *ps)
         break;
 
       case SDL_MOUSEMOTION:
+      {
+        // Only the last position of consecutive motions matters
+        SDL_Event next;
+        while (SDL_PeepEvents(&next, 1, SDL_PEEKEVENT,
+                              SDL_FIRSTEVENT, SDL_LASTEVENT) > 0 &&
+               next.type == SDL_MOUSEMOTION)
+          SDL_PeepEvents(&e, 1, SDL_GETEVENT, SDL_MOUSEMOTION, SDL_MOUSEMOTION);
         ui_mouse_move(ps->ctx, ui, e.motion.x, e.motion.y);
         break;
+      }
 
       case SDL_WINDOWEVENT:
         switch (e.window.event)
@@ -1196,6 +2014,29 @@ bool texpresso_main(struct persistent_state *ps)
           case SDL_WINDOWEVENT_RESIZED:
             schedule_event(RENDER_EVENT);
             break;
+
+          case SDL_WINDOWEVENT_HIDDEN:
+          case SDL_WINDOWEVENT_MINIMIZED:
+            if (ui->fbexport)
+              break;
+            if (!ui->hidden)
+              fprintf(stderr, "[info] window hidden, suspending\n");
+            ui->hidden = 1;
+            break;
+
+          case SDL_WINDOWEVENT_SHOWN:
+          case SDL_WINDOWEVENT_EXPOSED:
+          case SDL_WINDOWEVENT_RESTORED:
+          case SDL_WINDOWEVENT_MAXIMIZED:
+            if (ui->hidden)
+            {
+              fprintf(stderr, "[info] window visible, resuming\n");
+              ui->hidden = 0;
+              // Only the current page is refreshed, the engine resumes
+              // from where it stopped
+              schedule_event(RELOAD_EVENT);
+            }
+            break;
         }
         break;
     }
@@ -1203,7 +2044,7 @@ bool texpresso_main(struct persistent_state *ps)
     if (e.type == ps->custom_event)
     {
       int page_count;
-      *(char *)e.user.data1 = 0;
+      SDL_AtomicSet((SDL_atomic_t *)e.user.data1, 0);
       switch (e.user.code)
       {
         case SCAN_EVENT:
@@ -1224,6 +2065,8 @@ bool texpresso_main(struct persistent_state *ps)
 
         case RENDER_EVENT:
           render(ps->ctx, ui);
+          if (ui->render_pool)
+            rescale_page(ps, ui);
           send(begin_changes, ui->eng, ps->ctx);
           flush_changes(ps, ui);
           if (send(end_changes, ui->eng, ps->ctx))
@@ -1242,11 +2085,20 @@ bool texpresso_main(struct persistent_state *ps)
               ui->page = page_count - 1;
           }
           if (ui->page < page_count)
+          {
             display_page(ps, ui);
+            startup_mark(ps, "first page");
+            startup_done = 1;
+          }
           break;
 
         case STDIN_EVENT:
           break;
+
+        case HELPER_EVENT:
+          if (ui->render_pool)
+            collect_pages(ps, ui);
+          break;
       }
     }
   }
@@ -1261,19 +2113,39 @@ bool texpresso_main(struct persistent_state *ps)
 
   SDL_DelEventWatch(repaint_on_resize, &repaint_on_resize_env);
 
+  // Only the primary document survives a reload
+  ui->documents[ui->active_document].page = ui->page;
+  ui->documents[ui->active_document].need_synctex = ui->need_synctex;
+
   if (ps->initial.initialized && ps->initial.display_list)
     fz_drop_display_list(ps->ctx, ps->initial.display_list);
   ps->initial.initialized = 1;
-  ps->initial.page = ui->page;
-  ps->initial.need_synctex = ui->need_synctex;
+  ps->initial.page = ui->documents[0].page;
+  ps->initial.need_synctex = ui->documents[0].need_synctex;
   ps->initial.zoom = ui->zoom;
   ps->initial.config = *txp_renderer_get_config(ps->ctx, ui->doc_renderer);
-  ps->initial.display_list = txp_renderer_get_contents(ps->ctx, ui->doc_renderer);
+  ps->initial.display_list = NULL;
+  if (ui->active_document == 0)
+    ps->initial.display_list = txp_renderer_get_contents(ps->ctx, ui->doc_renderer);
   if (ps->initial.display_list)
     fz_keep_display_list(ps->ctx, ps->initial.display_list);
 
+  txp_budget_unregister(ui);
+  txp_render_pool_free(ps->ctx, ui->render_pool);
+  txp_worker_free(ps->ctx, ui->worker);
+  if (ui->fbexport)
+    txp_fbexport_free(ps->ctx, ui->fbexport);
+  if (ui->viewserver)
+    txp_viewserver_free(ps->ctx, ui->viewserver);
   txp_renderer_free(ps->ctx, ui->doc_renderer);
-  send(destroy, ui->eng, ps->ctx);
+  for (int i = 0; i < ui->document_count; ++i)
+  {
+    send(destroy, ui->documents[i].eng, ps->ctx);
+    txp_pdfexport_free(ps->ctx, ui->documents[i].pdfexport);
+    fz_free(ps->ctx, ui->documents[i].path);
+    fz_free(ps->ctx, ui->documents[i].name);
+  }
+  dvi_resmanager_drop(ps->ctx, ui->resmanager);
 
   return reload;
 }
@@ -0,0 +1,281 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2023 Frédéric Bour <frederic.bour@lakaban.net>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#ifdef __APPLE__
+#include <mach/mach.h>
+#endif
+#include "membudget.h"
+
+#define MAX_CONSUMERS 32
+#define MB (1024.0 * 1024.0)
+
+static struct {
+  txp_budget_consumer consumers[MAX_CONSUMERS];
+  int count;
+  size_t limit;
+  // Usage left after the last eviction that could not get under the limit:
+  // don't evict again until usage grows noticeably past it
+  size_t floor;
+  struct timespec last_check;
+} budget;
+
+void txp_budget_register(const txp_budget_consumer *consumer)
+{
+  if (budget.count == MAX_CONSUMERS)
+  {
+    fprintf(stderr, "[budget] too many consumers, ignoring %s\n", consumer->name);
+    return;
+  }
+  budget.consumers[budget.count++] = *consumer;
+}
+
+void txp_budget_unregister(void *data)
+{
+  int j = 0;
+  for (int i = 0; i < budget.count; ++i)
+    if (budget.consumers[i].data != data)
+      budget.consumers[j++] = budget.consumers[i];
+  budget.count = j;
+}
+
+// Limits
+
+static size_t read_size(const char *path)
+{
+  FILE *f = fopen(path, "r");
+  if (!f)
+    return 0;
+  unsigned long long value = 0;
+  // "max" (no limit) does not parse
+  if (fscanf(f, "%llu", &value) != 1)
+    value = 0;
+  fclose(f);
+  // cgroup v1 reports "no limit" as a huge number
+  if (value >= (1ULL << 60))
+    value = 0;
+  return value;
+}
+
+static size_t cgroup_limit(void)
+{
+  FILE *f = fopen("/proc/self/cgroup", "r");
+  if (!f)
+    return 0;
+
+  size_t limit = 0;
+  char line[4096], path[4200];
+  while (!limit && fgets(line, sizeof(line), f))
+  {
+    line[strcspn(line, "\n")] = '\0';
+    if (strncmp(line, "0::", 3) == 0)
+    {
+      // cgroup v2
+      snprintf(path, sizeof(path), "/sys/fs/cgroup%s/memory.max", line + 3);
+      limit = read_size(path);
+    }
+    else if (strstr(line, ":memory:"))
+    {
+      // cgroup v1
+      snprintf(path, sizeof(path), "/sys/fs/cgroup/memory%s/memory.limit_in_bytes",
+               strstr(line, ":memory:") + 8);
+      limit = read_size(path);
+    }
+  }
+  fclose(f);
+  return limit;
+}
+
+size_t txp_budget_default_limit(void)
+{
+  long pages = sysconf(_SC_PHYS_PAGES), page_size = sysconf(_SC_PAGESIZE);
+  size_t total = (pages > 0 && page_size > 0) ? (size_t)pages * page_size : 0;
+  size_t cgroup = cgroup_limit();
+  if (cgroup && (!total || cgroup < total))
+    total = cgroup;
+  return total / 2;
+}
+
+void txp_budget_set_limit(size_t bytes)
+{
+  budget.limit = bytes;
+}
+
+size_t txp_budget_limit(void)
+{
+  return budget.limit;
+}
+
+// Measures
+
+static size_t statm_memory(const char *path)
+{
+  FILE *f = fopen(path, "r");
+  if (!f)
+    return 0;
+  unsigned long size, resident;
+  int n = fscanf(f, "%lu %lu", &size, &resident);
+  fclose(f);
+  if (n != 2)
+    return 0;
+  return resident * sysconf(_SC_PAGESIZE);
+}
+
+// Proportional set size: pages shared by n processes, including the
+// anonymous pages a snapshot shares copy-on-write with its parent, count
+// for 1/n in each. Returns 0 if smaps_rollup is not available.
+static size_t pss_memory(const char *path)
+{
+  FILE *f = fopen(path, "r");
+  if (!f)
+    return 0;
+  char line[256];
+  unsigned long long kb = 0;
+  while (fgets(line, sizeof(line), f))
+    if (sscanf(line, "Pss: %llu kB", &kb) == 1)
+      break;
+  fclose(f);
+  return kb * 1024;
+}
+
+static size_t self_memory(void)
+{
+#ifdef __APPLE__
+  mach_task_basic_info_data_t info;
+  mach_msg_type_number_t count = MACH_TASK_BASIC_INFO_COUNT;
+  if (task_info(mach_task_self(), MACH_TASK_BASIC_INFO,
+                (task_info_t)&info, &count) == KERN_SUCCESS)
+    return info.resident_size;
+  return 0;
+#else
+  size_t pss = pss_memory("/proc/self/smaps_rollup");
+  return pss ? pss : statm_memory("/proc/self/statm");
+#endif
+}
+
+size_t txp_budget_process_memory(pid_t pid)
+{
+  // Snapshots share most of their pages with their parent: only count their
+  // share of them. Without smaps_rollup, count nothing rather than the
+  // shared pages once per snapshot.
+  char path[64];
+  snprintf(path, sizeof(path), "/proc/%d/smaps_rollup", (int)pid);
+  return pss_memory(path);
+}
+
+size_t txp_budget_usage(void)
+{
+  size_t usage = self_memory();
+  for (int i = 0; i < budget.count; ++i)
+  {
+    txp_budget_consumer *c = &budget.consumers[i];
+    if (c->external && c->size)
+      usage += c->size(c->data);
+  }
+  return usage;
+}
+
+// Eviction
+
+void txp_budget_enforce(fz_context *ctx)
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  if (now.tv_sec - budget.last_check.tv_sec < 1)
+    return;
+  budget.last_check = now;
+
+  if (budget.limit == 0)
+    return;
+  size_t usage = txp_budget_usage();
+  if (usage <= budget.limit)
+  {
+    budget.floor = 0;
+    return;
+  }
+  if (budget.floor && usage < budget.floor + budget.limit / 10)
+    return;
+
+  // Memory of the consumers that cannot be evicted (snapshots) is part of
+  // the usage, but evicting the others cannot bring it below that
+  size_t fixed = 0;
+  for (int i = 0; i < budget.count; ++i)
+  {
+    txp_budget_consumer *c = &budget.consumers[i];
+    if (!c->evict && c->size)
+      fixed += c->size(c->data);
+  }
+
+  // Cheapest consumers first
+  txp_budget_consumer *order[MAX_CONSUMERS];
+  int count = 0;
+  for (int i = 0; i < budget.count; ++i)
+  {
+    txp_budget_consumer *c = &budget.consumers[i];
+    if (!c->evict)
+      continue;
+    int j = count++;
+    while (j > 0 && order[j - 1]->cost > c->cost)
+    {
+      order[j] = order[j - 1];
+      j--;
+    }
+    order[j] = c;
+  }
+
+  size_t target = budget.limit / 10 * 9;
+  if (target < fixed)
+    target = fixed;
+  fprintf(stderr, "[budget] using %.1fMB (%.1fMB not evictable), limit %.1fMB\n",
+          usage / MB, fixed / MB, budget.limit / MB);
+
+  for (int i = 0; i < count && usage > target; ++i)
+  {
+    txp_budget_consumer *c = order[i];
+    size_t wanted = usage - target;
+    size_t freed = 0;
+    fz_try(ctx)
+    {
+      freed = c->evict(ctx, c->data, wanted);
+    }
+    fz_catch(ctx)
+    {
+      fprintf(stderr, "[budget] evicting %s failed: %s\n",
+              c->name, fz_caught_message(ctx));
+    }
+    // Freed memory is not always returned to the system: trust the
+    // estimate of the consumer if it is larger than what was measured
+    size_t measured = txp_budget_usage();
+    if (measured + freed < usage)
+      freed = usage - measured;
+    fprintf(stderr, "[budget] %s: freed %.1fMB\n", c->name, freed / MB);
+    usage = freed < usage ? usage - freed : 0;
+  }
+
+  budget.floor = usage > budget.limit ? usage : 0;
+}
@@ -0,0 +1,82 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2023 Frédéric Bour <frederic.bour@lakaban.net>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#ifndef MEMBUDGET_H_
+#define MEMBUDGET_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+#include <mupdf/fitz/context.h>
+
+// A memory budget shared by the caches of the process.
+//
+// Consumers (mupdf store, resource caches, TeX snapshots, ...) register
+// with an estimate of the cost of rebuilding their data. When the memory
+// used by the process and its snapshots exceeds the limit, consumers are
+// asked to shed memory, cheapest first, until usage is back under 90% of
+// the limit. Memory that cannot be evicted (snapshots) is not a target:
+// when it alone keeps usage over the limit, eviction resumes only once
+// usage grew by another 10% of the limit.
+// All functions must be called from the main thread.
+
+// Bytes used by `data`, 0 if unknown
+typedef size_t txp_budget_size_fn(void *data);
+
+// Free about `wanted` bytes, return an estimate of what was freed (0 if
+// unknown: the budget also measures the memory returned to the system)
+typedef size_t txp_budget_evict_fn(fz_context *ctx, void *data, size_t wanted);
+
+typedef struct {
+  const char *name;
+  // Relative cost of rebuilding the data
+  float cost;
+  txp_budget_size_fn *size;
+  // NULL if the data cannot be evicted: it is only accounted
+  txp_budget_evict_fn *evict;
+  // The memory lives in other processes, it is not part of ours
+  bool external;
+  void *data;
+} txp_budget_consumer;
+
+void txp_budget_register(const txp_budget_consumer *consumer);
+// Remove the consumers registered with `data`
+void txp_budget_unregister(void *data);
+
+// Half of the physical memory, or of the cgroup limit if lower
+size_t txp_budget_default_limit(void);
+void txp_budget_set_limit(size_t bytes);
+size_t txp_budget_limit(void);
+
+// Memory used by this process and the external consumers
+size_t txp_budget_usage(void);
+
+// Shed memory if the process is over budget.
+// Cheap when under budget; measures at most once per second.
+void txp_budget_enforce(fz_context *ctx);
+
+// Private memory of another process (e.g. a snapshot), 0 if unknown
+size_t txp_budget_process_memory(pid_t pid);
+
+#endif // MEMBUDGET_H_
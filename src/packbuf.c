@@ -0,0 +1,121 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2023 Frédéric Bour <frederic.bour@lakaban.net>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#include <mupdf/fitz.h>
+#include "packbuf.h"
+
+struct packbuf_s {
+  size_t len, packed_len;
+  unsigned char *packed;
+};
+
+// Smaller buffers are not worth compressing
+#define MIN_LENGTH 4096
+
+packbuf_t *packbuf_pack(fz_context *ctx, fz_buffer *buf)
+{
+  if (buf->len < MIN_LENGTH)
+    return NULL;
+
+  size_t packed_len = 0;
+  unsigned char *packed =
+    fz_new_deflated_data_from_buffer(ctx, &packed_len, buf, FZ_DEFLATE_BEST_SPEED);
+
+  // Keep at least a quarter of the memory
+  if (packed_len > buf->len - buf->len / 4)
+  {
+    fz_free(ctx, packed);
+    return NULL;
+  }
+
+  // The deflated data is allocated for the worst case
+  unsigned char *shrunk = fz_realloc_no_throw(ctx, packed, packed_len);
+  if (shrunk)
+    packed = shrunk;
+
+  packbuf_t *pb;
+  fz_try(ctx)
+  {
+    pb = fz_malloc_struct(ctx, packbuf_t);
+  }
+  fz_catch(ctx)
+  {
+    fz_free(ctx, packed);
+    fz_rethrow(ctx);
+  }
+
+  pb->len = buf->len;
+  pb->packed_len = packed_len;
+  pb->packed = packed;
+  return pb;
+}
+
+void packbuf_drop(fz_context *ctx, packbuf_t *pb)
+{
+  if (!pb)
+    return;
+  fz_free(ctx, pb->packed);
+  fz_free(ctx, pb);
+}
+
+fz_buffer *packbuf_unpack(fz_context *ctx, packbuf_t *pb)
+{
+  fz_stream *mem = NULL, *inflate = NULL;
+  fz_buffer *buf = NULL;
+  fz_var(mem);
+  fz_var(inflate);
+  fz_var(buf);
+
+  fz_try(ctx)
+  {
+    buf = fz_new_buffer(ctx, pb->len);
+    mem = fz_open_memory(ctx, pb->packed, pb->packed_len);
+    inflate = fz_open_flated(ctx, mem, 15);
+    buf->len = fz_read(ctx, inflate, buf->data, pb->len);
+    if (buf->len != pb->len)
+      fz_throw(ctx, FZ_ERROR_GENERIC, "packbuf: truncated data");
+  }
+  fz_always(ctx)
+  {
+    fz_drop_stream(ctx, inflate);
+    fz_drop_stream(ctx, mem);
+  }
+  fz_catch(ctx)
+  {
+    fz_drop_buffer(ctx, buf);
+    fz_rethrow(ctx);
+  }
+
+  return buf;
+}
+
+size_t packbuf_length(const packbuf_t *pb)
+{
+  return pb->len;
+}
+
+size_t packbuf_size(const packbuf_t *pb)
+{
+  return sizeof(*pb) + pb->packed_len;
+}
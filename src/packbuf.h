@@ -0,0 +1,51 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2023 Frédéric Bour <frederic.bour@lakaban.net>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#ifndef PACKBUF_H_
+#define PACKBUF_H_
+
+#include <stddef.h>
+#include <mupdf/fitz/buffer.h>
+
+// Compressed copy of a buffer that is not used for a while.
+// The contents are deflated (zlib is already linked through mupdf) and
+// inflated again on demand.
+
+typedef struct packbuf_s packbuf_t;
+
+// Compress buf, NULL if it does not shrink enough to be worth it.
+// buf is left untouched.
+packbuf_t *packbuf_pack(fz_context *ctx, fz_buffer *buf);
+void packbuf_drop(fz_context *ctx, packbuf_t *pb);
+
+// A new buffer with the original contents
+fz_buffer *packbuf_unpack(fz_context *ctx, packbuf_t *pb);
+
+// Length of the original contents
+size_t packbuf_length(const packbuf_t *pb);
+
+// Bytes used by the compressed copy
+size_t packbuf_size(const packbuf_t *pb);
+
+#endif // PACKBUF_H_
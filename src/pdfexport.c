@@ -0,0 +1,597 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2023 Frédéric Bour <frederic.bour@lakaban.net>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <mupdf/fitz.h>
+#include <mupdf/pdf.h>
+#include "pdfexport.h"
+
+#define MAX_DEPTH 32
+
+struct export_page
+{
+  // Hash of the contents the page was written with
+  unsigned char digest[16];
+  int num;
+  // Fonts and images used by the page, an object appears once per use
+  int *shared, shared_len;
+};
+
+struct obj_info
+{
+  // Number of pages using a shared object
+  int refs;
+  // Size of a stream, as it will be written
+  size_t size;
+};
+
+struct txp_pdfexport_s
+{
+  pdf_document *doc;
+  int page_count, page_cap;
+  struct export_page *pages;
+  // Indexed by object number
+  struct obj_info *objs;
+  int objs_cap;
+  // Bytes of the streams in the document
+  size_t size;
+};
+
+// Object numbers collected while hashing or deleting
+struct num_list
+{
+  int *nums, len, cap;
+};
+
+static void num_list_add(fz_context *ctx, struct num_list *l, int num)
+{
+  if (l->len == l->cap)
+  {
+    int cap = l->cap ? l->cap * 2 : 32;
+    l->nums = fz_realloc_array(ctx, l->nums, cap, int);
+    l->cap = cap;
+  }
+  l->nums[l->len++] = num;
+}
+
+txp_pdfexport *txp_pdfexport_new(fz_context *ctx)
+{
+  txp_pdfexport *ex = fz_malloc_struct(ctx, txp_pdfexport);
+  fz_try(ctx)
+  {
+    ex->doc = pdf_create_document(ctx);
+  }
+  fz_catch(ctx)
+  {
+    fz_free(ctx, ex);
+    fz_rethrow(ctx);
+  }
+  return ex;
+}
+
+void txp_pdfexport_free(fz_context *ctx, txp_pdfexport *ex)
+{
+  if (!ex)
+    return;
+  pdf_drop_document(ctx, ex->doc);
+  for (int i = 0; i < ex->page_count; ++i)
+    fz_free(ctx, ex->pages[i].shared);
+  fz_free(ctx, ex->pages);
+  fz_free(ctx, ex->objs);
+  fz_free(ctx, ex);
+}
+
+int txp_pdfexport_page_count(txp_pdfexport *ex)
+{
+  return ex->page_count;
+}
+
+size_t txp_pdfexport_size(txp_pdfexport *ex)
+{
+  return ex->size;
+}
+
+// Fonts and images are looked up by digest when a page is written, so the
+// same object is shared by every page that shows them. Other objects
+// (form XObjects for transparency groups and masks, graphic states) are
+// created anew for each version of a page: they belong to the page.
+enum
+{
+  // The object belongs to the page
+  OBJ_OWNED = 1,
+  // The object is the ExtGState dictionary of some resources
+  OBJ_GSTATES = 2,
+};
+
+static bool is_owned(fz_context *ctx, pdf_obj *obj, int flags)
+{
+  return (flags & OBJ_OWNED) ||
+    pdf_name_eq(ctx, pdf_dict_get(ctx, obj, PDF_NAME(Subtype)), PDF_NAME(Form));
+}
+
+// Flags of the values of a dictionary entry
+static int child_flags(fz_context *ctx, pdf_obj *key, int flags)
+{
+  if (flags & OBJ_GSTATES)
+    return OBJ_OWNED;
+  if (pdf_name_eq(ctx, key, PDF_NAME(ExtGState)))
+    return OBJ_GSTATES;
+  return 0;
+}
+
+static void hash_bytes(fz_md5 *md5, char tag, const void *data, size_t len)
+{
+  fz_md5_update(md5, (const unsigned char *)&tag, 1);
+  fz_md5_update(md5, (const unsigned char *)&len, sizeof(len));
+  fz_md5_update(md5, data, len);
+}
+
+// Hash an object as it will be written. Shared objects are identified by
+// their number, objects owned by the page by their contents, so that two
+// versions of a page showing the same thing hash the same.
+// The numbers of the shared objects are added to `shared`.
+static void hash_obj(fz_context *ctx, pdf_document *doc, fz_md5 *md5,
+                     struct num_list *shared, pdf_obj *obj, int flags, int depth)
+{
+  if (depth > MAX_DEPTH)
+    fz_throw(ctx, FZ_ERROR_GENERIC, "pdf export: objects nested too deeply");
+
+  if (pdf_is_indirect(ctx, obj))
+  {
+    int num = pdf_to_num(ctx, obj);
+    if (!is_owned(ctx, obj, flags))
+    {
+      hash_bytes(md5, 'R', &num, sizeof(num));
+      num_list_add(ctx, shared, num);
+      return;
+    }
+    if (pdf_is_stream(ctx, obj))
+    {
+      fz_buffer *buf = pdf_load_raw_stream_number(ctx, doc, num);
+      hash_bytes(md5, 'S', buf->data, buf->len);
+      fz_drop_buffer(ctx, buf);
+    }
+    obj = pdf_resolve_indirect(ctx, obj);
+  }
+
+  if (pdf_is_dict(ctx, obj))
+  {
+    int len = pdf_dict_len(ctx, obj);
+    hash_bytes(md5, 'D', &len, sizeof(len));
+    for (int i = 0; i < len; ++i)
+    {
+      pdf_obj *key = pdf_dict_get_key(ctx, obj, i);
+      const char *name = pdf_to_name(ctx, key);
+      hash_bytes(md5, 'K', name, strlen(name));
+      hash_obj(ctx, doc, md5, shared, pdf_dict_get_val(ctx, obj, i),
+               child_flags(ctx, key, flags), depth + 1);
+    }
+  }
+  else if (pdf_is_array(ctx, obj))
+  {
+    int len = pdf_array_len(ctx, obj);
+    hash_bytes(md5, 'A', &len, sizeof(len));
+    for (int i = 0; i < len; ++i)
+      hash_obj(ctx, doc, md5, shared, pdf_array_get(ctx, obj, i), 0, depth + 1);
+  }
+  else if (pdf_is_name(ctx, obj))
+  {
+    const char *name = pdf_to_name(ctx, obj);
+    hash_bytes(md5, 'N', name, strlen(name));
+  }
+  else if (pdf_is_string(ctx, obj))
+    hash_bytes(md5, 'T', pdf_to_str_buf(ctx, obj), pdf_to_str_len(ctx, obj));
+  else if (pdf_is_int(ctx, obj))
+  {
+    int64_t i = pdf_to_int64(ctx, obj);
+    hash_bytes(md5, 'I', &i, sizeof(i));
+  }
+  else if (pdf_is_real(ctx, obj))
+  {
+    float f = pdf_to_real(ctx, obj);
+    hash_bytes(md5, 'F', &f, sizeof(f));
+  }
+  else if (pdf_is_bool(ctx, obj))
+  {
+    int b = pdf_to_bool(ctx, obj);
+    hash_bytes(md5, 'B', &b, sizeof(b));
+  }
+  else
+    hash_bytes(md5, '0', NULL, 0);
+}
+
+static struct obj_info *obj_info(fz_context *ctx, txp_pdfexport *ex, int num)
+{
+  if (num >= ex->objs_cap)
+  {
+    int cap = ex->objs_cap ? ex->objs_cap : 256;
+    while (cap <= num)
+      cap *= 2;
+    ex->objs = fz_realloc_array(ctx, ex->objs, cap, struct obj_info);
+    memset(ex->objs + ex->objs_cap, 0,
+           sizeof(struct obj_info) * (cap - ex->objs_cap));
+    ex->objs_cap = cap;
+  }
+  return &ex->objs[num];
+}
+
+static int *shared_ref(fz_context *ctx, txp_pdfexport *ex, int num)
+{
+  return &obj_info(ctx, ex, num)->refs;
+}
+
+static void delete_object(fz_context *ctx, txp_pdfexport *ex, int num)
+{
+  struct obj_info *info = obj_info(ctx, ex, num);
+  ex->size -= info->size;
+  info->size = 0;
+  pdf_delete_object(ctx, ex->doc, num);
+}
+
+// Delete the objects owned by the page that are reachable from obj
+static void delete_owned(fz_context *ctx, txp_pdfexport *ex, pdf_obj *obj, int flags, int depth)
+{
+  if (depth > MAX_DEPTH)
+    return;
+
+  int num = 0;
+  if (pdf_is_indirect(ctx, obj))
+  {
+    if (!is_owned(ctx, obj, flags))
+      return;
+    num = pdf_to_num(ctx, obj);
+    obj = pdf_resolve_indirect(ctx, obj);
+  }
+
+  if (pdf_is_dict(ctx, obj))
+  {
+    int len = pdf_dict_len(ctx, obj);
+    for (int i = 0; i < len; ++i)
+      delete_owned(ctx, ex, pdf_dict_get_val(ctx, obj, i),
+                   child_flags(ctx, pdf_dict_get_key(ctx, obj, i), flags),
+                   depth + 1);
+  }
+  else if (pdf_is_array(ctx, obj))
+  {
+    int len = pdf_array_len(ctx, obj);
+    for (int i = 0; i < len; ++i)
+      delete_owned(ctx, ex, pdf_array_get(ctx, obj, i), 0, depth + 1);
+  }
+
+  if (num > 0)
+    delete_object(ctx, ex, num);
+}
+
+// Delete a font or an image and the objects only it refers to (font
+// descriptors and files, soft masks, ...). Colorspaces are shared between
+// images and kept, so are the objects still used by a page.
+static void delete_shared(fz_context *ctx, txp_pdfexport *ex, struct num_list *deleted,
+                          pdf_obj *obj, int depth)
+{
+  if (depth > MAX_DEPTH)
+    return;
+
+  int num = 0;
+  if (pdf_is_indirect(ctx, obj))
+  {
+    num = pdf_to_num(ctx, obj);
+    if (num <= 0 || *shared_ref(ctx, ex, num) > 0)
+      return;
+    for (int i = 0; i < deleted->len; ++i)
+      if (deleted->nums[i] == num)
+        return;
+    num_list_add(ctx, deleted, num);
+    obj = pdf_resolve_indirect(ctx, obj);
+  }
+
+  if (pdf_is_dict(ctx, obj))
+  {
+    int len = pdf_dict_len(ctx, obj);
+    for (int i = 0; i < len; ++i)
+      if (!pdf_name_eq(ctx, pdf_dict_get_key(ctx, obj, i), PDF_NAME(ColorSpace)))
+        delete_shared(ctx, ex, deleted, pdf_dict_get_val(ctx, obj, i), depth + 1);
+  }
+  else if (pdf_is_array(ctx, obj))
+  {
+    int len = pdf_array_len(ctx, obj);
+    for (int i = 0; i < len; ++i)
+      delete_shared(ctx, ex, deleted, pdf_array_get(ctx, obj, i), depth + 1);
+  }
+}
+
+static int is_deleted_resource(fz_context *ctx, void *state, void *key, int keylen, void *val)
+{
+  struct num_list *deleted = state;
+  int num = pdf_to_num(ctx, val);
+  for (int i = 0; i < deleted->len; ++i)
+    if (deleted->nums[i] == num)
+      return 1;
+  return 0;
+}
+
+// Count the uses of the shared objects of a page version
+static void retain_shared(fz_context *ctx, txp_pdfexport *ex, const int *nums, int len)
+{
+  for (int i = 0; i < len; ++i)
+    *shared_ref(ctx, ex, nums[i]) += 1;
+}
+
+// Release the shared objects of a page version, deleting the ones no page
+// uses anymore
+static void release_shared(fz_context *ctx, txp_pdfexport *ex, const int *nums, int len)
+{
+  pdf_document *doc = ex->doc;
+  struct num_list deleted = {NULL, 0, 0};
+  fz_var(deleted);
+
+  fz_try(ctx)
+  {
+    for (int i = 0; i < len; ++i)
+    {
+      int *refs = shared_ref(ctx, ex, nums[i]);
+      *refs -= 1;
+      if (*refs == 0)
+      {
+        pdf_obj *obj = pdf_new_indirect(ctx, doc, nums[i], 0);
+        fz_try(ctx)
+        {
+          delete_shared(ctx, ex, &deleted, obj, 0);
+        }
+        fz_always(ctx)
+        {
+          pdf_drop_obj(ctx, obj);
+        }
+        fz_catch(ctx)
+        {
+          fz_rethrow(ctx);
+        }
+      }
+    }
+
+    if (deleted.len > 0)
+    {
+      // Don't let the next pages reuse the deleted objects
+      if (doc->resources.fonts)
+        fz_hash_filter(ctx, doc->resources.fonts, &deleted, is_deleted_resource);
+      if (doc->resources.images)
+        fz_hash_filter(ctx, doc->resources.images, &deleted, is_deleted_resource);
+      for (int i = 0; i < deleted.len; ++i)
+        delete_object(ctx, ex, deleted.nums[i]);
+    }
+  }
+  fz_always(ctx)
+  {
+    fz_free(ctx, deleted.nums);
+  }
+  fz_catch(ctx)
+  {
+    fz_rethrow(ctx);
+  }
+}
+
+// Delete a page that was removed from the page tree, with its contents,
+// resources and the objects it owns
+static void delete_page_object(fz_context *ctx, txp_pdfexport *ex, struct export_page *ep)
+{
+  pdf_document *doc = ex->doc;
+  pdf_obj *page = pdf_load_object(ctx, doc, ep->num);
+  fz_try(ctx)
+  {
+    pdf_obj *resources = pdf_dict_get(ctx, page, PDF_NAME(Resources));
+    pdf_obj *contents = pdf_dict_get(ctx, page, PDF_NAME(Contents));
+    delete_owned(ctx, ex, resources, 0, 0);
+    if (pdf_is_indirect(ctx, resources))
+      delete_object(ctx, ex, pdf_to_num(ctx, resources));
+    if (pdf_is_indirect(ctx, contents))
+      delete_object(ctx, ex, pdf_to_num(ctx, contents));
+    delete_object(ctx, ex, ep->num);
+    release_shared(ctx, ex, ep->shared, ep->shared_len);
+  }
+  fz_always(ctx)
+  {
+    pdf_drop_obj(ctx, page);
+    fz_free(ctx, ep->shared);
+    ep->shared = NULL;
+    ep->shared_len = 0;
+  }
+  fz_catch(ctx)
+  {
+    fz_rethrow(ctx);
+  }
+}
+
+// Compress the streams created since object `first`: fonts, uncompressed
+// images and page contents. They are written as is when saving.
+// Their size is added to the size of the document.
+static void compress_new_streams(fz_context *ctx, txp_pdfexport *ex, int first)
+{
+  pdf_document *doc = ex->doc;
+  int len = pdf_xref_len(ctx, doc);
+  for (int num = first; num < len; ++num)
+  {
+    pdf_obj *obj = pdf_new_indirect(ctx, doc, num, 0);
+    fz_buffer *raw = NULL, *zbuf = NULL;
+    fz_var(raw);
+    fz_var(zbuf);
+
+    fz_try(ctx)
+    {
+      if (pdf_is_stream(ctx, obj))
+        raw = pdf_load_raw_stream_number(ctx, doc, num);
+      if (raw && !pdf_dict_get(ctx, obj, PDF_NAME(Filter)))
+      {
+        size_t zlen;
+        unsigned char *zdata =
+          fz_new_deflated_data_from_buffer(ctx, &zlen, raw, FZ_DEFLATE_DEFAULT);
+        zbuf = fz_new_buffer_from_data(ctx, zdata, zlen);
+        if (zlen < raw->len)
+        {
+          pdf_update_stream(ctx, doc, obj, zbuf, 1);
+          pdf_dict_put(ctx, obj, PDF_NAME(Filter), PDF_NAME(FlateDecode));
+        }
+      }
+      if (raw)
+      {
+        struct obj_info *info = obj_info(ctx, ex, num);
+        info->size = zbuf && zbuf->len < raw->len ? zbuf->len : raw->len;
+        ex->size += info->size;
+      }
+    }
+    fz_always(ctx)
+    {
+      fz_drop_buffer(ctx, raw);
+      fz_drop_buffer(ctx, zbuf);
+      pdf_drop_obj(ctx, obj);
+    }
+    fz_catch(ctx)
+    {
+      fz_rethrow(ctx);
+    }
+  }
+}
+
+static void ensure_page_cap(fz_context *ctx, txp_pdfexport *ex, int count)
+{
+  if (count <= ex->page_cap)
+    return;
+  int cap = ex->page_cap ? ex->page_cap * 2 : 16;
+  while (cap < count)
+    cap *= 2;
+  ex->pages = fz_realloc_array(ctx, ex->pages, cap, struct export_page);
+  ex->page_cap = cap;
+}
+
+bool txp_pdfexport_update_page(fz_context *ctx, txp_pdfexport *ex, int index, fz_display_list *dl)
+{
+  if (index < 0 || index > ex->page_count)
+    fz_throw(ctx, FZ_ERROR_GENERIC, "pdf export: invalid page %d", index);
+  ensure_page_cap(ctx, ex, index + 1);
+
+  pdf_document *doc = ex->doc;
+  fz_rect mediabox = fz_bound_display_list(ctx, dl);
+  int first = pdf_xref_len(ctx, doc);
+  bool changed = 0;
+
+  pdf_obj *resources = NULL, *page = NULL;
+  fz_buffer *contents = NULL;
+  fz_device *dev = NULL;
+  struct num_list shared = {NULL, 0, 0};
+  fz_var(resources);
+  fz_var(page);
+  fz_var(contents);
+  fz_var(dev);
+  fz_var(shared);
+
+  fz_try(ctx)
+  {
+    // Writing the page is cheap: fonts and images that are already
+    // embedded are found by digest.
+    dev = pdf_page_write(ctx, doc, mediabox, &resources, &contents);
+    fz_run_display_list(ctx, dl, dev, fz_identity, fz_infinite_rect, NULL);
+    fz_close_device(ctx, dev);
+
+    fz_md5 md5;
+    unsigned char digest[16];
+    fz_md5_init(&md5);
+    hash_bytes(&md5, 'M', &mediabox, sizeof(mediabox));
+    hash_bytes(&md5, 'C', contents->data, contents->len);
+    hash_obj(ctx, doc, &md5, &shared, resources, 0, 0);
+    fz_md5_final(&md5, digest);
+
+    struct export_page *ep = &ex->pages[index];
+    if (index < ex->page_count && memcmp(ep->digest, digest, 16) == 0)
+    {
+      // Unchanged: drop the objects created for this version
+      delete_owned(ctx, ex, resources, 0, 0);
+    }
+    else
+    {
+      page = pdf_add_page(ctx, doc, mediabox, 0, resources, contents);
+      compress_new_streams(ctx, ex, first);
+      // Retain the objects of the new version before releasing the old one,
+      // the objects they have in common are kept
+      retain_shared(ctx, ex, shared.nums, shared.len);
+      if (index < ex->page_count)
+      {
+        pdf_delete_page(ctx, doc, index);
+        delete_page_object(ctx, ex, ep);
+      }
+      else
+        ex->page_count += 1;
+      pdf_insert_page(ctx, doc, index, page);
+      ep->num = pdf_to_num(ctx, page);
+      ep->shared = shared.nums;
+      ep->shared_len = shared.len;
+      shared.nums = NULL;
+      memcpy(ep->digest, digest, 16);
+      changed = 1;
+    }
+  }
+  fz_always(ctx)
+  {
+    fz_free(ctx, shared.nums);
+    fz_drop_device(ctx, dev);
+    pdf_drop_obj(ctx, page);
+    pdf_drop_obj(ctx, resources);
+    fz_drop_buffer(ctx, contents);
+  }
+  fz_catch(ctx)
+  {
+    fz_rethrow(ctx);
+  }
+
+  return changed;
+}
+
+void txp_pdfexport_truncate(fz_context *ctx, txp_pdfexport *ex, int count)
+{
+  while (ex->page_count > count && count >= 0)
+  {
+    int index = ex->page_count - 1;
+    pdf_delete_page(ctx, ex->doc, index);
+    ex->page_count = index;
+    delete_page_object(ctx, ex, &ex->pages[index]);
+  }
+}
+
+void txp_pdfexport_save(fz_context *ctx, txp_pdfexport *ex, const char *path)
+{
+  char tmp[4096];
+  if (snprintf(tmp, sizeof(tmp), "%s.tmp", path) >= (int)sizeof(tmp))
+    fz_throw(ctx, FZ_ERROR_GENERIC, "pdf export: path too long");
+
+  // Streams are already compressed.
+  // Garbage collection skips the fonts and images no page uses anymore.
+  pdf_write_options opts;
+  pdf_parse_write_options(ctx, &opts, "garbage");
+  pdf_save_document(ctx, ex->doc, tmp, &opts);
+  if (rename(tmp, path) != 0)
+  {
+    remove(tmp);
+    fz_throw(ctx, FZ_ERROR_GENERIC, "pdf export: cannot rename %s: %s",
+             tmp, strerror(errno));
+  }
+}
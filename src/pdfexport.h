@@ -0,0 +1,59 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2023 Frédéric Bour <frederic.bour@lakaban.net>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#ifndef PDFEXPORT_H_
+#define PDFEXPORT_H_
+
+#include <stdbool.h>
+#include <mupdf/fitz.h>
+
+// A PDF version of a document, updated page by page from display lists.
+// Fonts and images are embedded once and shared by all the pages using
+// them, and deleted when the last page using them is removed. A page is
+// rewritten only when its contents changed since the last update, and
+// streams are compressed when they are added: saving the document only has
+// to write it out.
+
+typedef struct txp_pdfexport_s txp_pdfexport;
+
+txp_pdfexport *txp_pdfexport_new(fz_context *ctx);
+void txp_pdfexport_free(fz_context *ctx, txp_pdfexport *ex);
+
+// Set the contents of page `index`, with 0 <= index <= page count.
+// Returns true if the page was added or changed.
+bool txp_pdfexport_update_page(fz_context *ctx, txp_pdfexport *ex, int index, fz_display_list *dl);
+
+// Remove pages after `count`
+void txp_pdfexport_truncate(fz_context *ctx, txp_pdfexport *ex, int count);
+
+int txp_pdfexport_page_count(txp_pdfexport *ex);
+
+// Estimate of the memory used: bytes of the streams in the document
+size_t txp_pdfexport_size(txp_pdfexport *ex);
+
+// Write the document to path (through a temporary file, so that a reader
+// never sees a partial PDF)
+void txp_pdfexport_save(fz_context *ctx, txp_pdfexport *ex, const char *path);
+
+#endif // PDFEXPORT_H_
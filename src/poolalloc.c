@@ -0,0 +1,316 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2023 Frédéric Bour <frederic.bour@lakaban.net>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <SDL2/SDL.h>
+#include "poolalloc.h"
+
+// Size classes: multiples of 16 bytes up to 256, then of 64 bytes up to
+// SMALL_LIMIT
+#define SMALL_LIMIT 1024
+#define CLASS_COUNT 28
+#define CHUNK_SIZE (64 * 1024)
+
+// A chunk serves blocks of a single size class, with its own free list:
+// when all its blocks are free, it can be given back to the system.
+struct chunk
+{
+  struct pool *pool;
+  int cls;
+  // Blocks allocated from this chunk and not freed yet
+  int live;
+  struct free_block *free;
+  char *bump, *bump_end;
+  // Link in the list of chunks with free blocks
+  struct chunk *prev, *next;
+  bool listed;
+};
+
+// Precedes each block, keeps the payload 16-byte aligned
+struct header
+{
+  // Chunk the block belongs to, NULL for large blocks
+  struct chunk *chunk;
+  // Size class of pooled blocks, size of large ones
+  size_t info;
+};
+
+struct free_block
+{
+  struct free_block *next;
+};
+
+struct pool
+{
+  // Chunk blocks are allocated from, for each size class
+  struct chunk *current[CLASS_COUNT];
+  // Other chunks with free blocks
+  struct chunk *partial[CLASS_COUNT];
+  // Blocks freed by other threads, taken back when a chunk runs out.
+  // Display lists and jobs are allocated by the UI thread and released by
+  // workers: without this, the blocks would pile up in the worker pools.
+  void *remote;
+};
+
+// Pools are never freed: blocks of a thread that exited can still be freed
+// by others
+static _Thread_local struct pool *local_pool;
+
+// Chunks allocated by all pools
+static SDL_atomic_t chunk_count;
+
+static struct pool *get_pool(void)
+{
+  if (!local_pool)
+    local_pool = calloc(1, sizeof(struct pool));
+  return local_pool;
+}
+
+static int class_of(size_t size)
+{
+  if (size <= 256)
+    return size ? (size - 1) >> 4 : 0;
+  return 16 + ((size - 257) >> 6);
+}
+
+static size_t class_size(int cls)
+{
+  if (cls < 16)
+    return (cls + 1) * 16;
+  return 256 + (cls - 15) * 64;
+}
+
+static size_t block_size(struct header *h)
+{
+  return h->chunk ? class_size(h->info) : h->info;
+}
+
+static void *large_malloc(size_t size)
+{
+  struct header *h = malloc(sizeof(struct header) + size);
+  if (!h)
+    return NULL;
+  h->chunk = NULL;
+  h->info = size;
+  return h + 1;
+}
+
+// Chunks are mapped directly: free() would not always return them to the
+// system
+static struct chunk *chunk_new(struct pool *p, int cls)
+{
+  struct chunk *c = mmap(NULL, CHUNK_SIZE, PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (c == MAP_FAILED)
+    return NULL;
+  *c = (struct chunk){ .pool = p, .cls = cls };
+  c->bump = (char *)c + ((sizeof(struct chunk) + 15) & ~(size_t)15);
+  c->bump_end = (char *)c + CHUNK_SIZE;
+  SDL_AtomicAdd(&chunk_count, 1);
+  return c;
+}
+
+static void chunk_unlink(struct pool *p, struct chunk *c)
+{
+  if (c->prev)
+    c->prev->next = c->next;
+  else
+    p->partial[c->cls] = c->next;
+  if (c->next)
+    c->next->prev = c->prev;
+  c->prev = c->next = NULL;
+  c->listed = 0;
+}
+
+static void *chunk_alloc(struct chunk *c)
+{
+  struct header *h;
+  if (c->free)
+  {
+    h = (struct header *)c->free - 1;
+    c->free = c->free->next;
+  }
+  else
+  {
+    size_t need = sizeof(struct header) + class_size(c->cls);
+    if ((size_t)(c->bump_end - c->bump) < need)
+      return NULL;
+    h = (struct header *)c->bump;
+    c->bump += need;
+    h->chunk = c;
+    h->info = c->cls;
+  }
+  c->live += 1;
+  return h + 1;
+}
+
+// Return a block to its chunk, from the thread owning the pool.
+// A chunk that has no block in use anymore is given back to the system,
+// unless it is the one the size class allocates from.
+static void chunk_release(struct pool *p, struct chunk *c, struct free_block *b)
+{
+  b->next = c->free;
+  c->free = b;
+  c->live -= 1;
+
+  if (c == p->current[c->cls])
+    return;
+
+  if (c->live == 0)
+  {
+    if (c->listed)
+      chunk_unlink(p, c);
+    munmap(c, CHUNK_SIZE);
+    SDL_AtomicAdd(&chunk_count, -1);
+  }
+  else if (!c->listed)
+  {
+    c->next = p->partial[c->cls];
+    if (c->next)
+      c->next->prev = c;
+    p->partial[c->cls] = c;
+    c->listed = 1;
+  }
+}
+
+// Give the blocks freed by other threads back to their chunks
+static void take_remote(struct pool *p)
+{
+  struct free_block *b = SDL_AtomicSetPtr(&p->remote, NULL);
+  while (b)
+  {
+    struct free_block *next = b->next;
+    chunk_release(p, ((struct header *)b - 1)->chunk, b);
+    b = next;
+  }
+}
+
+static void *pool_malloc(void *user, size_t size)
+{
+  if (size > SMALL_LIMIT)
+    return large_malloc(size);
+
+  struct pool *p = get_pool();
+  if (!p)
+    return NULL;
+
+  int cls = class_of(size);
+  struct chunk *c = p->current[cls];
+  void *result = c ? chunk_alloc(c) : NULL;
+  if (result)
+    return result;
+
+  if (SDL_AtomicGetPtr(&p->remote))
+  {
+    take_remote(p);
+    if (c && (result = chunk_alloc(c)))
+      return result;
+  }
+
+  // The current chunk is full: switch to one with free blocks, or to a new
+  // one. The full chunk is listed again once one of its blocks is freed.
+  struct chunk *next = p->partial[cls];
+  if (next)
+    chunk_unlink(p, next);
+  else if (!(next = chunk_new(p, cls)))
+    return NULL;
+  p->current[cls] = next;
+  return chunk_alloc(next);
+}
+
+static void pool_free(void *user, void *ptr)
+{
+  if (!ptr)
+    return;
+  struct header *h = (struct header *)ptr - 1;
+  if (!h->chunk)
+  {
+    free(h);
+    return;
+  }
+
+  struct free_block *b = ptr;
+  struct pool *p = h->chunk->pool;
+  if (p == local_pool)
+  {
+    chunk_release(p, h->chunk, b);
+    return;
+  }
+
+  void *head;
+  do
+  {
+    head = SDL_AtomicGetPtr(&p->remote);
+    b->next = head;
+  }
+  while (!SDL_AtomicCASPtr(&p->remote, head, b));
+}
+
+static void *pool_realloc(void *user, void *ptr, size_t size)
+{
+  if (!ptr)
+    return pool_malloc(user, size);
+
+  struct header *h = (struct header *)ptr - 1;
+  if (!h->chunk && size > SMALL_LIMIT)
+  {
+    h = realloc(h, sizeof(struct header) + size);
+    if (!h)
+      return NULL;
+    h->info = size;
+    return h + 1;
+  }
+
+  // Shrinking, or growing within the size class
+  size_t old_size = block_size(h);
+  if (h->chunk && size <= old_size)
+    return ptr;
+
+  void *result = pool_malloc(user, size);
+  if (!result)
+    return NULL;
+  memcpy(result, ptr, old_size < size ? old_size : size);
+  pool_free(user, ptr);
+  return result;
+}
+
+size_t txp_pool_allocator_size(void)
+{
+  return (size_t)SDL_AtomicGet(&chunk_count) * CHUNK_SIZE;
+}
+
+fz_alloc_context *txp_pool_allocator(void)
+{
+  static fz_alloc_context alloc = {
+    .user = NULL,
+    .malloc = pool_malloc,
+    .realloc = pool_realloc,
+    .free = pool_free,
+  };
+  return &alloc;
+}
@@ -0,0 +1,45 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2023 Frédéric Bour <frederic.bour@lakaban.net>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#ifndef POOLALLOC_H_
+#define POOLALLOC_H_
+
+#include <mupdf/fitz/context.h>
+
+// An allocator for mupdf contexts, tuned for the many small short-lived
+// allocations made while interpreting and rendering pages (display list
+// nodes, text spans, paths, ...).
+//
+// Small blocks are served from per-thread pools of chunks, each chunk
+// holding blocks of one size class, with its own free list refilled by
+// bumping a pointer. A block freed by another thread is handed back to the
+// pool it came from, through a lock-free list. A chunk whose blocks are all
+// free is given back to the system. Large blocks use malloc.
+
+fz_alloc_context *txp_pool_allocator(void);
+
+// Bytes held in chunks by all the pools
+size_t txp_pool_allocator_size(void);
+
+#endif // POOLALLOC_H_
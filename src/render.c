@@ -0,0 +1,545 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2023 Frédéric Bour <frederic.bour@lakaban.net>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+// texpresso-render: rasterize the pages of an XDV (or DVI) file to PNG.
+// Pages are distributed to a pool of threads. Each thread interprets the
+// file with its own incdvi; fonts, images and embedded PDFs are loaded once
+// by a resource manager shared by all threads.
+//
+// With -S, it serves pages to texpresso instead (see renderpool.h).
+
+#ifdef __linux__
+#define _GNU_SOURCE
+#endif
+
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <SDL2/SDL.h>
+#include <mupdf/fitz.h>
+#include "mydvi.h"
+#include "incdvi.h"
+#include "worker.h"
+#include "poolalloc.h"
+#include "renderpool.h"
+
+struct batch
+{
+  dvi_resmanager *rm;
+  chunkbuf_t *buffer;
+  const char *dir;
+  const char *pattern; // NULL: don't save
+  float scale;
+  int first, last;
+
+  SDL_atomic_t next;
+  SDL_atomic_t failures;
+  SDL_sem *done;
+};
+
+static void usage(void)
+{
+  fprintf(stderr,
+          "Usage: texpresso-render [-j threads] [-r dpi] [-p first[-last]] "
+          "[-a malloc|pool] file.xdv output-%%d.png\n"
+          "       texpresso-render -n [options] file.xdv\n"
+          "       texpresso-render -S document-directory\n"
+          "With -n, pages are rendered but not saved (for benchmarking).\n"
+          "With -S, pages are rendered for texpresso (-render-helpers).\n");
+}
+
+// The output pattern must have a single integer conversion, for the page
+// number, and no other conversion than %%.
+static bool valid_pattern(const char *pattern)
+{
+  int conversions = 0;
+  for (const char *p = pattern; *p; p++)
+  {
+    if (*p != '%')
+      continue;
+    p++;
+    if (*p == '%')
+      continue;
+    while (*p == '0' || *p == '-' || *p == ' ' || *p == '+')
+      p++;
+    while (*p >= '0' && *p <= '9')
+      p++;
+    if (*p != 'd')
+      return 0;
+    conversions += 1;
+  }
+  return conversions == 1;
+}
+
+static bool parse_range(const char *arg, int *first, int *last)
+{
+  char *end;
+  long a = strtol(arg, &end, 10), b = a;
+  if (end == arg)
+    return 0;
+  if (*end == '-')
+  {
+    const char *rest = end + 1;
+    b = *rest ? strtol(rest, &end, 10) : INT_MAX;
+    if (*rest && end == rest)
+      return 0;
+  }
+  if (*end || a < 1 || b < a)
+    return 0;
+  *first = a;
+  *last = b > INT_MAX ? INT_MAX : b;
+  return 1;
+}
+
+static void render_page(fz_context *ctx, struct batch *b, incdvi_t *d, int page)
+{
+  fz_pixmap *pix = NULL;
+  fz_device *dev = NULL;
+  fz_var(pix);
+  fz_var(dev);
+
+  fz_try(ctx)
+  {
+    float width, height;
+    incdvi_page_dim(ctx, d, b->buffer, page, &width, &height, NULL);
+    fz_matrix ctm = fz_scale(b->scale, b->scale);
+    fz_irect bbox =
+      fz_round_rect(fz_transform_rect(fz_make_rect(0, 0, width, height), ctm));
+    pix = fz_new_pixmap_with_bbox(ctx, fz_device_rgb(ctx), bbox, NULL, 0);
+    fz_clear_pixmap_with_value(ctx, pix, 255);
+    dev = fz_new_draw_device(ctx, ctm, pix);
+    incdvi_render_page(ctx, d, b->buffer, page, dev);
+    fz_close_device(ctx, dev);
+
+    if (b->pattern)
+    {
+      char path[PATH_MAX];
+      if (snprintf(path, PATH_MAX, b->pattern, page + 1) >= PATH_MAX)
+        fz_throw(ctx, FZ_ERROR_GENERIC, "output path too long");
+      fz_save_pixmap_as_png(ctx, pix, path);
+    }
+  }
+  fz_always(ctx)
+  {
+    fz_drop_device(ctx, dev);
+    fz_drop_pixmap(ctx, pix);
+  }
+  fz_catch(ctx)
+  {
+    fz_rethrow(ctx);
+  }
+}
+
+// Run by each thread: pick the next page until the range is exhausted.
+// Pages are handed out one at a time, so that threads that get simple
+// pages do not wait for the others.
+static void render_job(fz_context *ctx, void *data)
+{
+  struct batch *b = data;
+  incdvi_t *d = incdvi_new(ctx, b->rm, b->dir);
+
+  fz_try(ctx)
+  {
+    incdvi_update(ctx, d, b->buffer);
+    while (1)
+    {
+      int page = b->first + SDL_AtomicAdd(&b->next, 1);
+      if (page > b->last)
+        break;
+      fz_try(ctx)
+      {
+        render_page(ctx, b, d, page);
+      }
+      fz_catch(ctx)
+      {
+        fprintf(stderr, "[render] page %d: %s\n", page + 1,
+                fz_caught_message(ctx));
+        SDL_AtomicAdd(&b->failures, 1);
+      }
+    }
+  }
+  fz_always(ctx)
+  {
+    incdvi_free(ctx, d);
+  }
+  fz_catch(ctx)
+  {
+    fz_rethrow(ctx);
+  }
+}
+
+static void render_job_done(fz_context *ctx, void *data)
+{
+  struct batch *b = data;
+  SDL_SemPost(b->done);
+}
+
+/* Helper mode */
+
+// Bring the copy of the document up to date with the mirror
+static void serve_update(fz_context *ctx, incdvi_t *d, chunkbuf_t *buf,
+                         const struct txp_render_request *req)
+{
+  int valid = req->valid < buf->len ? req->valid : buf->len;
+  if (valid < buf->len)
+  {
+    // Let incdvi forget what follows
+    chunkbuf_truncate(buf, valid);
+    incdvi_update(ctx, d, buf);
+  }
+  if (req->length > valid)
+  {
+    uint8_t *mirror = mmap(NULL, req->length, PROT_READ, MAP_SHARED,
+                           TXP_RENDER_MIRROR_FD, 0);
+    if (mirror == MAP_FAILED)
+      fz_throw(ctx, FZ_ERROR_GENERIC, "cannot map document: %s",
+               strerror(errno));
+    fz_try(ctx)
+    {
+      chunkbuf_write(ctx, buf, valid, mirror + valid, req->length - valid);
+    }
+    fz_always(ctx)
+    {
+      munmap(mirror, req->length);
+    }
+    fz_catch(ctx)
+    {
+      fz_rethrow(ctx);
+    }
+  }
+  incdvi_update(ctx, d, buf);
+}
+
+// Render a page to shared memory, returns the descriptor
+static int serve_page(fz_context *ctx, incdvi_t *d, chunkbuf_t *buf,
+                      const struct txp_render_request *req,
+                      struct txp_render_reply *reply)
+{
+  int fd = -1;
+  uint8_t *samples = MAP_FAILED;
+  size_t size = 0;
+  fz_pixmap *pix = NULL;
+  fz_device *dev = NULL;
+  fz_var(fd);
+  fz_var(samples);
+  fz_var(size);
+  fz_var(pix);
+  fz_var(dev);
+
+  fz_try(ctx)
+  {
+    if (req->page < 0 || req->page >= incdvi_page_count(d))
+      fz_throw(ctx, FZ_ERROR_GENERIC, "page not available");
+    if (!(req->scale > 0 && req->scale <= 32))
+      fz_throw(ctx, FZ_ERROR_GENERIC, "invalid scale %.2f", req->scale);
+
+    float width, height;
+    incdvi_page_dim(ctx, d, buf, req->page, &width, &height, NULL);
+    fz_matrix ctm = fz_scale(req->scale, req->scale);
+    fz_irect bbox =
+      fz_round_rect(fz_transform_rect(fz_make_rect(0, 0, width, height), ctm));
+    int w = bbox.x1 - bbox.x0, h = bbox.y1 - bbox.y0;
+    if (w <= 0 || h <= 0)
+      fz_throw(ctx, FZ_ERROR_GENERIC, "empty page");
+
+    // Draw directly into the shared memory
+    size = (size_t)w * 3 * h;
+    fd = txp_render_shared_fd("texpresso-page");
+    if (fd == -1 || ftruncate(fd, size) == -1)
+      fz_throw(ctx, FZ_ERROR_GENERIC, "cannot allocate page: %s",
+               strerror(errno));
+    samples = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (samples == MAP_FAILED)
+      fz_throw(ctx, FZ_ERROR_GENERIC, "cannot map page: %s", strerror(errno));
+
+    pix = fz_new_pixmap_with_bbox_and_data(ctx, fz_device_rgb(ctx), bbox,
+                                           NULL, 0, samples);
+    fz_clear_pixmap_with_value(ctx, pix, 255);
+    dev = fz_new_draw_device(ctx, ctm, pix);
+    incdvi_render_page(ctx, d, buf, req->page, dev);
+    fz_close_device(ctx, dev);
+
+    reply->ok = 1;
+    reply->width = width;
+    reply->height = height;
+    reply->w = w;
+    reply->h = h;
+    reply->stride = w * 3;
+  }
+  fz_always(ctx)
+  {
+    fz_drop_device(ctx, dev);
+    fz_drop_pixmap(ctx, pix);
+    if (samples != MAP_FAILED)
+      munmap(samples, size);
+  }
+  fz_catch(ctx)
+  {
+    if (fd != -1)
+      close(fd);
+    fz_rethrow(ctx);
+  }
+
+  return fd;
+}
+
+// Answer requests until texpresso closes the socket
+static int serve(fz_context *ctx, const char *tectonic_path, const char *dir)
+{
+  dvi_resmanager *rm = NULL;
+  chunkbuf_t *buf = NULL;
+  incdvi_t *d = NULL;
+  fz_var(rm);
+  fz_var(buf);
+  fz_var(d);
+  int result = 0;
+
+  fz_try(ctx)
+  {
+    rm = dvi_resmanager_new(ctx, dvi_resdaemon_hooks(ctx, tectonic_path, dir));
+    buf = chunkbuf_new(ctx);
+    d = incdvi_new(ctx, rm, dir);
+
+    struct txp_render_request req;
+    while (txp_render_recv(TXP_RENDER_SOCKET_FD, &req, sizeof(req), NULL))
+    {
+      struct txp_render_reply reply = {.id = req.id, .page = req.page, .ok = 0};
+      int fd = -1;
+      fz_var(fd);
+      fz_try(ctx)
+      {
+        serve_update(ctx, d, buf, &req);
+        fd = serve_page(ctx, d, buf, &req, &reply);
+      }
+      fz_catch(ctx)
+      {
+        fprintf(stderr, "[render] page %d: %s\n", req.page + 1,
+                fz_caught_message(ctx));
+        // The copy may be partially updated
+        chunkbuf_truncate(buf, 0);
+        incdvi_update(ctx, d, buf);
+      }
+      bool sent = txp_render_send(TXP_RENDER_SOCKET_FD, &reply, sizeof(reply), fd);
+      if (fd != -1)
+        close(fd);
+      if (!sent)
+        break;
+    }
+  }
+  fz_always(ctx)
+  {
+    if (d)
+      incdvi_free(ctx, d);
+    chunkbuf_drop(ctx, buf);
+    dvi_resmanager_drop(ctx, rm);
+  }
+  fz_catch(ctx)
+  {
+    fprintf(stderr, "[render] %s\n", fz_caught_message(ctx));
+    result = 1;
+  }
+
+  return result;
+}
+
+int main(int argc, char **argv)
+{
+  int threads = SDL_GetCPUCount();
+  float dpi = 150;
+  int first = 1, last = INT_MAX;
+  bool save = 1;
+  fz_alloc_context *alloc = NULL;
+  const char *serve_dir = NULL;
+
+  int opt;
+  while ((opt = getopt(argc, argv, "j:r:p:a:nS:")) != -1)
+  {
+    switch (opt)
+    {
+      case 'a':
+        if (strcmp(optarg, "pool") == 0)
+          alloc = txp_pool_allocator();
+        else if (strcmp(optarg, "malloc") != 0)
+        {
+          fprintf(stderr, "Unknown allocator: %s\n", optarg);
+          return 1;
+        }
+        break;
+      case 'n':
+        save = 0;
+        break;
+      case 'S':
+        serve_dir = optarg;
+        break;
+      case 'j':
+        threads = atoi(optarg);
+        break;
+      case 'r':
+        dpi = atof(optarg);
+        break;
+      case 'p':
+        if (!parse_range(optarg, &first, &last))
+        {
+          fprintf(stderr, "Invalid page range: %s\n", optarg);
+          return 1;
+        }
+        break;
+      default:
+        usage();
+        return 1;
+    }
+  }
+
+  if (serve_dir ? argc != optind
+      : (argc - optind != (save ? 2 : 1) || threads < 1 || !(dpi > 0)))
+  {
+    usage();
+    return 1;
+  }
+
+  const char *input = serve_dir ? NULL : argv[optind];
+  const char *pattern = input && save ? argv[optind + 1] : NULL;
+  if (pattern && !valid_pattern(pattern))
+  {
+    fprintf(stderr, "Output pattern should contain a single %%d: %s\n", pattern);
+    return 1;
+  }
+
+  // Prefer the texpresso-tonic installed next to this binary
+  char tectonic_path[PATH_MAX] = "texpresso-tonic";
+  const char *sep = strrchr(argv[0], '/');
+  if (sep)
+  {
+    snprintf(tectonic_path, PATH_MAX, "%.*s/texpresso-tonic",
+             (int)(sep - argv[0]), argv[0]);
+    if (access(tectonic_path, X_OK) != 0)
+      strcpy(tectonic_path, "texpresso-tonic");
+  }
+
+  // Directory of the input, for resolving graphics
+  char dir[PATH_MAX] = ".";
+  sep = input ? strrchr(input, '/') : NULL;
+  if (sep)
+    snprintf(dir, PATH_MAX, "%.*s", (int)(sep - input), input);
+
+  fz_context *ctx = fz_new_context(alloc, txp_worker_locks(), FZ_STORE_DEFAULT);
+  if (!ctx)
+  {
+    fprintf(stderr, "Cannot create MuPDF context\n");
+    return 1;
+  }
+
+  if (serve_dir)
+  {
+    int result = serve(ctx, tectonic_path, serve_dir);
+    fz_drop_context(ctx);
+    return result;
+  }
+
+  int result = 0;
+  struct batch b = {0,};
+  incdvi_t *d = NULL;
+  txp_worker *pool = NULL;
+  fz_var(d);
+  fz_var(pool);
+
+  fz_try(ctx)
+  {
+    fz_buffer *data = fz_read_file(ctx, input);
+    b.buffer = chunkbuf_new(ctx);
+    chunkbuf_write(ctx, b.buffer, 0, data->data, data->len);
+    fz_drop_buffer(ctx, data);
+
+    b.rm = dvi_resmanager_new(ctx, dvi_resdaemon_hooks(ctx, tectonic_path, dir));
+    b.dir = dir;
+    b.pattern = pattern;
+    b.scale = dpi / 72.0;
+
+    // Count the pages once, on this thread
+    d = incdvi_new(ctx, b.rm, dir);
+    incdvi_update(ctx, d, b.buffer);
+    int count = incdvi_page_count(d);
+    if (last > count)
+      last = count;
+    b.first = first - 1;
+    b.last = last - 1;
+    int pages = last - first + 1;
+    if (pages <= 0)
+      fz_throw(ctx, FZ_ERROR_GENERIC, "no page to render (document has %d)", count);
+
+    if (threads > pages)
+      threads = pages;
+    b.done = SDL_CreateSemaphore(0);
+    if (!b.done)
+      fz_throw(ctx, FZ_ERROR_GENERIC, "cannot create semaphore: %s", SDL_GetError());
+
+    Uint64 start = SDL_GetTicks64();
+    pool = txp_worker_new(ctx, threads);
+    for (int i = 0; i < threads; ++i)
+    {
+      if (!txp_worker_submit(pool, render_job, render_job_done, &b))
+      {
+        // No thread could be started: render everything on this one
+        render_job(ctx, &b);
+        render_job_done(ctx, &b);
+      }
+    }
+    for (int i = 0; i < threads; ++i)
+      SDL_SemWait(b.done);
+
+    int failures = SDL_AtomicGet(&b.failures);
+    double seconds = (SDL_GetTicks64() - start) / 1000.0;
+    fprintf(stderr, "[render] %d pages in %.2fs (%.1f pages/s), %d threads, %s allocator",
+            pages - failures, seconds, (pages - failures) / (seconds > 0 ? seconds : 1e-3),
+            threads, alloc ? "pool" : "malloc");
+    if (failures)
+      fprintf(stderr, ", %d failed", failures);
+    fprintf(stderr, "\n");
+    if (failures)
+      result = 1;
+  }
+  fz_always(ctx)
+  {
+    if (pool)
+      txp_worker_free(ctx, pool);
+    if (b.done)
+      SDL_DestroySemaphore(b.done);
+    if (d)
+      incdvi_free(ctx, d);
+    dvi_resmanager_drop(ctx, b.rm);
+    chunkbuf_drop(ctx, b.buffer);
+  }
+  fz_catch(ctx)
+  {
+    fprintf(stderr, "[render] %s\n", fz_caught_message(ctx));
+    result = 1;
+  }
+
+  fz_drop_context(ctx);
+  return result;
+}
@@ -23,6 +23,8 @@
  */
 
 #include "renderer.h"
+#include "glyphatlas.h"
+#include "selection.h"
 #include <math.h>
 #include <stdio.h>
 #include <string.h>
@@ -39,14 +41,60 @@ static float clampf(float x, float min, float max)
   return x;
 }
 
+// The texture is used as a torus: rect is the area holding the view whose
+// top-left corner is at (x, y) in page pixels, rendered at scale.
+// Stale contents (previous display list or colors) are shown until they
+// are replaced, but never reused.
 typedef struct
 {
   int w, h;
   int x, y;
   fz_irect rect;
   float scale;
+  bool stale;
 } texture_state;
 
+// Crop bounds are computed by a worker thread and cached per display list.
+// The cache is shared with pending jobs, hence reference counted.
+#define BOUNDS_CACHE_SIZE 8
+
+typedef struct
+{
+  SDL_mutex *lock;
+  int refs;
+  int next;
+  struct {
+    fz_display_list *dl;
+    fz_rect bounds;
+    bool ready;
+  } entries[BOUNDS_CACHE_SIZE];
+  void (*notify)(void);
+} bounds_cache;
+
+// Rasterization of the whole texture by a worker thread, band by band.
+// The job is shared with the worker: it is stopped through its cookie when
+// its result becomes obsolete, and freed by whoever drops it last.
+#define RASTER_BAND_HEIGHT 64
+// Faster renders are shown at once, slower ones band by band (ms)
+#define RASTER_PROGRESSIVE_DELAY 50
+
+typedef struct
+{
+  SDL_atomic_t refs;
+  fz_cookie cookie;
+  fz_display_list *dl;
+  fz_rect bounds;
+  int x, y, w, h;
+  float scale;
+  uint32_t bg, fg;
+  uint32_t started;
+  uint8_t *pixels;
+  // Rows rasterized by the worker, and rows uploaded to the texture
+  SDL_atomic_t ready;
+  int uploaded;
+  void (*notify)(void);
+} raster_job;
+
 struct txp_renderer_s
 {
   SDL_Renderer *sdl;
@@ -57,18 +105,64 @@ struct txp_renderer_s
   fz_stext_page *stext;
   int contents_bounds_valid;
   fz_rect contents_bounds;
+  int last_bounds_valid;
+  fz_rect last_bounds;
+  // Contents only cover the visible area, their bounds are meaningless
+  bool contents_partial;
+  // Incremented each time the contents change
+  unsigned contents_version;
+  txp_worker *worker;
+  bounds_cache *bounds;
   txp_renderer_config config;
 
+  // Glyph atlas path: glyphs and rules are composited, the texture only
+  // holds the residual content. NULL atlas when disabled, NULL glyphs when
+  // the page cannot be split.
+  txp_glyph_atlas *atlas;
+  txp_glyph_page *glyphs;
+  bool glyphs_valid;
+  // Display list rasterized in the texture
+  fz_display_list *raster;
+  // Rasterization in progress, NULL when the texture is up to date
+  raster_job *raster_job;
+
   SDL_Texture *tex;
   texture_state st;
   fz_point selection_start;
-  fz_rect selections[40];
+  // Rects to highlight: the snapped rect of a click, or the rects of the
+  // selection being dragged
+  const fz_rect *selections;
   int selection_count;
+  fz_rect snapped;
+  txp_selection *drag;
+  bool drag_started;
   fz_point scale_factor;
 
   uint32_t cached_bg, cached_fg;
 };
 
+static void raster_job_drop(fz_context *ctx, raster_job *job)
+{
+  if (SDL_AtomicAdd(&job->refs, -1) > 1)
+    return;
+  fz_drop_display_list(ctx, job->dl);
+  fz_free(ctx, job->pixels);
+  fz_free(ctx, job);
+}
+
+static void cancel_raster(fz_context *ctx, txp_renderer *self)
+{
+  if (!self->raster_job)
+    return;
+  // Only the rows uploaded so far are valid
+  int rows = self->raster_job->uploaded;
+  if (rows > 0 && rows < self->raster_job->h)
+    self->st.rect.y1 = self->st.rect.y0 + rows;
+  self->raster_job->cookie.abort = 1;
+  raster_job_drop(ctx, self->raster_job);
+  self->raster_job = NULL;
+}
+
 static void txp_get_colors(txp_renderer_config *config, uint32_t *bg, uint32_t *fg)
 {
   uint32_t cbg = 0xFFFFFF, cfg = 0x000000;
@@ -112,19 +206,61 @@ txp_renderer *txp_renderer_new(fz_context *ctx, SDL_Renderer *sdl)
   return self;
 }
 
+static void bounds_cache_drop(fz_context *ctx, bounds_cache *cache)
+{
+  SDL_LockMutex(cache->lock);
+  int refs = --cache->refs;
+  SDL_UnlockMutex(cache->lock);
+  if (refs > 0)
+    return;
+
+  for (int i = 0; i < BOUNDS_CACHE_SIZE; ++i)
+    if (cache->entries[i].dl)
+      fz_drop_display_list(ctx, cache->entries[i].dl);
+  SDL_DestroyMutex(cache->lock);
+  fz_free(ctx, cache);
+}
+
+void txp_renderer_set_worker(fz_context *ctx, txp_renderer *self,
+                             txp_worker *worker, void (*notify)(void))
+{
+  self->worker = worker;
+  if (!self->bounds)
+  {
+    self->bounds = fz_malloc_struct(ctx, bounds_cache);
+    self->bounds->lock = SDL_CreateMutex();
+    self->bounds->refs = 1;
+    if (!self->bounds->lock)
+      abort();
+  }
+  self->bounds->notify = notify;
+}
+
 void txp_renderer_free(fz_context *ctx, txp_renderer *self)
 {
+  cancel_raster(ctx, self);
+  if (self->bounds)
+    bounds_cache_drop(ctx, self->bounds);
   if (self->contents)
     fz_drop_display_list(ctx, self->contents);
   if (self->stext)
     fz_drop_stext_page(ctx, self->stext);
+  txp_selection_free(ctx, self->drag);
   if (self->tex)
     SDL_DestroyTexture(self->tex);
   if (self->scratch)
     fz_drop_buffer(ctx, self->scratch);
+  txp_glyph_page_free(ctx, self->glyphs);
+  txp_glyph_atlas_free(ctx, self->atlas);
   fz_free(ctx, self);
 }
 
+void txp_renderer_use_glyph_atlas(fz_context *ctx, txp_renderer *self)
+{
+  if (!self->atlas)
+    self->atlas = txp_glyph_atlas_new(ctx, self->sdl);
+}
+
 static void update_renderer_size(txp_renderer *self)
 {
   SDL_GetRendererOutputSize(self->sdl, &self->output_w, &self->output_h);
@@ -132,32 +268,98 @@ static void update_renderer_size(txp_renderer *self)
 
 static void clear_texture(txp_renderer *self)
 {
-  self->st.x = 0;
-  self->st.y = 0;
-  self->st.rect = fz_make_irect(0, 0, 0, 0);
+  // The job is dropped by the next update of the texture
+  if (self->raster_job)
+    self->raster_job->cookie.abort = 1;
+  self->st.stale = 1;
 }
 
-void txp_renderer_set_contents(fz_context *ctx, txp_renderer *self, fz_display_list *dl)
+static void set_contents(fz_context *ctx, txp_renderer *self, fz_display_list *dl, bool partial)
 {
   if (self->contents == dl)
     return;
+  self->contents_partial = partial;
   fz_keep_display_list(ctx, dl);
   if (self->contents)
     fz_drop_display_list(ctx, self->contents);
   if (self->stext)
     fz_drop_stext_page(ctx, self->stext);
   self->stext = NULL;
+  txp_selection_free(ctx, self->drag);
+  self->drag = NULL;
+  self->drag_started = 0;
   self->contents = dl;
+  self->contents_version += 1;
+  txp_glyph_page_free(ctx, self->glyphs);
+  self->glyphs = NULL;
+  self->glyphs_valid = 0;
+  self->raster = NULL;
   clear_texture(self);
   self->contents_bounds_valid = 0;
   self->selection_count = 0;
 }
 
+void txp_renderer_set_contents(fz_context *ctx, txp_renderer *self, fz_display_list *dl)
+{
+  set_contents(ctx, self, dl, 0);
+}
+
+void txp_renderer_set_partial_contents(fz_context *ctx, txp_renderer *self, fz_display_list *dl)
+{
+  set_contents(ctx, self, dl, 1);
+}
+
 fz_display_list *txp_renderer_get_contents(fz_context *ctx, txp_renderer *self)
 {
   return self->contents;
 }
 
+unsigned txp_renderer_contents_version(txp_renderer *self)
+{
+  return self->contents_version;
+}
+
+size_t txp_renderer_memory(txp_renderer *self)
+{
+  size_t size = (size_t)self->st.w * self->st.h * 3;
+  if (self->raster_job)
+    size += (size_t)self->raster_job->w * 3 * self->raster_job->h;
+  if (self->scratch)
+    size += self->scratch->cap;
+  return size + txp_glyph_atlas_memory(self->atlas);
+}
+
+void txp_renderer_shrink(fz_context *ctx, txp_renderer *self)
+{
+  // A selection being dragged refers to the text page
+  if (self->stext && !self->drag)
+  {
+    fz_drop_stext_page(ctx, self->stext);
+    self->stext = NULL;
+  }
+
+  if (self->scratch)
+  {
+    fz_drop_buffer(ctx, self->scratch);
+    self->scratch = NULL;
+  }
+
+  // Pending entries are still needed by their job
+  bounds_cache *cache = self->bounds;
+  if (cache)
+  {
+    SDL_LockMutex(cache->lock);
+    for (int i = 0; i < BOUNDS_CACHE_SIZE; ++i)
+      if (cache->entries[i].dl && cache->entries[i].ready &&
+          cache->entries[i].dl != self->contents)
+      {
+        fz_drop_display_list(ctx, cache->entries[i].dl);
+        cache->entries[i].dl = NULL;
+      }
+    SDL_UnlockMutex(cache->lock);
+  }
+}
+
 txp_renderer_config *txp_renderer_get_config(fz_context *ctx, txp_renderer *self)
 {
   return &self->config;
@@ -167,6 +369,115 @@ void txp_renderer_config_changed(fz_context *ctx, txp_renderer *self)
 {
 }
 
+static fz_rect compute_bounds(fz_context *ctx, fz_display_list *dl)
+{
+  fz_rect bounds = fz_bound_display_list(ctx, dl);
+  fz_rect result = fz_empty_rect;
+  fz_device * dev = fz_new_bbox_device(ctx, &result);
+  fz_try(ctx)
+  {
+    fz_run_display_list(ctx, dl, dev, fz_identity, bounds, NULL);
+    fz_close_device(ctx, dev);
+  }
+  fz_always(ctx)
+  {
+    fz_drop_device(ctx, dev);
+  }
+  fz_catch(ctx)
+  {
+    fz_rethrow(ctx);
+  }
+  return fz_intersect_rect(bounds, result);
+}
+
+struct bounds_job
+{
+  bounds_cache *cache;
+  fz_display_list *dl;
+};
+
+static void bounds_job_run(fz_context *ctx, void *data)
+{
+  struct bounds_job *job = data;
+  fz_rect bounds;
+  fz_try(ctx)
+  {
+    bounds = compute_bounds(ctx, job->dl);
+  }
+  fz_catch(ctx)
+  {
+    // Don't leave the entry pending forever: use the whole page
+    fprintf(stderr, "[renderer] cannot compute bounds: %s\n",
+            fz_caught_message(ctx));
+    bounds = fz_bound_display_list(ctx, job->dl);
+  }
+  bounds_cache *cache = job->cache;
+
+  SDL_LockMutex(cache->lock);
+  for (int i = 0; i < BOUNDS_CACHE_SIZE; ++i)
+  {
+    if (cache->entries[i].dl == job->dl)
+    {
+      cache->entries[i].bounds = bounds;
+      cache->entries[i].ready = 1;
+    }
+  }
+  SDL_UnlockMutex(cache->lock);
+
+  if (cache->notify)
+    cache->notify();
+}
+
+static void bounds_job_release(fz_context *ctx, void *data)
+{
+  struct bounds_job *job = data;
+  fz_drop_display_list(ctx, job->dl);
+  bounds_cache_drop(ctx, job->cache);
+  fz_free(ctx, job);
+}
+
+// Look for the bounds of a display list in the cache, scheduling their
+// computation if they are not known
+static bool bounds_cache_lookup(fz_context *ctx, txp_renderer *self,
+                                fz_display_list *dl, fz_rect *bounds)
+{
+  bounds_cache *cache = self->bounds;
+  SDL_LockMutex(cache->lock);
+
+  for (int i = 0; i < BOUNDS_CACHE_SIZE; ++i)
+  {
+    if (cache->entries[i].dl == dl)
+    {
+      bool ready = cache->entries[i].ready;
+      if (ready)
+        *bounds = cache->entries[i].bounds;
+      SDL_UnlockMutex(cache->lock);
+      return ready;
+    }
+  }
+
+  int index = cache->next;
+  cache->next = (index + 1) % BOUNDS_CACHE_SIZE;
+  if (cache->entries[index].dl)
+    fz_drop_display_list(ctx, cache->entries[index].dl);
+  cache->entries[index].dl = fz_keep_display_list(ctx, dl);
+  cache->entries[index].ready = 0;
+  cache->refs += 1;
+  SDL_UnlockMutex(cache->lock);
+
+  struct bounds_job *job = fz_malloc_struct(ctx, struct bounds_job);
+  job->cache = cache;
+  job->dl = fz_keep_display_list(ctx, dl);
+  if (!txp_worker_submit(self->worker, bounds_job_run, bounds_job_release, job))
+  {
+    bounds_job_run(ctx, job);
+    bounds_job_release(ctx, job);
+    return bounds_cache_lookup(ctx, self, dl, bounds);
+  }
+
+  return 0;
+}
+
 static fz_rect get_bounds(fz_context *ctx, txp_renderer *self)
 {
   fz_rect bounds = fz_bound_display_list(ctx, self->contents);
@@ -174,15 +485,25 @@ static fz_rect get_bounds(fz_context *ctx, txp_renderer *self)
   if (!self->config.crop)
     return bounds;
 
+  // Crop bounds of a partial page would be wrong, keep the previous ones
+  if (self->contents_partial)
+    return self->last_bounds_valid ? self->last_bounds : bounds;
+
   if (!self->contents_bounds_valid)
   {
-    self->contents_bounds = fz_empty_rect;
-    fz_device * dev = fz_new_bbox_device(ctx, &self->contents_bounds);
-    fz_run_display_list(ctx, self->contents, dev, fz_identity, bounds, NULL);
-    fz_close_device(ctx, dev);
-    fz_drop_device(ctx, dev);
-    self->contents_bounds = fz_intersect_rect(bounds, self->contents_bounds);
+    if (!self->bounds)
+      self->contents_bounds = compute_bounds(ctx, self->contents);
+    else if (!bounds_cache_lookup(ctx, self, self->contents,
+                                  &self->contents_bounds))
+    {
+      // Not ready yet: keep the bounds of the previous page meanwhile
+      if (self->last_bounds_valid)
+        return self->last_bounds;
+      return bounds;
+    }
     self->contents_bounds_valid = 1;
+    self->last_bounds = self->contents_bounds;
+    self->last_bounds_valid = 1;
   }
 
   return self->contents_bounds;
@@ -280,6 +601,8 @@ static void prepare_texture(fz_context *ctx, txp_renderer *self)
     {
       SDL_DestroyTexture(self->tex);
       self->tex = NULL;
+      if (self->raster_job)
+        self->raster_job->cookie.abort = 1;
     }
   }
 
@@ -308,6 +631,7 @@ static void invert_pixmap(fz_context *ctx, fz_pixmap *pix, uint32_t black, uint3
   int stride = fz_pixmap_stride(ctx, pix);
   int width = fz_pixmap_width(ctx, pix);
   int height = fz_pixmap_height(ctx, pix);
+  int n = fz_pixmap_components(ctx, pix);
 
   // 0x282c34
   uint8_t dark[3] = {
@@ -324,7 +648,7 @@ static void invert_pixmap(fz_context *ctx, fz_pixmap *pix, uint32_t black, uint3
   for (int y = 0; y < height; ++y)
   {
     uint8_t *data = data0 + stride * y;
-    for (int x = 0; x < width; ++x, data += 3)
+    for (int x = 0; x < width; ++x, data += n)
     {
       data[0] = remap(data[0], dark[0], light[0]);
       data[1] = remap(data[1], dark[1], light[1]);
@@ -333,8 +657,9 @@ static void invert_pixmap(fz_context *ctx, fz_pixmap *pix, uint32_t black, uint3
   }
 }
 
-static void render_rect(fz_context *ctx, txp_renderer *self, fz_rect bounds, void *pixels, int pitch,
-                        int x, int y, fz_irect r, float scale)
+static void rasterize(fz_context *ctx, fz_display_list *dl, fz_rect bounds,
+                      void *pixels, int pitch, int x, int y, fz_irect r,
+                      float scale, uint32_t bg, uint32_t fg, fz_cookie *cookie)
 {
   fz_colorspace *csp = fz_device_bgr(ctx);
   if (pitch == 0)
@@ -352,19 +677,31 @@ static void render_rect(fz_context *ctx, txp_renderer *self, fz_rect bounds, voi
   bounds.x1 = bounds.x0 + (r.x1 - r.x0) / scale;
   bounds.y1 = bounds.y0 + (r.y1 - r.y0) / scale;
 
-  fz_point p0 = fz_transform_point_xy(bounds.x0, bounds.y0, ctm);
-  fz_point p1 = fz_transform_point_xy(bounds.x1, bounds.y1, ctm);
-  fprintf(stderr, "optimized bounds: %f,%f - %f,%f\n", p0.x, p0.y, p1.x, p1.y);
-
-  fz_run_display_list(ctx, self->contents, dev, fz_identity, bounds, NULL);
-  fz_close_device(ctx, dev);
-  fz_drop_device(ctx, dev);
+  fz_try(ctx)
+  {
+    fz_run_display_list(ctx, dl, dev, fz_identity, bounds, cookie);
+    fz_close_device(ctx, dev);
+    //if (bg != 0x00FFFFFF || fg != 0x00000000)
+      invert_pixmap(ctx, pm, fg, bg);
+  }
+  fz_always(ctx)
+  {
+    fz_drop_device(ctx, dev);
+    fz_drop_pixmap(ctx, pm);
+  }
+  fz_catch(ctx)
+  {
+    fz_rethrow(ctx);
+  }
+}
 
+static void render_rect(fz_context *ctx, txp_renderer *self, fz_rect bounds, void *pixels, int pitch,
+                        int x, int y, fz_irect r, float scale)
+{
   uint32_t bg, fg;
   txp_get_colors(&self->config, &bg, &fg);
-  //if (bg != 0x00FFFFFF || fg != 0x00000000)
-    invert_pixmap(ctx, pm, fg, bg);
-  fz_drop_pixmap(ctx, pm);
+  rasterize(ctx, self->raster, bounds, pixels, pitch, x, y, r, scale, bg, fg,
+            NULL);
 }
 
 static void render_inc_rect(fz_context *ctx, txp_renderer *self, fz_rect bounds, void *pixels,
@@ -373,6 +710,127 @@ static void render_inc_rect(fz_context *ctx, txp_renderer *self, fz_rect bounds,
   render_rect(ctx, self, bounds, pixels, 0, x + r.x0 - n.x0, y + r.y0 - n.y0, r, scale);
 }
 
+static void fill_background(uint8_t *pixels, int pitch, int w, int h, uint32_t bg)
+{
+  // BGR, like the texture
+  for (int y = 0; y < h; ++y)
+  {
+    uint8_t *row = pixels + (size_t)y * pitch;
+    for (int x = 0; x < w; ++x, row += 3)
+    {
+      row[0] = bg & 0xFF;
+      row[1] = (bg >> 8) & 0xFF;
+      row[2] = (bg >> 16) & 0xFF;
+    }
+  }
+}
+
+static void raster_job_run(fz_context *ctx, void *data)
+{
+  raster_job *job = data;
+  int pitch = job->w * 3;
+
+  for (int y0 = 0; y0 < job->h && !job->cookie.abort; y0 += RASTER_BAND_HEIGHT)
+  {
+    int y1 = fz_mini(y0 + RASTER_BAND_HEIGHT, job->h);
+    fz_try(ctx)
+    {
+      rasterize(ctx, job->dl, job->bounds, job->pixels + (size_t)y0 * pitch,
+                pitch, job->x, job->y + y0, fz_make_irect(0, 0, job->w, y1 - y0),
+                job->scale, job->bg, job->fg, &job->cookie);
+    }
+    fz_catch(ctx)
+    {
+      fprintf(stderr, "[renderer] cannot rasterize rows %d-%d: %s\n", y0, y1,
+              fz_caught_message(ctx));
+      fill_background(job->pixels + (size_t)y0 * pitch, pitch, job->w, y1 - y0,
+                      job->bg);
+    }
+    // An aborted band is incomplete
+    if (job->cookie.abort)
+      break;
+    SDL_AtomicSet(&job->ready, y1);
+    job->notify();
+  }
+}
+
+static void raster_job_release(fz_context *ctx, void *data)
+{
+  raster_job_drop(ctx, data);
+}
+
+// Rasterize the whole texture on a worker thread, returns false if it has to
+// be done synchronously
+static bool start_raster(fz_context *ctx, txp_renderer *self, fz_rect bounds,
+                         int x, int y, int w, int h, float scale)
+{
+  if (!self->worker || !self->bounds || !self->bounds->notify)
+    return 0;
+
+  raster_job *job = fz_malloc_struct(ctx, raster_job);
+  fz_try(ctx)
+  {
+    job->pixels = fz_malloc(ctx, (size_t)w * 3 * h);
+  }
+  fz_catch(ctx)
+  {
+    fz_free(ctx, job);
+    return 0;
+  }
+
+  SDL_AtomicSet(&job->refs, 2);
+  job->dl = fz_keep_display_list(ctx, self->raster);
+  job->bounds = bounds;
+  job->x = x;
+  job->y = y;
+  job->w = w;
+  job->h = h;
+  job->scale = scale;
+  txp_get_colors(&self->config, &job->bg, &job->fg);
+  job->started = SDL_GetTicks();
+  job->notify = self->bounds->notify;
+
+  if (!txp_worker_submit(self->worker, raster_job_run, raster_job_release, job))
+  {
+    raster_job_drop(ctx, job);
+    raster_job_drop(ctx, job);
+    return 0;
+  }
+
+  self->raster_job = job;
+  return 1;
+}
+
+// Upload the bands finished by the worker.
+// The texture and its state keep the previous frame until the first upload.
+static void upload_raster(fz_context *ctx, txp_renderer *self)
+{
+  raster_job *job = self->raster_job;
+  int ready = SDL_AtomicGet(&job->ready);
+  if (ready < job->h &&
+      SDL_GetTicks() - job->started < RASTER_PROGRESSIVE_DELAY)
+    return;
+
+  if (ready > job->uploaded)
+  {
+    if (job->uploaded == 0)
+    {
+      self->st.x = job->x;
+      self->st.y = job->y;
+      self->st.rect = fz_make_irect(0, 0, job->w, job->h);
+      self->st.scale = job->scale;
+      self->st.stale = 0;
+    }
+    int pitch = job->w * 3;
+    SDL_Rect r = {.x = 0, .y = job->uploaded, .w = job->w, .h = ready - job->uploaded};
+    SDL_UpdateTexture(self->tex, &r, job->pixels + (size_t)job->uploaded * pitch, pitch);
+    job->uploaded = ready;
+  }
+
+  if (job->uploaded == job->h)
+    cancel_raster(ctx, self);
+}
+
 static void update_sdl_texture(SDL_Texture *t, int pitch, void *pixels,
                                int x0, int y0, int x1, int y1)
 {
@@ -550,12 +1008,31 @@ static void update_texture(fz_context *ctx,
   float doc_w = bounds.x1 - bounds.x0;
   float scale = (page_rect->w / doc_w);
 
+  if (self->raster_job)
+  {
+    raster_job *job = self->raster_job;
+    fz_irect view = fz_make_irect(x, y, x + w, y + h);
+    fz_irect area = fz_make_irect(job->x, job->y, job->x + job->w, job->y + job->h);
+    // Scrolling does not restart the job: its rows are drawn where they
+    // belong, and the rest of the view is rendered once it is done
+    if (!job->cookie.abort && job->w == w && job->h == h && job->scale == scale &&
+        !fz_is_empty_irect(fz_intersect_irect(view, area)))
+    {
+      upload_raster(ctx, self);
+      if (self->raster_job)
+        return;
+    }
+    else
+      // Obsolete: the texture keeps the previous frame until the next job
+      // uploads
+      cancel_raster(ctx, self);
+  }
+
   int done = 0;
 
-  if (scale != self->st.scale)
+  if (self->st.stale || scale != self->st.scale || fz_is_empty_irect(self->st.rect))
   {
-    self->st.scale = scale;
-    // TODO: Full rerender
+    // Full rerender
   }
   else if (self->st.x != x ||
            self->st.y != y ||
@@ -570,9 +1047,6 @@ static void update_texture(fz_context *ctx,
     n.y0 = o.y0 - self->st.y + y,
     n.x1 = n.x0 + w;
     n.y1 = n.y0 + h;
-    self->st.x = x;
-    self->st.y = y;
-    self->st.rect = n;
 
     fz_irect overlap = fz_intersect_irect(o, n);
     if (fz_is_empty_irect(overlap))
@@ -580,6 +1054,9 @@ static void update_texture(fz_context *ctx,
     else
     {
       fprintf(stderr, "Overlap: %d pixels\n", fz_irect_area(overlap));
+      self->st.x = x;
+      self->st.y = y;
+      self->st.rect = n;
 
       fz_irect tl = fz_make_irect(n.x0, n.y0, fz_mini(n.x1, o.x0), fz_mini(n.y1, o.y1));
       fz_irect tr = fz_make_irect(fz_maxi(o.x0, n.x0), n.y0, n.x1, fz_mini(n.y1, o.y0));
@@ -647,6 +1124,12 @@ static void update_texture(fz_context *ctx,
   if (done)
     return;
 
+  if (!STRESS && start_raster(ctx, self, bounds, x, y, w, h, scale))
+  {
+    upload_raster(ctx, self);
+    return;
+  }
+
   void *pixels;
   int pitch;
 
@@ -690,6 +1173,8 @@ static void update_texture(fz_context *ctx,
   self->st.rect.y0 = y0;
   self->st.rect.x1 = x0 + w;
   self->st.rect.y1 = y0 + h;
+  self->st.scale = scale;
+  self->st.stale = 0;
 
   if (STRESS)
   {
@@ -699,6 +1184,42 @@ static void update_texture(fz_context *ctx,
   // fprintf(stderr, "[txp_renderer] updated texture, new pixels: %d\n", w * h);
 }
 
+// Draw the view (x, y, w, h in page pixels) at (bx, by) on the screen.
+// While a job runs, the texture can hold another position or the previous
+// contents: only the part at the right place and scale is drawn, the rest
+// of the view shows the background.
+static void blit_texture(txp_renderer *self, int bx, int by, int x, int y,
+                         int w, int h, float scale, uint32_t bg)
+{
+  fz_irect valid = self->st.rect;
+  if (self->raster_job && self->raster_job->uploaded > 0)
+    valid.y1 = valid.y0 + self->raster_job->uploaded;
+
+  // The view in texture coordinates
+  fz_irect view;
+  view.x0 = valid.x0 - self->st.x + x;
+  view.y0 = valid.y0 - self->st.y + y;
+  view.x1 = view.x0 + w;
+  view.y1 = view.y0 + h;
+
+  fz_irect vis = fz_make_irect(0, 0, 0, 0);
+  if (self->st.scale == scale)
+    vis = fz_intersect_irect(valid, view);
+
+  if (fz_is_empty_irect(vis) || vis.x0 != view.x0 || vis.y0 != view.y0 ||
+      vis.x1 != view.x1 || vis.y1 != view.y1)
+  {
+    SDL_Rect rest = {.x = bx, .y = by, .w = w, .h = h};
+    SDL_SetRenderDrawColor(self->sdl, (bg >> 16) & 0xFF, (bg >> 8) & 0xFF,
+                           bg & 0xFF, 255);
+    SDL_RenderFillRect(self->sdl, &rest);
+  }
+
+  if (!fz_is_empty_irect(vis))
+    render_texture_rect(self->sdl, bx + vis.x0 - view.x0, by + vis.y0 - view.y0,
+                        self->tex, vis);
+}
+
 static void render_caret(txp_renderer *self, int x, int y, int h)
 {
   int scale_factor = self->scale_factor.x;
@@ -723,16 +1244,53 @@ static void render_caret(txp_renderer *self, int x, int y, int h)
 }
 
 
+static txp_glyph_page *get_glyphs(fz_context *ctx, txp_renderer *self)
+{
+  if (!self->atlas)
+    return NULL;
+
+  if (!self->glyphs_valid)
+  {
+    self->glyphs_valid = 1;
+    fz_try(ctx)
+    {
+      self->glyphs = txp_glyph_page_new(ctx, self->contents);
+    }
+    fz_catch(ctx)
+    {
+      fprintf(stderr, "[renderer] cannot collect glyphs: %s\n",
+              fz_caught_message(ctx));
+      self->glyphs = NULL;
+    }
+  }
+
+  return self->glyphs;
+}
+
 void txp_renderer_render(fz_context *ctx, txp_renderer *self)
 {
   SDL_FRect page_rect;
+  fz_point translate;
   float scale;
 
   // fprintf(stderr, "[txp_renderer] txp_renderer_render: compute page pos\n");
 
-  if (!txp_renderer_page_position(ctx, self, &page_rect, NULL, &scale))
+  if (!txp_renderer_page_position(ctx, self, &page_rect, &translate, &scale))
     return;
 
+  // Glyphs are composited from the atlas unless they are too large, in
+  // which case the whole page is rasterized
+  txp_glyph_page *glyphs = get_glyphs(ctx, self);
+  if (glyphs && !txp_glyph_page_fits(glyphs, scale))
+    glyphs = NULL;
+
+  fz_display_list *raster = glyphs ? txp_glyph_page_residue(glyphs) : self->contents;
+  if (raster != self->raster)
+  {
+    self->raster = raster;
+    clear_texture(self);
+  }
+
   uint32_t bg, fg;
   txp_get_colors(&self->config, &bg, &fg);
   if (self->cached_bg != bg || self->cached_fg != fg)
@@ -761,19 +1319,46 @@ void txp_renderer_render(fz_context *ctx, txp_renderer *self)
 
   // fprintf(stderr, "[txp_renderer] txp_renderer_render: update texture\n");
 
-  struct timespec update_start, update_end;
-  clock_gettime(CLOCK_MONOTONIC, &update_start);
-  update_texture(ctx, self, &page_rect, &view_rect);
-  clock_gettime(CLOCK_MONOTONIC, &update_end);
-  // fprintf(stderr, "[txp_renderer] updated texture in %ldus\n",
-  //         (update_end.tv_sec - update_start.tv_sec) * 1000 * 1000 +
-  //         (update_end.tv_nsec - update_start.tv_nsec) / 1000);
-  // fprintf(stderr, "[txp_renderer] txp_renderer_render: blit texture to screen\n");
-
   int bx0 = floorf(view_rect.x);
   int by0 = floorf(view_rect.y);
   int pixel_pushed = 0;
-  render_texture_rect(self->sdl, bx0, by0, self->tex, self->st.rect);
+
+  if (self->raster)
+  {
+    struct timespec update_start, update_end;
+    clock_gettime(CLOCK_MONOTONIC, &update_start);
+    update_texture(ctx, self, &page_rect, &view_rect);
+    clock_gettime(CLOCK_MONOTONIC, &update_end);
+    // fprintf(stderr, "[txp_renderer] updated texture in %ldus\n",
+    //         (update_end.tv_sec - update_start.tv_sec) * 1000 * 1000 +
+    //         (update_end.tv_nsec - update_start.tv_nsec) / 1000);
+    // fprintf(stderr, "[txp_renderer] txp_renderer_render: blit texture to screen\n");
+    // Same view as update_texture
+    fz_rect bounds = get_bounds(ctx, self);
+    blit_texture(self, bx0, by0, view_rect.x - page_rect.x, view_rect.y - page_rect.y,
+                 view_rect.w, view_rect.h, page_rect.w / (bounds.x1 - bounds.x0), bg);
+  }
+  else
+  {
+    // Only glyphs and rules: nothing to rasterize
+    SDL_SetRenderDrawColor(self->sdl, (bg >> 16) & 0xFF, (bg >> 8) & 0xFF,
+                           bg & 0xFF, 255);
+    SDL_RenderFillRectF(self->sdl, &view_rect);
+  }
+
+  if (glyphs)
+  {
+    fz_try(ctx)
+    {
+      txp_glyph_atlas_draw(ctx, self->atlas, glyphs, translate, scale, fg, bg);
+    }
+    fz_catch(ctx)
+    {
+      fprintf(stderr, "[renderer] cannot draw glyphs: %s\n",
+              fz_caught_message(ctx));
+    }
+  }
+
   if (self->selection_count != 0)
   {
     SDL_SetRenderDrawBlendMode(self->sdl, SDL_BLENDMODE_BLEND);
@@ -803,6 +1388,49 @@ void txp_renderer_render(fz_context *ctx, txp_renderer *self)
   // fprintf(stderr, "[render] pixels pushed to screen: %d\n", pixel_pushed);
 }
 
+bool txp_renderer_render_pixels(fz_context *ctx, txp_renderer *self,
+                                uint8_t *pixels, int w, int h, int stride)
+{
+  fz_point translate;
+  float scale;
+  if (!txp_renderer_page_position(ctx, self, NULL, &translate, &scale))
+    return 0;
+
+  fz_pixmap *pm = fz_new_pixmap_with_data(ctx, fz_device_bgr(ctx), w, h,
+                                          NULL, 1, stride, pixels);
+  fz_device *dev = NULL;
+  fz_var(dev);
+
+  fz_try(ctx)
+  {
+    fz_clear_pixmap_with_value(ctx, pm, 255);
+    fz_matrix ctm = fz_pre_scale(fz_translate(translate.x, translate.y),
+                                 scale, scale);
+    fz_rect area = fz_make_rect(-translate.x / scale, -translate.y / scale,
+                                (w - translate.x) / scale,
+                                (h - translate.y) / scale);
+    dev = fz_new_draw_device(ctx, ctm, pm);
+    fz_run_display_list(ctx, self->contents, dev, fz_identity, area, NULL);
+    fz_close_device(ctx, dev);
+
+    uint32_t bg, fg;
+    txp_get_colors(&self->config, &bg, &fg);
+    invert_pixmap(ctx, pm, fg, bg);
+  }
+  fz_always(ctx)
+  {
+    fz_drop_device(ctx, dev);
+    fz_drop_pixmap(ctx, pm);
+  }
+  fz_catch(ctx)
+  {
+    fprintf(stderr, "[renderer] cannot render pixels: %s\n",
+            fz_caught_message(ctx));
+    return 0;
+  }
+  return 1;
+}
+
 static float point_to_rect_dist(fz_point p, fz_rect r)
 {
   float dx = fz_max(0, fz_max(r.x0 - p.x, p.x - r.x1));
@@ -819,6 +1447,7 @@ bool txp_renderer_start_selection(fz_context *ctx, txp_renderer *self, fz_point
 {
   int has_sel = self->selection_count != 0;
   self->selection_count = 0;
+  self->drag_started = 0;
 
   SDL_FRect page_rect;
   float scale;
@@ -833,30 +1462,21 @@ bool txp_renderer_start_selection(fz_context *ctx, txp_renderer *self, fz_point
   return has_sel;
 }
 
-static int set_quads(fz_context *ctx, txp_renderer *self, fz_quad *quads, int count)
+static int set_quad(fz_context *ctx, txp_renderer *self, fz_quad quad, int count)
 {
-  int diff = count != self->selection_count;
+  fz_rect r = fz_rect_from_quad(quad);
+  int diff = count != self->selection_count ||
+             (count > 0 && self->selections != &self->snapped) ||
+             (count > 0 && (r.x0 != self->snapped.x0 || r.y0 != self->snapped.y0 ||
+                            r.x1 != self->snapped.x1 || r.y1 != self->snapped.y1));
+  self->snapped = r;
+  self->selections = &self->snapped;
   self->selection_count = count;
-
-  for (int i = 0; i < count; ++i)
-  {
-    fz_rect r = fz_rect_from_quad(quads[i]);
-    if (!diff)
-      diff =
-          (r.x0 != self->selections[i].x0 || r.y0 != self->selections[i].y0 ||
-           r.x1 != self->selections[i].x1 || r.y1 != self->selections[i].y1);
-    self->selections[i] = r;
-  }
-
   return diff;
 }
 
 bool txp_renderer_drag_selection(fz_context *ctx, txp_renderer *self, fz_point pt)
 {
-  fz_stext_page *page = get_stext(ctx, self);
-  if (!page)
-    return 0;
-
   SDL_FRect page_rect;
   fz_point translate, p;
   float scale;
@@ -864,12 +1484,33 @@ bool txp_renderer_drag_selection(fz_context *ctx, txp_renderer *self, fz_point p
   if (!txp_renderer_page_position(ctx, self, &page_rect, &translate, &scale))
     return 0;
 
+  if (!self->drag)
+  {
+    fz_stext_page *page = get_stext(ctx, self);
+    if (!page)
+      return 0;
+    self->drag = txp_selection_new(ctx, page);
+  }
+
+  if (!self->drag_started)
+  {
+    txp_selection_start(self->drag, self->selection_start);
+    self->drag_started = 1;
+  }
+
   p = fz_make_point((pt.x - translate.x) / scale, (pt.y - translate.y) / scale);
 
-  fz_quad quads[40];
-  int count = fz_highlight_selection(ctx, page, self->selection_start, p, quads, 40);
+  bool was_drag = self->selection_count > 0 && self->selections != &self->snapped;
+  bool diff = txp_selection_extend(ctx, self->drag, p);
+  if (!diff && was_drag)
+    return 0;
 
-  return set_quads(ctx, self, quads, count);
+  // The first move replaces the rect of the click
+  int count;
+  self->selections = txp_selection_rects(self->drag, &count);
+  diff = diff || count != self->selection_count;
+  self->selection_count = count;
+  return diff;
 }
 
 bool txp_renderer_select_char(fz_context *ctx, txp_renderer *self, fz_point pt)
@@ -916,7 +1557,7 @@ bool txp_renderer_select_char(fz_context *ctx, txp_renderer *self, fz_point pt)
   fprintf(stderr, "sel rect: (%f,%f)-(%f,%f)\n", r.x0, r.y0, r.x1, r.y1);
 
 
-  return set_quads(ctx, self, &q, count);
+  return set_quad(ctx, self, q, count);
 }
 
 bool txp_renderer_select_word(fz_context *ctx, txp_renderer *self, fz_point pt)
@@ -944,7 +1585,7 @@ bool txp_renderer_select_word(fz_context *ctx, txp_renderer *self, fz_point pt)
     q = fz_snap_selection(ctx, page, &p0, &p1, FZ_SELECT_WORDS);
   }
 
-  return set_quads(ctx, self, &q, 1);
+  return set_quad(ctx, self, q, 1);
 }
 
 void txp_renderer_set_scale_factor(fz_context *ctx, txp_renderer *self, fz_point scale)
@@ -961,6 +1602,18 @@ fz_point txp_renderer_screen_to_document(fz_context *ctx, txp_renderer *self, fz
   return fz_make_point((pt.x - translate.x) / scale, (pt.y - translate.y) / scale);
 }
 
+fz_rect txp_renderer_visible_rect(fz_context *ctx, txp_renderer *self)
+{
+  fz_point translate;
+  float scale;
+  if (!txp_renderer_page_position(ctx, self, NULL, &translate, &scale))
+    return fz_infinite_rect;
+  return fz_make_rect(-translate.x / scale,
+                      -translate.y / scale,
+                      (self->output_w - translate.x) / scale,
+                      (self->output_h - translate.y) / scale);
+}
+
 fz_point txp_renderer_document_to_screen(fz_context *ctx, txp_renderer *self, fz_point pt)
 {
   fz_point translate;
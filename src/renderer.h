@@ -30,12 +30,22 @@
 #include <mupdf/fitz/context.h>
 #include <mupdf/fitz/display-list.h>
 #include <mupdf/fitz/structured-text.h>
+#include "worker.h"
 
 typedef struct txp_renderer_s txp_renderer;
 
 txp_renderer *txp_renderer_new(fz_context *ctx, SDL_Renderer *sdl);
 void txp_renderer_free(fz_context *ctx, txp_renderer *r);
 
+// Offload work (computing crop bounds) to a worker pool.
+// notify is called from a worker thread when a result is available.
+void txp_renderer_set_worker(fz_context *ctx, txp_renderer *self,
+                             txp_worker *worker, void (*notify)(void));
+
+// Composite glyphs and rules from an atlas texture rather than rasterizing
+// them (see glyphatlas.h)
+void txp_renderer_use_glyph_atlas(fz_context *ctx, txp_renderer *self);
+
 enum txp_fit_mode
 {
   FIT_WIDTH,
@@ -52,10 +62,24 @@ typedef struct
 } txp_renderer_config;
 
 void txp_renderer_set_contents(fz_context *ctx, txp_renderer *self, fz_display_list *dl);
+// Contents only covering the visible area, to be replaced by the full page
+void txp_renderer_set_partial_contents(fz_context *ctx, txp_renderer *self, fz_display_list *dl);
 fz_display_list *txp_renderer_get_contents(fz_context *ctx, txp_renderer *self);
+// Changes each time the contents are replaced
+unsigned txp_renderer_contents_version(txp_renderer *self);
+// Bytes used by the textures and pixel buffers. Display lists and text
+// pages are not counted: mupdf does not report their size.
+size_t txp_renderer_memory(txp_renderer *self);
+// Drop what is cheap to recompute: the text of the page, scratch pixels,
+// and the crop bounds of other pages with the display lists they keep alive
+void txp_renderer_shrink(fz_context *ctx, txp_renderer *self);
 txp_renderer_config *txp_renderer_get_config(fz_context* ctx, txp_renderer *self);
 int txp_renderer_page_position(fz_context *ctx, txp_renderer *self, SDL_FRect *rect, fz_point *translate, float *scale);
 void txp_renderer_render(fz_context *ctx, txp_renderer *self);
+// Rasterize the window contents into a w x h BGRA buffer, without the
+// selection. Returns false if there is nothing to display.
+bool txp_renderer_render_pixels(fz_context *ctx, txp_renderer *self,
+                                uint8_t *pixels, int w, int h, int stride);
 void txp_renderer_set_scale_factor(fz_context *ctx, txp_renderer *self, fz_point scale);
 bool txp_renderer_start_selection(fz_context *ctx, txp_renderer *self, fz_point pt);
 bool txp_renderer_drag_selection(fz_context *ctx, txp_renderer *self, fz_point pt);
@@ -64,5 +88,7 @@ bool txp_renderer_select_char(fz_context *ctx, txp_renderer *self, fz_point pt);
 void txp_renderer_screen_size(fz_context *ctx, txp_renderer *self, int *w, int *h);
 fz_point txp_renderer_screen_to_document(fz_context *ctx, txp_renderer *self, fz_point pt);
 fz_point txp_renderer_document_to_screen(fz_context *ctx, txp_renderer *self, fz_point pt);
+// Area of the document visible on screen (infinite if unknown)
+fz_rect txp_renderer_visible_rect(fz_context *ctx, txp_renderer *self);
 
 #endif /*!_RENDERER_H_*/
@@ -0,0 +1,822 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2023 Frédéric Bour <frederic.bour@lakaban.net>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#ifdef __linux__
+#define _GNU_SOURCE
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <SDL2/SDL.h>
+#include "renderpool.h"
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+// A helper taking longer than this on a page is killed (in milliseconds)
+#define RENDER_TIMEOUT 10000
+
+struct helper
+{
+  pid_t pid; // -1 if not running
+  int sock;
+  // Prefix of the mirror already copied by the helper
+  int valid;
+  // Request being rendered
+  bool busy;
+  // The mirror changed under the request, its result is dropped
+  bool stale;
+  uint32_t id;
+  int page, length;
+  float scale;
+  Uint64 started;
+};
+
+struct txp_render_pool
+{
+  char *helper_path, *dir;
+  int count;
+  struct helper *helpers;
+
+  // Copy of the document shared with the helpers.
+  // mirror_doc is the document last copied, with its rewrites counter.
+  int mirror_fd;
+  uint8_t *mirror;
+  int mirror_len;
+  size_t mirror_cap;
+  chunkbuf_t *mirror_doc;
+  unsigned mirror_rewrites;
+
+  // Last request, until a helper is available
+  bool pending;
+  struct txp_render_request request;
+  uint32_t last_id;
+
+  // A request that could not be dispatched
+  bool failed;
+  txp_render_result failure;
+
+  // The watcher thread polls the sockets of busy helpers and calls notify.
+  // lock protects the sock, busy and started fields of the helpers, and
+  // polling, set while the watcher uses the sockets: they are closed only
+  // after it is signaled idle.
+  SDL_mutex *lock;
+  SDL_cond *idle;
+  bool polling;
+  SDL_Thread *thread;
+  int wake[2];
+  struct pollfd *fds;
+  void (*notify)(void);
+};
+
+/* Protocol */
+
+int txp_render_shared_fd(const char *name)
+{
+#ifdef __linux__
+  return memfd_create(name, MFD_CLOEXEC);
+#else
+  const char *tmp = getenv("TMPDIR");
+  char path[PATH_MAX];
+  snprintf(path, sizeof(path), "%s/%s-XXXXXX", tmp && *tmp ? tmp : "/tmp", name);
+  int fd = mkstemp(path);
+  if (fd == -1)
+    return -1;
+  unlink(path);
+  fcntl(fd, F_SETFD, FD_CLOEXEC);
+  return fd;
+#endif
+}
+
+static bool send_all(int fd, const void *data, size_t len)
+{
+  const char *ptr = data;
+  while (len > 0)
+  {
+    ssize_t n = send(fd, ptr, len, MSG_NOSIGNAL);
+    if (n == -1 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      return 0;
+    ptr += n;
+    len -= n;
+  }
+  return 1;
+}
+
+static bool read_all(int fd, void *data, size_t len)
+{
+  char *ptr = data;
+  while (len > 0)
+  {
+    ssize_t n = read(fd, ptr, len);
+    if (n == -1 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      return 0;
+    ptr += n;
+    len -= n;
+  }
+  return 1;
+}
+
+bool txp_render_send(int sock, const void *msg, size_t len, int fd)
+{
+  char control[CMSG_SPACE(sizeof(int))];
+  memset(control, 0, sizeof(control));
+  struct iovec iov = {.iov_base = (void *)msg, .iov_len = len};
+  struct msghdr m = {
+    .msg_iov = &iov,
+    .msg_iovlen = 1,
+  };
+
+  if (fd != -1)
+  {
+    m.msg_control = control;
+    m.msg_controllen = sizeof(control);
+    struct cmsghdr *c = CMSG_FIRSTHDR(&m);
+    c->cmsg_level = SOL_SOCKET;
+    c->cmsg_type = SCM_RIGHTS;
+    c->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(c), &fd, sizeof(int));
+  }
+
+  ssize_t n;
+  do n = sendmsg(sock, &m, MSG_NOSIGNAL);
+  while (n == -1 && errno == EINTR);
+  if (n <= 0)
+    return 0;
+  // The descriptor went with the first bytes
+  return (size_t)n == len || send_all(sock, (const char *)msg + n, len - n);
+}
+
+bool txp_render_recv(int sock, void *msg, size_t len, int *fd)
+{
+  char control[CMSG_SPACE(sizeof(int))];
+  struct iovec iov = {.iov_base = msg, .iov_len = len};
+  struct msghdr m = {
+    .msg_iov = &iov,
+    .msg_iovlen = 1,
+    .msg_control = control,
+    .msg_controllen = sizeof(control),
+  };
+
+  ssize_t n;
+  do n = recvmsg(sock, &m, 0);
+  while (n == -1 && errno == EINTR);
+  if (n <= 0)
+    return 0;
+
+  int received = -1;
+  for (struct cmsghdr *c = CMSG_FIRSTHDR(&m); c; c = CMSG_NXTHDR(&m, c))
+    if (c->cmsg_level == SOL_SOCKET && c->cmsg_type == SCM_RIGHTS)
+    {
+      memcpy(&received, CMSG_DATA(c), sizeof(int));
+      fcntl(received, F_SETFD, FD_CLOEXEC);
+    }
+
+  if ((size_t)n < len && !read_all(sock, (char *)msg + n, len - n))
+  {
+    if (received != -1)
+      close(received);
+    return 0;
+  }
+
+  if (fd)
+    *fd = received;
+  else if (received != -1)
+    close(received);
+  return 1;
+}
+
+/* Watcher thread */
+
+static void wakeup_watcher(txp_render_pool *pool, char c)
+{
+  while (1)
+  {
+    int n = write(pool->wake[1], &c, 1);
+    if (n == 1)
+      break;
+    if (n == -1 && errno == EINTR)
+      continue;
+    perror("[render] write(wake, _, _)");
+    break;
+  }
+}
+
+// Like the stdin thread of the UI: after each notification, the watcher
+// waits for the UI to collect the results and to send 'c' before polling
+// again. 's' interrupts a poll so that a socket can be closed.
+static int SDLCALL watcher_main(void *data)
+{
+  txp_render_pool *pool = data;
+  struct pollfd *fds = pool->fds;
+
+  while (1)
+  {
+    char c;
+    int n = read(pool->wake[0], &c, 1);
+    if (n == -1)
+    {
+      if (errno == EINTR)
+        continue;
+      return 1;
+    }
+    if (n == 0 || c == 'q')
+      return 0;
+
+    int count = 0;
+    Uint64 deadline = UINT64_MAX;
+    SDL_LockMutex(pool->lock);
+    for (int i = 0; i < pool->count; ++i)
+    {
+      struct helper *h = &pool->helpers[i];
+      if (!h->busy)
+        continue;
+      fds[count].fd = h->sock;
+      fds[count].events = POLLIN;
+      fds[count].revents = 0;
+      count += 1;
+      if (h->started + RENDER_TIMEOUT < deadline)
+        deadline = h->started + RENDER_TIMEOUT;
+    }
+    pool->polling = 1;
+    SDL_UnlockMutex(pool->lock);
+    fds[count].fd = pool->wake[0];
+    fds[count].events = POLLIN;
+    fds[count].revents = 0;
+
+    int timeout = -1;
+    if (count > 0)
+    {
+      Uint64 now = SDL_GetTicks64();
+      timeout = deadline > now ? (int)(deadline - now) : 0;
+    }
+
+    do n = poll(fds, count + 1, timeout);
+    while (n == -1 && errno == EINTR);
+
+    SDL_LockMutex(pool->lock);
+    pool->polling = 0;
+    SDL_CondBroadcast(pool->idle);
+    SDL_UnlockMutex(pool->lock);
+    if (n == -1)
+      return 1;
+
+    // Timeouts are handled when collecting
+    bool ready = (n == 0);
+    for (int i = 0; i < count; ++i)
+      if (fds[i].revents)
+        ready = 1;
+    if (ready)
+      pool->notify();
+    // Otherwise the UI sent a new command
+  }
+}
+
+/* Document mirror */
+
+static bool grow_mirror(txp_render_pool *pool, size_t len)
+{
+  size_t cap = pool->mirror_cap ? pool->mirror_cap : 1 << 20;
+  while (cap < len)
+    cap *= 2;
+
+  // Helpers map the part they need for each request, growing the file
+  // does not invalidate their mappings.
+  if (ftruncate(pool->mirror_fd, cap) == -1)
+  {
+    perror("[render] ftruncate");
+    return 0;
+  }
+  void *ptr =
+    mmap(NULL, cap, PROT_READ | PROT_WRITE, MAP_SHARED, pool->mirror_fd, 0);
+  if (ptr == MAP_FAILED)
+  {
+    perror("[render] mmap");
+    return 0;
+  }
+  if (pool->mirror)
+    munmap(pool->mirror, pool->mirror_cap);
+  pool->mirror = ptr;
+  pool->mirror_cap = cap;
+  return 1;
+}
+
+// Copy doc to the mirror, returns the offset of the first change or -1.
+// If doc was only appended to since the last copy, the mirrored part is
+// known to be the same and is not compared.
+static int update_mirror(fz_context *ctx, txp_render_pool *pool, chunkbuf_t *doc)
+{
+  int len = doc->len, pos = 0;
+  int common = len < pool->mirror_len ? len : pool->mirror_len;
+
+  if (pool->mirror_doc == doc && pool->mirror_rewrites == doc->rewrites)
+    pos = common;
+  else
+  {
+    chunkbuf_drop(ctx, pool->mirror_doc);
+    pool->mirror_doc = chunkbuf_keep(ctx, doc);
+  }
+  pool->mirror_rewrites = doc->rewrites;
+
+  while (pos < common)
+  {
+    int avail;
+    const uint8_t *p = chunkbuf_at(doc, pos, &avail);
+    if (avail > common - pos)
+      avail = common - pos;
+    if (memcmp(p, pool->mirror + pos, avail) != 0)
+    {
+      int i = 0;
+      while (p[i] == pool->mirror[pos + i])
+        i++;
+      pos += i;
+      break;
+    }
+    pos += avail;
+  }
+
+  int changed = pos;
+  if ((size_t)len > pool->mirror_cap && !grow_mirror(pool, len))
+  {
+    pool->mirror_len = changed;
+    return -1;
+  }
+
+  while (pos < len)
+  {
+    int avail;
+    const uint8_t *p = chunkbuf_at(doc, pos, &avail);
+    if (avail > len - pos)
+      avail = len - pos;
+    memcpy(pool->mirror + pos, p, avail);
+    pos += avail;
+  }
+
+  pool->mirror_len = len;
+  return changed;
+}
+
+/* Helpers */
+
+static bool spawn_helper(txp_render_pool *pool, struct helper *h)
+{
+  int sockets[2];
+  if (socketpair(PF_UNIX, SOCK_STREAM, 0, sockets) != 0)
+  {
+    perror("[render] socketpair");
+    return 0;
+  }
+  fcntl(sockets[0], F_SETFD, FD_CLOEXEC);
+  fcntl(sockets[1], F_SETFD, FD_CLOEXEC);
+#ifdef SO_NOSIGPIPE
+  // Without MSG_NOSIGNAL, a closed peer is reported as EPIPE this way
+  int on = 1;
+  setsockopt(sockets[0], SOL_SOCKET, SO_NOSIGPIPE, &on, sizeof(on));
+  setsockopt(sockets[1], SOL_SOCKET, SO_NOSIGPIPE, &on, sizeof(on));
+#endif
+
+  char *args[] = {pool->helper_path, "-S", pool->dir, NULL};
+
+  pid_t pid = fork();
+  if (pid == 0)
+  {
+    /* CHILD */
+    // Move the socket and the mirror to the descriptors the helper expects
+    int sock = fcntl(sockets[1], F_DUPFD_CLOEXEC, 10);
+    int mirror = fcntl(pool->mirror_fd, F_DUPFD_CLOEXEC, 10);
+    if (sock == -1 || mirror == -1 ||
+        dup2(sock, TXP_RENDER_SOCKET_FD) == -1 ||
+        dup2(mirror, TXP_RENDER_MIRROR_FD) == -1)
+      _exit(2);
+    // Stdout belongs to the editor
+    dup2(STDERR_FILENO, STDOUT_FILENO);
+    execvp(args[0], args);
+    _exit(2);
+  }
+
+  close(sockets[1]);
+  if (pid == -1)
+  {
+    perror("[render] fork");
+    close(sockets[0]);
+    return 0;
+  }
+
+  h->pid = pid;
+  h->valid = 0;
+  SDL_LockMutex(pool->lock);
+  h->sock = sockets[0];
+  h->busy = 0;
+  SDL_UnlockMutex(pool->lock);
+  return 1;
+}
+
+// Helpers have no state worth saving, they are simply killed.
+// If report is set, explain why a busy helper stopped.
+static void stop_helper(txp_render_pool *pool, struct helper *h, bool report)
+{
+  if (h->pid == -1)
+    return;
+
+  SDL_LockMutex(pool->lock);
+  if (pool->polling)
+  {
+    wakeup_watcher(pool, 's');
+    while (pool->polling)
+      SDL_CondWait(pool->idle, pool->lock);
+  }
+  close(h->sock);
+  h->sock = -1;
+  h->busy = 0;
+  SDL_UnlockMutex(pool->lock);
+
+  kill(h->pid, SIGKILL);
+  int status = 0;
+  while (waitpid(h->pid, &status, 0) == -1 && errno == EINTR);
+
+  if (report)
+  {
+    if (WIFSIGNALED(status) && WTERMSIG(status) != SIGKILL)
+      fprintf(stderr, "[render] helper %d killed by signal %d on page %d\n",
+              (int)h->pid, WTERMSIG(status), h->page + 1);
+    else if (WIFEXITED(status))
+      fprintf(stderr, "[render] helper %d exited with status %d on page %d\n",
+              (int)h->pid, WEXITSTATUS(status), h->page + 1);
+    else
+      fprintf(stderr, "[render] helper %d stopped responding on page %d\n",
+              (int)h->pid, h->page + 1);
+  }
+
+  h->pid = -1;
+  h->valid = 0;
+}
+
+// Send the pending request to an idle helper, if any
+static void dispatch(txp_render_pool *pool)
+{
+  if (!pool->pending)
+    return;
+
+  // Prefer a running helper: its copy of the document is probably valid
+  struct helper *h = NULL;
+  for (int i = 0; i < pool->count && !h; ++i)
+    if (pool->helpers[i].pid != -1 && !pool->helpers[i].busy)
+      h = &pool->helpers[i];
+  for (int i = 0; i < pool->count && !h; ++i)
+    if (pool->helpers[i].pid == -1)
+      h = &pool->helpers[i];
+  if (!h)
+    return;
+
+  struct txp_render_request req = pool->request;
+  pool->pending = 0;
+
+  if (h->pid == -1 && !spawn_helper(pool, h))
+    goto failed;
+
+  req.valid = h->valid;
+  if (!txp_render_send(h->sock, &req, sizeof(req), -1))
+  {
+    h->page = req.page;
+    stop_helper(pool, h, 1);
+    goto failed;
+  }
+
+  h->valid = req.length;
+  h->stale = 0;
+  h->id = req.id;
+  h->page = req.page;
+  h->length = req.length;
+  h->scale = req.scale;
+  SDL_LockMutex(pool->lock);
+  h->started = SDL_GetTicks64();
+  h->busy = 1;
+  SDL_UnlockMutex(pool->lock);
+  wakeup_watcher(pool, 'c');
+  return;
+
+failed:
+  pool->failed = 1;
+  pool->failure = (txp_render_result){
+    .id = req.id, .page = req.page, .scale = req.scale, .dl = NULL,
+  };
+}
+
+/* Results */
+
+// Wrap the pixmap sent by a helper in a display list
+static fz_display_list *load_page(fz_context *ctx,
+                                  const struct txp_render_reply *r, int fd)
+{
+  size_t size = (size_t)r->stride * r->h;
+  struct stat st;
+  // A short file would fault when read
+  if (fd == -1 || r->w <= 0 || r->h <= 0 || r->stride < r->w * 3 ||
+      fstat(fd, &st) == -1 || (size_t)st.st_size < size)
+  {
+    fprintf(stderr, "[render] page %d: invalid reply\n", r->page + 1);
+    return NULL;
+  }
+
+  uint8_t *data = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+  if (data == MAP_FAILED)
+  {
+    perror("[render] mmap");
+    return NULL;
+  }
+
+  fz_pixmap *pix = NULL;
+  fz_image *img = NULL;
+  fz_device *dev = NULL;
+  fz_display_list *dl = NULL;
+  fz_var(pix);
+  fz_var(img);
+  fz_var(dev);
+  fz_var(dl);
+
+  fz_try(ctx)
+  {
+    pix = fz_new_pixmap(ctx, fz_device_rgb(ctx), r->w, r->h, NULL, 0);
+    unsigned char *samples = fz_pixmap_samples(ctx, pix);
+    int stride = fz_pixmap_stride(ctx, pix);
+    for (int y = 0; y < r->h; ++y)
+      memcpy(samples + (size_t)y * stride, data + (size_t)y * r->stride,
+             r->w * 3);
+    img = fz_new_image_from_pixmap(ctx, pix, NULL);
+
+    dl = fz_new_display_list(ctx, fz_make_rect(0, 0, r->width, r->height));
+    dev = fz_new_list_device(ctx, dl);
+    fz_fill_image(ctx, dev, img, fz_scale(r->width, r->height), 1,
+                  fz_default_color_params);
+    fz_close_device(ctx, dev);
+  }
+  fz_always(ctx)
+  {
+    fz_drop_device(ctx, dev);
+    fz_drop_image(ctx, img);
+    fz_drop_pixmap(ctx, pix);
+    munmap(data, size);
+  }
+  fz_catch(ctx)
+  {
+    fprintf(stderr, "[render] page %d: %s\n", r->page + 1,
+            fz_caught_message(ctx));
+    fz_drop_display_list(ctx, dl);
+    dl = NULL;
+  }
+
+  return dl;
+}
+
+// Read the reply of a busy helper, returns false if it should be ignored
+static bool receive(fz_context *ctx, txp_render_pool *pool, struct helper *h,
+                    txp_render_result *result)
+{
+  struct txp_render_reply reply;
+  int fd = -1;
+
+  *result = (txp_render_result){
+    .id = h->id, .page = h->page, .scale = h->scale, .dl = NULL,
+  };
+
+  if (!txp_render_recv(h->sock, &reply, sizeof(reply), &fd) ||
+      reply.id != h->id)
+  {
+    if (fd != -1)
+      close(fd);
+    stop_helper(pool, h, 1);
+    dispatch(pool);
+    return 1;
+  }
+
+  SDL_LockMutex(pool->lock);
+  h->busy = 0;
+  SDL_UnlockMutex(pool->lock);
+  bool stale = h->stale;
+  dispatch(pool);
+
+  if (reply.ok && !stale)
+    result->dl = load_page(ctx, &reply, fd);
+  if (fd != -1)
+    close(fd);
+  return !stale;
+}
+
+bool txp_render_pool_collect(fz_context *ctx, txp_render_pool *pool,
+                             txp_render_result *result)
+{
+  Uint64 now = SDL_GetTicks64();
+
+  for (int i = 0; i < pool->count; ++i)
+  {
+    struct helper *h = &pool->helpers[i];
+    if (!h->busy)
+      continue;
+
+    struct pollfd fd = {.fd = h->sock, .events = POLLIN, .revents = 0};
+    if (poll(&fd, 1, 0) == 1)
+    {
+      if (receive(ctx, pool, h, result))
+        return 1;
+    }
+    else if (now - h->started >= RENDER_TIMEOUT)
+    {
+      fprintf(stderr, "[render] page %d: helper %d timed out\n", h->page + 1,
+              (int)h->pid);
+      *result = (txp_render_result){
+        .id = h->id, .page = h->page, .scale = h->scale, .dl = NULL,
+      };
+      bool stale = h->stale;
+      stop_helper(pool, h, 0);
+      dispatch(pool);
+      if (!stale)
+        return 1;
+    }
+  }
+
+  dispatch(pool);
+
+  if (pool->failed)
+  {
+    pool->failed = 0;
+    *result = pool->failure;
+    return 1;
+  }
+
+  // Watch the helpers again
+  for (int i = 0; i < pool->count; ++i)
+    if (pool->helpers[i].busy)
+    {
+      wakeup_watcher(pool, 'c');
+      break;
+    }
+
+  return 0;
+}
+
+/* Pool */
+
+txp_render_pool *txp_render_pool_new(fz_context *ctx, const char *helper_path,
+                                     int count, void (*notify)(void))
+{
+  int mirror_fd = txp_render_shared_fd("texpresso-mirror");
+  if (mirror_fd == -1)
+  {
+    perror("[render] cannot create shared memory, render helpers are not supported");
+    return NULL;
+  }
+
+  int wake[2];
+  if (pipe(wake) == -1)
+  {
+    perror("[render] pipe");
+    close(mirror_fd);
+    return NULL;
+  }
+  fcntl(wake[0], F_SETFD, FD_CLOEXEC);
+  fcntl(wake[1], F_SETFD, FD_CLOEXEC);
+
+  txp_render_pool *pool = fz_malloc_struct(ctx, txp_render_pool);
+  pool->helper_path = fz_strdup(ctx, helper_path);
+  pool->count = count;
+  pool->helpers = fz_malloc_struct_array(ctx, count, struct helper);
+  for (int i = 0; i < count; ++i)
+  {
+    pool->helpers[i].pid = -1;
+    pool->helpers[i].sock = -1;
+  }
+  pool->fds = fz_malloc_struct_array(ctx, count + 1, struct pollfd);
+  pool->mirror_fd = mirror_fd;
+  pool->wake[0] = wake[0];
+  pool->wake[1] = wake[1];
+  pool->notify = notify;
+  pool->lock = SDL_CreateMutex();
+  pool->idle = SDL_CreateCond();
+  if (pool->lock && pool->idle)
+    pool->thread = SDL_CreateThread(watcher_main, "render_pool", pool);
+  if (!pool->thread)
+  {
+    fprintf(stderr, "[render] cannot start watcher: %s\n", SDL_GetError());
+    txp_render_pool_free(ctx, pool);
+    return NULL;
+  }
+
+  fprintf(stderr, "[render] %d helpers (%s)\n", count, helper_path);
+  return pool;
+}
+
+void txp_render_pool_free(fz_context *ctx, txp_render_pool *pool)
+{
+  if (!pool)
+    return;
+
+  if (pool->thread)
+  {
+    wakeup_watcher(pool, 'q');
+    SDL_WaitThread(pool->thread, NULL);
+  }
+
+  for (int i = 0; i < pool->count; ++i)
+    stop_helper(pool, &pool->helpers[i], 0);
+
+  if (pool->idle)
+    SDL_DestroyCond(pool->idle);
+  if (pool->lock)
+    SDL_DestroyMutex(pool->lock);
+  chunkbuf_drop(ctx, pool->mirror_doc);
+  if (pool->mirror)
+    munmap(pool->mirror, pool->mirror_cap);
+  close(pool->mirror_fd);
+  close(pool->wake[0]);
+  close(pool->wake[1]);
+  fz_free(ctx, pool->fds);
+  fz_free(ctx, pool->helpers);
+  fz_free(ctx, pool->helper_path);
+  fz_free(ctx, pool->dir);
+  fz_free(ctx, pool);
+}
+
+uint32_t txp_render_pool_request(fz_context *ctx, txp_render_pool *pool,
+                                 const char *dir, chunkbuf_t *doc, int page,
+                                 float scale)
+{
+  // Helpers resolve graphics relative to the document
+  if (!pool->dir || strcmp(pool->dir, dir) != 0)
+  {
+    for (int i = 0; i < pool->count; ++i)
+      stop_helper(pool, &pool->helpers[i], 0);
+    fz_free(ctx, pool->dir);
+    pool->dir = fz_strdup(ctx, dir);
+  }
+
+  int changed = update_mirror(ctx, pool, doc);
+
+  // Copies of the helpers are valid up to the first change. A request
+  // reading changed bytes may be interpreting a mix of two documents.
+  for (int i = 0; i < pool->count; ++i)
+  {
+    struct helper *h = &pool->helpers[i];
+    int valid = changed < 0 ? 0 : changed;
+    if (h->valid > valid)
+      h->valid = valid;
+    if (h->busy && h->length > valid)
+      h->stale = 1;
+  }
+
+  if (changed < 0)
+    return 0;
+
+  pool->last_id += 1;
+  pool->request = (struct txp_render_request){
+    .id = pool->last_id,
+    .page = page,
+    .length = doc->len,
+    .valid = 0,
+    .scale = scale,
+  };
+  pool->pending = 1;
+  dispatch(pool);
+
+  if (pool->failed && pool->failure.id == pool->last_id)
+  {
+    pool->failed = 0;
+    return 0;
+  }
+  return pool->last_id;
+}
@@ -0,0 +1,105 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2023 Frédéric Bour <frederic.bour@lakaban.net>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#ifndef RENDERPOOL_H_
+#define RENDERPOOL_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <mupdf/fitz.h>
+#include "chunkbuf.h"
+
+// Out-of-process page rendering.
+// Pages of an XDV document are interpreted and rasterized by a pool of
+// helper processes (texpresso-render -S). The document is mirrored to a
+// shared memory file that the helpers read; a request tells the helper how
+// much of its own copy is still valid, so that only new bytes are copied and
+// interpreted. Rendered pages come back as RGB pixmaps in shared memory
+// (see txp_render_shared_fd).
+//
+// A helper that crashes or takes too long only loses the page it was
+// rendering: it is killed and started again on the next request.
+
+typedef struct txp_render_pool txp_render_pool;
+
+typedef struct {
+  uint32_t id;
+  int page;
+  float scale;
+  // NULL if the page could not be rendered
+  fz_display_list *dl;
+} txp_render_result;
+
+// Start count helpers from helper_path (lazily).
+// notify is called from a background thread when results are ready to be
+// collected.
+txp_render_pool *txp_render_pool_new(fz_context *ctx, const char *helper_path,
+                                     int count, void (*notify)(void));
+void txp_render_pool_free(fz_context *ctx, txp_render_pool *pool);
+
+// Ask for a page of doc rendered at scale (pixels per point).
+// dir is the directory of the document, for resolving graphics.
+// Only the last request waiting for a helper is kept, returns its id.
+uint32_t txp_render_pool_request(fz_context *ctx, txp_render_pool *pool,
+                                 const char *dir, chunkbuf_t *doc, int page,
+                                 float scale);
+
+// Get a finished request without blocking, returns false if there is none.
+// The caller owns result->dl.
+bool txp_render_pool_collect(fz_context *ctx, txp_render_pool *pool,
+                             txp_render_result *result);
+
+// Protocol between the pool and the helpers.
+// The helper gets the socket as fd 3 and the document mirror as fd 4.
+
+#define TXP_RENDER_SOCKET_FD 3
+#define TXP_RENDER_MIRROR_FD 4
+
+struct txp_render_request {
+  uint32_t id;
+  int32_t page;
+  // Bytes of the mirror to use, and prefix of the helper copy still valid
+  int32_t length, valid;
+  float scale;
+};
+
+// A shared memory file with h rows of stride bytes (RGB) is attached if ok
+// is set
+struct txp_render_reply {
+  uint32_t id;
+  int32_t page, ok;
+  // Page size in points
+  float width, height;
+  int32_t w, h, stride;
+};
+
+// Anonymous file for sharing memory between processes: a memfd on Linux,
+// an unlinked temporary file elsewhere. -1 on error, with errno set.
+int txp_render_shared_fd(const char *name);
+
+// Send or receive a message of len bytes with an optional fd (-1 for none)
+bool txp_render_send(int sock, const void *msg, size_t len, int fd);
+bool txp_render_recv(int sock, void *msg, size_t len, int *fd);
+
+#endif // RENDERPOOL_H_
@@ -0,0 +1,66 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2023 Frédéric Bour <frederic.bour@lakaban.net>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+// texpresso-resd: per-user daemon sharing TeX resources between texpresso
+// instances (see dvi/dvi_resdaemon.c).
+//
+// Usage: texpresso-resd [texpresso-tonic path]
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <limits.h>
+#include <mupdf/fitz.h>
+#include "mydvi.h"
+
+int main(int argc, char **argv)
+{
+  char tectonic_path[PATH_MAX] = "texpresso-tonic";
+
+  if (argc > 2)
+  {
+    fprintf(stderr, "Usage: texpresso-resd [texpresso-tonic path]\n");
+    return 1;
+  }
+
+  if (argc == 2)
+    snprintf(tectonic_path, PATH_MAX, "%s", argv[1]);
+  else
+  {
+    // Prefer the texpresso-tonic installed next to the daemon
+    const char *sep = strrchr(argv[0], '/');
+    if (sep)
+    {
+      snprintf(tectonic_path, PATH_MAX, "%.*s/texpresso-tonic",
+               (int)(sep - argv[0]), argv[0]);
+      if (access(tectonic_path, X_OK) != 0)
+        strcpy(tectonic_path, "texpresso-tonic");
+    }
+  }
+
+  fz_context *ctx = fz_new_context(NULL, NULL, FZ_STORE_DEFAULT);
+  int result = dvi_resdaemon_serve(ctx, tectonic_path);
+  fz_drop_context(ctx);
+  return result;
+}
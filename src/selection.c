@@ -0,0 +1,273 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2023 Frédéric Bour <frederic.bour@lakaban.net>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#include <float.h>
+#include <string.h>
+#include "selection.h"
+
+typedef struct {
+  // Index of the first character, the line ends where the next one starts
+  int first;
+  // Vertical extent of the characters, and horizontal extent of the line
+  float y0, y1, x0, x1;
+} line_t;
+
+struct txp_selection_s {
+  int line_count, char_count;
+  line_t *lines;
+  // Per character: left edge, middle, and right edge of the run of
+  // characters from the start of the line
+  float *left, *middle, *right;
+
+  // Selection between two boundaries (a boundary is the index of the
+  // character that follows it), -1 if not started
+  int anchor, focus;
+  // Rects of the lines first_line .. first_line + rect_count - 1
+  int first_line, rect_count, rect_cap;
+  fz_rect *rects;
+};
+
+// Building the index
+
+txp_selection *txp_selection_new(fz_context *ctx, fz_stext_page *page)
+{
+  int lines = 0, chars = 0;
+  for (fz_stext_block *b = page->first_block; b; b = b->next)
+  {
+    if (b->type != FZ_STEXT_BLOCK_TEXT)
+      continue;
+    for (fz_stext_line *l = b->u.t.first_line; l; l = l->next)
+    {
+      if (!l->first_char)
+        continue;
+      lines += 1;
+      for (fz_stext_char *c = l->first_char; c; c = c->next)
+        chars += 1;
+    }
+  }
+
+  txp_selection *sel = fz_malloc_struct(ctx, txp_selection);
+  fz_try(ctx)
+  {
+    sel->lines = fz_malloc_struct_array(ctx, lines + 1, line_t);
+    sel->left = fz_malloc_array(ctx, chars, float);
+    sel->middle = fz_malloc_array(ctx, chars, float);
+    sel->right = fz_malloc_array(ctx, chars, float);
+  }
+  fz_catch(ctx)
+  {
+    txp_selection_free(ctx, sel);
+    fz_rethrow(ctx);
+  }
+  sel->anchor = sel->focus = -1;
+
+  int li = 0, ci = 0;
+  for (fz_stext_block *b = page->first_block; b; b = b->next)
+  {
+    if (b->type != FZ_STEXT_BLOCK_TEXT)
+      continue;
+    for (fz_stext_line *l = b->u.t.first_line; l; l = l->next)
+    {
+      if (!l->first_char)
+        continue;
+      line_t *line = &sel->lines[li++];
+      line->first = ci;
+      line->x0 = line->y0 = FLT_MAX;
+      line->x1 = line->y1 = -FLT_MAX;
+      float right = -FLT_MAX;
+      for (fz_stext_char *c = l->first_char; c; c = c->next, ci++)
+      {
+        fz_rect r = fz_rect_from_quad(c->quad);
+        right = fz_max(right, r.x1);
+        sel->left[ci] = r.x0;
+        sel->middle[ci] = (r.x0 + r.x1) / 2;
+        sel->right[ci] = right;
+        line->x0 = fz_min(line->x0, r.x0);
+        line->y0 = fz_min(line->y0, r.y0);
+        line->y1 = fz_max(line->y1, r.y1);
+      }
+      line->x1 = right;
+    }
+  }
+  // Sentinel, to find where the last line ends
+  sel->lines[li].first = ci;
+  sel->line_count = li;
+  sel->char_count = ci;
+  return sel;
+}
+
+void txp_selection_free(fz_context *ctx, txp_selection *sel)
+{
+  if (!sel)
+    return;
+  fz_free(ctx, sel->lines);
+  fz_free(ctx, sel->left);
+  fz_free(ctx, sel->middle);
+  fz_free(ctx, sel->right);
+  fz_free(ctx, sel->rects);
+  fz_free(ctx, sel);
+}
+
+// Mapping points to boundaries
+
+// The line containing p vertically, closest horizontally, or the closest
+// one vertically.
+static int nearest_line(txp_selection *sel, fz_point p)
+{
+  int best = 0;
+  float best_dy = FLT_MAX, best_dx = FLT_MAX;
+  for (int i = 0; i < sel->line_count; ++i)
+  {
+    line_t *l = &sel->lines[i];
+    float dy = fz_max(0, fz_max(l->y0 - p.y, p.y - l->y1));
+    float dx = fz_max(0, fz_max(l->x0 - p.x, p.x - l->x1));
+    if (dy < best_dy || (dy == best_dy && dx < best_dx))
+    {
+      best = i;
+      best_dy = dy;
+      best_dx = dx;
+    }
+  }
+  return best;
+}
+
+static int boundary_at(txp_selection *sel, fz_point p)
+{
+  line_t *l = &sel->lines[nearest_line(sel, p)];
+  // First character whose middle is right of p
+  int lo = l->first, hi = l[1].first;
+  while (lo < hi)
+  {
+    int mid = (lo + hi) / 2;
+    if (sel->middle[mid] <= p.x)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return lo;
+}
+
+// Line of a character
+static int line_of(txp_selection *sel, int c)
+{
+  int lo = 0, hi = sel->line_count - 1;
+  while (lo < hi)
+  {
+    int mid = (lo + hi + 1) / 2;
+    if (sel->lines[mid].first <= c)
+      lo = mid;
+    else
+      hi = mid - 1;
+  }
+  return lo;
+}
+
+// Rects
+
+// Compute the rects of lines from..to, for the characters lo..hi-1
+static void fill_rects(txp_selection *sel, int from, int to, int lo, int hi)
+{
+  for (int i = from; i <= to; ++i)
+  {
+    line_t *l = &sel->lines[i];
+    int c0 = fz_maxi(lo, l->first), c1 = fz_mini(hi, l[1].first);
+    sel->rects[i - sel->first_line] =
+      fz_make_rect(sel->left[c0], l->y0, sel->right[c1 - 1], l->y1);
+  }
+}
+
+void txp_selection_start(txp_selection *sel, fz_point pt)
+{
+  sel->rect_count = 0;
+  sel->anchor = sel->focus = -1;
+  if (sel->line_count > 0)
+    sel->anchor = sel->focus = boundary_at(sel, pt);
+}
+
+bool txp_selection_extend(fz_context *ctx, txp_selection *sel, fz_point pt)
+{
+  if (sel->anchor < 0)
+    return 0;
+  int focus = boundary_at(sel, pt);
+  if (focus == sel->focus)
+    return 0;
+  sel->focus = focus;
+
+  int lo = fz_mini(sel->anchor, focus), hi = fz_maxi(sel->anchor, focus);
+  if (lo == hi)
+  {
+    bool had_rects = sel->rect_count > 0;
+    sel->rect_count = 0;
+    return had_rects;
+  }
+
+  int l0 = line_of(sel, lo), l1 = line_of(sel, hi - 1);
+  int count = l1 - l0 + 1;
+  if (count > sel->rect_cap)
+  {
+    int cap = fz_maxi(count, sel->rect_cap * 2);
+    sel->rects = fz_realloc_array(ctx, sel->rects, cap, fz_rect);
+    sel->rect_cap = cap;
+  }
+
+  if (sel->rect_count == 0)
+  {
+    sel->first_line = l0;
+    sel->rect_count = count;
+    fill_rects(sel, l0, l1, lo, hi);
+    return 1;
+  }
+
+  int o0 = sel->first_line, o1 = o0 + sel->rect_count - 1;
+
+  // Keep the rects of the lines that are in both selections
+  if (l0 != o0)
+  {
+    int k0 = fz_maxi(o0, l0), k1 = fz_mini(o1, l1);
+    if (k0 <= k1)
+      memmove(&sel->rects[k0 - l0], &sel->rects[k0 - o0],
+              (k1 - k0 + 1) * sizeof(fz_rect));
+  }
+  sel->first_line = l0;
+  sel->rect_count = count;
+
+  // Lines strictly inside both selections are entirely selected and keep
+  // their rects; compute the others
+  if (l1 < o0 || l0 > o1)
+    fill_rects(sel, l0, l1, lo, hi);
+  else
+  {
+    fill_rects(sel, l0, l0, lo, hi);
+    fill_rects(sel, fz_maxi(l0 + 1, l1), l1, lo, hi);
+    fill_rects(sel, l0 + 1, fz_mini(l1 - 1, o0), lo, hi);
+    fill_rects(sel, fz_maxi(l0 + 1, o1), l1 - 1, lo, hi);
+  }
+  return 1;
+}
+
+const fz_rect *txp_selection_rects(txp_selection *sel, int *count)
+{
+  *count = sel->rect_count;
+  return sel->rects;
+}
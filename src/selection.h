@@ -0,0 +1,55 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2023 Frédéric Bour <frederic.bour@lakaban.net>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#ifndef SELECTION_H_
+#define SELECTION_H_
+
+#include <stdbool.h>
+#include <mupdf/fitz.h>
+
+// Text selection on a page.
+//
+// The structured text of the page is flattened once into an ordered index
+// of characters, grouped in lines. A point maps to a character boundary
+// (nearest line, then binary search on the characters of the line) and
+// the selection is the run of characters between two boundaries, drawn
+// with one rect per line. When the selection is extended, only the rects
+// of the lines that changed are computed again.
+
+typedef struct txp_selection_s txp_selection;
+
+txp_selection *txp_selection_new(fz_context *ctx, fz_stext_page *page);
+void txp_selection_free(fz_context *ctx, txp_selection *sel);
+
+// Start an empty selection at the boundary nearest to pt
+void txp_selection_start(txp_selection *sel, fz_point pt);
+
+// Move the end of the selection to the boundary nearest to pt.
+// Returns true if the rects changed.
+bool txp_selection_extend(fz_context *ctx, txp_selection *sel, fz_point pt);
+
+// Rects covering the selected characters, one per line
+const fz_rect *txp_selection_rects(txp_selection *sel, int *count);
+
+#endif // SELECTION_H_
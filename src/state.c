@@ -102,6 +102,11 @@ void log_fileentry(fz_context *ctx, log_t *log, fileentry_t *entry)
       fz_keep_buffer(ctx, entry->saved.data);
       PUSH_VALUE(ctx, log->data, entry->saved.data->len);
     }
+    if (entry->saved.chunks)
+    {
+      chunkbuf_keep(ctx, entry->saved.chunks);
+      PUSH_VALUE(ctx, log->data, entry->saved.chunks->len);
+    }
     PUSH_VALUE(ctx, log->data, entry->saved);
     PUSH_VALUE(ctx, log->data, entry);
     push_action(ctx, log->data, LOG_ENTRY);
@@ -158,7 +163,15 @@ static void log_pop(fz_context *ctx, log_t *log)
       if (LOG) fprintf(stderr, "pop LOG_ENTRY %s\n", entry->path);
       if (entry->saved.data)
         fz_drop_buffer(ctx, entry->saved.data);
+      if (entry->saved.chunks)
+        chunkbuf_drop(ctx, entry->saved.chunks);
       POP_VALUE(log->data, entry->saved);
+      if (entry->saved.chunks)
+      {
+        int len;
+        POP_VALUE(log->data, len);
+        chunkbuf_truncate(entry->saved.chunks, len);
+      }
       if (entry->saved.data)
       {
         POP_VALUE(log->data, entry->saved.data->len);
@@ -187,6 +200,11 @@ static void log_pop(fz_context *ctx, log_t *log)
   }
 }
 
+size_t log_memory(log_t *log)
+{
+  return log->data->cap;
+}
+
 mark_t log_snapshot(fz_context *ctx, log_t *log)
 {
   return (log->snap = log->data->len);
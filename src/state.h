@@ -25,9 +25,12 @@
 #ifndef STATE_H
 #define STATE_H
 
+#include <time.h>
 #include <sys/stat.h>
 #include <mupdf/fitz/buffer.h>
 #include "sprotocol.h"
+#include "chunkbuf.h"
+#include "packbuf.h"
 
 #define MAX_FILES 1024
 
@@ -47,6 +50,12 @@ typedef struct fileentry_s {
   // Cache of filesystem state
   struct stat fs_stat;
   fz_buffer *fs_data;
+  // fs_data is compressed when it has not been used for a while:
+  // access it with fileentry_fs_data.
+  packbuf_t *fs_packed;
+  time_t fs_used;
+  // Packing fs_data did not save enough, don't try again until it changes
+  bool fs_incompressible;
 
   // Cached picture information
   struct pic_cache pic_cache;
@@ -57,6 +66,9 @@ typedef struct fileentry_s {
   // State observed and/or produced by TeX process
   struct {
     fz_buffer *data;
+    // The output document is stored in chunks rather than in data:
+    // it can grow large and is only appended to or truncated.
+    chunkbuf_t *chunks;
     enum accesslevel level;
     int access_flags, access_result, seen;
     mark_t snap;
@@ -100,6 +112,21 @@ fileentry_t *filesystem_lookup_or_create(fz_context *ctx, filesystem_t *fs, cons
 fileentry_t *filesystem_lookup(filesystem_t *fs, const char *path);
 fileentry_t *filesystem_scan(filesystem_t *fs, int *index);
 
+// Contents of the file on disk (NULL if not read), decompressed if needed
+fz_buffer *fileentry_fs_data(fz_context *ctx, fileentry_t *e);
+// Length of the file on disk, without decompressing it
+int fileentry_fs_length(fileentry_t *e);
+// Replace the contents of the file on disk, takes ownership of data
+void fileentry_set_fs_data(fz_context *ctx, fileentry_t *e, fz_buffer *data);
+// Compress the disk contents not used in the last `age` seconds,
+// return the number of bytes saved
+size_t filesystem_pack_cold(fz_context *ctx, filesystem_t *fs, int age);
+// Bytes used by the disk contents, compressed or not
+size_t filesystem_data_size(filesystem_t *fs);
+// Bytes used by the contents produced by TeX (the output document, logs,
+// auxiliary files), not counting buffers shared with the disk contents
+size_t filesystem_output_size(filesystem_t *fs);
+
 log_t *log_new(fz_context *ctx);
 void log_free(fz_context *ctx, log_t *log);
 mark_t log_snapshot(fz_context *ctx, log_t *log);
@@ -107,6 +134,8 @@ void log_rollback(fz_context *ctx, log_t *log, mark_t snapshot);
 void log_fileentry(fz_context *ctx, log_t *log, fileentry_t *entry);
 void log_filecell(fz_context *ctx, log_t *log, filecell_t *cell);
 void log_overwrite(fz_context *ctx, log_t *log, fz_buffer *buf, int start, int len);
+// Bytes used by the log itself, overwritten contents included
+size_t log_memory(log_t *log);
 
 bool stat_same(struct stat *st1, struct stat *st2);
 
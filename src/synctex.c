@@ -24,6 +24,7 @@
 
 #include <math.h>
 #include <string.h>
+#include <SDL2/SDL.h>
 #include "synctex.h"
 #include "editor.h"
 #include "myabort.h"
@@ -109,10 +110,48 @@ static void ob_append(fz_context *ctx, struct offset_buffer *ob, int offset)
   ob->len += 1;
 }
 
+/* A record of interest found while tokenizing synctex output: page
+   boundaries and input files. */
+struct pending_record
+{
+  uint8_t kind;
+  int index, offset;
+};
+
 struct synctex_s
 {
+  /* Offsets of pages and inputs.
+     Shared with the ingestion thread, protected by lock. */
   struct offset_buffer inputs, pages;
-  int bol, cur;
+
+  /* Number of bytes submitted for ingestion. */
+  int cur;
+
+  /* Set by a rollback: ingestion restarts at the beginning of the line
+     containing cur. */
+  int resync;
+
+  /* Background ingestion.
+
+     The main thread appends the output of TeX to queue, the ingestion
+     thread takes it, tokenizes it without holding the lock and commits the
+     records it found.
+
+     A rollback increments generation: a batch that was being tokenized
+     during a rollback is discarded when committing.
+     If the thread could not be started, ingestion is done synchronously
+     by synctex_update. */
+  SDL_mutex *lock;
+  SDL_cond *wakeup, *idle;
+  SDL_Thread *thread;
+  fz_context *thread_ctx;
+  int quit, busy, fresh, generation;
+  /* Data not ingested yet, starting at queue_base (always at the beginning
+     of a line). spare is an empty buffer swapped with queue by the thread. */
+  fz_buffer *queue, *spare, *records;
+  int queue_base;
+  /* Bytes before parsed have been ingested. */
+  int parsed;
 
   /* Backward search state */
 
@@ -148,6 +187,8 @@ struct synctex_s
   int candidate_page, candidate_line, candidate_x, candidate_y;
 };
 
+static int SDLCALL ingest_main(void *data);
+
 synctex_t *synctex_new(fz_context *ctx)
 {
   synctex_t *stx = fz_malloc_struct(ctx, synctex_t);
@@ -155,11 +196,49 @@ synctex_t *synctex_new(fz_context *ctx)
   ob_init(&stx->pages);
   stx->cur = 0;
   stx->target_path[0] = 0;
+
+  stx->queue = fz_new_buffer(ctx, 4096);
+  stx->spare = fz_new_buffer(ctx, 4096);
+  stx->records = fz_new_buffer(ctx, 256);
+  stx->lock = SDL_CreateMutex();
+  stx->wakeup = SDL_CreateCond();
+  stx->idle = SDL_CreateCond();
+  if (!stx->lock || !stx->wakeup || !stx->idle)
+    myabort();
+
+  // Cloning fails if the context has no locking functions:
+  // stay synchronous then.
+  stx->thread_ctx = fz_clone_context(ctx);
+  if (stx->thread_ctx)
+  {
+    stx->thread = SDL_CreateThread(ingest_main, "synctex", stx);
+    if (!stx->thread)
+    {
+      fprintf(stderr, "[synctex] cannot start thread: %s\n", SDL_GetError());
+      fz_drop_context(stx->thread_ctx);
+      stx->thread_ctx = NULL;
+    }
+  }
   return stx;
 }
 
 void synctex_free(fz_context *ctx, synctex_t *stx)
 {
+  if (stx->thread)
+  {
+    SDL_LockMutex(stx->lock);
+    stx->quit = 1;
+    SDL_CondSignal(stx->wakeup);
+    SDL_UnlockMutex(stx->lock);
+    SDL_WaitThread(stx->thread, NULL);
+    fz_drop_context(stx->thread_ctx);
+  }
+  SDL_DestroyCond(stx->idle);
+  SDL_DestroyCond(stx->wakeup);
+  SDL_DestroyMutex(stx->lock);
+  fz_drop_buffer(ctx, stx->queue);
+  fz_drop_buffer(ctx, stx->spare);
+  fz_drop_buffer(ctx, stx->records);
   ob_free(ctx, &stx->inputs);
   ob_free(ctx, &stx->pages);
   fz_free(ctx, stx);
@@ -170,13 +249,8 @@ int synctex_has_target(synctex_t *stx)
   return stx && (stx->target_path[0] != 0);
 }
 
-void synctex_rollback(fz_context *ctx, synctex_t *stx, size_t offset)
+static void rollback_search(synctex_t *stx)
 {
-  ob_rollback(ctx, &stx->pages, offset);
-  ob_rollback(ctx, &stx->inputs, offset);
-  if (stx->cur > offset)
-    stx->cur = offset;
-
   if (synctex_has_target(stx))
   {
     if (stx->input_tag >= stx->inputs.len)
@@ -195,6 +269,33 @@ void synctex_rollback(fz_context *ctx, synctex_t *stx, size_t offset)
   }
 }
 
+void synctex_rollback(fz_context *ctx, synctex_t *stx, size_t offset)
+{
+  SDL_LockMutex(stx->lock);
+
+  // Cancel in-flight ingestion and drop queued data: everything after
+  // `from` will be submitted again.
+  stx->generation += 1;
+  ob_rollback(ctx, &stx->pages, offset);
+  ob_rollback(ctx, &stx->inputs, offset);
+  int from = stx->parsed;
+  if (from > offset)
+    from = offset;
+  stx->parsed = from;
+  stx->queue->len = 0;
+  stx->queue_base = from;
+  stx->fresh = 0;
+
+  if (stx->cur > from)
+  {
+    stx->cur = from;
+    stx->resync = 1;
+  }
+
+  rollback_search(stx);
+  SDL_UnlockMutex(stx->lock);
+}
+
 static const uint8_t *string_parse_int(const uint8_t *string, int *i)
 {
   *i = 0;
@@ -230,51 +331,186 @@ static const uint8_t *string_skip_prefix(const uint8_t *string, const char *pref
   return string;
 }
 
-static void synctex_process_line(fz_context *ctx, synctex_t *stx, int offset, const uint8_t *bol, uint8_t *eol)
+static bool parse_record(const uint8_t *bol, struct pending_record *r)
 {
   int index = 0;
   uint8_t c = *bol;
   bol += 1;
 
   switch (c)
+  {
+    case '{': case '}':
+      if (!(bol = string_parse_int(bol, &index))) return 0;
+      break;
+
+    case 'I':
+      if (!(bol = string_skip_prefix(bol, "nput:"))) return 0;
+      if (!(bol = string_parse_int(bol, &index))) return 0;
+      if (!(bol = string_skip_prefix(bol, ":"))) return 0;
+      break;
+
+    case '/':
+      if (!(bol = string_parse_int(bol, &index))) return 0;
+      break;
+
+    default:
+      return 0;
+  }
+
+  r->kind = c;
+  r->index = index;
+  return 1;
+}
+
+// Tokenize the complete lines of data, which starts at offset base.
+// Records are appended to out, returns the number of bytes consumed.
+static int parse_lines(fz_context *ctx, const uint8_t *data, int len, int base, fz_buffer *out)
+{
+  int bol = 0;
+  const uint8_t *eol;
+
+  while ((eol = memchr(data + bol, '\n', len - bol)))
+  {
+    int next = eol - data + 1;
+    struct pending_record r;
+    if (next - 1 > bol && parse_record(data + bol, &r))
+    {
+      r.offset = base + bol;
+      fz_append_data(ctx, out, &r, sizeof(r));
+    }
+    bol = next;
+  }
+
+  return bol;
+}
+
+static void commit_record(fz_context *ctx, synctex_t *stx, const struct pending_record *r)
+{
+  switch (r->kind)
   {
     case '{': case '}':
     {
-      int is_closing = (c == '}');
-      if (!(bol = string_parse_int(bol, &index))) break;
-      if (index != stx->pages.len / 2 + 1 || is_closing != (stx->pages.len & 1))
+      int is_closing = (r->kind == '}');
+      if (r->index != stx->pages.len / 2 + 1 || is_closing != (stx->pages.len & 1))
       {
         fprintf(stderr, "[synctex] Invalid page index: index=%d/is_closing=%d expected=%d/%d\n",
-                index, is_closing, stx->pages.len / 2 + 1, stx->pages.len & 1);
+                r->index, is_closing, stx->pages.len / 2 + 1, stx->pages.len & 1);
       }
-      ob_append(ctx, &stx->pages, offset);
+      ob_append(ctx, &stx->pages, r->offset);
       break;
     }
 
     case 'I':
     {
-      if (!(bol = string_skip_prefix(bol, "nput:"))) break;
-      if (!(bol = string_parse_int(bol, &index))) break;
-      if (!(bol = string_skip_prefix(bol, ":"))) break;
-      if (index != stx->inputs.len + 1)
+      if (r->index != stx->inputs.len + 1)
       {
         fprintf(stderr, "[synctex] Invalid input index: index=%d expected=%d\n",
-                index, stx->inputs.len + 1);
+                r->index, stx->inputs.len + 1);
       }
-      ob_append(ctx, &stx->inputs, offset);
+      ob_append(ctx, &stx->inputs, r->offset);
       break;
     }
 
     case '/':
-    {
-      if (!(bol = string_parse_int(bol, &index))) break;
-      fprintf(stderr, "[synctex] Closed input: %d\n", index);
+      fprintf(stderr, "[synctex] Closed input: %d\n", r->index);
       break;
-    }
+  }
+}
 
-    default:
+static void commit_records(fz_context *ctx, synctex_t *stx, fz_buffer *records)
+{
+  struct pending_record *r = (void*)records->data;
+  int count = records->len / sizeof(struct pending_record);
+  for (int i = 0; i < count; ++i)
+    commit_record(ctx, stx, &r[i]);
+  records->len = 0;
+}
+
+// Remove the ingested prefix of buf, keeping the incomplete last line
+static void drop_prefix(fz_buffer *buf, int len)
+{
+  memmove(buf->data, buf->data + len, buf->len - len);
+  buf->len -= len;
+}
+
+static int SDLCALL ingest_main(void *data)
+{
+  synctex_t *stx = data;
+  fz_context *ctx = stx->thread_ctx;
+
+  SDL_LockMutex(stx->lock);
+  while (1)
+  {
+    while (!stx->fresh && !stx->quit)
+      SDL_CondWait(stx->wakeup, stx->lock);
+    if (stx->quit)
       break;
+
+    // Take the queue, new data goes to the spare buffer meanwhile
+    fz_buffer *batch = stx->queue;
+    int base = stx->queue_base;
+    int generation = stx->generation;
+    stx->queue = stx->spare;
+    stx->spare = NULL;
+    stx->queue_base = base + batch->len;
+    stx->fresh = 0;
+    stx->busy = 1;
+    SDL_UnlockMutex(stx->lock);
+
+    int consumed = 0;
+    fz_try(ctx)
+    {
+      consumed = parse_lines(ctx, batch->data, batch->len, base, stx->records);
+    }
+    fz_catch(ctx)
+    {
+      fprintf(stderr, "[synctex] ingestion failed: %s\n", fz_caught_message(ctx));
+      stx->records->len = 0;
+      consumed = 0;
+    }
+
+    SDL_LockMutex(stx->lock);
+    fz_try(ctx)
+    {
+      if (generation == stx->generation)
+      {
+        commit_records(ctx, stx, stx->records);
+        stx->parsed = base + consumed;
+        // The incomplete line goes back in front of the data queued
+        // while parsing
+        drop_prefix(batch, consumed);
+        fz_append_buffer(ctx, batch, stx->queue);
+        stx->queue->len = 0;
+        stx->spare = stx->queue;
+        stx->queue = batch;
+        stx->queue_base = base + consumed;
+      }
+      else
+      {
+        // A rollback happened, the batch is obsolete
+        stx->records->len = 0;
+        batch->len = 0;
+        stx->spare = batch;
+      }
+    }
+    fz_catch(ctx)
+    {
+      fprintf(stderr, "[synctex] ingestion failed: %s\n", fz_caught_message(ctx));
+      myabort();
+    }
+    stx->busy = 0;
+    SDL_CondBroadcast(stx->idle);
   }
+  SDL_UnlockMutex(stx->lock);
+  return 0;
+}
+
+// Wait for the ingestion thread to process the data submitted so far.
+// Must be called with lock held.
+static void wait_ingestion(synctex_t *stx)
+{
+  while (stx->busy || stx->fresh)
+    SDL_CondWait(stx->idle, stx->lock);
 }
 
 void synctex_update(fz_context *ctx, synctex_t *stx, fz_buffer *buf)
@@ -288,59 +524,98 @@ void synctex_update(fz_context *ctx, synctex_t *stx, fz_buffer *buf)
     return;
   }
 
-  uint8_t *ptr = buf->data;
-  int bol = stx->bol;
+  SDL_LockMutex(stx->lock);
 
-  if (bol > cur)
+  if (stx->resync)
   {
-    bol = cur;
-    while (bol > 0 && ptr[bol - 1] != '\n')
+    // Restart from the beginning of the line, dropping records that
+    // might have been produced by a line that was cut by the rollback
+    int bol = cur;
+    while (bol > 0 && buf->data[bol - 1] != '\n')
       bol -= 1;
+    ob_rollback(ctx, &stx->pages, bol);
+    ob_rollback(ctx, &stx->inputs, bol);
+    rollback_search(stx);
+    stx->queue->len = 0;
+    stx->queue_base = bol;
+    stx->parsed = bol;
+    stx->resync = 0;
+    cur = bol;
   }
 
-  while (cur < len)
+  fz_append_data(ctx, stx->queue, buf->data + cur, len - cur);
+  stx->cur = len;
+
+  if (stx->thread)
   {
-    if (ptr[cur] == '\n')
-    {
-      if (cur > bol)
-        synctex_process_line(ctx, stx, bol, ptr + bol, ptr + cur);
-      cur += 1;
-      // fprintf(stderr, "synctex: %.*s\n", (int)(cur - bol - 1), &ptr[bol]);
-      bol = cur;
-    }
-    else
-      cur += 1;
+    stx->fresh = 1;
+    SDL_CondSignal(stx->wakeup);
+  }
+  else
+  {
+    int consumed = parse_lines(ctx, stx->queue->data, stx->queue->len,
+                               stx->queue_base, stx->records);
+    commit_records(ctx, stx, stx->records);
+    drop_prefix(stx->queue, consumed);
+    stx->queue_base += consumed;
+    stx->parsed = stx->queue_base;
   }
 
-  stx->bol = bol;
-  stx->cur = cur;
+  SDL_UnlockMutex(stx->lock);
+}
+
+size_t synctex_memory(synctex_t *stx)
+{
+  if (!stx)
+    return 0;
+  SDL_LockMutex(stx->lock);
+  // spare is NULL while the thread is tokenizing it
+  size_t size = stx->queue->cap + (stx->spare ? stx->spare->cap : 0) +
+                (size_t)(stx->inputs.cap + stx->pages.cap) * sizeof(int);
+  SDL_UnlockMutex(stx->lock);
+  return size;
 }
 
 int synctex_page_count(synctex_t *stx)
 {
-  return stx ? stx->pages.len / 2 : 0;
+  if (!stx)
+    return 0;
+  SDL_LockMutex(stx->lock);
+  int count = stx->pages.len / 2;
+  SDL_UnlockMutex(stx->lock);
+  return count;
 }
 
 int synctex_input_count(synctex_t *stx)
 {
-  return stx ? stx->inputs.len : 0;
+  if (!stx)
+    return 0;
+  SDL_LockMutex(stx->lock);
+  int count = stx->inputs.len;
+  SDL_UnlockMutex(stx->lock);
+  return count;
 }
 
 void synctex_page_offset(fz_context *ctx, synctex_t *stx, unsigned index, int *bop, int *eop)
 {
+  SDL_LockMutex(stx->lock);
   if (index * 2 + 1 >= stx->pages.len)
     myabort();
 
   *bop = stx->pages.ptr[2 * index + 0];
   *eop = stx->pages.ptr[2 * index + 1];
+  SDL_UnlockMutex(stx->lock);
 }
 
 int synctex_input_offset(fz_context *ctx, synctex_t *stx, unsigned index)
 {
+  SDL_LockMutex(stx->lock);
   if (index >= stx->inputs.len)
     myabort();
 
-  return stx->inputs.ptr[index];
+  int offset = stx->inputs.ptr[index];
+  SDL_UnlockMutex(stx->lock);
+  return offset;
 }
 
 static const uint8_t *nextline(const uint8_t *ptr)
@@ -631,13 +906,13 @@ static int get_input(fz_buffer *buf,
   return (fend - filename);
 }
 
-void synctex_scan(fz_context *ctx,
-                  synctex_t *stx,
-                  fz_buffer *buf,
-                  const char *doc_dir,
-                  unsigned page,
-                  int x,
-                  int y)
+static void scan_page(fz_context *ctx,
+                      synctex_t *stx,
+                      fz_buffer *buf,
+                      const char *doc_dir,
+                      unsigned page,
+                      int x,
+                      int y)
 {
   if (synctex_page_count(stx) <= page)
     return;
@@ -839,11 +1114,24 @@ synctex_backscan_page(fz_context *ctx, synctex_t *stx, fz_buffer *buf, int page,
   }
 }
 
-int synctex_find_target(fz_context *ctx, synctex_t *stx, fz_buffer *buf, int *page, int *x, int *y)
+void synctex_scan(fz_context *ctx,
+                  synctex_t *stx,
+                  fz_buffer *buf,
+                  const char *doc_dir,
+                  unsigned page,
+                  int x,
+                  int y)
 {
-  if (!stx->target_path[0])
-    return 0;
+  SDL_LockMutex(stx->lock);
+  // Only block if the page has not been ingested yet
+  if (stx->pages.len / 2 <= page)
+    wait_ingestion(stx);
+  scan_page(ctx, stx, buf, doc_dir, page, x, y);
+  SDL_UnlockMutex(stx->lock);
+}
 
+static int find_target(fz_context *ctx, synctex_t *stx, fz_buffer *buf, int *page, int *x, int *y)
+{
   if (!synctex_find_input(ctx, stx, buf))
     return 0;
 
@@ -863,3 +1151,18 @@ int synctex_find_target(fz_context *ctx, synctex_t *stx, fz_buffer *buf, int *pa
   }
   return updated_candidate;
 }
+
+int synctex_find_target(fz_context *ctx, synctex_t *stx, fz_buffer *buf, int *page, int *x, int *y)
+{
+  if (!stx || !stx->target_path[0])
+    return 0;
+
+  SDL_LockMutex(stx->lock);
+  // Only block if the search has to look at pages that are not ingested
+  // yet
+  if (!stx->input_found || stx->scanned_pages >= stx->pages.len / 2)
+    wait_ingestion(stx);
+  int result = find_target(ctx, stx, buf, page, x, y);
+  SDL_UnlockMutex(stx->lock);
+  return result;
+}
@@ -32,9 +32,16 @@ typedef struct synctex_s synctex_t;
 
 synctex_t *synctex_new(fz_context *ctx);
 void synctex_free(fz_context *ctx, synctex_t *stx);
+
+// New contents passed to synctex_update are ingested by a background
+// thread. synctex_rollback cancels ingestion of data past the offset.
+// Queries wait for ingestion only when they need a page that has not been
+// ingested yet.
 void synctex_rollback(fz_context *ctx, synctex_t *stx, size_t offset);
 void synctex_update(fz_context *ctx, synctex_t *stx, fz_buffer *buf);
 int synctex_page_count(synctex_t *stx);
+// Bytes used by the index and the data waiting for ingestion
+size_t synctex_memory(synctex_t *stx);
 int synctex_input_count(synctex_t *stx);
 void synctex_page_offset(fz_context *ctx, synctex_t *stx, unsigned index, int *bop, int *eop);
 int synctex_input_offset(fz_context *ctx, synctex_t *stx, unsigned index);
@@ -0,0 +1,300 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2023 Frédéric Bour <frederic.bour@lakaban.net>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+// texpresso-viewer: display the page shared by a TeXpresso instance
+// started with -serve (see viewserver.h).
+
+#include <errno.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <SDL2/SDL.h>
+#include <mupdf/fitz.h>
+#include "renderer.h"
+#include "viewserver.h"
+#include "worker.h"
+
+struct update
+{
+  struct txp_view_header hdr;
+  unsigned char *data;
+};
+
+static Uint32 update_event;
+
+static bool read_all(int fd, void *data, size_t len)
+{
+  char *ptr = data;
+  while (len > 0)
+  {
+    ssize_t n = read(fd, ptr, len);
+    if (n == -1 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      return 0;
+    ptr += n;
+    len -= n;
+  }
+  return 1;
+}
+
+static void push_event(struct update *u)
+{
+  SDL_Event event;
+  SDL_zero(event);
+  event.type = update_event;
+  event.user.data1 = u;
+  if (SDL_PushEvent(&event) < 0)
+    abort();
+}
+
+// Read updates from the server, and pass them to the main thread.
+// A NULL update signals the end of the connection.
+static int SDLCALL reader_main(void *data)
+{
+  int fd = *(int *)data;
+
+  while (1)
+  {
+    struct update *u = malloc(sizeof(struct update));
+    if (!u)
+      abort();
+    if (!read_all(fd, &u->hdr, sizeof(u->hdr)) ||
+        u->hdr.magic != TXP_VIEW_MAGIC ||
+        !(u->data = malloc(u->hdr.length ? u->hdr.length : 1)))
+    {
+      free(u);
+      break;
+    }
+    if (!read_all(fd, u->data, u->hdr.length))
+    {
+      free(u->data);
+      free(u);
+      break;
+    }
+    push_event(u);
+  }
+
+  push_event(NULL);
+  return 0;
+}
+
+static int viewer_connect(const char *path)
+{
+  struct sockaddr_un addr = {0,};
+  addr.sun_family = AF_UNIX;
+  if (strlen(path) >= sizeof(addr.sun_path))
+    return -1;
+  strcpy(addr.sun_path, path);
+
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd == -1)
+    return -1;
+
+  if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1)
+  {
+    close(fd);
+    return -1;
+  }
+
+  return fd;
+}
+
+static fz_display_list *load_update(fz_context *ctx, struct update *u)
+{
+  fz_display_list *dl = NULL;
+  fz_buffer *buf = NULL;
+  fz_stream *stm = NULL;
+  fz_document *doc = NULL;
+  fz_page *page = NULL;
+  fz_var(buf);
+  fz_var(stm);
+  fz_var(doc);
+  fz_var(page);
+
+  fz_try(ctx)
+  {
+    buf = fz_new_buffer_from_copied_data(ctx, u->data, u->hdr.length);
+    stm = fz_open_buffer(ctx, buf);
+    doc = fz_open_document_with_stream(ctx, "application/pdf", stm);
+    page = fz_load_page(ctx, doc, 0);
+    dl = fz_new_display_list_from_page(ctx, page);
+  }
+  fz_always(ctx)
+  {
+    fz_drop_page(ctx, page);
+    fz_drop_document(ctx, doc);
+    fz_drop_stream(ctx, stm);
+    fz_drop_buffer(ctx, buf);
+  }
+  fz_catch(ctx)
+  {
+    fprintf(stderr, "[viewer] cannot load update: %s\n",
+            fz_caught_message(ctx));
+  }
+
+  return dl;
+}
+
+static void render(fz_context *ctx, SDL_Renderer *sdl, txp_renderer *r)
+{
+  SDL_SetRenderDrawColor(sdl, 0, 0, 0, 255);
+  SDL_RenderClear(sdl);
+  txp_renderer_render(ctx, r);
+  SDL_RenderPresent(sdl);
+}
+
+int main(int argc, const char **argv)
+{
+  if (argc != 2)
+  {
+    fprintf(stderr, "Usage: texpresso-viewer socket-path\n");
+    return 1;
+  }
+
+  int fd = viewer_connect(argv[1]);
+  if (fd == -1)
+  {
+    perror("[viewer] connect");
+    return 1;
+  }
+
+  fz_context *ctx = fz_new_context(NULL, txp_worker_locks(), FZ_STORE_DEFAULT);
+  fz_register_document_handlers(ctx);
+
+  if (SDL_Init(SDL_INIT_VIDEO) < 0)
+  {
+    fprintf(stderr, "SDL could not initialize! SDL_Error: %s\n", SDL_GetError());
+    return 1;
+  }
+  update_event = SDL_RegisterEvents(1);
+
+  SDL_Window *window = SDL_CreateWindow(
+    "TeXpresso viewer", SDL_WINDOWPOS_UNDEFINED, SDL_WINDOWPOS_UNDEFINED,
+    700, 900,
+    SDL_WINDOW_SHOWN | SDL_WINDOW_ALLOW_HIGHDPI | SDL_WINDOW_RESIZABLE);
+  if (window == NULL)
+  {
+    fprintf(stderr, "Window could not be created! SDL_Error: %s\n", SDL_GetError());
+    return 1;
+  }
+
+  SDL_Renderer *sdl = SDL_CreateRenderer(window, -1, SDL_RENDERER_PRESENTVSYNC);
+  txp_renderer *r = txp_renderer_new(ctx, sdl);
+  txp_renderer_get_config(ctx, r)->fit = FIT_PAGE;
+
+  SDL_Thread *reader = SDL_CreateThread(reader_main, "reader", &fd);
+  int zoom = 0;
+  bool quit = 0;
+
+  while (!quit)
+  {
+    SDL_Event e;
+    if (!SDL_WaitEvent(&e))
+      break;
+
+    if (e.type == update_event)
+    {
+      struct update *u = e.user.data1;
+      if (!u)
+      {
+        fprintf(stderr, "[viewer] connection closed\n");
+        break;
+      }
+
+      // Damage is relative to the previous update we received, even if
+      // the server skipped some versions in between
+      fprintf(stderr, "[viewer] update %u, page %d, damage: %.02f,%.02f - %.02f,%.02f\n",
+              u->hdr.sequence, u->hdr.page + 1,
+              u->hdr.damage_x0, u->hdr.damage_y0,
+              u->hdr.damage_x1, u->hdr.damage_y1);
+
+      fz_display_list *dl = load_update(ctx, u);
+      free(u->data);
+      free(u);
+      if (dl)
+      {
+        txp_renderer_set_contents(ctx, r, dl);
+        fz_drop_display_list(ctx, dl);
+        render(ctx, sdl, r);
+      }
+      continue;
+    }
+
+    switch (e.type)
+    {
+      case SDL_QUIT:
+        quit = 1;
+        break;
+
+      case SDL_KEYDOWN:
+        if (e.key.keysym.sym == SDLK_q || e.key.keysym.sym == SDLK_ESCAPE)
+          quit = 1;
+        break;
+
+      case SDL_MOUSEWHEEL:
+        if (SDL_GetModState() & KMOD_CTRL)
+        {
+          zoom = fz_clampi(zoom + e.wheel.y * 100, 0, 5000);
+          txp_renderer_get_config(ctx, r)->zoom = expf(zoom / 5000.0f);
+        }
+        else
+          txp_renderer_get_config(ctx, r)->pan.y += e.wheel.y * 50;
+        render(ctx, sdl, r);
+        break;
+
+      case SDL_WINDOWEVENT:
+        if (e.window.event == SDL_WINDOWEVENT_SIZE_CHANGED ||
+            e.window.event == SDL_WINDOWEVENT_EXPOSED)
+          render(ctx, sdl, r);
+        break;
+    }
+  }
+
+  // Unblock the reader, then drain its pending updates
+  shutdown(fd, SHUT_RDWR);
+  SDL_WaitThread(reader, NULL);
+  close(fd);
+  SDL_Event e;
+  while (SDL_PeepEvents(&e, 1, SDL_GETEVENT, update_event, update_event) > 0)
+  {
+    struct update *u = e.user.data1;
+    if (u)
+    {
+      free(u->data);
+      free(u);
+    }
+  }
+
+  txp_renderer_free(ctx, r);
+  SDL_DestroyRenderer(sdl);
+  SDL_DestroyWindow(window);
+  SDL_Quit();
+  fz_drop_context(ctx);
+  return 0;
+}
@@ -0,0 +1,560 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2023 Frédéric Bour <frederic.bour@lakaban.net>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <SDL2/SDL.h>
+#include <mupdf/fitz.h>
+#include "viewserver.h"
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+#define MAX_VIEWERS 16
+
+// Resolution used to find the area that changed between two updates
+#define DAMAGE_SCALE 0.5f
+
+struct viewer
+{
+  int fd;
+  // Update being sent: header then msg, NULL if idle
+  struct txp_view_header hdr;
+  fz_buffer *msg;
+  size_t sent;
+  // Last version of the page sent to this viewer, damage is computed from it
+  uint32_t sequence;
+  fz_display_list *shown;
+  int shown_page;
+};
+
+struct txp_viewserver_s
+{
+  char path[sizeof(((struct sockaddr_un *)0)->sun_path)];
+  int listen_fd;
+  int wakeup[2];
+  SDL_Thread *thread;
+
+  // Shared with the main thread
+  SDL_mutex *lock;
+  fz_display_list *pending;
+  int pending_page;
+  bool quit;
+
+  // Owned by the server thread
+  fz_context *ctx;
+  fz_display_list *current;
+  int current_page;
+  // Last version encoded and its PDF data, shared by all viewers
+  fz_buffer *latest;
+  fz_display_list *sent;
+  int sent_page;
+  uint32_t sequence;
+  struct viewer viewers[MAX_VIEWERS];
+  int count;
+};
+
+static fz_buffer *encode_page(fz_context *ctx, fz_display_list *dl)
+{
+  fz_buffer *buf = fz_new_buffer(ctx, 64 * 1024);
+  fz_output *out = NULL;
+  fz_document_writer *wri = NULL;
+  fz_var(out);
+  fz_var(wri);
+
+  fz_try(ctx)
+  {
+    out = fz_new_output_with_buffer(ctx, buf);
+    wri = fz_new_pdf_writer_with_output(ctx, out, "compress");
+    fz_device *dev = fz_begin_page(ctx, wri, fz_bound_display_list(ctx, dl));
+    fz_run_display_list(ctx, dl, dev, fz_identity, fz_infinite_rect, NULL);
+    fz_end_page(ctx, wri);
+    fz_close_document_writer(ctx, wri);
+    fz_close_output(ctx, out);
+  }
+  fz_always(ctx)
+  {
+    fz_drop_document_writer(ctx, wri);
+    fz_drop_output(ctx, out);
+  }
+  fz_catch(ctx)
+  {
+    fz_drop_buffer(ctx, buf);
+    fz_rethrow(ctx);
+  }
+
+  return buf;
+}
+
+static bool same_rect(fz_rect a, fz_rect b)
+{
+  return a.x0 == b.x0 && a.y0 == b.y0 && a.x1 == b.x1 && a.y1 == b.y1;
+}
+
+// Compare low resolution renderings of two versions of a page.
+// Returns false if they look the same.
+static bool page_damage(fz_context *ctx, fz_display_list *before,
+                        fz_display_list *after, fz_rect *damage)
+{
+  fz_rect bounds = fz_bound_display_list(ctx, after);
+  *damage = bounds;
+  if (!before || !same_rect(bounds, fz_bound_display_list(ctx, before)))
+    return 1;
+
+  fz_matrix ctm = fz_scale(DAMAGE_SCALE, DAMAGE_SCALE);
+  fz_pixmap *pa = NULL, *pb = NULL;
+  fz_var(pa);
+  fz_var(pb);
+  bool changed = 1;
+
+  fz_try(ctx)
+  {
+    pa = fz_new_pixmap_from_display_list(ctx, before, ctm, fz_device_gray(ctx), 0);
+    pb = fz_new_pixmap_from_display_list(ctx, after, ctm, fz_device_gray(ctx), 0);
+
+    int w = fz_pixmap_width(ctx, pb), h = fz_pixmap_height(ctx, pb);
+    if (w == fz_pixmap_width(ctx, pa) && h == fz_pixmap_height(ctx, pa))
+    {
+      const uint8_t *a = fz_pixmap_samples(ctx, pa);
+      const uint8_t *b = fz_pixmap_samples(ctx, pb);
+      int sa = fz_pixmap_stride(ctx, pa), sb = fz_pixmap_stride(ctx, pb);
+      int x0 = w, y0 = h, x1 = 0, y1 = 0;
+
+      for (int y = 0; y < h; ++y)
+        for (int x = 0; x < w; ++x)
+          if (a[y * sa + x] != b[y * sb + x])
+          {
+            if (x < x0) x0 = x;
+            if (x >= x1) x1 = x + 1;
+            if (y < y0) y0 = y;
+            y1 = y + 1;
+          }
+
+      if (x0 >= x1)
+        changed = 0;
+      else
+      {
+        // One pixel of margin for antialiasing
+        float px = fz_pixmap_x(ctx, pb), py = fz_pixmap_y(ctx, pb);
+        fz_rect r = fz_make_rect((px + x0 - 1) / DAMAGE_SCALE,
+                                 (py + y0 - 1) / DAMAGE_SCALE,
+                                 (px + x1 + 1) / DAMAGE_SCALE,
+                                 (py + y1 + 1) / DAMAGE_SCALE);
+        *damage = fz_intersect_rect(r, bounds);
+      }
+    }
+  }
+  fz_always(ctx)
+  {
+    fz_drop_pixmap(ctx, pa);
+    fz_drop_pixmap(ctx, pb);
+  }
+  fz_catch(ctx)
+  {
+    fprintf(stderr, "[viewserver] cannot compute damage: %s\n",
+            fz_caught_message(ctx));
+  }
+
+  return changed;
+}
+
+// Encode the current page if some viewers need it
+static void prepare_update(txp_viewserver *s)
+{
+  fz_context *ctx = s->ctx;
+
+  if (!s->current || s->count == 0 || s->current == s->sent)
+    return;
+
+  fz_rect damage;
+  if (s->sent && s->current_page == s->sent_page &&
+      !page_damage(ctx, s->sent, s->current, &damage))
+  {
+    // Nothing visible changed, keep the previous encoding
+    fz_drop_display_list(ctx, s->current);
+    s->current = fz_keep_display_list(ctx, s->sent);
+    return;
+  }
+
+  fz_buffer *buf = NULL;
+  fz_var(buf);
+  fz_try(ctx)
+    buf = encode_page(ctx, s->current);
+  fz_catch(ctx)
+  {
+    fprintf(stderr, "[viewserver] cannot encode page: %s\n",
+            fz_caught_message(ctx));
+    return;
+  }
+
+  s->sequence += 1;
+  if (s->latest)
+    fz_drop_buffer(ctx, s->latest);
+  s->latest = buf;
+  if (s->sent)
+    fz_drop_display_list(ctx, s->sent);
+  s->sent = fz_keep_display_list(ctx, s->current);
+  s->sent_page = s->current_page;
+}
+
+// Queue the latest encoding to an idle viewer.
+// Damage is relative to what this viewer received last: a slow viewer that
+// skipped some versions still gets every area that changed since then.
+static void queue_update(txp_viewserver *s, struct viewer *v)
+{
+  fz_context *ctx = s->ctx;
+  fz_rect damage = fz_bound_display_list(ctx, s->sent);
+  bool changed = !v->shown || v->shown_page != s->sent_page ||
+                 page_damage(ctx, v->shown, s->sent, &damage);
+
+  if (v->shown)
+    fz_drop_display_list(ctx, v->shown);
+  v->shown = fz_keep_display_list(ctx, s->sent);
+  v->shown_page = s->sent_page;
+  v->sequence = s->sequence;
+
+  // Already up-to-date
+  if (!changed)
+    return;
+
+  v->hdr = (struct txp_view_header){
+    .magic = TXP_VIEW_MAGIC,
+    .sequence = s->sequence,
+    .page = s->sent_page,
+    .damage_x0 = damage.x0,
+    .damage_y0 = damage.y0,
+    .damage_x1 = damage.x1,
+    .damage_y1 = damage.y1,
+    .length = s->latest->len,
+  };
+  v->msg = fz_keep_buffer(ctx, s->latest);
+  v->sent = 0;
+}
+
+static void close_viewer(txp_viewserver *s, int index)
+{
+  struct viewer *v = &s->viewers[index];
+  close(v->fd);
+  if (v->msg)
+    fz_drop_buffer(s->ctx, v->msg);
+  if (v->shown)
+    fz_drop_display_list(s->ctx, v->shown);
+  s->viewers[index] = s->viewers[s->count - 1];
+  s->count -= 1;
+}
+
+// Returns false if the connection is lost
+static bool viewer_output(txp_viewserver *s, struct viewer *v)
+{
+  while (v->msg)
+  {
+    ssize_t n;
+    if (v->sent < sizeof(v->hdr))
+      n = send(v->fd, (char *)&v->hdr + v->sent, sizeof(v->hdr) - v->sent,
+               MSG_NOSIGNAL);
+    else
+      n = send(v->fd, v->msg->data + v->sent - sizeof(v->hdr),
+               v->msg->len + sizeof(v->hdr) - v->sent, MSG_NOSIGNAL);
+    if (n == -1 && errno == EINTR)
+      continue;
+    if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+      return 1;
+    if (n <= 0)
+      return 0;
+    v->sent += n;
+    if (v->sent == v->msg->len + sizeof(v->hdr))
+    {
+      fz_drop_buffer(s->ctx, v->msg);
+      v->msg = NULL;
+    }
+  }
+  return 1;
+}
+
+// Viewers don't send anything: just detect disconnection
+static bool viewer_input(struct viewer *v)
+{
+  char buf[256];
+  ssize_t n = recv(v->fd, buf, sizeof(buf), 0);
+  if (n == -1)
+    return errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK;
+  return n > 0;
+}
+
+static void accept_viewer(txp_viewserver *s)
+{
+  int fd = accept(s->listen_fd, NULL, NULL);
+  if (fd == -1)
+  {
+    perror("[viewserver] accept");
+    return;
+  }
+  if (s->count == MAX_VIEWERS)
+  {
+    fprintf(stderr, "[viewserver] too many viewers\n");
+    close(fd);
+    return;
+  }
+  fcntl(fd, F_SETFD, FD_CLOEXEC);
+  fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+  // Nothing shown yet: the first update covers the whole page
+  s->viewers[s->count] = (struct viewer){ .fd = fd, .shown_page = -1 };
+  s->count += 1;
+  fprintf(stderr, "[viewserver] viewer connected (%d)\n", s->count);
+}
+
+static int SDLCALL server_main(void *data)
+{
+  txp_viewserver *s = data;
+  fz_context *ctx = s->ctx;
+  struct pollfd fds[MAX_VIEWERS + 2];
+
+  while (1)
+  {
+    SDL_LockMutex(s->lock);
+    bool quit = s->quit;
+    fz_display_list *dl = s->pending;
+    int page = s->pending_page;
+    s->pending = NULL;
+    SDL_UnlockMutex(s->lock);
+
+    if (quit)
+    {
+      if (dl)
+        fz_drop_display_list(ctx, dl);
+      break;
+    }
+
+    if (dl)
+    {
+      if (s->current)
+        fz_drop_display_list(ctx, s->current);
+      s->current = dl;
+      s->current_page = page;
+    }
+
+    prepare_update(s);
+
+    for (int i = 0; i < s->count; ++i)
+    {
+      struct viewer *v = &s->viewers[i];
+      if (!v->msg && s->latest && v->sequence != s->sequence)
+        queue_update(s, v);
+    }
+
+    fds[0] = (struct pollfd){ .fd = s->listen_fd, .events = POLLIN };
+    fds[1] = (struct pollfd){ .fd = s->wakeup[0], .events = POLLIN };
+    for (int i = 0; i < s->count; ++i)
+      fds[i + 2] = (struct pollfd){
+        .fd = s->viewers[i].fd,
+        .events = POLLIN | (s->viewers[i].msg ? POLLOUT : 0),
+      };
+
+    if (poll(fds, s->count + 2, -1) == -1)
+    {
+      if (errno == EINTR)
+        continue;
+      perror("[viewserver] poll");
+      break;
+    }
+
+    if (fds[1].revents & POLLIN)
+    {
+      char buf[64];
+      while (read(s->wakeup[0], buf, sizeof(buf)) > 0);
+    }
+
+    for (int i = s->count - 1; i >= 0; --i)
+    {
+      struct viewer *v = &s->viewers[i];
+      short ev = fds[i + 2].revents;
+      if (((ev & (POLLIN | POLLHUP | POLLERR)) && !viewer_input(v)) ||
+          ((ev & POLLOUT) && !viewer_output(s, v)))
+      {
+        close_viewer(s, i);
+        fprintf(stderr, "[viewserver] viewer disconnected (%d)\n", s->count);
+      }
+    }
+
+    if (fds[0].revents & POLLIN)
+      accept_viewer(s);
+  }
+
+  return 0;
+}
+
+static int server_listen(const char *path)
+{
+  struct sockaddr_un addr = {0,};
+  addr.sun_family = AF_UNIX;
+  if (strlen(path) >= sizeof(addr.sun_path))
+  {
+    fprintf(stderr, "[viewserver] socket path too long: %s\n", path);
+    return -1;
+  }
+  strcpy(addr.sun_path, path);
+
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd == -1)
+  {
+    perror("[viewserver] socket");
+    return -1;
+  }
+  fcntl(fd, F_SETFD, FD_CLOEXEC);
+
+  // Replace the socket only if nobody is answering on it
+  if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0)
+  {
+    fprintf(stderr, "[viewserver] %s is already in use\n", path);
+    close(fd);
+    return -1;
+  }
+  close(fd);
+  unlink(path);
+
+  fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd == -1)
+  {
+    perror("[viewserver] socket");
+    return -1;
+  }
+  fcntl(fd, F_SETFD, FD_CLOEXEC);
+
+  mode_t mask = umask(0077);
+  int r = bind(fd, (struct sockaddr *)&addr, sizeof(addr));
+  umask(mask);
+
+  if (r == -1 || listen(fd, MAX_VIEWERS) == -1)
+  {
+    perror("[viewserver] bind");
+    close(fd);
+    return -1;
+  }
+
+  return fd;
+}
+
+txp_viewserver *txp_viewserver_new(fz_context *ctx, const char *path)
+{
+  fz_context *thread_ctx = fz_clone_context(ctx);
+  if (!thread_ctx)
+  {
+    fprintf(stderr, "[viewserver] cannot clone context\n");
+    return NULL;
+  }
+
+  int lfd = server_listen(path);
+  if (lfd == -1)
+  {
+    fz_drop_context(thread_ctx);
+    return NULL;
+  }
+
+  int wakeup[2];
+  if (pipe(wakeup) == -1)
+  {
+    perror("[viewserver] pipe");
+    close(lfd);
+    unlink(path);
+    fz_drop_context(thread_ctx);
+    return NULL;
+  }
+  fcntl(wakeup[0], F_SETFL, fcntl(wakeup[0], F_GETFL) | O_NONBLOCK);
+
+  txp_viewserver *s = fz_malloc_struct(ctx, txp_viewserver);
+  strcpy(s->path, path);
+  s->listen_fd = lfd;
+  s->wakeup[0] = wakeup[0];
+  s->wakeup[1] = wakeup[1];
+  s->ctx = thread_ctx;
+  s->lock = SDL_CreateMutex();
+  s->sent_page = -1;
+  s->thread = SDL_CreateThread(server_main, "viewserver", s);
+  if (!s->thread)
+  {
+    fprintf(stderr, "[viewserver] cannot start thread: %s\n", SDL_GetError());
+    txp_viewserver_free(ctx, s);
+    return NULL;
+  }
+
+  fprintf(stderr, "[viewserver] listening on %s\n", path);
+  return s;
+}
+
+static void wakeup_server(txp_viewserver *s)
+{
+  char c = 0;
+  while (write(s->wakeup[1], &c, 1) == -1 && errno == EINTR);
+}
+
+void txp_viewserver_free(fz_context *ctx, txp_viewserver *s)
+{
+  if (s->thread)
+  {
+    SDL_LockMutex(s->lock);
+    s->quit = 1;
+    SDL_UnlockMutex(s->lock);
+    wakeup_server(s);
+    SDL_WaitThread(s->thread, NULL);
+  }
+
+  while (s->count > 0)
+    close_viewer(s, s->count - 1);
+  if (s->pending)
+    fz_drop_display_list(ctx, s->pending);
+  if (s->current)
+    fz_drop_display_list(s->ctx, s->current);
+  if (s->sent)
+    fz_drop_display_list(s->ctx, s->sent);
+  if (s->latest)
+    fz_drop_buffer(s->ctx, s->latest);
+  fz_drop_context(s->ctx);
+
+  close(s->listen_fd);
+  unlink(s->path);
+  close(s->wakeup[0]);
+  close(s->wakeup[1]);
+  SDL_DestroyMutex(s->lock);
+  fz_free(ctx, s);
+}
+
+void txp_viewserver_publish(fz_context *ctx, txp_viewserver *s, int page,
+                            fz_display_list *dl)
+{
+  SDL_LockMutex(s->lock);
+  if (s->pending)
+    fz_drop_display_list(ctx, s->pending);
+  s->pending = fz_keep_display_list(ctx, dl);
+  s->pending_page = page;
+  SDL_UnlockMutex(s->lock);
+  wakeup_server(s);
+}
@@ -0,0 +1,66 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2023 Frédéric Bour <frederic.bour@lakaban.net>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#ifndef VIEWSERVER_H_
+#define VIEWSERVER_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <mupdf/fitz/context.h>
+#include <mupdf/fitz/display-list.h>
+
+// Share the page displayed by TeXpresso with viewers (texpresso-viewer)
+// connected to a unix socket.
+//
+// Each update is a txp_view_header followed by a single-page PDF with the
+// contents of the page. Encoding happens once on a background thread,
+// whatever the number of viewers; a slow viewer skips intermediate updates.
+// Damage is computed for each viewer from the last update it received.
+
+#define TXP_VIEW_MAGIC 0x56505854 // "TXPV"
+
+struct txp_view_header
+{
+  uint32_t magic;
+  uint32_t sequence;
+  // Page of the document
+  int32_t page;
+  // Area that changed since the previous update received by this viewer,
+  // in page coordinates
+  float damage_x0, damage_y0, damage_x1, damage_y1;
+  // Length of the PDF data that follows
+  uint32_t length;
+};
+
+typedef struct txp_viewserver_s txp_viewserver;
+
+// Returns NULL if the socket cannot be created.
+// The context should have been created with locking functions.
+txp_viewserver *txp_viewserver_new(fz_context *ctx, const char *path);
+void txp_viewserver_free(fz_context *ctx, txp_viewserver *s);
+
+// Send a new version of the page to the viewers
+void txp_viewserver_publish(fz_context *ctx, txp_viewserver *s, int page, fz_display_list *dl);
+
+#endif // VIEWSERVER_H_
@@ -0,0 +1,231 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2023 Frédéric Bour <frederic.bour@lakaban.net>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <SDL2/SDL.h>
+#include "worker.h"
+
+#define MAX_THREADS 64
+#define DEFAULT_THREADS 16
+
+struct job
+{
+  txp_job_fn *run, *release;
+  void *data;
+  struct job *next;
+};
+
+struct thread
+{
+  txp_worker *pool;
+  fz_context *ctx;
+  SDL_Thread *thread;
+};
+
+struct txp_worker_s
+{
+  SDL_mutex *lock;
+  SDL_cond *cond;
+  struct job *first, *last;
+  bool quit;
+  int count;
+  struct thread threads[MAX_THREADS];
+};
+
+static int SDLCALL worker_main(void *data)
+{
+  struct thread *t = data;
+  txp_worker *w = t->pool;
+
+  SDL_LockMutex(w->lock);
+  while (1)
+  {
+    while (!w->first && !w->quit)
+      SDL_CondWait(w->cond, w->lock);
+    if (w->quit)
+      break;
+
+    struct job *job = w->first;
+    w->first = job->next;
+    if (!w->first)
+      w->last = NULL;
+    SDL_UnlockMutex(w->lock);
+
+    fz_try(t->ctx)
+    {
+      job->run(t->ctx, job->data);
+    }
+    fz_catch(t->ctx)
+    {
+      fprintf(stderr, "[worker] job failed: %s\n", fz_caught_message(t->ctx));
+    }
+    if (job->release)
+      job->release(t->ctx, job->data);
+    free(job);
+
+    SDL_LockMutex(w->lock);
+  }
+  SDL_UnlockMutex(w->lock);
+  return 0;
+}
+
+int txp_worker_default_threads(void)
+{
+  int count = SDL_GetCPUCount() - 1;
+  if (count < 1)
+    return 1;
+  if (count > DEFAULT_THREADS)
+    return DEFAULT_THREADS;
+  return count;
+}
+
+/* MuPDF locks, needed to share resources with worker threads */
+
+static SDL_mutex *fz_mutexes[FZ_LOCK_MAX];
+
+static void lock_mutex(void *user, int lock)
+{
+  SDL_LockMutex(fz_mutexes[lock]);
+}
+
+static void unlock_mutex(void *user, int lock)
+{
+  SDL_UnlockMutex(fz_mutexes[lock]);
+}
+
+fz_locks_context *txp_worker_locks(void)
+{
+  static fz_locks_context locks = {
+    .user = NULL,
+    .lock = lock_mutex,
+    .unlock = unlock_mutex,
+  };
+
+  if (fz_mutexes[0])
+    return &locks;
+
+  for (int i = 0; i < FZ_LOCK_MAX; ++i)
+  {
+    fz_mutexes[i] = SDL_CreateMutex();
+    if (!fz_mutexes[i])
+    {
+      fprintf(stderr, "Cannot create mutex: %s\n", SDL_GetError());
+      abort();
+    }
+  }
+
+  return &locks;
+}
+
+txp_worker *txp_worker_new(fz_context *ctx, int threads)
+{
+  txp_worker *w = calloc(1, sizeof(txp_worker));
+  if (!w)
+    abort();
+
+  w->lock = SDL_CreateMutex();
+  w->cond = SDL_CreateCond();
+  if (!w->lock || !w->cond)
+  {
+    fprintf(stderr, "[worker] cannot create mutex: %s\n", SDL_GetError());
+    abort();
+  }
+
+  if (threads > MAX_THREADS)
+    threads = MAX_THREADS;
+
+  for (int i = 0; i < threads; ++i)
+  {
+    struct thread *t = &w->threads[w->count];
+    t->pool = w;
+    t->ctx = fz_clone_context(ctx);
+    if (!t->ctx)
+    {
+      fprintf(stderr, "[worker] cannot clone context (no locks?)\n");
+      break;
+    }
+    t->thread = SDL_CreateThread(worker_main, "txp_worker", t);
+    if (!t->thread)
+    {
+      fz_drop_context(t->ctx);
+      break;
+    }
+    w->count += 1;
+  }
+
+  return w;
+}
+
+void txp_worker_free(fz_context *ctx, txp_worker *w)
+{
+  SDL_LockMutex(w->lock);
+  w->quit = 1;
+  SDL_CondBroadcast(w->cond);
+  SDL_UnlockMutex(w->lock);
+
+  for (int i = 0; i < w->count; ++i)
+  {
+    SDL_WaitThread(w->threads[i].thread, NULL);
+    fz_drop_context(w->threads[i].ctx);
+  }
+
+  // Release jobs that did not start
+  for (struct job *job = w->first; job; )
+  {
+    struct job *next = job->next;
+    if (job->release)
+      job->release(ctx, job->data);
+    free(job);
+    job = next;
+  }
+
+  SDL_DestroyCond(w->cond);
+  SDL_DestroyMutex(w->lock);
+  free(w);
+}
+
+bool txp_worker_submit(txp_worker *w, txp_job_fn *run, txp_job_fn *release, void *data)
+{
+  if (!w || w->count == 0)
+    return 0;
+
+  struct job *job = malloc(sizeof(struct job));
+  if (!job)
+    abort();
+  job->run = run;
+  job->release = release;
+  job->data = data;
+  job->next = NULL;
+
+  SDL_LockMutex(w->lock);
+  if (w->last)
+    w->last->next = job;
+  else
+    w->first = job;
+  w->last = job;
+  SDL_CondSignal(w->cond);
+  SDL_UnlockMutex(w->lock);
+  return 1;
+}
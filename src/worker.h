@@ -0,0 +1,56 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2023 Frédéric Bour <frederic.bour@lakaban.net>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+
+#ifndef WORKER_H_
+#define WORKER_H_
+
+#include <stdbool.h>
+#include <mupdf/fitz/context.h>
+
+// A pool of threads running jobs in the background.
+// Each thread owns a clone of the context it was created with: the context
+// should have been created with locking functions.
+
+typedef struct txp_worker_s txp_worker;
+
+// `run` is executed on a worker thread, with the context of that thread.
+// `release`, if not NULL, is executed after `run`, or instead of it if the
+// pool is destroyed before the job started.
+typedef void txp_job_fn(fz_context *ctx, void *data);
+
+txp_worker *txp_worker_new(fz_context *ctx, int threads);
+void txp_worker_free(fz_context *ctx, txp_worker *w);
+
+// Returns false if the pool has no thread: the job is not queued and the
+// caller keeps ownership of data.
+bool txp_worker_submit(txp_worker *w, txp_job_fn *run, txp_job_fn *release, void *data);
+
+// Default number of threads for a pool: one per core, leaving one for the UI
+int txp_worker_default_threads(void);
+
+// Locking functions to create the root context with, so that it can be
+// cloned by the pool threads
+fz_locks_context *txp_worker_locks(void);
+
+#endif // WORKER_H_